@@ -0,0 +1,162 @@
+#!/bin/bash
+# Benchmark operacji na dysku wirtualnym: kopiowanie na dysk, z dysku, usuwanie i listowanie.
+# Dla każdego rozmiaru obrazu i rozkładu rozmiarów plików wypisuje na stdout po jednym wierszu JSON
+# na operację (przepustowość, opóźnienia p50/p99, liczba wywołań systemowych), postęp trafia na stderr.
+#
+# Użycie: ./bench.sh [rozmiar_dysku_MB ...]          (domyślnie 64 256)
+# Zmienne środowiskowe:
+#   PROG           program do testowania (domyślnie ./program, jak w test.sh)
+#   DISTS          rozkłady rozmiarów plików: small, mixed, large (domyślnie wszystkie)
+#   FILES          największa liczba plików w jednym przebiegu (domyślnie 200)
+#   BLOCK_SIZE     rozmiar bloku tworzonych dysków (domyślnie 1024)
+#   LIST_RUNS      liczba listowań katalogu (domyślnie 20)
+#   STRACE_SAMPLES liczba operacji każdego rodzaju liczonych przez strace (domyślnie 5, 0 = bez strace)
+#   LABEL          etykieta wersji w wynikach (domyślnie git describe)
+#   WORKDIR        katalog roboczy (domyślnie tymczasowy, usuwany na końcu)
+
+PROG=$(realpath "${PROG:-./program}")
+DISTS=${DISTS:-"small mixed large"}
+FILES=${FILES:-200}
+BLOCK_SIZE=${BLOCK_SIZE:-1024}
+LIST_RUNS=${LIST_RUNS:-20}
+STRACE_SAMPLES=${STRACE_SAMPLES:-5}
+LABEL=${LABEL:-$(git -C "$(dirname "$0")" describe --always --dirty 2>/dev/null || echo unknown)}
+SIZES=${*:-"64 256"}
+
+if [ ! -x "$PROG" ]; then
+  echo "Brak programu $PROG (ustaw PROG)." >&2
+  exit 1
+fi
+if [ "$STRACE_SAMPLES" -gt 0 ] && ! command -v strace >/dev/null; then
+  echo "Brak strace, liczba wywołań systemowych nie będzie mierzona." >&2
+  STRACE_SAMPLES=0
+fi
+
+KEEP_WORKDIR=${WORKDIR:+1}
+WORKDIR=${WORKDIR:-$(mktemp -d)}
+mkdir -p "$WORKDIR/in" "$WORKDIR/out"
+cd "$WORKDIR" || exit 1
+trap '[ -z "$KEEP_WORKDIR" ] && rm -rf "$WORKDIR"' EXIT
+
+now_ns() {
+  date +%s%N
+}
+
+# Rozmiary plików rozkładu $1 dla dysku $2 MB: zajmują co najwyżej połowę dysku i FILES plików
+file_sizes() {
+  awk -v dist="$1" -v disk_mb="$2" -v max_files="$FILES" 'BEGIN {
+    srand(42)
+    budget = disk_mb * 1048576 / 2
+    for (i = 0; i < max_files; i++) {
+      if (dist == "small") {
+        size = int(512 + rand() * 7680)
+      } else if (dist == "large") {
+        size = int(1048576 + rand() * 3145728)
+      } else {
+        size = int(exp(log(64) + rand() * (log(1048576) - log(64))))
+      }
+      if (size > budget) {
+        break
+      }
+      budget -= size
+      print size
+    }
+  }'
+}
+
+# Czas wykonania polecenia w nanosekundach dopisywany do pliku $1
+timed() {
+  local log=$1
+  shift
+  local start
+  start=$(now_ns)
+  "$@" >/dev/null 2>&1
+  echo $(( $(now_ns) - start )) >> "$log"
+}
+
+# Średnia liczba wywołań systemowych na operację z pliku z sumami strace -c (jedna liczba na wiersz)
+syscalls_per_op() {
+  if [ ! -s "$1" ]; then
+    echo null
+    return
+  fi
+  awk '{ sum += $1; n++ } END { printf "%.1f", sum / n }' "$1"
+}
+
+# Liczba wywołań systemowych jednego polecenia, dopisywana do pliku $1
+counted() {
+  local log=$1
+  shift
+  strace -f -c -o strace.txt "$@" >/dev/null 2>&1
+  awk '$NF == "total" { print $4 }' strace.txt >> "$log"
+}
+
+# Wypisuje wiersz wyników operacji $1 na podstawie czasów z pliku $1.ns
+report() {
+  local op=$1 bytes=$2
+  sort -n "$op.ns" | awk -v label="$LABEL" -v disk_mb="$DISK_MB" -v dist="$DIST" -v block_size="$BLOCK_SIZE" \
+      -v op="$op" -v bytes="$bytes" -v syscalls="$(syscalls_per_op "$op.sys")" '
+    { t[NR] = $1; total += $1 }
+    END {
+      p50 = t[int((NR - 1) * 0.50) + 1]
+      p99 = t[int((NR - 1) * 0.99) + 1]
+      seconds = total / 1e9
+      mb_per_s = (bytes > 0 && seconds > 0) ? sprintf("%.2f", bytes / 1048576 / seconds) : "null"
+      printf "{\"label\": \"%s\", \"disk_mb\": %d, \"block_size\": %d, \"dist\": \"%s\", \"op\": \"%s\", ", label, disk_mb, block_size, dist, op
+      printf "\"count\": %d, \"bytes\": %d, \"seconds\": %.3f, \"ops_per_s\": %.1f, \"mb_per_s\": %s, ", NR, bytes, seconds, NR / seconds, mb_per_s
+      printf "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"syscalls_per_op\": %s}\n", p50 / 1e6, p99 / 1e6, syscalls
+    }'
+}
+
+for DISK_MB in $SIZES; do
+  for DIST in $DISTS; do
+    echo "Dysk $DISK_MB MB, rozkład $DIST..." >&2
+    rm -f vd.bin in/* out/* ./*.ns ./*.sys
+    "$PROG" 1 "$DISK_MB" vd.bin 0 6 sparse "$BLOCK_SIZE" >/dev/null || exit 1
+
+    count=0
+    bytes=0
+    for size in $(file_sizes "$DIST" "$DISK_MB"); do
+      head -c "$size" /dev/urandom > "in/f$count"
+      count=$((count + 1))
+      bytes=$((bytes + size))
+    done
+
+    # Nazwa pliku na dysku jest też ścieżką źródła, więc import działa z wersją bazową programu,
+    # która nie przyjmuje osobnego pliku źródłowego
+    cd in || exit 1
+    for ((i = 0; i < count; i++)); do
+      timed ../import.ns "$PROG" 0 "$DISK_MB" ../vd.bin 0 1 "f$i"
+    done
+    cd ..
+    for ((i = 0; i < LIST_RUNS; i++)); do
+      timed list.ns "$PROG" 0 "$DISK_MB" vd.bin 1 4
+    done
+    cd out || exit 1
+    for ((i = 0; i < count; i++)); do
+      timed ../export.ns "$PROG" 0 "$DISK_MB" ../vd.bin 0 2 "f$i"
+    done
+    cd ..
+    for ((i = 0; i < count; i++)); do
+      cmp -s "in/f$i" "out/f$i" || echo "Plik f$i różni się po skopiowaniu z dysku." >&2
+    done
+
+    # Wywołania systemowe są liczone osobno, bo strace wydłuża czasy mierzonych operacji
+    for ((i = 0; i < STRACE_SAMPLES && i < count; i++)); do
+      ln -f "in/f$i" "in/s$i"
+      (cd in && counted ../import.sys "$PROG" 0 "$DISK_MB" ../vd.bin 0 1 "s$i")
+      counted list.sys "$PROG" 0 "$DISK_MB" vd.bin 1 4
+      (cd out && counted ../export.sys "$PROG" 0 "$DISK_MB" ../vd.bin 0 2 "s$i")
+      counted delete.sys "$PROG" 0 "$DISK_MB" vd.bin 0 5 "s$i"
+    done
+
+    for ((i = 0; i < count; i++)); do
+      timed delete.ns "$PROG" 0 "$DISK_MB" vd.bin 0 5 "f$i"
+    done
+
+    report import "$bytes"
+    report export "$bytes"
+    report delete 0
+    report list 0
+  done
+done
@@ -1,403 +1,5054 @@
+#define _FILE_OFFSET_BITS 64  // 64-bitowy off_t (fseeko, pread) także w systemach 32-bitowych
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+
+#if defined(_POSIX_ADVISORY_INFO) && _POSIX_ADVISORY_INFO > 0
+#define HAVE_POSIX_FALLOCATE 1   // Rezerwacja miejsca na dysku bez zapisywania zer
+#endif
+
+#if defined(_POSIX_MAPPED_FILES) && _POSIX_MAPPED_FILES > 0 && !defined(FS_NO_MMAP)
+#include <sys/mman.h>
+#define HAVE_MMAP 1              // Obraz dysku mapowany do pamięci (-DFS_NO_MMAP wymusza stdio)
+#endif
+
+#if defined(_POSIX_FSYNC) && _POSIX_FSYNC > 0
+#define HAVE_FSYNC 1             // Zatwierdzenie dziennika czeka na zapis na nośnik
+#endif
+
+#if defined(_POSIX_THREADS) && _POSIX_THREADS > 0 && !defined(FS_NO_THREADS)
+#include <pthread.h>
+#define HAVE_PTHREAD 1           // Import katalogu kopiuje dane w kilku wątkach (-DFS_NO_THREADS wyłącza)
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_SCAN 1         // Przeszukiwanie bitmapy instrukcjami AVX2 (wybierane w czasie działania)
+#define HAVE_SSE42_CRC 1         // Sumy CRC32C instrukcją crc32 z SSE4.2 (wybierane w czasie działania)
+#endif
 
 typedef unsigned char bool;
-#define true 1;
-#define false 0;
+#define true 1
+#define false 0
 
-#define BLOCK_SIZE 1024          // Rozmiar jednego bloku w bajtach
-#define MAX_FILES 128            // Maksymalna liczba plików w katalogu
+// Przesunięcia w obrazie i rozmiary plików przekraczają 4 GB, a long ma na 32-bitowych systemach 32 bity
+typedef unsigned long long disk_offset;
+
+#define DEFAULT_BLOCK_SIZE 1024  // Domyślny rozmiar bloku w bajtach
+#define MIN_BLOCK_SIZE 512       // Rozmiar bloku jest wielokrotnością tej wartości
+#define MAX_BLOCK_SIZE 32768     // Największy rozmiar bloku (pole block_size ma 16 bitów)
+#define MAX_FILES 128            // Liczba i-węzłów w dawnym formacie dysku
 #define MAX_FILENAME_LEN 64      // Maksymalna długość nazwy pliku
+#define MAX_EXTENTS 8            // Liczba ekstentów przechowywanych bezpośrednio w i-węźle
+#define INLINE_DATA_SIZE (MAX_EXTENTS * sizeof(Extent)) // Największy plik przechowywany w samym i-węźle
+#ifndef IO_BUFFER_SIZE
+#define IO_BUFFER_SIZE (256 * 1024) // Liczba bajtów przesyłanych jednym wywołaniem fread/fwrite
+#endif
+#ifndef EXPORT_BUFFER_SIZE
+#define EXPORT_BUFFER_SIZE (1024 * 1024) // Rozmiar bufora eksportu w bajtach (-DEXPORT_BUFFER_SIZE=... zmienia)
+#endif
+#define EXPORT_VECTORS 64        // Liczba fragmentów przekazywanych jednym wywołaniem writev
+#define CATALOG_INITIAL_BLOCKS 4 // Początkowy rozmiar katalogu i-węzłów w blokach
+#define NO_BLOCK ((unsigned int)-1)
+#define NO_INODE ((unsigned int)-1)
+#define BULK_MAX_THREADS 16      // Największa liczba wątków importu katalogu
+#define HOST_PATH_LEN 512        // Maksymalna długość ścieżki pliku na dysku gospodarza
+#define LZ_CHUNK (64 * 1024)     // Tyle bajtów pliku pakuje jedna ramka kompresji
+#define LZ_HASH_BITS 12          // Rozmiar tablicy szukania powtórzeń (2^12 pozycji)
+#define LZ_MIN_MATCH 4           // Najkrótsze kodowane powtórzenie
+#define LZ_STORED 0x80000000U    // Bit nagłówka ramki: porcja zapisana bez kompresji
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16) // Największy rozmiar spakowanych n bajtów
+#define CRC32C_POLY 0x82f63b78U  // Wielomian CRC32C (Castagnoli) w odwróconej postaci
+#define SUMS_PER_PASS 256        // Tyle sum kontrolnych liczonych i zapisywanych naraz
+#define PATH_CACHE_SIZE 256      // Liczba zapamiętanych katalogów z rozwiązanych ścieżek
+#define ROOT_DIRECTORY 0         // Numer katalogu głównego (indeksu nazw) przy rozwiązywaniu ścieżek
+
+// Tryby tworzenia dysku
+#define CREATE_SPARSE 0          // Plik rzadki: zapisywane są tylko metadane
+#define CREATE_PREALLOCATE 1     // Miejsce rezerwowane przez posix_fallocate
+#define CREATE_ZERO 2            // Cały obszar danych zapisywany zerami
+
+// Statystyki operacji (--stats)
+#define STATS_OFF 0
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+// Polityki przydziału bloków (--alloc)
+#define ALLOC_FIRST 0            // Najniższy wolny ciąg mieszczący cały plik
+#define ALLOC_BEST 1             // Najkrótszy wolny ciąg mieszczący cały plik
+#define ALLOC_NEXT 2             // Pierwszy pasujący ciąg za poprzednim przydziałem
+
+// Drzewa indeksu wolnych ciągów
+#define BY_ADDRESS 0             // Według adresu
+#define BY_LENGTH 1              // Według długości, potem adresu
+
+// Etapy operacji, których czas mierzy --stats
+#define PHASE_LOAD 0             // Wczytywanie i wyszukiwanie metadanych (wszystko poza pozostałymi etapami)
+#define PHASE_ALLOC 1            // Przydział bloków
+#define PHASE_COPY 2             // Kopiowanie danych plików
+#define PHASE_FLUSH 3            // Zapis metadanych i zatwierdzenie dziennika
+#define NUM_PHASES 4
+
+// Kompresja danych pliku (pole compression i-węzła)
+#define COMPRESS_NONE 0
+#define COMPRESS_LZ 1            // Ramki LZ po LZ_CHUNK bajtów
+
+// Bity pola file_type i-węzła
+#define TYPE_HIDDEN 1            // Plik ukryty (nazwa zaczyna się od kropki)
+#define TYPE_DIRECTORY 2         // Katalog (od wersji 11)
+
+#define FS_MAGIC 0x56465331      // Znacznik formatu z ekstentami
+#define FS_VERSION 11            // Wersja formatu dysku
+#define FS_OLDEST_VERSION 4      // Najstarsza obsługiwana wersja (zawsze bloki 1024 B)
+#define INLINE_VERSION 6         // Pierwsza wersja z danymi małych plików w i-węźle
+#define DEDUP_VERSION 7          // Pierwsza wersja z deduplikacją bloków
+#define COMPRESS_VERSION 8       // Pierwsza wersja z kompresją plików
+#define CHECKSUM_VERSION 9       // Pierwsza wersja z sumami kontrolnymi bloków
+#define LARGE_FILE_VERSION 10    // Pierwsza wersja z 48-bitowymi rozmiarami plików
+#define DIRECTORY_VERSION 11     // Pierwsza wersja z zagnieżdżonymi katalogami
+
+// Numery bloków są 32-bitowe; wartości powyżej MAX_BLOCKS zostają dla NO_BLOCK
+// i jednostek dziennika obejmujących obszar przed pierwszym blokiem danych
+#define MAX_BLOCKS 0xffe00000U
+
+#define JOURNAL_MAGIC 0x4a524e4c // Znacznik zatwierdzonej transakcji w dzienniku
+#define JOURNAL_MIN_BLOCKS 16    // Najmniejszy i największy rozmiar dziennika w blokach
+#define JOURNAL_MAX_BLOCKS 1024
+
+// Bitmapa bloków: jeden bit na blok, przeszukiwana całymi słowami
+typedef unsigned long bitmap_word;
+#define BITS_PER_WORD (sizeof(bitmap_word) * 8)
+#define BITMAP_BYTES(bits) ((((disk_offset)(bits) + 63) / 64) * 8)  // Rozmiar bitmapy na dysku (wielokrotność 8 bajtów)
+#define ALL_SET ((bitmap_word)~0UL)
+
+// Ciągły obszar bloków danych pliku
+typedef struct {
+    unsigned int start;              // Indeks pierwszego bloku obszaru
+    unsigned int length;             // Liczba bloków w obszarze
+} Extent;
+
+// Struktura pojedynczego Inode. Od wersji 11 nazwa jest jednym członem ścieżki, a katalog
+// trzyma w swoich blokach tablicę wpisów taką jak indeks nazw i ich liczbę w first_block.
+typedef struct {
+    char file_name[MAX_FILENAME_LEN]; // Nazwa pliku (pusta w wolnym i-węźle)
+    unsigned int file_size;           // Rozmiar pliku w bajtach (przed kompresją)
+    unsigned int first_block;         // Indeks pierwszego bloku danych (w wolnym i-węźle: następny wolny i-węzeł, w katalogu: liczba wpisów)
+    unsigned char file_type;          // Bity TYPE_HIDDEN i TYPE_DIRECTORY (0 = zwykły plik)
+    unsigned char compression;        // COMPRESS_NONE albo COMPRESS_LZ (do wersji 8 bajt wyrównania)
+    unsigned short size_high;         // Bity 32..47 rozmiaru pliku (do wersji 9 wyrównanie)
+    unsigned int num_extents;         // Liczba wszystkich ekstentów pliku
+    unsigned int extent_block;        // Pierwszy blok z dodatkowymi ekstentami
+    Extent extents[MAX_EXTENTS];      // Pierwsze ekstenty pliku (plik bez ekstentów trzyma tu swoje dane)
+} Inode;
+
+// Pozycja indeksu nazw albo indeksu bloków; i-węzeł 0 jest zarezerwowany, więc value == 0 oznacza pustą pozycję
+typedef struct {
+    unsigned int hash;               // Skrót nazwy pliku albo zawartości bloku
+    unsigned int value;              // Numer i-węzła pliku albo numer bloku powiększony o 1
+} IndexEntry;
+
+// Skrót zawartości i liczba odwołań plików do jednego bloku danych dysku z deduplikacją
+typedef struct {
+    unsigned int hash;
+    unsigned int refs;
+} BlockRef;
+
+// Bitmapa jest zapisywana na dysk porcjami; zapisywane są tylko porcje zmienione od ostatniej synchronizacji
+#define BITMAP_CHUNK_BYTES 1024
+#define BITMAP_CHUNK_BITS (BITMAP_CHUNK_BYTES * 8)
 
 // Struktura metadanych dysku
 typedef struct {
     unsigned int disk_size;          // Rozmiar dysku w MB
-    unsigned short block_size;       // Rozmiar bloku w bajtach
+    unsigned short block_size;       // Rozmiar bloku w bajtach, wybierany przy tworzeniu dysku
+    unsigned short version;          // Wersja formatu dysku
     unsigned int num_blocks;         // Liczba bloków
-    unsigned long first_data_block;  // Adres pierwszego bloku danych
-    unsigned short num_files;        // Liczba plików w katalogu
-    unsigned short max_files;        // Maksymalna liczba plików
+    unsigned int free_blocks;        // Liczba wolnych bloków
+    disk_offset first_data_block;    // Adres pierwszego bloku danych
+    unsigned int num_files;          // Liczba wpisów indeksu nazw (od wersji 11: katalogu głównego)
+    unsigned int magic;              // Znacznik formatu (FS_MAGIC)
+    unsigned int num_inodes;         // Liczba użytych pozycji katalogu i-węzłów
+    unsigned int free_inode;         // Pierwszy wolny i-węzeł lub NO_INODE
+    Inode catalog;                   // Katalog i-węzłów przechowywany w blokach danych jak plik
+    Inode name_index;                // Tablica mieszająca nazw plików, również w blokach danych (od wersji 11 katalog główny)
+    unsigned int journal_start;      // Pierwszy blok dziennika metadanych
+    unsigned int journal_blocks;     // Rozmiar dziennika w blokach (stały od utworzenia dysku)
+    // Od wersji 7; starsze wersje kończą metadane przed tymi polami
+    Inode block_index;               // Tablica mieszająca skrót zawartości -> blok (dysk z deduplikacją)
+    Inode block_refs;                // Tablica BlockRef, po jednej pozycji na blok (pusta bez deduplikacji)
+    unsigned int indexed_blocks;     // Liczba bloków w indeksie bloków
+    unsigned int reserved;           // Wyrównanie; metadane wersji 7 i 8 kończą się za nim
+    // Od wersji 9
+    Inode block_sums;                // CRC32C każdego bloku danych, w jednym ciągu bloków
+    unsigned int padding;            // Utrzymuje rozmiar 800 bajtów także tam, gdzie pola 64-bitowe wyrównuje się do 4 bajtów
 } DiskMetadata;
 
-// Struktura pojedynczego Inode
-typedef struct {
-    char file_name[MAX_FILENAME_LEN]; // Nazwa pliku
-    unsigned int file_size;           // Rozmiar pliku w bajtach
-    unsigned int first_block;         // Indeks pierwszego bloku danych
-    unsigned char file_type;          // Typ pliku (0 = zwykły, 1 = ukryty)
-} Inode;
+// Pierwszy blok dziennika; dalej leżą numery jednostek, a od następnego bloku ich obrazy.
+// Suma kontrolna obejmuje całość (z wyzerowanym polem checksum).
+typedef struct {
+    unsigned int magic;
+    unsigned int sequence;
+    unsigned int num_pages;
+    unsigned int checksum;
+} JournalHeader;
+
+// Metadane zmienione od ostatniego zatwierdzenia. Obraz dzieli się na jednostki: kawałki
+// obszaru przed pierwszym blokiem danych o rozmiarze bloku, a dalej po jednej na blok danych.
+typedef struct {
+    unsigned int unit;
+    unsigned char *data;             // Obraz jednostki (block_size bajtów)
+} JournalPage;
+
+// Dawny format dysku: każdy blok danych kończy się wskaźnikiem na następny blok.
+// Pola mają rozmiary natywne dla maszyny, która zapisała obraz.
+typedef struct {
+    unsigned int disk_size;
+    unsigned short block_size;
+    unsigned int num_blocks;
+    unsigned long first_data_block;
+    unsigned short num_files;
+    unsigned short max_files;
+} LegacyDiskMetadata;
+
+typedef struct {
+    char file_name[MAX_FILENAME_LEN];
+    unsigned int file_size;
+    unsigned int first_block;
+    unsigned char file_type;
+} LegacyInode;
+
+// Wolny ciąg bloków w indeksie wolnego miejsca. Każdy węzeł należy do dwóch drzew (treap):
+// uporządkowanego według adresu, w którym węzeł pamięta też najdłuższy ciąg w swoim poddrzewie,
+// i uporządkowanego według długości, a potem adresu. Dowiązania to numery węzłów; 0 to puste drzewo.
+typedef struct {
+    unsigned int start;
+    unsigned int length;
+    unsigned int longest;            // Najdłuższy ciąg w poddrzewie adresowym
+    unsigned int priority;
+    unsigned int left[2];            // Dzieci w drzewach BY_ADDRESS i BY_LENGTH
+    unsigned int right[2];
+} SpaceNode;
+
+// Wolne ciągi bitmapy bloków, uaktualniane razem z nią przez set_blocks. Gdy zabraknie pamięci
+// na węzeł, indeks jest oznaczany jako nieaktualny i odbudowywany z bitmapy przed kolejnym przydziałem.
+typedef struct {
+    SpaceNode *nodes;
+    unsigned int capacity;
+    unsigned int used;               // Wydane węzły razem z węzłem 0
+    unsigned int unused;             // Lista zwolnionych węzłów połączona przez left[BY_ADDRESS]
+    unsigned int root[2];
+    unsigned int count;              // Liczba wolnych ciągów
+    unsigned int seed;               // Stan generatora priorytetów
+    unsigned int cursor;             // Tu zaczyna szukać ALLOC_NEXT
+    bool stale;
+} SpaceIndex;
+
+// Katalog zapamiętany przy rozwiązywaniu ścieżki: wpis name katalogu parent to i-węzeł number.
+// number == 0 oznacza pustą pozycję, bo i-węzeł 0 nigdy nie jest katalogiem.
+typedef struct {
+    unsigned int parent;
+    unsigned int number;
+    char name[MAX_FILENAME_LEN];
+} PathCacheEntry;
+
+// Otwarty dysk: plik, metadane i wczytane listy ekstentów katalogu oraz indeksu nazw.
+// Metadane i bitmapa bloków są trzymane w pamięci i zapisywane przez sync_disk.
+// Zapisy metadanych trafiają do stron dziennika, które sync_disk zatwierdza naraz.
+typedef struct {
+    FILE *file;
+    unsigned char *map;              // Cały obraz zmapowany do pamięci lub NULL (dostęp przez stdio)
+    unsigned long map_size;
+    bool writable;
+    DiskMetadata metadata;
+    bitmap_word *block_bitmap;
+    bool *bitmap_dirty;              // Zmienione porcje bitmapy
+    SpaceIndex space;                // Wolne ciągi bloków
+    bool dirty;                      // Metadane lub bitmapa zmienione od ostatniej synchronizacji
+    Extent *catalog_extents;
+    Extent *index_extents;
+    Extent *block_index_extents;
+    Extent *ref_extents;
+    Inode *legacy_catalog;           // Katalog dawnego formatu wczytany w całości
+    unsigned int block_size;         // Geometria wyliczona z metadanych przez set_block_geometry
+    unsigned int block_shift;        // log2(block_size) albo 0, gdy rozmiar nie jest potęgą dwójki
+    unsigned int extents_per_block;
+    unsigned int inodes_per_block;
+    unsigned int index_entries_per_block;
+    JournalPage *pages;              // Niezatwierdzone jednostki metadanych
+    unsigned char *page_data;        // Obrazy wszystkich stron w jednym przydziale
+    unsigned int num_pages;
+    unsigned int page_capacity;      // Tyle stron mieści jedno zatwierdzenie (0: bez dziennika)
+    unsigned int *page_slots;        // Tablica mieszająca: numer jednostki -> indeks strony + 1
+    unsigned int slot_mask;
+    unsigned int journal_sequence;
+    bool journal_dirty;              // Dziennik zawiera transakcję, której nie oznaczono jako wykonaną
+    Extent *deferred;                // Bloki zwolnione w bieżącej transakcji
+    unsigned int num_deferred;
+    unsigned int deferred_capacity;
+    PathCacheEntry *path_cache;      // Ostatnio rozwiązane katalogi według rodzica i nazwy
+    unsigned int bad_sums;           // Liczba niezgodnych sum kontrolnych od otwarcia dysku
+} Disk;
+
+// Katalog otwarty do wyszukiwania i zmian. table, extents i entries wskazują indeks nazw,
+// jego ekstenty i num_files dla katalogu głównego, a dla pozostałych pola inode.
+typedef struct {
+    unsigned int number;
+    Inode inode;
+    Extent *inode_extents;
+    Inode *table;
+    Extent **extents;
+    unsigned int *entries;
+} Directory;
+
+// Plik gospodarza importowany razem z całym katalogiem; nazwa na dysku to ścieżka względna
+typedef struct {
+    char path[HOST_PATH_LEN];
+    char name[HOST_PATH_LEN];
+    char leaf[MAX_FILENAME_LEN];     // Ostatni człon nazwy
+    unsigned int parent;             // Katalog na dysku, do którego trafia plik
+    disk_offset file_size;
+    Extent *extents;
+    unsigned int num_extents;
+    unsigned int *sums;              // Sumy kontrolne bloków liczone przez wątek kopiujący
+    Inode inode;
+    int status;                      // 0 = w toku, 1 = pominięty, -1 = błąd kopiowania
+} BulkFile;
+
+// Praca dzielona między wątki importu; next to pierwszy plik, którego nikt jeszcze nie wziął
+typedef struct {
+    Disk *disk;
+    BulkFile *files;
+    unsigned int num_files;
+    unsigned int capacity;
+    unsigned int next;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+} BulkImport;
+
+// Źródło importu; źródło z kompresją czyta plik porcjami po LZ_CHUNK bajtów i oddaje ramki:
+// unsigned int z długością spakowanych danych (z LZ_STORED, gdy porcja się nie zmniejszyła) i same dane
+typedef struct {
+    FILE *file;
+    unsigned char *raw;              // Porcja pliku (NULL: dane przechodzą bez zmian)
+    unsigned char *packed;           // Bieżąca ramka
+    unsigned long packed_length;
+    unsigned long packed_offset;     // Tyle bajtów ramki już oddano
+    disk_offset raw_bytes;           // Tyle bajtów przeczytano z pliku
+} Source;
+
+// Ciąg bloków jednego pliku sprawdzany przez wątek weryfikacji; file wskazuje nazwę pliku
+typedef struct {
+    unsigned int start;
+    unsigned int length;
+    unsigned int file;
+} ScrubRun;
+
+// Praca dzielona między wątki weryfikacji; sums to cała tablica sum kontrolnych
+typedef struct {
+    Disk *disk;
+    ScrubRun *runs;
+    unsigned int num_runs;
+    unsigned int capacity;
+    char *names;                     // Nazwy plików, po MAX_FILENAME_LEN bajtów
+    unsigned int num_files;
+    unsigned int *sums;
+    unsigned int next;
+    unsigned long checked;
+    unsigned int damaged;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+} Scrub;
+
+// Operacje na obrazie dysku w czasie jednej operacji, wypisywane przez --stats. Przesunięcie (seek)
+// to dostęp, który nie zaczyna się tam, gdzie skończył się poprzedni dostęp tego samego wątku
+typedef struct {
+    unsigned long seeks;
+    unsigned long reads;
+    unsigned long writes;
+    disk_offset bytes_read;
+    disk_offset bytes_written;
+    unsigned long blocks_allocated;
+    unsigned long blocks_freed;
+    disk_offset position;            // Pozycja za ostatnim dostępem
+    double seconds[NUM_PHASES];
+} Stats;
+
+// Plik, który defragmentacja może przenieść: numer i-węzła, pierwszy blok, rozmiar w blokach
+// i liczba fizycznie rozdzielonych ciągów jego bloków
+typedef struct {
+    unsigned int number;
+    unsigned int start;
+    unsigned int blocks;
+    unsigned int fragments;
+} DefragFile;
+
+// Postęp jednej defragmentacji; max_seconds i max_bytes równe 0 oznaczają brak limitu
+typedef struct {
+    Disk *disk;
+    unsigned char *buffer;
+    struct timeval start;
+    double max_seconds;
+    disk_offset max_bytes;
+    disk_offset moved;
+    unsigned int relocated;
+    unsigned int skipped;
+    unsigned int failed;
+} Defrag;
+
+// Ciąg bloków danych o stałej roli, pokazywany jako jeden obszar mapy zajętości
+typedef struct {
+    unsigned int start;
+    unsigned int length;
+    const char *type;
+} MapArea;
+
+// Plik otwarty do odczytu od dowolnego miejsca. starts[i] to pierwszy blok pliku w ekstencie i,
+// a starts[num_extents] liczba bloków, więc ekstent bloku znajduje wyszukiwanie binarne.
+// blocks przechowuje num_loaded bloków od bloku pliku loaded. Plik skompresowany ma też
+// frames[k], przesunięcie ramki z bajtami od k * LZ_CHUNK, i trzyma ostatnią rozpakowaną ramkę
+typedef struct {
+    Inode inode;
+    disk_offset size;
+    Extent *extents;
+    unsigned int *starts;
+    disk_offset *frames;
+    unsigned long num_frames;
+    unsigned long cached;            // Numer ramki rozpakowanej w raw
+    unsigned int loaded;
+    unsigned int num_loaded;
+    unsigned char *blocks;
+    unsigned char *packed;
+    unsigned char *raw;
+} OpenFile;
+
+
+disk_offset count_blocks(disk_offset disk_size_bytes, unsigned int block_size) {
+    disk_offset bitmap_size_bytes;
+    disk_offset reserved_space;
+    disk_offset num_blocks = (disk_size_bytes - sizeof(DiskMetadata)) / block_size;
+    disk_offset prev_num_blocks = 0;
+
+    while (num_blocks != prev_num_blocks) {
+        prev_num_blocks = num_blocks;
+
+        // Oblicz rozmiar bitmapy bloków (jeden bit na blok)
+        bitmap_size_bytes = BITMAP_BYTES(num_blocks);
+
+        // Oblicz całkowitą zajętą przestrzeń (katalog i-węzłów leży w blokach danych)
+        reserved_space = sizeof(DiskMetadata) + bitmap_size_bytes;
+
+        num_blocks = (disk_size_bytes - reserved_space) / block_size;
+    }
+    return num_blocks;
+}
+
+bool is_legacy_image(const DiskMetadata *metadata) {
+    return metadata->magic != FS_MAGIC;
+}
+
+// Rozmiar metadanych na dysku: dawny format ma mniejszą strukturę, a wersje sprzed 7 kończą się przed block_index
+unsigned long metadata_size(const DiskMetadata *metadata) {
+    if (is_legacy_image(metadata)) {
+        return sizeof(LegacyDiskMetadata);
+    }
+    if (metadata->version < DEDUP_VERSION) {
+        return offsetof(DiskMetadata, block_index);
+    }
+    return metadata->version < CHECKSUM_VERSION ? offsetof(DiskMetadata, block_sums) : sizeof(DiskMetadata);
+}
+
+// Przesunięcia obszarów dysku zależą od formatu
+unsigned long block_bitmap_offset(const DiskMetadata *metadata) {
+    return metadata_size(metadata);
+}
+
+disk_offset data_block_offset(const DiskMetadata *metadata, unsigned int block) {
+    return metadata->first_data_block + (disk_offset)block * metadata->block_size;
+}
+
+bool valid_block_size(unsigned int block_size) {
+    return block_size >= MIN_BLOCK_SIZE && block_size <= MAX_BLOCK_SIZE && block_size % MIN_BLOCK_SIZE == 0;
+}
+
+// Wylicza geometrię bloków otwartego dysku z jego metadanych
+void set_block_geometry(Disk *disk) {
+    disk->block_size = disk->metadata.block_size;
+    disk->block_shift = 0;
+    if ((disk->block_size & (disk->block_size - 1)) == 0) {
+        while ((1u << disk->block_shift) < disk->block_size) {
+            disk->block_shift++;
+        }
+    }
+    disk->extents_per_block = (disk->block_size - sizeof(unsigned int)) / sizeof(Extent);
+    disk->inodes_per_block = disk->block_size / sizeof(Inode);
+    disk->index_entries_per_block = disk->block_size / sizeof(IndexEntry);
+}
+
+// Dane w i-węźle wymagają wersji 6; starsze programy uznałyby taki plik za pusty
+bool stores_inline(const Disk *disk, disk_offset file_size) {
+    return !is_legacy_image(&disk->metadata) && disk->metadata.version >= INLINE_VERSION &&
+           file_size > 0 && file_size <= INLINE_DATA_SIZE;
+}
+
+bool is_inline(const Disk *disk, const Inode *inode) {
+    return !is_legacy_image(&disk->metadata) && inode->num_extents == 0 && inode->file_size > 0;
+}
+
+// Przed wersją 8 bajt compression był wyrównaniem i może zawierać cokolwiek
+bool is_compressed(const Disk *disk, const Inode *inode) {
+    return !is_legacy_image(&disk->metadata) && disk->metadata.version >= COMPRESS_VERSION &&
+           inode->compression == COMPRESS_LZ;
+}
+
+// Przed wersją 10 pole size_high było wyrównaniem, więc rozmiary kończą się tam na 32 bitach
+bool has_large_files(const DiskMetadata *metadata) {
+    return !is_legacy_image(metadata) && metadata->version >= LARGE_FILE_VERSION;
+}
+
+bool has_directories(const DiskMetadata *metadata) {
+    return !is_legacy_image(metadata) && metadata->version >= DIRECTORY_VERSION;
+}
+
+disk_offset inode_size(const DiskMetadata *metadata, const Inode *inode) {
+    disk_offset size = inode->file_size;
+    if (has_large_files(metadata)) {
+        size |= (disk_offset)inode->size_high << 32;
+    }
+    return size;
+}
+
+void set_inode_size(const DiskMetadata *metadata, Inode *inode, disk_offset size) {
+    inode->file_size = (unsigned int)size;
+    if (has_large_files(metadata)) {
+        inode->size_high = (unsigned short)(size >> 32);
+    }
+}
+
+disk_offset max_file_size(const DiskMetadata *metadata) {
+    if (!has_large_files(metadata)) {
+        return UINT_MAX;
+    }
+    return (disk_offset)USHRT_MAX << 32 | UINT_MAX;
+}
+
+// Arytmetyka bloków: zwykłe rozmiary będące potęgą dwójki używają przesunięć,
+// pozostałe wielokrotności MIN_BLOCK_SIZE dzielenia
+unsigned long bytes_to_blocks(const Disk *disk, disk_offset bytes) {
+    return disk->block_shift ? bytes >> disk->block_shift : bytes / disk->block_size;
+}
+
+// Liczba bloków potrzebna na bytes bajtów
+unsigned long blocks_for_bytes(const Disk *disk, disk_offset bytes) {
+    return bytes_to_blocks(disk, bytes + disk->block_size - 1);
+}
+
+disk_offset blocks_to_bytes(const Disk *disk, unsigned long blocks) {
+    return disk->block_shift ? (disk_offset)blocks << disk->block_shift : (disk_offset)blocks * disk->block_size;
+}
+
+// Rozmiar bufora o pojemności około size bajtów, mieszczącego całe bloki
+unsigned long buffer_size(const Disk *disk, unsigned long size) {
+    return size < disk->block_size ? disk->block_size : size - size % disk->block_size;
+}
+
+// Warstwa dostępu do obrazu: zmapowany obraz jest czytany i zapisywany w pamięci,
+// a gdy mapowanie jest niedostępne, używane są fseeko/fread/fwrite
+int map_disk(Disk *disk) {
+#ifdef HAVE_MMAP
+    struct stat st;
+    // Obraz większy niż przestrzeń adresowa jest czytany przez stdio
+    if (fstat(fileno(disk->file), &st) != 0 || st.st_size == 0 || (off_t)(size_t)st.st_size != st.st_size) {
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, disk->writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fileno(disk->file), 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    disk->map = map;
+    disk->map_size = st.st_size;
+    return 0;
+#else
+    (void)disk;
+    return -1;
+#endif
+}
+
+void unmap_disk(Disk *disk) {
+#ifdef HAVE_MMAP
+    if (disk->map) {
+        munmap(disk->map, disk->map_size);
+    }
+#endif
+    disk->map = NULL;
+}
+
+// Wskaźnik na length bajtów obrazu od offset albo NULL, gdy obraz nie jest zmapowany
+void *disk_ptr(Disk *disk, disk_offset offset, unsigned long length) {
+    if (!disk->map || offset > disk->map_size || length > disk->map_size - offset) {
+        return NULL;
+    }
+    return disk->map + offset;
+}
+
+Stats io_stats;
+int stats_mode = STATS_OFF;
+int stats_phase = PHASE_LOAD;
+struct timeval stats_mark;           // Początek bieżącego etapu
+int alloc_policy = ALLOC_FIRST;
+
+void count_io(Stats *stats, bool write, disk_offset offset, unsigned long length) {
+    if (offset != stats->position) {
+        stats->seeks++;
+    }
+    stats->position = offset + length;
+    if (write) {
+        stats->writes++;
+        stats->bytes_written += length;
+    } else {
+        stats->reads++;
+        stats->bytes_read += length;
+    }
+}
+
+// Dolicza liczniki wątku roboczego; wywołujący trzyma blokadę wspólnej pracy
+void merge_stats(const Stats *worker) {
+    io_stats.seeks += worker->seeks;
+    io_stats.reads += worker->reads;
+    io_stats.writes += worker->writes;
+    io_stats.bytes_read += worker->bytes_read;
+    io_stats.bytes_written += worker->bytes_written;
+}
+
+// Dolicza czas od ostatniej zmiany do bieżącego etapu i rozpoczyna etap phase.
+// Zwraca przerwany etap, żeby wywołujący mógł do niego wrócić
+int enter_phase(int phase) {
+    int previous = stats_phase;
+    if (stats_mode == STATS_OFF) {
+        return previous;
+    }
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    io_stats.seconds[stats_phase] += (now.tv_sec - stats_mark.tv_sec) + (now.tv_usec - stats_mark.tv_usec) / 1e6;
+    stats_mark = now;
+    stats_phase = phase;
+    return previous;
+}
+
+// Pomija czas, który upłynął od ostatniej zmiany etapu, np. czekanie na odpowiedź użytkownika
+void restart_stats_clock(void) {
+    gettimeofday(&stats_mark, NULL);
+}
+
+// Wypisuje na stderr liczniki zebrane od poprzedniego raportu i zeruje je
+void report_stats(const char *operation) {
+    if (stats_mode == STATS_OFF) {
+        return;
+    }
+    enter_phase(stats_phase);
+    if (stats_mode == STATS_JSON) {
+        fprintf(stderr, "{\"operation\": \"%s\", \"seeks\": %lu, \"reads\": %lu, \"writes\": %lu, "
+                "\"bytes_read\": %llu, \"bytes_written\": %llu, \"blocks_allocated\": %lu, \"blocks_freed\": %lu, "
+                "\"seconds\": {\"load\": %.6f, \"allocation\": %.6f, \"copy\": %.6f, \"flush\": %.6f}}\n",
+                operation, io_stats.seeks, io_stats.reads, io_stats.writes, io_stats.bytes_read, io_stats.bytes_written,
+                io_stats.blocks_allocated, io_stats.blocks_freed, io_stats.seconds[PHASE_LOAD], io_stats.seconds[PHASE_ALLOC],
+                io_stats.seconds[PHASE_COPY], io_stats.seconds[PHASE_FLUSH]);
+    } else {
+        fprintf(stderr, "Statystyki operacji %s:\n", operation);
+        fprintf(stderr, "  przesunięcia          %lu\n", io_stats.seeks);
+        fprintf(stderr, "  odczyty               %lu (%llu bajtów)\n", io_stats.reads, io_stats.bytes_read);
+        fprintf(stderr, "  zapisy                %lu (%llu bajtów)\n", io_stats.writes, io_stats.bytes_written);
+        fprintf(stderr, "  przydzielone bloki    %lu\n", io_stats.blocks_allocated);
+        fprintf(stderr, "  zwolnione bloki       %lu\n", io_stats.blocks_freed);
+        fprintf(stderr, "  czas                  metadane %.6f s, przydział %.6f s, kopiowanie %.6f s, zapis %.6f s\n",
+                io_stats.seconds[PHASE_LOAD], io_stats.seconds[PHASE_ALLOC], io_stats.seconds[PHASE_COPY],
+                io_stats.seconds[PHASE_FLUSH]);
+    }
+    memset(&io_stats, 0, sizeof(Stats));
+}
+
+int image_read(Disk *disk, disk_offset offset, void *buffer, unsigned long length) {
+    count_io(&io_stats, false, offset, length);
+    if (disk->map) {
+        if (!disk_ptr(disk, offset, length)) {
+            return -1;
+        }
+        memcpy(buffer, disk->map + offset, length);
+        return 0;
+    }
+    if (fseeko(disk->file, (off_t)offset, SEEK_SET) != 0) {
+        return -1;
+    }
+    return fread(buffer, 1, length, disk->file) == length ? 0 : -1;
+}
+
+int image_write(Disk *disk, disk_offset offset, const void *buffer, unsigned long length) {
+    count_io(&io_stats, true, offset, length);
+    if (disk->map) {
+        if (!disk->writable || !disk_ptr(disk, offset, length)) {
+            return -1;
+        }
+        memcpy(disk->map + offset, buffer, length);
+        return 0;
+    }
+    if (fseeko(disk->file, (off_t)offset, SEEK_SET) != 0) {
+        return -1;
+    }
+    return fwrite(buffer, 1, length, disk->file) == length ? 0 : -1;
+}
+
+// Utrwala na nośniku wszystko, co dotąd zapisano
+void flush_disk(Disk *disk) {
+#ifdef HAVE_MMAP
+    if (disk->map) {
+        msync(disk->map, disk->map_size, MS_SYNC);
+    }
+#endif
+    fflush(disk->file);
+#ifdef HAVE_FSYNC
+    fsync(fileno(disk->file));
+#endif
+}
+
+unsigned int header_units(const Disk *disk) {
+    return blocks_for_bytes(disk, disk->metadata.first_data_block);
+}
+
+unsigned int offset_unit(const Disk *disk, disk_offset offset) {
+    if (offset < disk->metadata.first_data_block) {
+        return bytes_to_blocks(disk, offset);
+    }
+    return header_units(disk) + bytes_to_blocks(disk, offset - disk->metadata.first_data_block);
+}
+
+disk_offset unit_offset(const Disk *disk, unsigned int unit) {
+    if (unit < header_units(disk)) {
+        return blocks_to_bytes(disk, unit);
+    }
+    return data_block_offset(&disk->metadata, unit - header_units(disk));
+}
+
+unsigned long unit_length(const Disk *disk, unsigned int unit) {
+    if (unit + 1 == header_units(disk)) {
+        return disk->metadata.first_data_block - blocks_to_bytes(disk, unit);
+    }
+    return disk->block_size;
+}
+
+JournalPage *find_page(Disk *disk, unsigned int unit) {
+    if (disk->num_pages == 0) {
+        return NULL;
+    }
+    unsigned int index;
+    for (unsigned int slot = (unit * 2654435761u) & disk->slot_mask; (index = disk->page_slots[slot]) != 0;
+         slot = (slot + 1) & disk->slot_mask) {
+        if (disk->pages[index - 1].unit == unit) {
+            return &disk->pages[index - 1];
+        }
+    }
+    return NULL;
+}
+
+unsigned int journal_descriptor_blocks(const Disk *disk, unsigned int num_pages) {
+    return blocks_for_bytes(disk, sizeof(JournalHeader) + num_pages * sizeof(unsigned int));
+}
+
+// FNV-1a po bloku opisu i obrazach wszystkich stron
+unsigned int journal_checksum(const unsigned char *descriptor, unsigned long length, const JournalPage *pages, unsigned int num_pages,
+                              unsigned int block_size) {
+    unsigned int hash = 2166136261u;
+    for (unsigned long i = 0; i < length; i++) {
+        hash = (hash ^ descriptor[i]) * 16777619u;
+    }
+    for (unsigned int page = 0; page < num_pages; page++) {
+        for (unsigned long i = 0; i < block_size; i++) {
+            hash = (hash ^ pages[page].data[i]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+// Grupowe zatwierdzenie: najpierw utrwalane są dane plików i poprzedni checkpoint, potem
+// wszystkie strony trafiają do dziennika jednym sekwencyjnym zapisem i jednym fsync,
+// a na końcu są zapisywane na swoje miejsca. Ten ostatni zapis utrwala następne
+// zatwierdzenie albo close_disk.
+int journal_commit(Disk *disk) {
+    if (disk->num_pages == 0) {
+        return 0;
+    }
+    unsigned int blocks = journal_descriptor_blocks(disk, disk->num_pages);
+    unsigned char *descriptor = calloc(blocks, disk->block_size);
+    if (!descriptor) {
+        return -1;
+    }
+    JournalHeader *header = (JournalHeader *)descriptor;
+    unsigned int *units = (unsigned int *)(descriptor + sizeof(JournalHeader));
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = disk->journal_sequence++;
+    header->num_pages = disk->num_pages;
+    for (unsigned int i = 0; i < disk->num_pages; i++) {
+        units[i] = disk->pages[i].unit;
+    }
+    header->checksum = journal_checksum(descriptor, blocks_to_bytes(disk, blocks), disk->pages, disk->num_pages, disk->block_size);
+
+    disk_offset journal = data_block_offset(&disk->metadata, disk->metadata.journal_start);
+    int result = 0;
+    flush_disk(disk);
+    for (unsigned int i = 0; i < disk->num_pages; i++) {
+        result |= image_write(disk, journal + blocks_to_bytes(disk, blocks + i), disk->pages[i].data, disk->block_size);
+    }
+    result |= image_write(disk, journal, descriptor, blocks_to_bytes(disk, blocks));
+    flush_disk(disk);
+
+    for (unsigned int i = 0; i < disk->num_pages; i++) {
+        result |= image_write(disk, unit_offset(disk, disk->pages[i].unit), disk->pages[i].data,
+                              unit_length(disk, disk->pages[i].unit));
+    }
+    disk->num_pages = 0;
+    memset(disk->page_slots, 0, (disk->slot_mask + 1) * sizeof(unsigned int));
+    disk->journal_dirty = true;
+    free(descriptor);
+    return result;
+}
+
+// Po utrwaleniu ostatniego checkpointu oznacza dziennik jako pusty, aby przy otwarciu nie było czego odtwarzać
+void journal_clear(Disk *disk) {
+    if (!disk->journal_dirty) {
+        return;
+    }
+    flush_disk(disk);
+    JournalHeader header;
+    memset(&header, 0, sizeof(JournalHeader));
+    image_write(disk, data_block_offset(&disk->metadata, disk->metadata.journal_start), &header, sizeof(JournalHeader));
+    disk->journal_dirty = false;
+}
+
+// Operacja większa niż dziennik jest zatwierdzana w częściach
+JournalPage *add_page(Disk *disk, unsigned int unit) {
+    if (disk->num_pages == disk->page_capacity && journal_commit(disk) != 0) {
+        return NULL;
+    }
+    JournalPage *page = &disk->pages[disk->num_pages++];
+    page->unit = unit;
+    unsigned int slot = (unit * 2654435761u) & disk->slot_mask;
+    while (disk->page_slots[slot] != 0) {
+        slot = (slot + 1) & disk->slot_mask;
+    }
+    disk->page_slots[slot] = disk->num_pages;
+    return page;
+}
+
+// Odczyt uwzględnia niezatwierdzone strony; ciągi jednostek bez strony są czytane jednym wywołaniem
+int disk_read(Disk *disk, disk_offset offset, void *buffer, unsigned long length) {
+    if (disk->num_pages == 0) {
+        return image_read(disk, offset, buffer, length);
+    }
+    unsigned char *target = buffer;
+    unsigned long run = 0;
+    while (length > 0) {
+        unsigned int unit = offset_unit(disk, offset);
+        disk_offset start = unit_offset(disk, unit);
+        unsigned long piece = start + unit_length(disk, unit) - offset;
+        if (piece > length) {
+            piece = length;
+        }
+        JournalPage *page = find_page(disk, unit);
+        if (page) {
+            if (run > 0 && image_read(disk, offset - run, target - run, run) != 0) {
+                return -1;
+            }
+            run = 0;
+            memcpy(target, page->data + (offset - start), piece);
+        } else {
+            run += piece;
+        }
+        offset += piece;
+        target += piece;
+        length -= piece;
+    }
+    return run > 0 ? image_read(disk, offset - run, target - run, run) : 0;
+}
+
+// Zapis metadanych zmienia tylko niezatwierdzone strony; na dysk trafiają przez journal_commit
+int disk_write(Disk *disk, disk_offset offset, const void *buffer, unsigned long length) {
+    if (disk->page_capacity == 0) {
+        return image_write(disk, offset, buffer, length);
+    }
+    if (!disk->writable) {
+        return -1;
+    }
+    const unsigned char *source = buffer;
+    while (length > 0) {
+        unsigned int unit = offset_unit(disk, offset);
+        disk_offset start = unit_offset(disk, unit);
+        unsigned long piece = start + unit_length(disk, unit) - offset;
+        if (piece > length) {
+            piece = length;
+        }
+        JournalPage *page = find_page(disk, unit);
+        if (!page) {
+            page = add_page(disk, unit);
+            if (!page || image_read(disk, start, page->data, unit_length(disk, unit)) != 0) {
+                return -1;
+            }
+        }
+        memcpy(page->data + (offset - start), source, piece);
+        offset += piece;
+        source += piece;
+        length -= piece;
+    }
+    return 0;
+}
+
+// Bloki przydzielone od ostatniego zatwierdzenia są zapisywane wprost do obrazu: żadne
+// zatwierdzone metadane jeszcze na nie nie wskazują, więc nie trzeba ich dziennikować.
+// Do zmapowanego obrazu dane trafiają przez pwrite, które jest spójne z mapowaniem,
+// a nie wywołuje błędu strony dla każdej strony pamięci.
+int disk_write_new(Disk *disk, disk_offset offset, const void *buffer, unsigned long length) {
+#ifdef HAVE_MMAP
+    if (disk->map && disk->writable && disk_ptr(disk, offset, length)) {
+        count_io(&io_stats, true, offset, length);
+        if (pwrite(fileno(disk->file), buffer, length, (off_t)offset) != (ssize_t)length) {
+            return -1;
+        }
+    } else if (image_write(disk, offset, buffer, length) != 0) {
+        return -1;
+    }
+#else
+    if (image_write(disk, offset, buffer, length) != 0) {
+        return -1;
+    }
+#endif
+    const unsigned char *source = buffer;
+    while (disk->num_pages > 0 && length > 0) {
+        unsigned int unit = offset_unit(disk, offset);
+        disk_offset start = unit_offset(disk, unit);
+        unsigned long piece = start + unit_length(disk, unit) - offset;
+        if (piece > length) {
+            piece = length;
+        }
+        JournalPage *page = find_page(disk, unit);
+        if (page) {
+            memcpy(page->data + (offset - start), source, piece);
+        }
+        offset += piece;
+        source += piece;
+        length -= piece;
+    }
+    return 0;
+}
+
+unsigned int crc32c_table[8][256];
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+unsigned int crc32c_sse42(unsigned int crc, const unsigned char *data, unsigned long length) {
+#ifdef __x86_64__
+    unsigned long long wide = crc;
+    for (; length >= sizeof(unsigned long long); data += sizeof(unsigned long long), length -= sizeof(unsigned long long)) {
+        unsigned long long word;
+        memcpy(&word, data, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (unsigned int)wide;
+#endif
+    for (; length > 0; data++, length--) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+
+bool cpu_has_sse42(void) {
+    static int supported = -1;
+    if (supported < 0) {
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    }
+    return supported;
+}
+#endif
+
+// Buduje tablice CRC32C liczonego po 8 bajtów; wywoływane, zanim jakikolwiek wątek policzy sumę
+void crc32c_init(void) {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (unsigned int i = 0; i < 256; i++) {
+        for (int j = 1; j < 8; j++) {
+            crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xff] ^ (crc32c_table[j - 1][i] >> 8);
+        }
+    }
+#ifdef HAVE_SSE42_CRC
+    cpu_has_sse42();
+#endif
+}
+
+// Wariant bez SSE4.2: osiem niezależnych odczytów tablic na każde 8 bajtów danych
+unsigned int crc32c_sliced(unsigned int crc, const unsigned char *data, unsigned long length) {
+    for (; length >= 8; data += 8, length -= 8) {
+        crc ^= (unsigned int)data[0] | ((unsigned int)data[1] << 8) | ((unsigned int)data[2] << 16) | ((unsigned int)data[3] << 24);
+        crc = crc32c_table[7][crc & 0xff] ^ crc32c_table[6][(crc >> 8) & 0xff] ^
+              crc32c_table[5][(crc >> 16) & 0xff] ^ crc32c_table[4][crc >> 24] ^
+              crc32c_table[3][data[4]] ^ crc32c_table[2][data[5]] ^ crc32c_table[1][data[6]] ^ crc32c_table[0][data[7]];
+    }
+    for (; length > 0; data++, length--) {
+        crc = crc32c_table[0][(crc ^ *data) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+unsigned int block_sum(const Disk *disk, const unsigned char *data) {
+#ifdef HAVE_SSE42_CRC
+    if (cpu_has_sse42()) {
+        return ~crc32c_sse42(~0U, data, disk->block_size);
+    }
+#endif
+    return ~crc32c_sliced(~0U, data, disk->block_size);
+}
+
+bool checksums_enabled(const Disk *disk) {
+    return !is_legacy_image(&disk->metadata) && inode_size(&disk->metadata, &disk->metadata.block_sums) > 0;
+}
+
+disk_offset sum_offset(const Disk *disk, unsigned int block) {
+    return data_block_offset(&disk->metadata, disk->metadata.block_sums.extents[0].start) + (disk_offset)block * sizeof(unsigned int);
+}
+
+// Sumy nowych bloków pliku są metadanymi i trafiają na dysk razem z bitmapą
+void write_sums(Disk *disk, unsigned int block, const unsigned int *sums, unsigned int count) {
+    disk_write(disk, sum_offset(disk, block), sums, count * sizeof(unsigned int));
+}
+
+void record_sums(Disk *disk, unsigned int block, const unsigned char *data, unsigned int count) {
+    if (!checksums_enabled(disk)) {
+        return;
+    }
+    unsigned int sums[SUMS_PER_PASS];
+    while (count > 0) {
+        unsigned int piece = count < SUMS_PER_PASS ? count : SUMS_PER_PASS;
+        for (unsigned int i = 0; i < piece; i++) {
+            sums[i] = block_sum(disk, data + blocks_to_bytes(disk, i));
+        }
+        write_sums(disk, block, sums, piece);
+        data += blocks_to_bytes(disk, piece);
+        block += piece;
+        count -= piece;
+    }
+}
+
+// Porównuje count bloków przeczytanych od bloku block z ich zapisanymi sumami kontrolnymi
+int verify_sums(Disk *disk, unsigned int block, const unsigned char *data, unsigned int count) {
+    if (!checksums_enabled(disk)) {
+        return 0;
+    }
+    unsigned int sums[SUMS_PER_PASS];
+    while (count > 0) {
+        unsigned int piece = count < SUMS_PER_PASS ? count : SUMS_PER_PASS;
+        if (disk_read(disk, sum_offset(disk, block), sums, piece * sizeof(unsigned int)) != 0) {
+            return -1;
+        }
+        for (unsigned int i = 0; i < piece; i++) {
+            if (block_sum(disk, data + blocks_to_bytes(disk, i)) != sums[i]) {
+                fprintf(stderr, "Niezgodna suma kontrolna bloku %u.\n", block + i);
+                disk->bad_sums++;
+                return -1;
+            }
+        }
+        data += blocks_to_bytes(disk, piece);
+        block += piece;
+        count -= piece;
+    }
+    return 0;
+}
+
+// Zapisuje bloki ekstentu kolejnymi bajtami pliku source, z których bytes należy do pliku,
+// dopełniając ostatni blok zerami; błąd, gdy źródło kończy się wcześniej lub nie da się go odczytać
+int write_extent_from_file(Disk *disk, const Extent *extent, FILE *source, disk_offset bytes, unsigned char *buffer) {
+    disk_offset offset = data_block_offset(&disk->metadata, extent->start);
+    disk_offset length = blocks_to_bytes(disk, extent->length);
+    unsigned long size = buffer_size(disk, IO_BUFFER_SIZE);
+    unsigned int block = extent->start;
+
+    while (length > 0) {
+        unsigned long chunk = length < size ? length : size;
+        unsigned long wanted = bytes < chunk ? bytes : chunk;
+        size_t bytes_read = fread(buffer, 1, wanted, source);
+        if (bytes_read < wanted) {
+            fprintf(stderr, "Nie udało się odczytać pliku źródłowego.\n");
+            return -1;
+        }
+        memset(buffer + bytes_read, 0, chunk - bytes_read);
+        if (disk_write_new(disk, offset, buffer, chunk) != 0) {
+            fprintf(stderr, "Nie udało się zapisać obrazu dysku.\n");
+            return -1;
+        }
+        bytes -= wanted;
+        record_sums(disk, block, buffer, bytes_to_blocks(disk, chunk));
+        block += bytes_to_blocks(disk, chunk);
+        offset += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+// Zapisuje wszystkie fragmenty do fd, wznawiając po niepełnym zapisie
+int write_vectors(int fd, struct iovec *vectors, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, vectors, count);
+        if (written < 0) {
+            return -1;
+        }
+        while (count > 0 && (size_t)written >= vectors->iov_len) {
+            written -= vectors->iov_len;
+            vectors++;
+            count--;
+        }
+        if (count > 0) {
+            vectors->iov_base = (char *)vectors->iov_base + written;
+            vectors->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Dopisuje fragment pamięci; fragment leżący tuż za poprzednim jest z nim łączony
+void add_vector(struct iovec *vectors, int *count, void *base, unsigned long length) {
+    if (*count > 0 && (char *)vectors[*count - 1].iov_base + vectors[*count - 1].iov_len == (char *)base) {
+        vectors[*count - 1].iov_len += length;
+        return;
+    }
+    vectors[*count].iov_base = base;
+    vectors[*count].iov_len = length;
+    (*count)++;
+}
+
+// Kopiuje pierwsze bytes bajtów pliku do fd. Sąsiadujące fizycznie ekstenty są łączone w ciągi,
+// czytane całymi blokami, żeby dało się sprawdzić ich sumy kontrolne.
+// Ze zmapowanego obrazu ciągi trafiają do writev bezpośrednio, po EXPORT_VECTORS naraz;
+// w przeciwnym razie każdy ciąg jest czytany jednym wywołaniem do bufora, zapisywanego po zapełnieniu.
+int export_extents(Disk *disk, const Extent *extents, unsigned int num_extents, disk_offset bytes, int fd, unsigned char *buffer) {
+    struct iovec vectors[EXPORT_VECTORS];
+    int count = 0;
+    unsigned long size = buffer_size(disk, EXPORT_BUFFER_SIZE);
+    unsigned long filled = 0;
+    unsigned long blocks = blocks_for_bytes(disk, bytes);
+    unsigned long excess = blocks_to_bytes(disk, blocks) - bytes; // Dopełnienie ostatniego bloku, pomijane przy zapisie
+    unsigned int i = 0;
+
+    while (i < num_extents && blocks > 0) {
+        unsigned int start = extents[i].start;
+        unsigned int end = start + extents[i].length;
+        for (i++; i < num_extents && extents[i].start == end; i++) {
+            end += extents[i].length;
+        }
+        if (end - start > blocks) {
+            end = start + blocks;
+        }
+        blocks -= end - start;
+        disk_offset offset = data_block_offset(&disk->metadata, start);
+        disk_offset length = blocks_to_bytes(disk, end - start);
+
+        if (disk->map) {
+            unsigned char *source = disk_ptr(disk, offset, length);
+            count_io(&io_stats, false, offset, length);
+            if (!source || verify_sums(disk, start, source, end - start) != 0) {
+                return -1;
+            }
+            if (count == EXPORT_VECTORS) {
+                if (write_vectors(fd, vectors, count) != 0) {
+                    return -1;
+                }
+                count = 0;
+            }
+            add_vector(vectors, &count, source, blocks == 0 ? length - excess : length);
+            continue;
+        }
+
+        for (unsigned int block = start; length > 0; ) {
+            unsigned long piece = size - filled;
+            if (piece > length) {
+                piece = length;
+            }
+            if (disk_read(disk, offset, buffer + filled, piece) != 0 ||
+                verify_sums(disk, block, buffer + filled, bytes_to_blocks(disk, piece)) != 0) {
+                return -1;
+            }
+            block += bytes_to_blocks(disk, piece);
+            filled += piece;
+            offset += piece;
+            length -= piece;
+            if (filled == size) {
+                add_vector(vectors, &count, buffer, blocks == 0 && length == 0 ? filled - excess : filled);
+                if (write_vectors(fd, vectors, count) != 0) {
+                    return -1;
+                }
+                count = 0;
+                filled = 0;
+            }
+        }
+    }
+    if (blocks > 0) {
+        return -1;
+    }
+
+    if (filled > 0) {
+        add_vector(vectors, &count, buffer, filled - excess);
+    }
+    return write_vectors(fd, vectors, count);
+}
+
+#if defined(__GNUC__)
+#define word_ctz(word) ((unsigned int)__builtin_ctzl(word))
+#define word_popcount(word) ((unsigned int)__builtin_popcountl(word))
+#else
+unsigned int word_ctz(bitmap_word word) {
+    unsigned int n = 0;
+    while (!(word & 1)) {
+        word >>= 1;
+        n++;
+    }
+    return n;
+}
+
+unsigned int word_popcount(bitmap_word word) {
+    unsigned int n = 0;
+    while (word) {
+        word &= word - 1;
+        n++;
+    }
+    return n;
+}
+#endif
+
+bitmap_word *alloc_bitmap(unsigned int num_bits) {
+    return calloc(BITMAP_BYTES(num_bits) / sizeof(bitmap_word), sizeof(bitmap_word));
+}
+
+bool bitmap_test(const bitmap_word *bitmap, unsigned int bit) {
+    return (bitmap[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1;
+}
+
+// Ustawia lub czyści bity [start, start + length) całymi słowami
+void bitmap_fill(bitmap_word *bitmap, unsigned int start, unsigned int length, bool value) {
+    unsigned int word = start / BITS_PER_WORD;
+    unsigned int offset = start % BITS_PER_WORD;
+
+    while (length > 0) {
+        unsigned int count = BITS_PER_WORD - offset;
+        if (count > length) {
+            count = length;
+        }
+        bitmap_word mask = (count == BITS_PER_WORD) ? ALL_SET : (((bitmap_word)1 << count) - 1) << offset;
+        if (value) {
+            bitmap[word] |= mask;
+        } else {
+            bitmap[word] &= ~mask;
+        }
+        length -= count;
+        offset = 0;
+        word++;
+    }
+}
+
+unsigned int bitmap_count_set(const bitmap_word *bitmap, unsigned int num_bits) {
+    unsigned int num_words = num_bits / BITS_PER_WORD;
+    unsigned int count = 0;
+
+    for (unsigned int i = 0; i < num_words; i++) {
+        count += word_popcount(bitmap[i]);
+    }
+    if (num_bits % BITS_PER_WORD) {
+        count += word_popcount(bitmap[num_words] & ((((bitmap_word)1) << (num_bits % BITS_PER_WORD)) - 1));
+    }
+    return count;
+}
+
+#ifdef HAVE_AVX2_SCAN
+// Pomija słowa równe value po 256 bitów naraz
+__attribute__((target("avx2")))
+unsigned int skip_words_avx2(const bitmap_word *bitmap, unsigned int word, unsigned int num_words, bitmap_word value) {
+    const unsigned int step = sizeof(__m256i) / sizeof(bitmap_word);
+    __m256i pattern = _mm256_set1_epi8((char)value);
+
+    while (word + step <= num_words) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(bitmap + word));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, pattern)) != -1) {
+            break;
+        }
+        word += step;
+    }
+    return word;
+}
+
+bool cpu_has_avx2(void) {
+    static int supported = -1;
+    if (supported < 0) {
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return supported;
+}
+#endif
+
+// Zwraca indeks pierwszego słowa od word, które jest różne od value
+unsigned int skip_words(const bitmap_word *bitmap, unsigned int word, unsigned int num_words, bitmap_word value) {
+#ifdef HAVE_AVX2_SCAN
+    if (cpu_has_avx2()) {
+        word = skip_words_avx2(bitmap, word, num_words, value);
+    }
+#endif
+    while (word < num_words && bitmap[word] == value) {
+        word++;
+    }
+    return word;
+}
+
+// Zwraca pierwszy bit o wartości value od indeksu from (num_bits, gdy brak)
+unsigned int bitmap_find(const bitmap_word *bitmap, unsigned int num_bits, unsigned int from, bool value) {
+    if (from >= num_bits) {
+        return num_bits;
+    }
+
+    unsigned int num_words = (num_bits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    bitmap_word invert = value ? 0 : ALL_SET;
+    unsigned int word = from / BITS_PER_WORD;
+    bitmap_word candidates = (bitmap[word] ^ invert) & (ALL_SET << (from % BITS_PER_WORD));
+
+    while (!candidates) {
+        word = skip_words(bitmap, word + 1, num_words, invert);
+        if (word >= num_words) {
+            return num_bits;
+        }
+        candidates = bitmap[word] ^ invert;
+    }
+
+    unsigned int bit = word * BITS_PER_WORD + word_ctz(candidates);
+    return bit < num_bits ? bit : num_bits;
+}
+
+// Zwraca początek pierwszego wolnego ciągu bloków od indeksu from (num_blocks, gdy brak)
+unsigned int find_free_run(const bitmap_word *block_bitmap, unsigned int num_blocks, unsigned int from, unsigned int *length) {
+    unsigned int start = bitmap_find(block_bitmap, num_blocks, from, false);
+    *length = bitmap_find(block_bitmap, num_blocks, start, true) - start;
+    return start;
+}
+
+// Wczytuje kopię bitmapy bloków, aby jej zmiany trafiały na dysk tylko przez dziennik;
+// bitmapa dawnego formatu (bool na blok) jest pakowana do bitów
+bitmap_word *read_block_bitmap(Disk *disk) {
+    DiskMetadata *metadata = &disk->metadata;
+    bitmap_word *block_bitmap = alloc_bitmap(metadata->num_blocks);
+    if (!block_bitmap) {
+        return NULL;
+    }
+
+    if (!is_legacy_image(metadata)) {
+        if (disk_read(disk, block_bitmap_offset(metadata), block_bitmap, BITMAP_BYTES(metadata->num_blocks)) != 0) {
+            free(block_bitmap);
+            return NULL;
+        }
+        return block_bitmap;
+    }
+
+    bool legacy_bits[BITMAP_CHUNK_BYTES];
+    unsigned int count;
+    for (unsigned int done = 0; done < metadata->num_blocks; done += count) {
+        count = metadata->num_blocks - done;
+        if (count > BITMAP_CHUNK_BYTES) {
+            count = BITMAP_CHUNK_BYTES;
+        }
+        disk_read(disk, block_bitmap_offset(metadata) + done * sizeof(bool), legacy_bits, count * sizeof(bool));
+        for (unsigned int i = 0; i < count; i++) {
+            if (legacy_bits[i]) {
+                bitmap_fill(block_bitmap, done + i, 1, true);
+            }
+        }
+    }
+    return block_bitmap;
+}
+
+unsigned int bitmap_chunks(const DiskMetadata *metadata) {
+    return (BITMAP_BYTES(metadata->num_blocks) + BITMAP_CHUNK_BYTES - 1) / BITMAP_CHUNK_BYTES;
+}
+
+// Zapisuje tylko zmienione porcje bitmapy, jednym zapisem na każdy ciąg sąsiednich porcji
+void write_block_bitmap(Disk *disk) {
+    unsigned long bitmap_bytes = BITMAP_BYTES(disk->metadata.num_blocks);
+    unsigned int chunks = bitmap_chunks(&disk->metadata);
+    unsigned int last;
+    for (unsigned int first = 0; first < chunks; first = last) {
+        if (!disk->bitmap_dirty[first]) {
+            last = first + 1;
+            continue;
+        }
+        for (last = first; last < chunks && disk->bitmap_dirty[last]; last++) {
+            disk->bitmap_dirty[last] = false;
+        }
+        unsigned long offset = (unsigned long)first * BITMAP_CHUNK_BYTES;
+        unsigned long end = (unsigned long)last * BITMAP_CHUNK_BYTES < bitmap_bytes ? (unsigned long)last * BITMAP_CHUNK_BYTES : bitmap_bytes;
+        disk_write(disk, block_bitmap_offset(&disk->metadata) + offset, (unsigned char *)disk->block_bitmap + offset, end - offset);
+    }
+}
+
+bool space_before(const SpaceIndex *space, int tree, unsigned int node, unsigned int start, unsigned int length) {
+    const SpaceNode *n = &space->nodes[node];
+    if (tree == BY_ADDRESS) {
+        return n->start < start;
+    }
+    return n->length < length || (n->length == length && n->start < start);
+}
+
+void space_update(SpaceIndex *space, unsigned int node) {
+    SpaceNode *n = &space->nodes[node];
+    n->longest = n->length;
+    if (space->nodes[n->left[BY_ADDRESS]].longest > n->longest) {
+        n->longest = space->nodes[n->left[BY_ADDRESS]].longest;
+    }
+    if (space->nodes[n->right[BY_ADDRESS]].longest > n->longest) {
+        n->longest = space->nodes[n->right[BY_ADDRESS]].longest;
+    }
+}
+
+unsigned int space_merge(SpaceIndex *space, int tree, unsigned int first, unsigned int second) {
+    if (!first || !second) {
+        return first ? first : second;
+    }
+    unsigned int top;
+    if (space->nodes[first].priority > space->nodes[second].priority) {
+        space->nodes[first].right[tree] = space_merge(space, tree, space->nodes[first].right[tree], second);
+        top = first;
+    } else {
+        space->nodes[second].left[tree] = space_merge(space, tree, first, space->nodes[second].left[tree]);
+        top = second;
+    }
+    if (tree == BY_ADDRESS) {
+        space_update(space, top);
+    }
+    return top;
+}
+
+// Dzieli drzewo na węzły uporządkowane przed kluczem i pozostałe
+void space_split(SpaceIndex *space, int tree, unsigned int node, unsigned int start, unsigned int length,
+                 unsigned int *before, unsigned int *after) {
+    if (!node) {
+        *before = 0;
+        *after = 0;
+        return;
+    }
+    if (space_before(space, tree, node, start, length)) {
+        space_split(space, tree, space->nodes[node].right[tree], start, length, &space->nodes[node].right[tree], after);
+        *before = node;
+    } else {
+        space_split(space, tree, space->nodes[node].left[tree], start, length, before, &space->nodes[node].left[tree]);
+        *after = node;
+    }
+    if (tree == BY_ADDRESS) {
+        space_update(space, node);
+    }
+}
+
+unsigned int space_unlink(SpaceIndex *space, int tree, unsigned int node, unsigned int removed) {
+    SpaceNode *n = &space->nodes[node];
+    if (node == removed) {
+        return space_merge(space, tree, n->left[tree], n->right[tree]);
+    }
+    if (space_before(space, tree, node, space->nodes[removed].start, space->nodes[removed].length)) {
+        n->right[tree] = space_unlink(space, tree, n->right[tree], removed);
+    } else {
+        n->left[tree] = space_unlink(space, tree, n->left[tree], removed);
+    }
+    if (tree == BY_ADDRESS) {
+        space_update(space, node);
+    }
+    return node;
+}
+
+void space_insert(SpaceIndex *space, unsigned int start, unsigned int length) {
+    unsigned int node;
+    if (space->unused) {
+        node = space->unused;
+        space->unused = space->nodes[node].left[BY_ADDRESS];
+    } else {
+        if (space->used == space->capacity) {
+            unsigned int capacity = space->capacity * 2 + 64;
+            SpaceNode *grown = realloc(space->nodes, capacity * sizeof(SpaceNode));
+            if (!grown) {
+                space->stale = true;
+                return;
+            }
+            if (!space->nodes) {
+                memset(grown, 0, sizeof(SpaceNode));
+                space->used = 1;
+            }
+            space->nodes = grown;
+            space->capacity = capacity;
+        }
+        node = space->used++;
+    }
+
+    // xorshift32
+    space->seed ^= space->seed << 13;
+    space->seed ^= space->seed >> 17;
+    space->seed ^= space->seed << 5;
+    space->nodes[node] = (SpaceNode){ start, length, length, space->seed, { 0, 0 }, { 0, 0 } };
+    for (int tree = BY_ADDRESS; tree <= BY_LENGTH; tree++) {
+        unsigned int before, after;
+        space_split(space, tree, space->root[tree], start, length, &before, &after);
+        space->root[tree] = space_merge(space, tree, space_merge(space, tree, before, node), after);
+    }
+    space->count++;
+}
+
+void space_remove(SpaceIndex *space, unsigned int node) {
+    space->root[BY_ADDRESS] = space_unlink(space, BY_ADDRESS, space->root[BY_ADDRESS], node);
+    space->root[BY_LENGTH] = space_unlink(space, BY_LENGTH, space->root[BY_LENGTH], node);
+    space->nodes[node].left[BY_ADDRESS] = space->unused;
+    space->unused = node;
+    space->count--;
+}
+
+// Ciąg o największym początku nie większym niż block albo 0
+unsigned int space_floor(const SpaceIndex *space, unsigned int block) {
+    unsigned int found = 0;
+    for (unsigned int node = space->root[BY_ADDRESS]; node; ) {
+        if (space->nodes[node].start <= block) {
+            found = node;
+            node = space->nodes[node].right[BY_ADDRESS];
+        } else {
+            node = space->nodes[node].left[BY_ADDRESS];
+        }
+    }
+    return found;
+}
+
+// Ciąg o najmniejszym początku nie mniejszym niż block albo 0
+unsigned int space_ceiling(const SpaceIndex *space, unsigned int block) {
+    unsigned int found = 0;
+    for (unsigned int node = space->root[BY_ADDRESS]; node; ) {
+        if (space->nodes[node].start >= block) {
+            found = node;
+            node = space->nodes[node].left[BY_ADDRESS];
+        } else {
+            node = space->nodes[node].right[BY_ADDRESS];
+        }
+    }
+    return found;
+}
+
+// Najniższy ciąg zaczynający się od from, który mieści length bloków; poddrzewa, których
+// najdłuższy ciąg jest za krótki, są pomijane w całości
+unsigned int space_first_fit(const SpaceIndex *space, unsigned int node, unsigned int from, unsigned int length) {
+    while (node && space->nodes[node].longest >= length) {
+        const SpaceNode *n = &space->nodes[node];
+        if (n->start >= from) {
+            unsigned int found = space_first_fit(space, n->left[BY_ADDRESS], from, length);
+            if (found) {
+                return found;
+            }
+            if (n->length >= length) {
+                return node;
+            }
+        }
+        node = n->right[BY_ADDRESS];
+    }
+    return 0;
+}
+
+// Najkrótszy ciąg mieszczący length bloków, spośród równych najniższy
+unsigned int space_best_fit(const SpaceIndex *space, unsigned int length) {
+    unsigned int found = 0;
+    for (unsigned int node = space->root[BY_LENGTH]; node; ) {
+        if (space->nodes[node].length >= length) {
+            found = node;
+            node = space->nodes[node].left[BY_LENGTH];
+        } else {
+            node = space->nodes[node].right[BY_LENGTH];
+        }
+    }
+    return found;
+}
+
+unsigned int space_largest(const SpaceIndex *space) {
+    unsigned int node = space->root[BY_LENGTH];
+    while (node && space->nodes[node].right[BY_LENGTH]) {
+        node = space->nodes[node].right[BY_LENGTH];
+    }
+    return node;
+}
+
+// Zwolnione bloki łączą się z sąsiednimi wolnymi ciągami
+void space_add(SpaceIndex *space, unsigned int start, unsigned int length) {
+    unsigned int end = start + length;
+    unsigned int node = space_floor(space, start);
+    if (node && space->nodes[node].start + space->nodes[node].length >= start) {
+        start = space->nodes[node].start;
+        if (space->nodes[node].start + space->nodes[node].length > end) {
+            end = space->nodes[node].start + space->nodes[node].length;
+        }
+        space_remove(space, node);
+    }
+    while ((node = space_ceiling(space, start)) != 0 && space->nodes[node].start <= end) {
+        if (space->nodes[node].start + space->nodes[node].length > end) {
+            end = space->nodes[node].start + space->nodes[node].length;
+        }
+        space_remove(space, node);
+    }
+    space_insert(space, start, end - start);
+}
+
+// Zajęte bloki są wycinane z ciągów, które je zawierają
+void space_take(SpaceIndex *space, unsigned int start, unsigned int length) {
+    unsigned int end = start + length;
+    unsigned int node = space_floor(space, start);
+    if (!node || space->nodes[node].start + space->nodes[node].length <= start) {
+        node = space_ceiling(space, start);
+    }
+    while (node && space->nodes[node].start < end) {
+        unsigned int run_start = space->nodes[node].start;
+        unsigned int run_end = run_start + space->nodes[node].length;
+        space_remove(space, node);
+        if (run_start < start) {
+            space_insert(space, run_start, start - run_start);
+        }
+        if (run_end > end) {
+            space_insert(space, end, run_end - end);
+        }
+        node = space_ceiling(space, start);
+    }
+}
+
+// Buduje indeks z bitmapy bloków jednym przejściem po jej wolnych ciągach
+int build_space_index(Disk *disk) {
+    SpaceIndex *space = &disk->space;
+    space->used = space->nodes ? 1 : 0;
+    space->unused = 0;
+    space->root[BY_ADDRESS] = 0;
+    space->root[BY_LENGTH] = 0;
+    space->count = 0;
+    space->cursor = 0;
+    space->seed = 2463534242U;
+    space->stale = false;
+
+    unsigned int num_blocks = disk->metadata.num_blocks;
+    unsigned int length;
+    for (unsigned int start = find_free_run(disk->block_bitmap, num_blocks, 0, &length); start < num_blocks && !space->stale;
+         start = find_free_run(disk->block_bitmap, num_blocks, start + length, &length)) {
+        space_insert(space, start, length);
+    }
+    return space->stale ? -1 : 0;
+}
+
+// Każda zmiana bitmapy bloków przechodzi tędy, aby licznik wolnych bloków
+// i znaczniki zmienionych porcji bitmapy były zawsze zgodne
+void set_blocks(Disk *disk, unsigned int start, unsigned int length, bool used) {
+    if (length == 0) {
+        return;
+    }
+    bitmap_fill(disk->block_bitmap, start, length, used);
+    if (used) {
+        disk->metadata.free_blocks -= length;
+        space_take(&disk->space, start, length);
+    } else {
+        disk->metadata.free_blocks += length;
+        space_add(&disk->space, start, length);
+    }
+    for (unsigned int chunk = start / BITMAP_CHUNK_BITS; chunk <= (start + length - 1) / BITMAP_CHUNK_BITS; chunk++) {
+        disk->bitmap_dirty[chunk] = true;
+    }
+    disk->dirty = true;
+}
+
+// Zwolnione bloki mogą wciąż należeć do ostatniego zatwierdzonego stanu, dlatego
+// stają się wolne dopiero wraz z zatwierdzeniem transakcji, która je zwolniła
+void mark_blocks(Disk *disk, unsigned int start, unsigned int length, bool used) {
+    if (used) {
+        io_stats.blocks_allocated += length;
+    } else {
+        io_stats.blocks_freed += length;
+    }
+    if (used || length == 0) {
+        set_blocks(disk, start, length, used);
+        return;
+    }
+    if (disk->num_deferred == disk->deferred_capacity) {
+        unsigned int capacity = disk->deferred_capacity * 2 + MAX_EXTENTS;
+        Extent *grown = realloc(disk->deferred, capacity * sizeof(Extent));
+        if (!grown) {
+            set_blocks(disk, start, length, false);
+            return;
+        }
+        disk->deferred = grown;
+        disk->deferred_capacity = capacity;
+    }
+    disk->deferred[disk->num_deferred].start = start;
+    disk->deferred[disk->num_deferred].length = length;
+    disk->num_deferred++;
+    disk->dirty = true;
+}
+
+void apply_deferred_frees(Disk *disk) {
+    for (unsigned int i = 0; i < disk->num_deferred; i++) {
+        set_blocks(disk, disk->deferred[i].start, disk->deferred[i].length, false);
+    }
+    disk->num_deferred = 0;
+}
+
+// Ciąg, który wybiera polityka przydziału dla length bloków, albo 0, gdy żaden ich nie mieści.
+// first: najniższy ciąg; best: najkrótszy; next: najniższy za poprzednim przydziałem,
+// a gdy go nie ma, od początku dysku.
+unsigned int pick_run(const SpaceIndex *space, unsigned int length) {
+    if (alloc_policy == ALLOC_BEST) {
+        return space_best_fit(space, length);
+    }
+    if (alloc_policy == ALLOC_NEXT) {
+        unsigned int node = space_first_fit(space, space->root[BY_ADDRESS], space->cursor, length);
+        if (node) {
+            return node;
+        }
+    }
+    return space_first_fit(space, space->root[BY_ADDRESS], 0, length);
+}
+
+// Przydziela bloki jako listę ekstentów: jeden ciąg wybrany przez alloc_policy, gdy jakiś mieści
+// wszystkie bloki, a w przeciwnym razie najdłuższe ciągi, aż reszta zmieści się w jednym,
+// żeby plik miał jak najmniej ekstentów
+Extent *allocate_runs(Disk *disk, unsigned int blocks_needed, unsigned int *num_extents) {
+    SpaceIndex *space = &disk->space;
+    unsigned int capacity = MAX_EXTENTS;
+    unsigned int count = 0;
+    unsigned int allocated = 0;
+
+    // Licznik wolnych bloków pozwala odrzucić za duży plik bez przeszukiwania indeksu
+    if (blocks_needed > disk->metadata.free_blocks) {
+        return NULL;
+    }
+    if (space->stale && build_space_index(disk) != 0) {
+        return NULL;
+    }
+
+    Extent *extents = malloc(capacity * sizeof(Extent));
+    if (!extents) {
+        return NULL;
+    }
+
+    while (allocated < blocks_needed) {
+        unsigned int node = pick_run(space, blocks_needed - allocated);
+        if (!node) {
+            node = space_largest(space);
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            Extent *grown = realloc(extents, capacity * sizeof(Extent));
+            if (grown) {
+                extents = grown;
+            } else {
+                node = 0;
+            }
+        }
+        if (!node) {
+            // Nic jeszcze nie wskazuje na te bloki, więc mogą od razu stać się wolne
+            for (unsigned int i = 0; i < count; i++) {
+                set_blocks(disk, extents[i].start, extents[i].length, false);
+            }
+            free(extents);
+            return NULL;
+        }
+        unsigned int length = space->nodes[node].length;
+        if (length > blocks_needed - allocated) {
+            length = blocks_needed - allocated;
+        }
+        extents[count] = (Extent){ space->nodes[node].start, length };
+        mark_blocks(disk, extents[count].start, length, true);
+        space->cursor = extents[count].start + length;
+        count++;
+        allocated += length;
+    }
+
+    *num_extents = count;
+    return extents;
+}
+
+// Przydział bloków jest mierzony przez --stats jako osobny etap
+Extent *allocate_extents(Disk *disk, unsigned int blocks_needed, unsigned int *num_extents) {
+    int previous = enter_phase(PHASE_ALLOC);
+    Extent *extents = allocate_runs(disk, blocks_needed, num_extents);
+    enter_phase(previous);
+    return extents;
+}
+
+void release_extent(Disk *disk, const Extent *extent) {
+    mark_blocks(disk, extent->start, extent->length, false);
+}
+
+unsigned int overflow_blocks(const Disk *disk, unsigned int num_extents) {
+    if (num_extents <= MAX_EXTENTS) {
+        return 0;
+    }
+    return (num_extents - MAX_EXTENTS + disk->extents_per_block - 1) / disk->extents_per_block;
+}
+
+// Zapisuje ekstenty w i-węźle, a nadmiarowe w dodatkowych blokach ekstentów. Blok jest wypełniany
+// od początku; za ostatnim mieszczącym się ekstentem (extents_per_block) leży numer kolejnego bloku.
+// Wszystkie bloki ekstentów są przydzielane naraz, więc zwykle tworzą jeden ciągły obszar.
+int store_extents(Disk *disk, Inode *inode, const Extent *extents, unsigned int num_extents) {
+    unsigned int blocks = overflow_blocks(disk, num_extents);
+
+    inode->num_extents = num_extents;
+    inode->extent_block = NO_BLOCK;
+    inode->first_block = num_extents > 0 ? extents[0].start : NO_BLOCK;
+    unsigned int stored = num_extents < MAX_EXTENTS ? num_extents : MAX_EXTENTS;
+    memcpy(inode->extents, extents, stored * sizeof(Extent));
+    if (blocks == 0) {
+        return 0;
+    }
+
+    unsigned int num_runs = 0;
+    Extent *runs = allocate_extents(disk, blocks, &num_runs);
+    unsigned char *table = calloc(blocks, disk->block_size);
+    if (!runs || !table) {
+        for (unsigned int i = 0; runs && i < num_runs; i++) {
+            release_extent(disk, &runs[i]);
+        }
+        free(runs);
+        free(table);
+        return -1;
+    }
+
+    // Bloki są budowane w pamięci razem ze wskaźnikami, a potem zapisywane po jednym obszarze
+    unsigned char *block = table;
+    for (unsigned int i = 0; i < num_runs; i++) {
+        for (unsigned int j = 0; j < runs[i].length; j++) {
+            unsigned int count = num_extents - stored;
+            if (count > disk->extents_per_block) {
+                count = disk->extents_per_block;
+            }
+            memcpy(block, extents + stored, count * sizeof(Extent));
+            stored += count;
+            unsigned int next_block;
+            if (j + 1 < runs[i].length) {
+                next_block = runs[i].start + j + 1;
+            } else {
+                next_block = i + 1 < num_runs ? runs[i + 1].start : NO_BLOCK;
+            }
+            memcpy(block + disk->extents_per_block * sizeof(Extent), &next_block, sizeof(unsigned int));
+            block += disk->block_size;
+        }
+    }
+
+    unsigned int done = 0;
+    for (unsigned int i = 0; i < num_runs; i++) {
+        disk_write_new(disk, data_block_offset(&disk->metadata, runs[i].start), table + blocks_to_bytes(disk, done),
+                       blocks_to_bytes(disk, runs[i].length));
+        done += runs[i].length;
+    }
+    inode->extent_block = runs[0].start;
+    free(runs);
+    free(table);
+    return 0;
+}
+
+// Zwraca pełną listę ekstentów pliku, a gdy chain nie jest NULL, także numery bloków ekstentów.
+// Łańcuch jest czytany oknem, które rośnie dwukrotnie, dopóki kolejny blok leży zaraz za poprzednim.
+Extent *read_extent_table(Disk *disk, const Inode *inode, unsigned int *chain) {
+    unsigned int num_blocks = disk->metadata.num_blocks;
+    unsigned int remaining = overflow_blocks(disk, inode->num_extents);
+    unsigned int max_window = bytes_to_blocks(disk, buffer_size(disk, IO_BUFFER_SIZE));
+
+    Extent *extents = malloc((inode->num_extents + 1) * sizeof(Extent));
+    unsigned char *table = NULL;
+    if (remaining > 0) {
+        table = malloc(blocks_to_bytes(disk, remaining < max_window ? remaining : max_window));
+    }
+    if (!extents || (remaining > 0 && !table)) {
+        free(extents);
+        return NULL;
+    }
+
+    unsigned int loaded = inode->num_extents < MAX_EXTENTS ? inode->num_extents : MAX_EXTENTS;
+    memcpy(extents, inode->extents, loaded * sizeof(Extent));
+
+    unsigned int current_block = inode->extent_block;
+    unsigned int window = 1;
+    unsigned int found = 0;
+    while (loaded < inode->num_extents && current_block < num_blocks) {
+        unsigned int base = current_block;
+        unsigned int blocks = remaining - found < window ? remaining - found : window;
+        if (blocks > num_blocks - base) {
+            blocks = num_blocks - base;
+        }
+        if (disk_read(disk, data_block_offset(&disk->metadata, base), table, blocks_to_bytes(disk, blocks)) != 0) {
+            break;
+        }
+        while (loaded < inode->num_extents && current_block >= base && current_block - base < blocks) {
+            unsigned char *block = table + blocks_to_bytes(disk, current_block - base);
+            unsigned int count = inode->num_extents - loaded;
+            if (count > disk->extents_per_block) {
+                count = disk->extents_per_block;
+            }
+            memcpy(extents + loaded, block, count * sizeof(Extent));
+            loaded += count;
+            if (chain) {
+                chain[found] = current_block;
+            }
+            found++;
+            memcpy(&current_block, block + disk->extents_per_block * sizeof(Extent), sizeof(unsigned int));
+        }
+        if (current_block == base + blocks) {
+            window = window * 2 < max_window ? window * 2 : max_window;
+        } else {
+            window = 1;
+        }
+    }
+    free(table);
+
+    if (loaded < inode->num_extents) {
+        free(extents);
+        return NULL;
+    }
+    return extents;
+}
+
+Extent *load_extents(Disk *disk, const Inode *inode) {
+    return read_extent_table(disk, inode, NULL);
+}
+
+// Zwalnia bloki ekstentów, jednym wywołaniem na każdy ciąg kolejnych bloków
+void release_chain(Disk *disk, const unsigned int *chain, unsigned int count) {
+    unsigned int last;
+    for (unsigned int first = 0; first < count; first = last) {
+        for (last = first + 1; last < count && chain[last] == chain[last - 1] + 1; last++) {
+        }
+        mark_blocks(disk, chain[first], last - first, false);
+    }
+}
+
+// Zwalnia łańcuch bloków z dodatkowymi ekstentami
+void release_extent_blocks(Disk *disk, const Inode *inode) {
+    unsigned int count = overflow_blocks(disk, inode->num_extents);
+    if (inode->extent_block == NO_BLOCK || count == 0) {
+        return;
+    }
+    unsigned int *chain = malloc(count * sizeof(unsigned int));
+    Extent *extents = chain ? read_extent_table(disk, inode, chain) : NULL;
+    if (extents) {
+        release_chain(disk, chain, count);
+    }
+    free(extents);
+    free(chain);
+}
+
+// Zamienia numer bloku w pliku na numer bloku dysku
+unsigned int map_file_block(const Extent *extents, unsigned int num_extents, unsigned int logical_block) {
+    for (unsigned int i = 0; i < num_extents; i++) {
+        if (logical_block < extents[i].length) {
+            return extents[i].start + logical_block;
+        }
+        logical_block -= extents[i].length;
+    }
+    return NO_BLOCK;
+}
+
+// Odczyt lub zapis początkowych bytes bajtów pliku opisanego listą ekstentów
+// (zapis dotyczy wyłącznie bloków przydzielonych od ostatniego zatwierdzenia)
+int file_data_io(Disk *disk, const Extent *extents, unsigned int num_extents, unsigned char *buffer, unsigned long bytes, bool write) {
+    for (unsigned int i = 0; i < num_extents && bytes > 0; i++) {
+        unsigned long length = blocks_to_bytes(disk, extents[i].length);
+        if (length > bytes) {
+            length = bytes;
+        }
+        disk_offset offset = data_block_offset(&disk->metadata, extents[i].start);
+        if ((write ? disk_write_new(disk, offset, buffer, length) : disk_read(disk, offset, buffer, length)) != 0) {
+            return -1;
+        }
+        buffer += length;
+        bytes -= length;
+    }
+    return bytes == 0 ? 0 : -1;
+}
+
+// Skrót nazwy pliku (FNV-1a)
+unsigned int name_hash(const char *name) {
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+disk_offset inode_offset(Disk *disk, unsigned int number) {
+    unsigned int block = map_file_block(disk->catalog_extents, disk->metadata.catalog.num_extents, number / disk->inodes_per_block);
+    return data_block_offset(&disk->metadata, block) + (number % disk->inodes_per_block) * sizeof(Inode);
+}
+
+int read_inode(Disk *disk, unsigned int number, Inode *inode) {
+    if (is_legacy_image(&disk->metadata)) {
+        *inode = disk->legacy_catalog[number];
+        return 0;
+    }
+    return disk_read(disk, inode_offset(disk, number), inode, sizeof(Inode));
+}
+
+int write_inode(Disk *disk, unsigned int number, const Inode *inode) {
+    return disk_write(disk, inode_offset(disk, number), inode, sizeof(Inode));
+}
+
+// Indeks nazw i indeks bloków to tablice mieszające IndexEntry przechowywane jak pliki, z liczbą
+// pozycji będącą potęgą dwójki i adresowaniem liniowym; table to i-węzeł jednej z nich, extents jej ekstenty
+unsigned int table_slots(const Disk *disk, const Inode *table) {
+    return inode_size(&disk->metadata, table) / sizeof(IndexEntry);
+}
+
+disk_offset table_entry_offset(Disk *disk, const Inode *table, const Extent *extents, unsigned int slot) {
+    unsigned int block = map_file_block(extents, table->num_extents, slot / disk->index_entries_per_block);
+    return data_block_offset(&disk->metadata, block) + (slot % disk->index_entries_per_block) * sizeof(IndexEntry);
+}
+
+void read_table_entry(Disk *disk, const Inode *table, const Extent *extents, unsigned int slot, IndexEntry *entry) {
+    if (disk_read(disk, table_entry_offset(disk, table, extents, slot), entry, sizeof(IndexEntry)) != 0) {
+        memset(entry, 0, sizeof(IndexEntry));
+    }
+}
+
+void write_table_entry(Disk *disk, const Inode *table, const Extent *extents, unsigned int slot, const IndexEntry *entry) {
+    disk_write(disk, table_entry_offset(disk, table, extents, slot), entry, sizeof(IndexEntry));
+}
+
+// Podwaja tablicę mieszającą: nowa tablica powstaje w pamięci i trafia do nowych bloków
+int grow_table(Disk *disk, Inode *table, Extent **table_extents) {
+    unsigned int old_slots = table_slots(disk, table);
+    unsigned int new_slots = old_slots * 2;
+
+    IndexEntry *old_entries = malloc(old_slots * sizeof(IndexEntry));
+    IndexEntry *new_entries = calloc(new_slots, sizeof(IndexEntry));
+    if (!old_entries || !new_entries ||
+        file_data_io(disk, *table_extents, table->num_extents, (unsigned char *)old_entries, old_slots * sizeof(IndexEntry), false) != 0) {
+        free(old_entries);
+        free(new_entries);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < old_slots; i++) {
+        if (old_entries[i].value == 0) {
+            continue;
+        }
+        unsigned int current = old_entries[i].hash & (new_slots - 1);
+        while (new_entries[current].value != 0) {
+            current = (current + 1) & (new_slots - 1);
+        }
+        new_entries[current] = old_entries[i];
+    }
+    free(old_entries);
+
+    unsigned int num_extents;
+    Extent *extents = allocate_extents(disk, blocks_for_bytes(disk, new_slots * sizeof(IndexEntry)), &num_extents);
+    Inode new_table = {0};
+    set_inode_size(&disk->metadata, &new_table, (unsigned long)new_slots * sizeof(IndexEntry));
+    if (!extents || store_extents(disk, &new_table, extents, num_extents) != 0 ||
+        file_data_io(disk, extents, num_extents, (unsigned char *)new_entries, (unsigned long)new_slots * sizeof(IndexEntry), true) != 0) {
+        if (extents) {
+            for (unsigned int i = 0; i < num_extents; i++) {
+                release_extent(disk, &extents[i]);
+            }
+            release_extent_blocks(disk, &new_table);
+        }
+        free(extents);
+        free(new_entries);
+        return -1;
+    }
+    free(new_entries);
+
+    // Stara tablica to metadane, więc jej bloki są zwalniane wprost, bez liczników odwołań
+    for (unsigned int i = 0; i < table->num_extents; i++) {
+        release_extent(disk, &(*table_extents)[i]);
+    }
+    release_extent_blocks(disk, table);
+    *table = new_table;
+    free(*table_extents);
+    *table_extents = extents;
+    return 0;
+}
+
+// Dodaje pozycję do tablicy zawierającej już count pozycji; tablica jest powiększana przy zapełnieniu powyżej 3/4
+int table_insert(Disk *disk, Inode *table, Extent **extents, unsigned int count, unsigned int hash, unsigned int value) {
+    if ((count + 1) * 4 > table_slots(disk, table) * 3 && grow_table(disk, table, extents) != 0) {
+        return -1;
+    }
+
+    unsigned int mask = table_slots(disk, table) - 1;
+    unsigned int current = hash & mask;
+    IndexEntry entry;
+    for (;;) {
+        read_table_entry(disk, table, *extents, current, &entry);
+        if (entry.value == 0) {
+            break;
+        }
+        current = (current + 1) & mask;
+    }
+    entry.hash = hash;
+    entry.value = value;
+    write_table_entry(disk, table, *extents, current, &entry);
+    return 0;
+}
+
+// Usuwa pozycję, przesuwając wstecz dalsze pozycje tego samego ciągu, więc tablica nie potrzebuje znaczników usunięcia
+void table_remove(Disk *disk, const Inode *table, const Extent *extents, unsigned int slot) {
+    unsigned int mask = table_slots(disk, table) - 1;
+    unsigned int hole = slot;
+    IndexEntry entry;
+    for (unsigned int current = (slot + 1) & mask; ; current = (current + 1) & mask) {
+        read_table_entry(disk, table, extents, current, &entry);
+        if (entry.value == 0) {
+            break;
+        }
+        unsigned int home = entry.hash & mask;
+        if (((current - home) & mask) >= ((current - hole) & mask)) {
+            write_table_entry(disk, table, extents, hole, &entry);
+            hole = current;
+        }
+    }
+    memset(&entry, 0, sizeof(IndexEntry));
+    write_table_entry(disk, table, extents, hole, &entry);
+}
+
+bool dedup_enabled(const Disk *disk) {
+    return inode_size(&disk->metadata, &disk->metadata.block_refs) > 0;
+}
+
+// Skrót bloku liczony słowami; zgodność skrótów jest potwierdzana porównaniem bloków
+unsigned int block_hash(const Disk *disk, const unsigned char *data) {
+    const unsigned int *words = (const unsigned int *)data;
+    unsigned int hash = 2166136261u;
+    for (unsigned int i = 0; i < disk->block_size / sizeof(unsigned int); i++) {
+        hash = (hash ^ words[i]) * 16777619u;
+    }
+    return hash;
+}
+
+disk_offset block_ref_offset(Disk *disk, unsigned int block) {
+    unsigned int refs_per_block = disk->block_size / sizeof(BlockRef);
+    unsigned int table_block = map_file_block(disk->ref_extents, disk->metadata.block_refs.num_extents, block / refs_per_block);
+    return data_block_offset(&disk->metadata, table_block) + (block % refs_per_block) * sizeof(BlockRef);
+}
+
+void read_block_ref(Disk *disk, unsigned int block, BlockRef *ref) {
+    if (disk_read(disk, block_ref_offset(disk, block), ref, sizeof(BlockRef)) != 0) {
+        memset(ref, 0, sizeof(BlockRef));
+    }
+}
+
+void write_block_ref(Disk *disk, unsigned int block, const BlockRef *ref) {
+    disk_write(disk, block_ref_offset(disk, block), ref, sizeof(BlockRef));
+}
+
+// Zwraca zapisany blok o tej samej zawartości co data albo NO_BLOCK; scratch mieści jeden blok
+unsigned int find_shared_block(Disk *disk, unsigned int hash, const unsigned char *data, unsigned char *scratch) {
+    Inode *table = &disk->metadata.block_index;
+    unsigned int mask = table_slots(disk, table) - 1;
+    for (unsigned int current = hash & mask; ; current = (current + 1) & mask) {
+        IndexEntry entry;
+        read_table_entry(disk, table, disk->block_index_extents, current, &entry);
+        if (entry.value == 0) {
+            return NO_BLOCK;
+        }
+        if (entry.hash == hash && disk_read(disk, data_block_offset(&disk->metadata, entry.value - 1), scratch, disk->block_size) == 0 &&
+            memcmp(scratch, data, disk->block_size) == 0) {
+            return entry.value - 1;
+        }
+    }
+}
+
+void add_block_ref(Disk *disk, unsigned int block) {
+    BlockRef ref;
+    read_block_ref(disk, block, &ref);
+    ref.refs++;
+    write_block_ref(disk, block, &ref);
+}
+
+// Zapisuje nowy blok w indeksie bloków z jednym odwołaniem
+int index_block(Disk *disk, unsigned int block, unsigned int hash) {
+    if (table_insert(disk, &disk->metadata.block_index, &disk->block_index_extents, disk->metadata.indexed_blocks, hash, block + 1) != 0) {
+        return -1;
+    }
+    disk->metadata.indexed_blocks++;
+    BlockRef ref = { hash, 1 };
+    write_block_ref(disk, block, &ref);
+    return 0;
+}
+
+void unindex_block(Disk *disk, unsigned int block, unsigned int hash) {
+    Inode *table = &disk->metadata.block_index;
+    unsigned int mask = table_slots(disk, table) - 1;
+    for (unsigned int current = hash & mask; ; current = (current + 1) & mask) {
+        IndexEntry entry;
+        read_table_entry(disk, table, disk->block_index_extents, current, &entry);
+        if (entry.value == 0) {
+            return;
+        }
+        if (entry.value == block + 1) {
+            table_remove(disk, table, disk->block_index_extents, current);
+            disk->metadata.indexed_blocks--;
+            return;
+        }
+    }
+}
+
+// Odejmuje jedno odwołanie od każdego bloku ekstentów; skrót jest w tablicy odwołań, więc dane
+// nie są czytane. Blok bez odwołań wypada z indeksu i jest zwalniany, sąsiednie bloki jednym wywołaniem.
+void release_shared(Disk *disk, const Extent *extents, unsigned int num_extents) {
+    unsigned int run_start = 0, run_length = 0;
+    for (unsigned int i = 0; i < num_extents; i++) {
+        for (unsigned int j = 0; j < extents[i].length; j++) {
+            unsigned int block = extents[i].start + j;
+            BlockRef ref;
+            read_block_ref(disk, block, &ref);
+            if (ref.refs > 1) {
+                ref.refs--;
+                write_block_ref(disk, block, &ref);
+                continue;
+            }
+            if (ref.refs == 1) {
+                unindex_block(disk, block, ref.hash);
+            }
+            memset(&ref, 0, sizeof(BlockRef));
+            write_block_ref(disk, block, &ref);
+            if (run_length > 0 && run_start + run_length == block) {
+                run_length++;
+                continue;
+            }
+            if (run_length > 0) {
+                mark_blocks(disk, run_start, run_length, false);
+            }
+            run_start = block;
+            run_length = 1;
+        }
+    }
+    if (run_length > 0) {
+        mark_blocks(disk, run_start, run_length, false);
+    }
+}
+
+// Zwalnia bloki danych pliku; na dysku z deduplikacją tracą one tylko jedno odwołanie
+void release_data(Disk *disk, const Extent *extents, unsigned int num_extents) {
+    if (dedup_enabled(disk)) {
+        release_shared(disk, extents, num_extents);
+        return;
+    }
+    for (unsigned int i = 0; i < num_extents; i++) {
+        release_extent(disk, &extents[i]);
+    }
+}
+
+// Zwalnia wszystkie bloki pliku: dane i bloki ekstentów. Tablica ekstentów jest czytana
+// raz, a samych bloków danych nie trzeba czytać wcale.
+int release_file_blocks(Disk *disk, const Inode *inode) {
+    unsigned int count = inode->extent_block == NO_BLOCK ? 0 : overflow_blocks(disk, inode->num_extents);
+    unsigned int *chain = malloc((count + 1) * sizeof(unsigned int));
+    Extent *extents = chain ? read_extent_table(disk, inode, count > 0 ? chain : NULL) : NULL;
+    if (!extents) {
+        free(chain);
+        return -1;
+    }
+    release_data(disk, extents, inode->num_extents);
+    release_chain(disk, chain, count);
+    free(extents);
+    free(chain);
+    return 0;
+}
+
+// Podwaja katalog i-węzłów, dokładając nowe bloki na koniec jego listy ekstentów
+int grow_catalog(Disk *disk) {
+    Inode *catalog = &disk->metadata.catalog;
+    unsigned int blocks = bytes_to_blocks(disk, inode_size(&disk->metadata, catalog));
+    unsigned int num_added;
+
+    Extent *added = allocate_extents(disk, blocks, &num_added);
+    if (!added) {
+        return -1;
+    }
+    Extent *combined = malloc((catalog->num_extents + num_added) * sizeof(Extent));
+    if (!combined) {
+        for (unsigned int i = 0; i < num_added; i++) {
+            release_extent(disk, &added[i]);
+        }
+        free(added);
+        return -1;
+    }
+
+    // Sąsiadujące obszary są łączone w jeden ekstent
+    memcpy(combined, disk->catalog_extents, catalog->num_extents * sizeof(Extent));
+    unsigned int total = catalog->num_extents;
+    for (unsigned int i = 0; i < num_added; i++) {
+        if (total > 0 && combined[total - 1].start + combined[total - 1].length == added[i].start) {
+            combined[total - 1].length += added[i].length;
+        } else {
+            combined[total++] = added[i];
+        }
+    }
+    free(added);
+
+    release_extent_blocks(disk, catalog);
+    if (store_extents(disk, catalog, combined, total) != 0) {
+        free(combined);
+        return -1;
+    }
+    set_inode_size(&disk->metadata, catalog, inode_size(&disk->metadata, catalog) + blocks_to_bytes(disk, blocks));
+    free(disk->catalog_extents);
+    disk->catalog_extents = combined;
+    return 0;
+}
+
+// Przydziela i-węzeł z listy wolnych, a gdy jest pusta, kolejny nieużyty numer
+unsigned int allocate_inode(Disk *disk) {
+    DiskMetadata *metadata = &disk->metadata;
+
+    if (metadata->free_inode != NO_INODE) {
+        unsigned int number = metadata->free_inode;
+        Inode inode;
+        if (read_inode(disk, number, &inode) != 0) {
+            return NO_INODE;
+        }
+        metadata->free_inode = inode.first_block;
+        return number;
+    }
+
+    if (metadata->num_inodes == bytes_to_blocks(disk, inode_size(metadata, &metadata->catalog)) * disk->inodes_per_block &&
+        grow_catalog(disk) != 0) {
+        return NO_INODE;
+    }
+    return metadata->num_inodes++;
+}
+
+// Zwalnia i-węzeł, dopisując go na początek listy wolnych i-węzłów
+void release_inode(Disk *disk, unsigned int number) {
+    Inode inode = {0};
+    inode.first_block = disk->metadata.free_inode;
+    write_inode(disk, number, &inode);
+    disk->metadata.free_inode = number;
+}
+
+// Katalogi
+
+int open_directory(Disk *disk, unsigned int number, Directory *dir) {
+    memset(dir, 0, sizeof(Directory));
+    dir->number = number;
+    if (number == ROOT_DIRECTORY) {
+        dir->table = &disk->metadata.name_index;
+        dir->extents = &disk->index_extents;
+        dir->entries = &disk->metadata.num_files;
+        return 0;
+    }
+    if (read_inode(disk, number, &dir->inode) != 0 || !(dir->inode.file_type & TYPE_DIRECTORY)) {
+        return -1;
+    }
+    dir->inode_extents = load_extents(disk, &dir->inode);
+    if (!dir->inode_extents) {
+        return -1;
+    }
+    dir->table = &dir->inode;
+    dir->extents = &dir->inode_extents;
+    dir->entries = &dir->inode.first_block;
+    return 0;
+}
+
+void close_directory(Directory *dir) {
+    free(dir->inode_extents);
+}
+
+// Szuka nazwy w tablicy katalogu (adresowanie liniowe); zwraca numer i-węzła lub NO_INODE
+unsigned int directory_lookup(Disk *disk, const Directory *dir, const char *name, Inode *inode, unsigned int *slot) {
+    unsigned int hash = name_hash(name);
+    unsigned int mask = table_slots(disk, dir->table) - 1;
+    for (unsigned int current = hash & mask; ; current = (current + 1) & mask) {
+        IndexEntry entry;
+        read_table_entry(disk, dir->table, *dir->extents, current, &entry);
+        if (entry.value == 0) {
+            return NO_INODE;
+        }
+        // Nazwa jest porównywana tylko przy zgodnym skrócie
+        if (entry.hash == hash && read_inode(disk, entry.value, inode) == 0 && strcmp(inode->file_name, name) == 0) {
+            if (slot) {
+                *slot = current;
+            }
+            return entry.value;
+        }
+    }
+}
+
+// grow_table buduje i-węzeł tablicy od nowa, więc katalog odzyskuje nazwę, typ i liczbę wpisów
+int directory_insert(Disk *disk, Directory *dir, const char *name, unsigned int number) {
+    Inode saved = *dir->table;
+    if (table_insert(disk, dir->table, dir->extents, *dir->entries, name_hash(name), number) != 0) {
+        return -1;
+    }
+    (*dir->entries)++;
+    if (dir->number != ROOT_DIRECTORY) {
+        memcpy(dir->inode.file_name, saved.file_name, MAX_FILENAME_LEN);
+        dir->inode.file_type = saved.file_type;
+        dir->inode.first_block = saved.first_block + 1;
+        write_inode(disk, dir->number, &dir->inode);
+    }
+    return 0;
+}
+
+// Szuka nazwy w katalogu parent; w dawnym formacie przegląda cały katalog i-węzłów
+unsigned int find_entry(Disk *disk, unsigned int parent, const char *name, Inode *inode) {
+    if (is_legacy_image(&disk->metadata)) {
+        for (unsigned int i = 0; i < MAX_FILES; i++) {
+            if (disk->legacy_catalog[i].file_name[0] != '\0' && strcmp(disk->legacy_catalog[i].file_name, name) == 0) {
+                *inode = disk->legacy_catalog[i];
+                return i;
+            }
+        }
+        return NO_INODE;
+    }
+    Directory dir;
+    if (open_directory(disk, parent, &dir) != 0) {
+        return NO_INODE;
+    }
+    unsigned int number = directory_lookup(disk, &dir, name, inode, NULL);
+    close_directory(&dir);
+    return number;
+}
+
+// Dopisuje nazwę do katalogu parent; katalog jest otwierany na nowo, bo od wyszukania
+// mogła urosnąć jego tablica albo katalog i-węzłów
+int link_entry(Disk *disk, unsigned int parent, const char *name, unsigned int number) {
+    Directory dir;
+    if (open_directory(disk, parent, &dir) != 0) {
+        return -1;
+    }
+    int result = directory_insert(disk, &dir, name, number);
+    close_directory(&dir);
+    return result;
+}
+
+// Nowy katalog dostaje jeden blok tablicy
+unsigned int create_directory(Disk *disk, unsigned int parent, const char *name) {
+    unsigned int slots = 1;
+    while (slots * 2 <= disk->index_entries_per_block) {
+        slots *= 2;
+    }
+    Inode inode = {0};
+    unsigned int num_extents;
+    Extent *extents = allocate_extents(disk, 1, &num_extents);
+    unsigned char *table = calloc(1, disk->block_size);
+    if (!extents || !table || store_extents(disk, &inode, extents, num_extents) != 0 ||
+        file_data_io(disk, extents, num_extents, table, disk->block_size, true) != 0) {
+        if (extents) {
+            release_extent(disk, &extents[0]);
+        }
+        free(extents);
+        free(table);
+        return NO_INODE;
+    }
+    free(table);
+    disk->dirty = true;
+
+    unsigned int number = allocate_inode(disk);
+    if (number == NO_INODE || link_entry(disk, parent, name, number) != 0) {
+        if (number != NO_INODE) {
+            release_inode(disk, number);
+        }
+        release_extent(disk, &extents[0]);
+        free(extents);
+        return NO_INODE;
+    }
+    free(extents);
+
+    strcpy(inode.file_name, name);
+    set_inode_size(&disk->metadata, &inode, slots * sizeof(IndexEntry));
+    inode.file_type = TYPE_DIRECTORY | (name[0] == '.' ? TYPE_HIDDEN : 0);
+    inode.first_block = 0;
+    write_inode(disk, number, &inode);
+    return number;
+}
+
+unsigned int path_cache_slot(unsigned int parent, const char *name) {
+    return (name_hash(name) ^ parent * 2654435761u) & (PATH_CACHE_SIZE - 1);
+}
+
+// Zwraca katalog name w katalogu parent, tworząc go przy create; NO_INODE, gdy go nie ma
+// albo nazwa należy do pliku. Znalezione katalogi trafiają do pamięci ścieżek.
+unsigned int enter_directory(Disk *disk, unsigned int parent, const char *name, bool create) {
+    PathCacheEntry *cached = disk->path_cache ? &disk->path_cache[path_cache_slot(parent, name)] : NULL;
+    if (cached && cached->number != 0 && cached->parent == parent && strcmp(cached->name, name) == 0) {
+        return cached->number;
+    }
+    Inode inode;
+    unsigned int number = find_entry(disk, parent, name, &inode);
+    if (number == NO_INODE && create) {
+        number = create_directory(disk, parent, name);
+    } else if (number != NO_INODE && !(inode.file_type & TYPE_DIRECTORY)) {
+        number = NO_INODE;
+    }
+    if (cached && number != NO_INODE) {
+        cached->parent = parent;
+        cached->number = number;
+        strcpy(cached->name, name);
+    }
+    return number;
+}
+
+// Sprawdza, czy żaden człon ścieżki nie jest za długi ani nie jest "." lub ".."
+bool valid_components(const char *path) {
+    for (path += strspn(path, "/"); *path != '\0'; path += strspn(path, "/")) {
+        size_t length = strcspn(path, "/");
+        if (length >= MAX_FILENAME_LEN || strncmp(path, ".", length) == 0 || strncmp(path, "..", length) == 0) {
+            return false;
+        }
+        path += length;
+    }
+    return true;
+}
+
+// Kopiuje ostatni człon ścieżki do leaf i zwraca katalog, który go zawiera; przy create
+// brakujące katalogi są tworzone. Powtórzone ukośniki są pomijane, pusty leaf oznacza
+// katalog główny. Bez katalogów cała ścieżka jest nazwą. Zwraca NO_INODE, gdy człon jest
+// za długi, jest "." lub "..", albo nie jest katalogiem; wszystkie człony są sprawdzane,
+// zanim powstanie jakikolwiek katalog.
+unsigned int find_parent(Disk *disk, const char *path, char *leaf, bool create) {
+    leaf[0] = '\0';
+    if (!has_directories(&disk->metadata)) {
+        size_t length = strlen(path);
+        if (length >= MAX_FILENAME_LEN) {
+            return NO_INODE;
+        }
+        memcpy(leaf, path, length + 1);
+        return ROOT_DIRECTORY;
+    }
+    if (!valid_components(path)) {
+        return NO_INODE;
+    }
+
+    unsigned int parent = ROOT_DIRECTORY;
+    for (;;) {
+        path += strspn(path, "/");
+        size_t length = strcspn(path, "/");
+        if (length == 0) {
+            return parent;
+        }
+        // Poprzedni człon okazał się katalogiem pośrednim
+        if (leaf[0] != '\0') {
+            parent = enter_directory(disk, parent, leaf, create);
+            if (parent == NO_INODE) {
+                return NO_INODE;
+            }
+        }
+        memcpy(leaf, path, length);
+        leaf[length] = '\0';
+        path += length;
+    }
+}
+
+// Szuka pliku po ścieżce; zwraca numer i-węzła lub NO_INODE
+unsigned int find_file(Disk *disk, const char *path, Inode *inode) {
+    char leaf[MAX_FILENAME_LEN];
+    unsigned int parent = find_parent(disk, path, leaf, false);
+    if (parent == NO_INODE || leaf[0] == '\0') {
+        return NO_INODE;
+    }
+    return find_entry(disk, parent, leaf, inode);
+}
+
+// Wczytuje metadane; obraz w dawnym formacie jest sprowadzany do bieżącej struktury
+int read_metadata(Disk *disk, DiskMetadata *metadata) {
+    memset(metadata, 0, sizeof(DiskMetadata));
+    if (disk_read(disk, 0, metadata, sizeof(DiskMetadata)) != 0) {
+        fprintf(stderr, "Nie udało się wczytać metadanych dysku.\n");
+        return -1;
+    }
+
+    if (metadata->magic == FS_MAGIC) {
+        if (metadata->version < FS_OLDEST_VERSION || metadata->version > FS_VERSION) {
+            fprintf(stderr, "Nieobsługiwana wersja formatu dysku %u.\n", metadata->version);
+            return -1;
+        }
+        // Wczytane bajty za metadanymi starszej wersji należą już do bitmapy
+        memset((unsigned char *)metadata + metadata_size(metadata), 0, sizeof(DiskMetadata) - metadata_size(metadata));
+    } else {
+        LegacyDiskMetadata legacy;
+        if (disk_read(disk, 0, &legacy, sizeof(LegacyDiskMetadata)) != 0) {
+            fprintf(stderr, "Nie udało się wczytać metadanych dysku.\n");
+            return -1;
+        }
+        memset(metadata, 0, sizeof(DiskMetadata));
+        metadata->disk_size = legacy.disk_size;
+        metadata->block_size = legacy.block_size;
+        metadata->num_blocks = legacy.num_blocks;
+        metadata->first_data_block = legacy.first_data_block;
+        metadata->num_files = legacy.num_files;
+        metadata->num_inodes = MAX_FILES;
+        metadata->free_inode = NO_INODE;
+    }
+
+    if (!valid_block_size(metadata->block_size)) {
+        fprintf(stderr, "Nieobsługiwany rozmiar bloku %u.\n", metadata->block_size);
+        return -1;
+    }
+    return 0;
+}
+
+// Dawne i-węzły nie mają ekstentów, tylko pierwszy blok łańcucha
+int load_legacy_catalog(Disk *disk) {
+    disk->legacy_catalog = calloc(MAX_FILES, sizeof(Inode));
+    if (!disk->legacy_catalog) {
+        return -1;
+    }
+
+    bool inode_bitmap[MAX_FILES];
+    unsigned long offset = sizeof(LegacyDiskMetadata) + disk->metadata.num_blocks * sizeof(bool);
+    if (disk_read(disk, offset, inode_bitmap, MAX_FILES * sizeof(bool)) != 0) {
+        return -1;
+    }
+    offset += MAX_FILES * sizeof(bool);
+    for (unsigned int i = 0; i < MAX_FILES; i++, offset += sizeof(LegacyInode)) {
+        LegacyInode legacy;
+        if (disk_read(disk, offset, &legacy, sizeof(LegacyInode)) != 0) {
+            return -1;
+        }
+        if (!inode_bitmap[i]) {
+            continue;
+        }
+        memcpy(disk->legacy_catalog[i].file_name, legacy.file_name, MAX_FILENAME_LEN);
+        disk->legacy_catalog[i].file_size = legacy.file_size;
+        disk->legacy_catalog[i].first_block = legacy.first_block;
+        disk->legacy_catalog[i].file_type = legacy.file_type;
+        disk->legacy_catalog[i].extent_block = NO_BLOCK;
+    }
+    return 0;
+}
+
+// Dobiera liczbę stron tak, aby jedno zatwierdzenie zawsze mieściło się w dzienniku
+int alloc_journal_pages(Disk *disk) {
+    unsigned int capacity = disk->metadata.journal_blocks;
+    while (capacity > 0 && journal_descriptor_blocks(disk, capacity) + capacity > disk->metadata.journal_blocks) {
+        capacity--;
+    }
+    unsigned int slots = 1;
+    while (slots < capacity * 2) {
+        slots *= 2;
+    }
+    disk->pages = malloc(capacity * sizeof(JournalPage));
+    disk->page_data = malloc(blocks_to_bytes(disk, capacity));
+    disk->page_slots = calloc(slots, sizeof(unsigned int));
+    if (capacity == 0 || !disk->pages || !disk->page_data || !disk->page_slots) {
+        return -1;
+    }
+    for (unsigned int i = 0; i < capacity; i++) {
+        disk->pages[i].data = disk->page_data + blocks_to_bytes(disk, i);
+    }
+    disk->slot_mask = slots - 1;
+    disk->page_capacity = capacity;
+    return 0;
+}
+
+// Odtwarza ostatnią transakcję z dziennika, jeśli została w całości zatwierdzona;
+// przerwany zapis nie zgadza się z sumą kontrolną i jest pomijany. Przy otwarciu
+// tylko do odczytu odtworzone jednostki zostają w pamięci jako strony.
+int journal_recover(Disk *disk) {
+    disk_offset journal = data_block_offset(&disk->metadata, disk->metadata.journal_start);
+    JournalHeader header;
+    if (image_read(disk, journal, &header, sizeof(JournalHeader)) != 0) {
+        return -1;
+    }
+    if (header.magic != JOURNAL_MAGIC || header.num_pages == 0 || header.num_pages > disk->page_capacity) {
+        return 0;
+    }
+    disk->journal_sequence = header.sequence + 1;
+
+    unsigned int blocks = journal_descriptor_blocks(disk, header.num_pages);
+    unsigned char *descriptor = malloc(blocks_to_bytes(disk, blocks));
+    if (!descriptor || image_read(disk, journal, descriptor, blocks_to_bytes(disk, blocks)) != 0) {
+        free(descriptor);
+        return -1;
+    }
+    unsigned int *units = (unsigned int *)(descriptor + sizeof(JournalHeader));
+    unsigned int i;
+    for (i = 0; i < header.num_pages; i++) {
+        JournalPage *page = add_page(disk, units[i]);
+        if (image_read(disk, journal + blocks_to_bytes(disk, blocks + i), page->data, disk->block_size) != 0) {
+            break;
+        }
+    }
+    ((JournalHeader *)descriptor)->checksum = 0;
+    if (i < header.num_pages ||
+        journal_checksum(descriptor, blocks_to_bytes(disk, blocks), disk->pages, disk->num_pages, disk->block_size) != header.checksum) {
+        disk->num_pages = 0;
+        memset(disk->page_slots, 0, (disk->slot_mask + 1) * sizeof(unsigned int));
+        free(descriptor);
+        return 0;
+    }
+    free(descriptor);
+
+    if (disk->writable) {
+        for (i = 0; i < disk->num_pages; i++) {
+            image_write(disk, unit_offset(disk, disk->pages[i].unit), disk->pages[i].data,
+                        unit_length(disk, disk->pages[i].unit));
+        }
+        disk->num_pages = 0;
+        memset(disk->page_slots, 0, (disk->slot_mask + 1) * sizeof(unsigned int));
+        disk->journal_dirty = true;
+        journal_clear(disk);
+    }
+    return 0;
+}
+
+void free_disk(Disk *disk) {
+    free(disk->block_bitmap);
+    free(disk->bitmap_dirty);
+    free(disk->space.nodes);
+    unmap_disk(disk);
+    fclose(disk->file);
+    free(disk->catalog_extents);
+    free(disk->index_extents);
+    free(disk->block_index_extents);
+    free(disk->ref_extents);
+    free(disk->legacy_catalog);
+    free(disk->pages);
+    free(disk->page_data);
+    free(disk->page_slots);
+    free(disk->deferred);
+    free(disk->path_cache);
+}
+
+// Otwiera dysk i wczytuje metadane oraz położenie katalogu i indeksu nazw.
+// Obraz jest mapowany do pamięci, a gdy się to nie uda, dostęp odbywa się przez stdio.
+// Metadane są czytane ponownie po odtworzeniu dziennika, które mogło je zmienić.
+int open_disk(const char *filename, const char *mode, Disk *disk) {
+    memset(disk, 0, sizeof(Disk));
+    disk->file = fopen(filename, mode);
+    if (!disk->file) {
+        perror("Nie udało się otworzyć pliku dysku");
+        return -1;
+    }
+    disk->writable = strchr(mode, '+') != NULL;
+    map_disk(disk);
+
+    if (read_metadata(disk, &disk->metadata) == 0) {
+        set_block_geometry(disk);
+        if (is_legacy_image(&disk->metadata)) {
+            disk->block_bitmap = read_block_bitmap(disk);
+            if (disk->block_bitmap && load_legacy_catalog(disk) == 0) {
+                return 0;
+            }
+        } else if (alloc_journal_pages(disk) == 0 && journal_recover(disk) == 0 &&
+                   read_metadata(disk, &disk->metadata) == 0) {
+            disk->block_bitmap = read_block_bitmap(disk);
+            disk->bitmap_dirty = calloc(bitmap_chunks(&disk->metadata), sizeof(bool));
+            if (disk->block_bitmap) {
+                build_space_index(disk);
+            }
+            disk->catalog_extents = load_extents(disk, &disk->metadata.catalog);
+            disk->index_extents = load_extents(disk, &disk->metadata.name_index);
+            if (dedup_enabled(disk)) {
+                disk->block_index_extents = load_extents(disk, &disk->metadata.block_index);
+                disk->ref_extents = load_extents(disk, &disk->metadata.block_refs);
+            }
+            if (checksums_enabled(disk)) {
+                crc32c_init();
+            }
+            if (has_directories(&disk->metadata)) {
+                disk->path_cache = calloc(PATH_CACHE_SIZE, sizeof(PathCacheEntry));
+            }
+            if (disk->catalog_extents && disk->index_extents && disk->block_bitmap && disk->bitmap_dirty &&
+                (!dedup_enabled(disk) || (disk->block_index_extents && disk->ref_extents))) {
+                return 0;
+            }
+        }
+        fprintf(stderr, "Nie udało się wczytać katalogu plików.\n");
+    }
+
+    free_disk(disk);
+    return -1;
+}
+
+// Kończy bieżącą transakcję: wszystko, co zmieniono od ostatniej synchronizacji, jest zatwierdzane naraz
+void sync_disk(Disk *disk) {
+    if (!disk->dirty) {
+        return;
+    }
+    int previous = enter_phase(PHASE_FLUSH);
+    apply_deferred_frees(disk);
+    write_block_bitmap(disk);
+    disk_write(disk, 0, &disk->metadata, metadata_size(&disk->metadata));
+    journal_commit(disk);
+    disk->dirty = false;
+    enter_phase(previous);
+}
+
+void close_disk(Disk *disk) {
+    sync_disk(disk);
+    int previous = enter_phase(PHASE_FLUSH);
+    journal_clear(disk);
+    free_disk(disk);
+    enter_phase(previous);
+}
+
+// Nadaje plikowi dysku docelowy rozmiar; obszaru danych nie trzeba zerować,
+// bo każdy zapisywany blok jest dopełniany zerami
+int reserve_disk_space(FILE *disk, disk_offset disk_size_bytes, disk_offset first_data_block, int create_mode) {
+    fflush(disk);
+    if (create_mode == CREATE_PREALLOCATE) {
+#ifdef HAVE_POSIX_FALLOCATE
+        return posix_fallocate(fileno(disk), 0, (off_t)disk_size_bytes) == 0 ? 0 : -1;
+#else
+        fprintf(stderr, "Prealokacja nie jest obsługiwana, obszar danych zostanie wypełniony zerami.\n");
+        create_mode = CREATE_ZERO;
+#endif
+    }
+    if (create_mode == CREATE_SPARSE) {
+        return ftruncate(fileno(disk), (off_t)disk_size_bytes);
+    }
+
+    // Wypełnienie pozostałego miejsca (obszar danych) zerami
+    unsigned char *zero_buffer = calloc(1, IO_BUFFER_SIZE);
+    if (!zero_buffer) {
+        return -1;
+    }
+    if (fseeko(disk, (off_t)first_data_block, SEEK_SET) != 0) {
+        free(zero_buffer);
+        return -1;
+    }
+    disk_offset remaining = disk_size_bytes - first_data_block;
+    while (remaining > 0) {
+        unsigned long chunk = remaining < IO_BUFFER_SIZE ? remaining : IO_BUFFER_SIZE;
+        if (fwrite(zero_buffer, 1, chunk, disk) != chunk) {
+            free(zero_buffer);
+            return -1;
+        }
+        remaining -= chunk;
+    }
+    free(zero_buffer);
+    return 0;
+}
+
+void initialize_disk(const char *filename, unsigned int disk_size_mb, int create_mode, unsigned int block_size, bool dedup) {
+    if (!valid_block_size(block_size)) {
+        fprintf(stderr, "Nieobsługiwany rozmiar bloku %u (wielokrotność %d, najwyżej %d).\n", block_size, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *disk = fopen(filename, "wb");
+    if (!disk) {
+        perror("Nie udało się utworzyć pliku dysku");
+        exit(EXIT_FAILURE);
+    }
+
+    // Rozmiar liczony w 64 bitach; liczba bloków musi się zmieścić w 32-bitowych numerach
+    disk_offset disk_size_bytes = (disk_offset)disk_size_mb * 1024 * 1024;
+    disk_offset num_blocks = count_blocks(disk_size_bytes, block_size);
+    if (num_blocks > MAX_BLOCKS || disk_size_bytes / 1024 / 1024 != disk_size_mb) {
+        fprintf(stderr, "Dysk o rozmiarze %u MB wymaga więcej niż %u bloków po %u B; wybierz większe bloki.\n",
+                disk_size_mb, MAX_BLOCKS, block_size);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long block_bitmap_size_bytes = BITMAP_BYTES(num_blocks);
+    disk_offset first_data_block = sizeof(DiskMetadata) + block_bitmap_size_bytes;
+
+    // Dziennik zajmuje 1/16 bloków, w granicach JOURNAL_MIN_BLOCKS..JOURNAL_MAX_BLOCKS
+    unsigned int journal_blocks = num_blocks / 16;
+    if (journal_blocks < JOURNAL_MIN_BLOCKS) {
+        journal_blocks = JOURNAL_MIN_BLOCKS;
+    } else if (journal_blocks > JOURNAL_MAX_BLOCKS) {
+        journal_blocks = JOURNAL_MAX_BLOCKS;
+    }
+    // Dysk z deduplikacją ma za dziennikiem jeszcze indeks bloków (jeden blok) i tablicę odwołań
+    unsigned int reserved_blocks = CATALOG_INITIAL_BLOCKS + 1 + journal_blocks;
+    unsigned int ref_blocks = 0;
+    if (dedup) {
+        ref_blocks = (unsigned int)((num_blocks * sizeof(BlockRef) + block_size - 1) / block_size);
+        reserved_blocks += 1 + ref_blocks;
+    }
+    // Ostatnie zarezerwowane bloki zajmuje tablica sum kontrolnych, po 4 bajty na blok
+    unsigned int sum_blocks = (unsigned int)((num_blocks * sizeof(unsigned int) + block_size - 1) / block_size);
+    reserved_blocks += sum_blocks;
+    if (num_blocks < reserved_blocks) {
+        fprintf(stderr, "Dysk o rozmiarze %u MB jest za mały.\n", disk_size_mb);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // Indeks nazw jest tablicą mieszającą o liczbie pozycji będącej potęgą dwójki
+    unsigned int index_slots = 1;
+    while (index_slots * 2 <= block_size / sizeof(IndexEntry)) {
+        index_slots *= 2;
+    }
+
+    // Inicjalizacja metadanych; katalog i-węzłów, indeks nazw i dziennik zajmują pierwsze bloki danych
+    DiskMetadata metadata = {
+        .disk_size = disk_size_mb,
+        .block_size = block_size,
+        .version = FS_VERSION,
+        .num_blocks = num_blocks,
+        .free_blocks = num_blocks - reserved_blocks,
+        .first_data_block = first_data_block,
+        .num_files = 0,
+        .magic = FS_MAGIC,
+        .num_inodes = 1,             // I-węzeł 0 jest zarezerwowany
+        .free_inode = NO_INODE,
+        .catalog = {
+            .file_size = CATALOG_INITIAL_BLOCKS * block_size,
+            .first_block = 0,
+            .num_extents = 1,
+            .extent_block = NO_BLOCK,
+            .extents = {{0, CATALOG_INITIAL_BLOCKS}},
+        },
+        .name_index = {
+            .file_size = index_slots * sizeof(IndexEntry),
+            .first_block = CATALOG_INITIAL_BLOCKS,
+            .num_extents = 1,
+            .extent_block = NO_BLOCK,
+            .extents = {{CATALOG_INITIAL_BLOCKS, 1}},
+        },
+        .journal_start = CATALOG_INITIAL_BLOCKS + 1,
+        .journal_blocks = journal_blocks,
+    };
+
+    // Indeks bloków i tablica odwołań są na początku wyzerowane, czyli puste, jak reszta zarezerwowanego miejsca
+    if (dedup) {
+        unsigned int index_block = CATALOG_INITIAL_BLOCKS + 1 + journal_blocks;
+        metadata.block_index = metadata.name_index;
+        metadata.block_index.first_block = index_block;
+        metadata.block_index.extents[0].start = index_block;
+        metadata.block_refs = (Inode){
+            .first_block = index_block + 1,
+            .num_extents = 1,
+            .extent_block = NO_BLOCK,
+            .extents = {{index_block + 1, ref_blocks}},
+        };
+        set_inode_size(&metadata, &metadata.block_refs, num_blocks * sizeof(BlockRef));
+    }
+    metadata.block_sums = (Inode){
+        .first_block = reserved_blocks - sum_blocks,
+        .num_extents = 1,
+        .extent_block = NO_BLOCK,
+        .extents = {{reserved_blocks - sum_blocks, sum_blocks}},
+    };
+    set_inode_size(&metadata, &metadata.block_sums, num_blocks * sizeof(unsigned int));
+
+    // Alokowanie pamięci dla bitmapy i pustego katalogu
+    bitmap_word *block_bitmap = alloc_bitmap(num_blocks);
+    unsigned char *zero_blocks = calloc(CATALOG_INITIAL_BLOCKS + 2, block_size);
+
+    if (!block_bitmap || !zero_blocks) {
+        perror("Nie udało się zaalokować pamięci");
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+    bitmap_fill(block_bitmap, 0, reserved_blocks, true);
+
+    // Zapis metadanych i bitmapy do pliku
+    fwrite(&metadata, sizeof(DiskMetadata), 1, disk);
+    fwrite(block_bitmap, 1, block_bitmap_size_bytes, disk);
+
+    // Nadanie plikowi docelowego rozmiaru zgodnie z trybem tworzenia
+    if (reserve_disk_space(disk, disk_size_bytes, first_data_block, create_mode) != 0) {
+        perror("Nie udało się zarezerwować miejsca na dysku");
+        free(block_bitmap);
+        free(zero_blocks);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    // Wyzerowanie bloków katalogu, indeksu nazw i nagłówka dziennika
+    fseeko(disk, (off_t)first_data_block, SEEK_SET);
+    fwrite(zero_blocks, block_size, CATALOG_INITIAL_BLOCKS + 2, disk);
+
+    printf("Dysk został pomyślnie zainicjalizowany.\n");
+    printf("Metadane: rozmiar dysku = %u MB, rozmiar bloku = %u B, liczba bloków = %llu\n", disk_size_mb, block_size, num_blocks);
+    printf("Pierwszy blok danych zaczyna się na offset = %llu bajtów\n", first_data_block);
+    if (dedup) {
+        printf("Deduplikacja bloków włączona (tablica odwołań: %u bloków).\n", ref_blocks);
+    }
+
+    // Sprzątanie
+    free(block_bitmap);
+    free(zero_blocks);
+    fclose(disk);
+}
+
+
+// Mały plik jest czytany wprost do i-węzła i nie zajmuje bloków danych
+Extent *import_inline(FILE *source, Inode *inode, disk_offset file_size) {
+    if (fread(inode->extents, 1, file_size, source) != file_size) {
+        fprintf(stderr, "Nie udało się odczytać pliku źródłowego.\n");
+        return NULL;
+    }
+    return malloc(sizeof(Extent));
+}
+
+// Przenosi mały plik wczytany strumieniowo z jego bloku do i-węzła; przy błędzie odczytu zostaje w bloku
+int move_inline(Disk *disk, Inode *inode, Extent *extents, unsigned int *num_extents, disk_offset file_size) {
+    if (disk_read(disk, data_block_offset(&disk->metadata, extents[0].start), inode->extents, file_size) != 0) {
+        return -1;
+    }
+    release_data(disk, extents, *num_extents);
+    *num_extents = 0;
+    return 0;
+}
+
+// Przydziela cały plik naraz, gdy jego rozmiar jest znany z góry
+Extent *import_sized(Disk *disk, FILE *source, disk_offset file_size, unsigned char *buffer, unsigned int *num_extents) {
+    if (file_size > max_file_size(&disk->metadata) || file_size > blocks_to_bytes(disk, disk->metadata.num_blocks)) {
+        fprintf(stderr, "Brak miejsca na dysku na ten plik.\n");
+        return NULL;
+    }
+    // Bloki zwolnione w bieżącej transakcji są dostępne dopiero po jej zatwierdzeniu
+    unsigned int blocks_needed = blocks_for_bytes(disk, file_size);
+    if (blocks_needed > disk->metadata.free_blocks && disk->num_deferred > 0) {
+        sync_disk(disk);
+    }
+    Extent *extents = allocate_extents(disk, blocks_needed, num_extents);
+    if (!extents) {
+        fprintf(stderr, "Brak miejsca na dysku na ten plik.\n");
+        return NULL;
+    }
+    // Zapis danych pliku ekstent po ekstencie, dużymi porcjami
+    for (unsigned int i = 0; i < *num_extents; i++) {
+        if (write_extent_from_file(disk, &extents[i], source, file_size, buffer) != 0) {
+            release_data(disk, extents, *num_extents);
+            free(extents);
+            return NULL;
+        }
+        disk_offset extent_bytes = blocks_to_bytes(disk, extents[i].length);
+        file_size -= file_size < extent_bytes ? file_size : extent_bytes;
+    }
+    return extents;
+}
+
+// Dokłada bloki do rosnącego pliku: ostatni ekstent jest wydłużany w miejscu, dopóki
+// bloki za nim są wolne, a reszta trafia do nowo przydzielonych ciągów. Gdy brakuje
+// miejsca, zatwierdzenie udostępnia bloki zwolnione w bieżącej transakcji; awaria przed
+// końcem importu może wtedy najwyżej zgubić zajęte dotąd bloki.
+int append_blocks(Disk *disk, Extent **extents, unsigned int *num_extents, unsigned int *capacity, unsigned int blocks) {
+    if (*num_extents > 0) {
+        int previous = enter_phase(PHASE_ALLOC);
+        Extent *last = &(*extents)[*num_extents - 1];
+        unsigned int end = last->start + last->length;
+        unsigned int length = bitmap_find(disk->block_bitmap, disk->metadata.num_blocks, end, true) - end;
+        if (length > blocks) {
+            length = blocks;
+        }
+        mark_blocks(disk, end, length, true);
+        last->length += length;
+        blocks -= length;
+        enter_phase(previous);
+    }
+    if (blocks == 0) {
+        return 0;
+    }
+
+    unsigned int num_added;
+    Extent *added = allocate_extents(disk, blocks, &num_added);
+    if (!added && disk->num_deferred > 0) {
+        sync_disk(disk);
+        added = allocate_extents(disk, blocks, &num_added);
+    }
+    if (!added) {
+        return -1;
+    }
+    if (*num_extents + num_added > *capacity) {
+        unsigned int capacity_needed = *capacity * 2 + num_added + MAX_EXTENTS;
+        Extent *grown = realloc(*extents, capacity_needed * sizeof(Extent));
+        if (!grown) {
+            for (unsigned int i = 0; i < num_added; i++) {
+                release_extent(disk, &added[i]);
+            }
+            free(added);
+            return -1;
+        }
+        *extents = grown;
+        *capacity = capacity_needed;
+    }
+    memcpy(*extents + *num_extents, added, num_added * sizeof(Extent));
+    *num_extents += num_added;
+    free(added);
+    return 0;
+}
+
+// Czyta albo zapisuje count bloków bufora, zaczynając od bloku logicznego first pliku
+int file_blocks_io(Disk *disk, const Extent *extents, unsigned int num_extents, unsigned int first, unsigned char *buffer, unsigned int count, bool write) {
+    for (unsigned int i = 0; i < num_extents && count > 0; i++) {
+        if (first >= extents[i].length) {
+            first -= extents[i].length;
+            continue;
+        }
+        unsigned int length = extents[i].length - first < count ? extents[i].length - first : count;
+        disk_offset offset = data_block_offset(&disk->metadata, extents[i].start + first);
+        if (write) {
+            if (disk_write_new(disk, offset, buffer, blocks_to_bytes(disk, length)) != 0) {
+                return -1;
+            }
+            record_sums(disk, extents[i].start + first, buffer, length);
+        } else if (disk_read(disk, offset, buffer, blocks_to_bytes(disk, length)) != 0 ||
+                   verify_sums(disk, extents[i].start + first, buffer, length) != 0) {
+            return -1;
+        }
+        buffer += blocks_to_bytes(disk, length);
+        count -= length;
+        first = 0;
+    }
+    return count == 0 ? 0 : -1;
+}
+
+unsigned int lz_read32(const unsigned char *data) {
+    unsigned int value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// Zapisuje długość literałów albo powtórzenia, która nie mieści się w czterech bitach tokenu
+unsigned char *lz_put_length(unsigned char *out, unsigned long length) {
+    for (; length >= 255; length -= 255) {
+        *out++ = 255;
+    }
+    *out++ = (unsigned char)length;
+    return out;
+}
+
+// Pakuje length bajtów z in do out (co najmniej LZ_BOUND(length) bajtów) i zwraca długość wyniku.
+// Format bloku LZ4: token z liczbą literałów i długością powtórzenia minus LZ_MIN_MATCH, literały,
+// 16-bitowe przesunięcie powtórzenia. Tablica pamięta ostatnią pozycję każdego skrótu 4 bajtów;
+// im dłużej nie ma powtórzeń, tym większe kroki robi wyszukiwanie
+unsigned long lz_compress(const unsigned char *in, unsigned long length, unsigned char *out) {
+    unsigned int table[1 << LZ_HASH_BITS];
+    unsigned char *start = out;
+    unsigned long pos = 0;
+    unsigned long anchor = 0;
+    unsigned long literals;
+
+    memset(table, 0, sizeof(table));
+    unsigned long limit = length > 12 ? length - 12 : 0;
+    while (pos < limit) {
+        unsigned int hash = (lz_read32(in + pos) * 2654435761U) >> (32 - LZ_HASH_BITS);
+        unsigned long ref = table[hash];
+        table[hash] = (unsigned int)pos;
+        if (ref >= pos || pos - ref > 65535 || lz_read32(in + ref) != lz_read32(in + pos)) {
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+
+        unsigned long match = LZ_MIN_MATCH;
+        while (pos + match < length - 5 && in[ref + match] == in[pos + match]) {
+            match++;
+        }
+        literals = pos - anchor;
+        unsigned char *token = out++;
+        *token = (unsigned char)((literals < 15 ? literals : 15) << 4);
+        if (literals >= 15) {
+            out = lz_put_length(out, literals - 15);
+        }
+        memcpy(out, in + anchor, literals);
+        out += literals;
+        *out++ = (unsigned char)((pos - ref) & 0xff);
+        *out++ = (unsigned char)((pos - ref) >> 8);
+        *token |= (unsigned char)(match - LZ_MIN_MATCH < 15 ? match - LZ_MIN_MATCH : 15);
+        if (match - LZ_MIN_MATCH >= 15) {
+            out = lz_put_length(out, match - LZ_MIN_MATCH - 15);
+        }
+        pos += match;
+        anchor = pos;
+    }
+
+    // Ostatnia sekwencja ma same literały
+    literals = length - anchor;
+    *out++ = (unsigned char)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) {
+        out = lz_put_length(out, literals - 15);
+    }
+    memcpy(out, in + anchor, literals);
+    return (unsigned long)(out - start) + literals;
+}
+
+// Rozpakowuje jedną ramkę do out; zwraca długość wyniku albo -1, gdy ramka jest uszkodzona
+long lz_decompress(const unsigned char *in, unsigned long length, unsigned char *out, unsigned long capacity) {
+    unsigned long pos = 0;
+    unsigned long done = 0;
+    unsigned char byte;
+
+    while (pos < length) {
+        unsigned char token = in[pos++];
+        unsigned long literals = token >> 4;
+        if (literals == 15) {
+            do {
+                if (pos >= length) {
+                    return -1;
+                }
+                byte = in[pos++];
+                literals += byte;
+            } while (byte == 255);
+        }
+        if (literals > length - pos || literals > capacity - done) {
+            return -1;
+        }
+        memcpy(out + done, in + pos, literals);
+        pos += literals;
+        done += literals;
+        if (pos == length) {
+            break;
+        }
+
+        if (length - pos < 2) {
+            return -1;
+        }
+        unsigned long offset = in[pos] | ((unsigned long)in[pos + 1] << 8);
+        pos += 2;
+        unsigned long match = token & 15;
+        if (match == 15) {
+            do {
+                if (pos >= length) {
+                    return -1;
+                }
+                byte = in[pos++];
+                match += byte;
+            } while (byte == 255);
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > done || match > capacity - done) {
+            return -1;
+        }
+        // Powtórzenie może zachodzić na kopiowane właśnie bajty
+        if (offset >= match) {
+            memcpy(out + done, out + done - offset, match);
+        } else {
+            for (unsigned long i = 0; i < match; i++) {
+                out[done + i] = out[done + i - offset];
+            }
+        }
+        done += match;
+    }
+    return (long)done;
+}
+
+// Wypełnia bufor jak fread; źródło z kompresją pakuje kolejną porcję, gdy poprzednia ramka się skończy
+size_t read_source(Source *source, unsigned char *buffer, size_t length) {
+    if (!source->raw) {
+        return fread(buffer, 1, length, source->file);
+    }
+
+    size_t filled = 0;
+    while (filled < length) {
+        if (source->packed_offset == source->packed_length) {
+            size_t raw = fread(source->raw, 1, LZ_CHUNK, source->file);
+            if (raw == 0) {
+                break;
+            }
+            source->raw_bytes += raw;
+            unsigned int header;
+            unsigned long packed = lz_compress(source->raw, raw, source->packed + sizeof(header));
+            if (packed < raw) {
+                header = (unsigned int)packed;
+            } else {
+                memcpy(source->packed + sizeof(header), source->raw, raw);
+                header = (unsigned int)raw | LZ_STORED;
+                packed = raw;
+            }
+            memcpy(source->packed, &header, sizeof(header));
+            source->packed_length = sizeof(header) + packed;
+            source->packed_offset = 0;
+        }
+        size_t piece = source->packed_length - source->packed_offset;
+        if (piece > length - filled) {
+            piece = length - filled;
+        }
+        memcpy(buffer + filled, source->packed + source->packed_offset, piece);
+        source->packed_offset += piece;
+        filled += piece;
+    }
+    return filled;
+}
+
+// Czyta źródło o nieznanej długości (potok, FIFO) porcjami po IO_BUFFER_SIZE bajtów
+// i przydziela bloki w miarę napływu danych
+Extent *import_stream(Disk *disk, Source *source, unsigned char *buffer, unsigned int *num_extents, disk_offset *file_size) {
+    Extent *extents = NULL;
+    unsigned int capacity = 0;
+    unsigned int written = 0;
+    size_t bytes_read;
+
+    *num_extents = 0;
+    *file_size = 0;
+    while ((bytes_read = read_source(source, buffer, buffer_size(disk, IO_BUFFER_SIZE))) > 0) {
+        unsigned int blocks = blocks_for_bytes(disk, bytes_read);
+        memset(buffer + bytes_read, 0, blocks_to_bytes(disk, blocks) - bytes_read);
+        if (*file_size + bytes_read > max_file_size(&disk->metadata) || append_blocks(disk, &extents, num_extents, &capacity, blocks) != 0 ||
+            file_blocks_io(disk, extents, *num_extents, written, buffer, blocks, true) != 0) {
+            fprintf(stderr, "Brak miejsca na dysku na ten plik.\n");
+            break;
+        }
+        written += blocks;
+        *file_size += bytes_read;
+    }
+
+    if (bytes_read > 0 || ferror(source->file)) {
+        if (bytes_read == 0) {
+            fprintf(stderr, "Nie udało się odczytać pliku źródłowego.\n");
+        }
+        for (unsigned int i = 0; i < *num_extents; i++) {
+            release_extent(disk, &extents[i]);
+        }
+        free(extents);
+        return NULL;
+    }
+    return extents ? extents : malloc(sizeof(Extent));
+}
+
+// Dopisuje jeden blok na koniec listy ekstentów pliku, wydłużając ostatni ekstent, gdy blok do niego przylega
+int add_file_block(Extent **extents, unsigned int *num_extents, unsigned int *capacity, unsigned int block) {
+    if (*num_extents > 0 && (*extents)[*num_extents - 1].start + (*extents)[*num_extents - 1].length == block) {
+        (*extents)[*num_extents - 1].length++;
+        return 0;
+    }
+    if (*num_extents == *capacity) {
+        Extent *grown = realloc(*extents, (*capacity * 2 + MAX_EXTENTS) * sizeof(Extent));
+        if (!grown) {
+            return -1;
+        }
+        *extents = grown;
+        *capacity = *capacity * 2 + MAX_EXTENTS;
+    }
+    (*extents)[*num_extents].start = block;
+    (*extents)[*num_extents].length = 1;
+    (*num_extents)++;
+    return 0;
+}
+
+// Import na dysk z deduplikacją: blok o zawartości już zapisanej na dysku dostaje kolejne odwołanie,
+// pozostałe trafiają do nowych bloków i do indeksu bloków
+Extent *import_shared(Disk *disk, Source *source, unsigned char *buffer, unsigned int *num_extents, disk_offset *file_size) {
+    Extent *extents = NULL;
+    unsigned int capacity = 0;
+    size_t bytes_read = 0;
+    bool failed = false;
+
+    *num_extents = 0;
+    *file_size = 0;
+    unsigned char *scratch = malloc(disk->block_size);
+    if (!scratch) {
+        fprintf(stderr, "Nie udało się zaalokować pamięci.\n");
+        return NULL;
+    }
+    while (!failed && (bytes_read = read_source(source, buffer, buffer_size(disk, IO_BUFFER_SIZE))) > 0) {
+        unsigned int blocks = blocks_for_bytes(disk, bytes_read);
+        memset(buffer + bytes_read, 0, blocks_to_bytes(disk, blocks) - bytes_read);
+        failed = *file_size + bytes_read > max_file_size(&disk->metadata);
+        for (unsigned int i = 0; i < blocks && !failed; i++) {
+            unsigned char *data = buffer + blocks_to_bytes(disk, i);
+            unsigned int hash = block_hash(disk, data);
+            unsigned int block = find_shared_block(disk, hash, data, scratch);
+            if (block != NO_BLOCK) {
+                failed = add_file_block(&extents, num_extents, &capacity, block) != 0;
+                if (!failed) {
+                    add_block_ref(disk, block);
+                }
+            } else if (append_blocks(disk, &extents, num_extents, &capacity, 1) != 0) {
+                failed = true;
+            } else {
+                Extent *last = &extents[*num_extents - 1];
+                block = last->start + last->length - 1;
+                failed = disk_write_new(disk, data_block_offset(&disk->metadata, block), data, disk->block_size) != 0 ||
+                         index_block(disk, block, hash) != 0;
+                record_sums(disk, block, data, 1);
+            }
+        }
+        *file_size += bytes_read;
+    }
+    free(scratch);
+
+    if (failed || ferror(source->file)) {
+        fprintf(stderr, failed ? "Brak miejsca na dysku na ten plik.\n" : "Nie udało się odczytać pliku źródłowego.\n");
+        release_shared(disk, extents, *num_extents);
+        free(extents);
+        return NULL;
+    }
+    return extents ? extents : malloc(sizeof(Extent));
+}
+
+// Kopiuje source_filename na dysk pod nazwą file_name. Źródła bez możliwości przewijania
+// (potoki, FIFO) są wczytywane strumieniowo, pozostałe pliki dostają od razu cały przydział.
+// Plik kompresowany zawsze idzie strumieniowo, bo rozmiar po kompresji jest znany dopiero na końcu
+int import_file_as(Disk *disk, const char *file_name, const char *source_filename, bool compress) {
+    if (is_legacy_image(&disk->metadata)) {
+        fprintf(stderr, "Dysk jest w dawnym formacie z łańcuchem bloków i można go tylko odczytywać.\n");
+        return -1;
+    }
+
+    // Nic nie powstaje na dysku, dopóki nazwa nie jest sprawdzona, a źródło otwarte;
+    // brakujące katalogi na ścieżce są tworzone dopiero po zapisaniu danych
+    char leaf[MAX_FILENAME_LEN];
+    unsigned int parent = find_parent(disk, file_name, leaf, false);
+    if (leaf[0] == '\0' || (has_directories(&disk->metadata) ?
+                            !valid_components(file_name) || file_name[strlen(file_name) - 1] == '/' :
+                            parent == NO_INODE)) {
+        fprintf(stderr, "Nieprawidłowa nazwa pliku '%s' (człony ścieżki mają najwyżej %d znaków, a pliki mogą leżeć tylko w katalogach).\n",
+                file_name, MAX_FILENAME_LEN - 1);
+        return -1;
+    }
+
+    // Nazwy plików w katalogu są unikalne
+    Inode inode;
+    if (parent != NO_INODE && find_entry(disk, parent, leaf, &inode) != NO_INODE) {
+        fprintf(stderr, "Plik '%s' już istnieje na dysku.\n", file_name);
+        return -1;
+    }
+
+    if (compress && disk->metadata.version < COMPRESS_VERSION) {
+        fprintf(stderr, "Dysk w wersji formatu %u nie obsługuje kompresji.\n", disk->metadata.version);
+        return -1;
+    }
+
+    FILE *file = fopen(source_filename, "rb");
+    if (!file) {
+        perror("Nie udało się otworzyć pliku źródłowego");
+        return -1;
+    }
+    // Katalog czy urządzenie dałyby przy sprawdzaniu rozmiaru przypadkową długość
+    struct stat info;
+    if (fstat(fileno(file), &info) == 0 && !S_ISREG(info.st_mode) && !S_ISFIFO(info.st_mode)) {
+        fprintf(stderr, "'%s' nie jest zwykłym plikiem.\n", source_filename);
+        fclose(file);
+        return -1;
+    }
+
+    Source source;
+    memset(&source, 0, sizeof(Source));
+    source.file = file;
+    unsigned char *buffer = malloc(buffer_size(disk, IO_BUFFER_SIZE));
+    if (compress) {
+        source.raw = malloc(LZ_CHUNK);
+        source.packed = malloc(sizeof(unsigned int) + LZ_BOUND(LZ_CHUNK));
+    }
+    if (!buffer || (compress && (!source.raw || !source.packed))) {
+        fprintf(stderr, "Nie udało się zaalokować pamięci.\n");
+        free(buffer);
+        free(source.raw);
+        free(source.packed);
+        fclose(file);
+        return -1;
+    }
+
+    // Przydział bloków w postaci ekstentów i zapis danych
+    disk->dirty = true;
+    unsigned int num_extents = 0;
+    disk_offset file_size;
+    off_t length;
+    Extent *extents;
+    memset(&inode, 0, sizeof(Inode));
+    int previous = enter_phase(PHASE_COPY);
+    if (fseeko(file, 0, SEEK_END) == 0 && (length = ftello(file)) >= 0) {
+        rewind(file);
+        file_size = length;
+        if (stores_inline(disk, file_size)) {
+            // Małe pliki trafiają do i-węzła bez kompresji
+            extents = import_inline(file, &inode, file_size);
+            compress = false;
+        } else if (dedup_enabled(disk)) {
+            extents = import_shared(disk, &source, buffer, &num_extents, &file_size);
+        } else if (compress) {
+            extents = import_stream(disk, &source, buffer, &num_extents, &file_size);
+        } else {
+            extents = import_sized(disk, file, file_size, buffer, &num_extents);
+        }
+    } else {
+        clearerr(file);
+        if (dedup_enabled(disk)) {
+            extents = import_shared(disk, &source, buffer, &num_extents, &file_size);
+        } else {
+            extents = import_stream(disk, &source, buffer, &num_extents, &file_size);
+        }
+        if (extents && !compress && stores_inline(disk, file_size)) {
+            move_inline(disk, &inode, extents, &num_extents, file_size);
+        }
+    }
+    enter_phase(previous);
+    free(buffer);
+    free(source.raw);
+    free(source.packed);
+    fclose(file);
+    // W i-węźle zapisywany jest rozmiar przed kompresją
+    if (compress) {
+        inode.compression = COMPRESS_LZ;
+        file_size = source.raw_bytes;
+    }
+
+    if (!extents || file_size > max_file_size(&disk->metadata) || store_extents(disk, &inode, extents, num_extents) != 0) {
+        // Wycofanie przydziału, bo bitmapa w pamięci trafi na dysk przy synchronizacji
+        if (extents) {
+            fprintf(stderr, "Brak miejsca na dysku na ten plik.\n");
+            release_data(disk, extents, num_extents);
+            release_extent_blocks(disk, &inode);
+        }
+        free(extents);
+        return -1;
+    }
+    free(extents);
+
+    if (parent == NO_INODE) {
+        parent = find_parent(disk, file_name, leaf, true);
+    }
+    if (parent == NO_INODE) {
+        fprintf(stderr, "Nie udało się utworzyć katalogów dla '%s' (pliki mogą leżeć tylko w katalogach).\n", file_name);
+        release_file_blocks(disk, &inode);
+        return -1;
+    }
+
+    // Przydział i-węzła (katalog rośnie, gdy wszystkie są zajęte), dodanie nazwy do indeksu i Inode do katalogu
+    unsigned int inode_number = allocate_inode(disk);
+    if (inode_number == NO_INODE || link_entry(disk, parent, leaf, inode_number) != 0) {
+        if (inode_number == NO_INODE) {
+            fprintf(stderr, "Brak wolnych i-odów.\n");
+        } else {
+            fprintf(stderr, "Brak miejsca na dysku na indeks nazw plików.\n");
+            release_inode(disk, inode_number);
+        }
+        release_file_blocks(disk, &inode);
+        return -1;
+    }
+
+    strcpy(inode.file_name, leaf);
+    set_inode_size(&disk->metadata, &inode, file_size);
+    inode.file_type = (leaf[0] == '.') ? TYPE_HIDDEN : 0;
+    write_inode(disk, inode_number, &inode);
+
+    printf("Plik '%s' został skopiowany na wirtualny dysk.\n", file_name);
+    return 0;
+}
+
+int import_file(Disk *disk, const char *source_filename, bool compress) {
+    return import_file_as(disk, source_filename, source_filename, compress);
+}
+
+// Dodaje wszystkie zwykłe pliki spod root/relative; dowiązania symboliczne są pomijane
+int collect_host_files(BulkImport *bulk, const char *root, const char *relative) {
+    char path[HOST_PATH_LEN];
+    char name[HOST_PATH_LEN];
+    snprintf(path, sizeof(path), relative[0] ? "%s/%s" : "%s", root, relative);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        return 1;
+    }
+
+    int failed = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        struct stat st;
+        if ((unsigned int)snprintf(name, sizeof(name), relative[0] ? "%s/%s" : "%s%s", relative, entry->d_name) >= sizeof(name) ||
+            (unsigned int)snprintf(path, sizeof(path), "%s/%s", root, name) >= sizeof(path) || lstat(path, &st) != 0) {
+            fprintf(stderr, "Pominięto '%s/%s'.\n", root, name);
+            failed++;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            failed += collect_host_files(bulk, root, name);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (!has_directories(&bulk->disk->metadata) && strlen(name) >= MAX_FILENAME_LEN) {
+            fprintf(stderr, "Nazwa pliku '%s' jest za długa (maksymalnie %d znaków).\n", name, MAX_FILENAME_LEN - 1);
+            failed++;
+            continue;
+        }
+
+        if (bulk->num_files == bulk->capacity) {
+            unsigned int capacity = bulk->capacity * 2 + 64;
+            BulkFile *grown = realloc(bulk->files, capacity * sizeof(BulkFile));
+            if (!grown) {
+                fprintf(stderr, "Nie udało się zaalokować pamięci.\n");
+                failed++;
+                break;
+            }
+            bulk->files = grown;
+            bulk->capacity = capacity;
+        }
+        BulkFile *file = &bulk->files[bulk->num_files++];
+        memset(file, 0, sizeof(BulkFile));
+        strcpy(file->path, path);
+        strcpy(file->name, name);
+        file->file_size = st.st_size;
+    }
+    closedir(dir);
+    return failed;
+}
+
+// Odcina dla jednego pliku kolejne bloki ze wspólnego przydziału
+unsigned int carve_extents(const Extent *pool, unsigned int *index, unsigned int *taken, unsigned int blocks, Extent *extents) {
+    unsigned int count = 0;
+    while (blocks > 0) {
+        unsigned int length = pool[*index].length - *taken;
+        if (length > blocks) {
+            length = blocks;
+        }
+        extents[count].start = pool[*index].start + *taken;
+        extents[count].length = length;
+        count++;
+        blocks -= length;
+        *taken += length;
+        if (*taken == pool[*index].length) {
+            (*index)++;
+            *taken = 0;
+        }
+    }
+    return count;
+}
+
+// Kopiuje plik gospodarza do jego bloków przez pread/pwrite, więc wątki nie dzielą pozycji w pliku.
+// Mały plik trafia do swojego i-węzła.
+int write_bulk_file(Disk *disk, BulkFile *file, unsigned char *buffer, Stats *stats) {
+    int source = open(file->path, O_RDONLY);
+    if (source < 0) {
+        perror(file->path);
+        return -1;
+    }
+    disk_offset position = 0;
+    unsigned long size = buffer_size(disk, IO_BUFFER_SIZE);
+    unsigned int done = 0;
+    int result = 0;
+    if (stores_inline(disk, file->file_size) &&
+        pread(source, file->inode.extents, file->file_size, 0) != (ssize_t)file->file_size) {
+        perror(file->path);
+        result = -1;
+    }
+    // Sumy kontrolne liczy wątek kopiujący; do tablicy sum wpisuje je potem wątek główny
+    if (checksums_enabled(disk) && file->num_extents > 0) {
+        file->sums = malloc(blocks_for_bytes(disk, file->file_size) * sizeof(unsigned int));
+        if (!file->sums) {
+            result = -1;
+        }
+    }
+    for (unsigned int i = 0; i < file->num_extents && result == 0; i++) {
+        disk_offset offset = data_block_offset(&disk->metadata, file->extents[i].start);
+        disk_offset length = blocks_to_bytes(disk, file->extents[i].length);
+        while (length > 0) {
+            unsigned long chunk = length < size ? length : size;
+            ssize_t bytes_read = pread(source, buffer, chunk, (off_t)position);
+            if (bytes_read < 0) {
+                perror(file->path);
+                result = -1;
+                break;
+            }
+            memset(buffer + bytes_read, 0, chunk - bytes_read);
+            count_io(stats, true, offset, chunk);
+            if (pwrite(fileno(disk->file), buffer, chunk, (off_t)offset) != (ssize_t)chunk) {
+                perror(file->path);
+                result = -1;
+                break;
+            }
+            for (unsigned int j = 0; file->sums && j < bytes_to_blocks(disk, chunk); j++) {
+                file->sums[done++] = block_sum(disk, buffer + blocks_to_bytes(disk, j));
+            }
+            position += chunk;
+            offset += chunk;
+            length -= chunk;
+        }
+    }
+    close(source);
+    return result;
+}
+
+void *bulk_worker(void *argument) {
+    BulkImport *bulk = argument;
+    unsigned char *buffer = malloc(IO_BUFFER_SIZE);
+    Stats stats;                     // Liczniki wątku, doliczane na końcu pod blokadą
+    memset(&stats, 0, sizeof(Stats));
+    for (;;) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&bulk->lock);
+#endif
+        unsigned int i = bulk->next++;
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&bulk->lock);
+#endif
+        if (i >= bulk->num_files) {
+            break;
+        }
+        if (bulk->files[i].status == 0) {
+            bulk->files[i].status = buffer ? write_bulk_file(bulk->disk, &bulk->files[i], buffer, &stats) : -1;
+        }
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&bulk->lock);
+#endif
+    merge_stats(&stats);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&bulk->lock);
+#endif
+    free(buffer);
+    return NULL;
+}
+
+// Uruchamia po jednym wątku na procesor; bez wątków całą pracę wykonuje wątek wywołujący
+void run_workers(void *(*worker)(void *), void *work) {
+#ifdef HAVE_PTHREAD
+    unsigned int count = BULK_MAX_THREADS;
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0 && cpus < BULK_MAX_THREADS) {
+        count = cpus;
+    }
+#endif
+    pthread_t threads[BULK_MAX_THREADS];
+    unsigned int started = 0;
+    while (started < count && pthread_create(&threads[started], NULL, worker, work) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        worker(work);
+    }
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+#else
+    worker(work);
+#endif
+}
+
+// Importuje wszystkie zwykłe pliki spod katalogu gospodarza pod ich ścieżkami względnymi.
+// Miejsce dla wszystkich plików jest przydzielane naraz, dane zapisują wątki wprost
+// do nowych bloków, a metadane są dodawane w jednym przebiegu i zatwierdzane razem
+// (w grupach, gdy nie mieszczą się naraz w dzienniku).
+int bulk_import(Disk *disk, const char *directory) {
+    if (is_legacy_image(&disk->metadata)) {
+        fprintf(stderr, "Dysk jest w dawnym formacie z łańcuchem bloków i można go tylko odczytywać.\n");
+        return -1;
+    }
+
+    BulkImport bulk;
+    memset(&bulk, 0, sizeof(BulkImport));
+    bulk.disk = disk;
+    int failed = collect_host_files(&bulk, directory, "");
+
+    // Deduplikacja wyszukuje bloki po kolei, więc taki dysk przyjmuje pliki jeden po drugim
+    if (dedup_enabled(disk)) {
+        unsigned int imported = 0;
+        for (unsigned int i = 0; i < bulk.num_files; i++) {
+            if (import_file_as(disk, bulk.files[i].name, bulk.files[i].path, false) == 0) {
+                imported++;
+            } else {
+                failed++;
+            }
+            if (disk->num_pages * 2 >= disk->page_capacity) {
+                sync_disk(disk);
+            }
+        }
+        sync_disk(disk);
+        free(bulk.files);
+        printf("Skopiowano na dysk wirtualny %u z %u plików z katalogu '%s'.\n", imported, bulk.num_files, directory);
+        return failed;
+    }
+
+    // Pliki, które już są na dysku, są pomijane; brakujące katalogi powstają dopiero po zapisaniu danych pliku
+    unsigned long total = 0;
+    for (unsigned int i = 0; i < bulk.num_files; i++) {
+        BulkFile *file = &bulk.files[i];
+        file->parent = find_parent(disk, file->name, file->leaf, false);
+        if (file->leaf[0] == '\0' || (has_directories(&disk->metadata) ? !valid_components(file->name) : file->parent == NO_INODE)) {
+            fprintf(stderr, "Nieprawidłowa nazwa pliku '%s' (człony ścieżki mają najwyżej %d znaków, a pliki mogą leżeć tylko w katalogach).\n",
+                    file->name, MAX_FILENAME_LEN - 1);
+            file->status = 1;
+            failed++;
+            continue;
+        }
+        Inode inode;
+        if (file->parent != NO_INODE && find_entry(disk, file->parent, file->leaf, &inode) != NO_INODE) {
+            fprintf(stderr, "Plik '%s' już istnieje na dysku.\n", file->name);
+            file->status = 1;
+            failed++;
+            continue;
+        }
+        if (file->file_size > max_file_size(&disk->metadata) || file->file_size > blocks_to_bytes(disk, disk->metadata.num_blocks)) {
+            fprintf(stderr, "Brak miejsca na dysku dla pliku '%s'.\n", file->name);
+            file->status = 1;
+            failed++;
+            continue;
+        }
+        if (!stores_inline(disk, file->file_size)) {
+            total += blocks_for_bytes(disk, file->file_size);
+        }
+    }
+
+    // Jeden przydział dla wszystkich plików, dzielony potem między pliki
+    disk->dirty = true;
+    if (total > disk->metadata.free_blocks && disk->num_deferred > 0) {
+        sync_disk(disk);
+    }
+    unsigned int num_pool = 0;
+    Extent *pool = NULL;
+    Extent *carved = NULL;
+    if (total <= disk->metadata.free_blocks) {
+        pool = allocate_extents(disk, total, &num_pool);
+    }
+    if (pool) {
+        carved = malloc((num_pool + bulk.num_files) * sizeof(Extent));
+        if (!carved) {
+            for (unsigned int i = 0; i < num_pool; i++) {
+                release_extent(disk, &pool[i]);
+            }
+            free(pool);
+            pool = NULL;
+        }
+    }
+
+    // Bez wspólnego przydziału pliki są umieszczane po kolei, dopóki starcza miejsca
+    unsigned int pool_index = 0, pool_taken = 0, carved_used = 0;
+    for (unsigned int i = 0; i < bulk.num_files; i++) {
+        BulkFile *file = &bulk.files[i];
+        if (file->status != 0) {
+            continue;
+        }
+        if (stores_inline(disk, file->file_size)) {
+            file->inode.first_block = NO_BLOCK;
+            file->inode.extent_block = NO_BLOCK;
+            continue;
+        }
+        unsigned int blocks = blocks_for_bytes(disk, file->file_size);
+        if (pool) {
+            file->extents = carved + carved_used;
+            file->num_extents = carve_extents(pool, &pool_index, &pool_taken, blocks, file->extents);
+            carved_used += file->num_extents;
+        } else {
+            file->extents = allocate_extents(disk, blocks, &file->num_extents);
+        }
+        if (!file->extents || store_extents(disk, &file->inode, file->extents, file->num_extents) != 0) {
+            fprintf(stderr, "Brak miejsca na dysku na plik '%s'.\n", file->name);
+            if (file->extents) {
+                for (unsigned int j = 0; j < file->num_extents; j++) {
+                    release_extent(disk, &file->extents[j]);
+                }
+                release_extent_blocks(disk, &file->inode);
+            }
+            file->status = 1;
+            failed++;
+        }
+    }
+    free(pool);
+
+    // Kopiowanie danych równolegle; bufor stdio nie może przesłaniać zapisów pwrite
+    fflush(disk->file);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&bulk.lock, NULL);
+#endif
+    int previous = enter_phase(PHASE_COPY);
+    run_workers(bulk_worker, &bulk);
+    enter_phase(previous);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&bulk.lock);
+#endif
+    fflush(disk->file);
+
+    unsigned int imported = 0;
+    for (unsigned int i = 0; i < bulk.num_files; i++) {
+        BulkFile *file = &bulk.files[i];
+        if (file->status == 1) {
+            continue;
+        }
+        if (file->status != 0) {
+            release_file_blocks(disk, &file->inode);
+            failed++;
+            continue;
+        }
+        if (file->parent == NO_INODE) {
+            file->parent = find_parent(disk, file->name, file->leaf, true);
+        }
+        if (file->parent == NO_INODE) {
+            fprintf(stderr, "Nie udało się utworzyć katalogów dla '%s' (pliki mogą leżeć tylko w katalogach).\n", file->name);
+            release_file_blocks(disk, &file->inode);
+            failed++;
+            continue;
+        }
+        unsigned int number = allocate_inode(disk);
+        if (number == NO_INODE || link_entry(disk, file->parent, file->leaf, number) != 0) {
+            fprintf(stderr, "Brak miejsca w katalogu na plik '%s'.\n", file->name);
+            if (number != NO_INODE) {
+                release_inode(disk, number);
+            }
+            release_file_blocks(disk, &file->inode);
+            failed++;
+            continue;
+        }
+        strcpy(file->inode.file_name, file->leaf);
+        set_inode_size(&disk->metadata, &file->inode, file->file_size);
+        file->inode.file_type = (file->leaf[0] == '.') ? TYPE_HIDDEN : 0;
+        write_inode(disk, number, &file->inode);
+        unsigned int logical = 0;
+        for (unsigned int j = 0; file->sums && j < file->num_extents; j++) {
+            write_sums(disk, file->extents[j].start, file->sums + logical, file->extents[j].length);
+            logical += file->extents[j].length;
+        }
+        imported++;
+        if (disk->num_pages * 2 >= disk->page_capacity) {
+            sync_disk(disk);
+        }
+    }
+    sync_disk(disk);
+
+    for (unsigned int i = 0; i < bulk.num_files; i++) {
+        free(bulk.files[i].sums);
+        if (!carved) {
+            free(bulk.files[i].extents);
+        }
+    }
+    free(carved);
+    free(bulk.files);
+
+    printf("Skopiowano na dysk wirtualny %u z %u plików z katalogu '%s'.\n", imported, bulk.num_files, directory);
+    return failed;
+}
+
+// Odczyt pliku z dysku w dawnym formacie: wskaźnik na kolejny blok w ostatnich 4 bajtach bloku.
+// Łańcuch jest czytany oknem, które podwaja się, dopóki kolejny blok leży tuż za oknem,
+// więc pliki zapisane po kolei są czytane dużymi porcjami, a rozproszone blok po bloku.
+int copy_legacy_chain(Disk *disk, const Inode *inode, int output, unsigned char *buffer) {
+    unsigned int num_blocks = disk->metadata.num_blocks;
+    unsigned int current_block = inode->first_block;
+    unsigned int bytes_remaining = inode->file_size;
+    unsigned int window = 1;
+    unsigned int max_window = bytes_to_blocks(disk, buffer_size(disk, EXPORT_BUFFER_SIZE));
+
+    while (current_block < num_blocks && bytes_remaining > 0) {
+        unsigned int base = current_block;
+        unsigned int blocks = num_blocks - base < window ? num_blocks - base : window;
+        if (disk_read(disk, data_block_offset(&disk->metadata, base), buffer, blocks_to_bytes(disk, blocks)) != 0) {
+            return -1;
+        }
+
+        struct iovec vectors[EXPORT_VECTORS];
+        int count = 0;
+        while (current_block >= base && current_block - base < blocks && bytes_remaining > 0 && count < EXPORT_VECTORS) {
+            unsigned char *block = buffer + blocks_to_bytes(disk, current_block - base);
+            unsigned int bytes_to_write = (bytes_remaining > disk->block_size) ? disk->block_size : bytes_remaining;
+            add_vector(vectors, &count, block, bytes_to_write);
+            bytes_remaining -= bytes_to_write;
+            memcpy(&current_block, block + disk->block_size - sizeof(int), sizeof(int));
+        }
+        if (write_vectors(output, vectors, count) != 0) {
+            return -1;
+        }
+
+        if (current_block == base + blocks) {
+            window = window * 2 < max_window ? window * 2 : max_window;
+        } else {
+            window = 1;
+        }
+    }
+    return 0;
+}
+
+// Rozpakowuje skompresowany plik ramka po ramce. Do packed czytane są całe bloki, aż zmieści się
+// w nim kolejna ramka; rozpakowane porcje zbierają się w buffer, zapisywanym po zapełnieniu
+int export_packed(Disk *disk, const Extent *extents, unsigned int num_extents, disk_offset bytes, int fd, unsigned char *buffer) {
+    unsigned long size = buffer_size(disk, EXPORT_BUFFER_SIZE);
+    unsigned long capacity = buffer_size(disk, 2 * (sizeof(unsigned int) + LZ_CHUNK));
+    unsigned char *packed = malloc(capacity);
+    if (!packed) {
+        return -1;
+    }
+    unsigned int total = 0;
+    for (unsigned int i = 0; i < num_extents; i++) {
+        total += extents[i].length;
+    }
+
+    unsigned long filled = 0;
+    unsigned long have = 0;
+    unsigned long used = 0;
+    unsigned long length = 0;
+    unsigned int next = 0;
+    unsigned int header = 0;
+    int result = 0;
+    while (bytes > 0 && result == 0) {
+        if (have - used >= sizeof(header)) {
+            memcpy(&header, packed + used, sizeof(header));
+            length = header & ~LZ_STORED;
+        }
+        // Niepełna ramka: reszta przesuwana na początek i doczytywane kolejne bloki
+        if (have - used < sizeof(header) || have - used - sizeof(header) < length) {
+            memmove(packed, packed + used, have - used);
+            have -= used;
+            used = 0;
+            unsigned int count = bytes_to_blocks(disk, capacity - have);
+            if (count > total - next) {
+                count = total - next;
+            }
+            if (count == 0 || file_blocks_io(disk, extents, num_extents, next, packed + have, count, false) != 0) {
+                result = -1;
+            }
+            next += count;
+            have += blocks_to_bytes(disk, count);
+            continue;
+        }
+
+        unsigned long raw = bytes < LZ_CHUNK ? bytes : LZ_CHUNK;
+        if (size - filled < raw) {
+            struct iovec vector = { buffer, filled };
+            result = write_vectors(fd, &vector, 1);
+            filled = 0;
+        }
+        if (header & LZ_STORED) {
+            if (length != raw) {
+                result = -1;
+            } else {
+                memcpy(buffer + filled, packed + used + sizeof(header), raw);
+            }
+        } else if (lz_decompress(packed + used + sizeof(header), length, buffer + filled, raw) != (long)raw) {
+            result = -1;
+        }
+        used += sizeof(header) + length;
+        filled += raw;
+        bytes -= raw;
+    }
+    free(packed);
+
+    if (result == 0 && filled > 0) {
+        struct iovec vector = { buffer, filled };
+        result = write_vectors(fd, &vector, 1);
+    }
+    return result;
+}
+
+// Tworzy brakujące katalogi hosta nad ścieżką, jak mkdir -p; katalogi, których nie udało
+// się utworzyć, zgłasza potem open
+void make_host_parents(const char *path) {
+    char prefix[HOST_PATH_LEN];
+    for (size_t length = 1; length < HOST_PATH_LEN && path[length] != '\0'; length++) {
+        if (path[length] == '/' && path[length - 1] != '/') {
+            memcpy(prefix, path, length);
+            prefix[length] = '\0';
+            struct stat info;
+            if (stat(prefix, &info) != 0) {
+                mkdir(prefix, 0777);
+            }
+        }
+    }
+}
+
+// Kopiuje plik z dysku pod tę samą ścieżkę na hoście, tworząc jej katalogi
+int export_file(Disk *disk, const char *output_filename) {
+    // Znajdź plik w indeksie nazw
+    Inode file_inode;
+    if (find_file(disk, output_filename, &file_inode) == NO_INODE) {
+        fprintf(stderr, "Plik '%s' nie został znaleziony na wirtualnym dysku.\n", output_filename);
+        return -1;
+    }
+    if (file_inode.file_type & TYPE_DIRECTORY) {
+        fprintf(stderr, "'%s' jest katalogiem.\n", output_filename);
+        return -1;
+    }
+
+    // Otwórz plik wyjściowy do zapisu
+    make_host_parents(output_filename);
+    int output = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (output < 0) {
+        perror("Nie udało się utworzyć pliku wyjściowego");
+        return -1;
+    }
+
+    // Dane małego pliku są w i-węźle, więc bloki danych nie są czytane
+    if (is_inline(disk, &file_inode)) {
+        struct iovec vector = { file_inode.extents, file_inode.file_size };
+        int result = write_vectors(output, &vector, 1);
+        if (close(output) != 0 || result != 0) {
+            fprintf(stderr, "Nie udało się zapisać pliku wyjściowego '%s'.\n", output_filename);
+            unlink(output_filename);
+            return -1;
+        }
+        printf("Plik '%s' został pomyślnie skopiowany z wirtualnego dysku.\n", output_filename);
+        return 0;
+    }
+
+    unsigned char *buffer = malloc(buffer_size(disk, EXPORT_BUFFER_SIZE));
+    Extent *extents = NULL;
+    if (!is_legacy_image(&disk->metadata)) {
+        extents = load_extents(disk, &file_inode);
+    }
+    if (!buffer || (!extents && !is_legacy_image(&disk->metadata))) {
+        fprintf(stderr, "Nie udało się odczytać ekstentów pliku '%s'.\n", output_filename);
+        free(buffer);
+        close(output);
+        unlink(output_filename);
+        return -1;
+    }
+
+    // Kopiuj dane pliku ciągami sąsiednich bloków
+    int result;
+    unsigned int bad_sums = disk->bad_sums;
+    int previous = enter_phase(PHASE_COPY);
+    if (extents && is_compressed(disk, &file_inode)) {
+        result = export_packed(disk, extents, file_inode.num_extents, inode_size(&disk->metadata, &file_inode), output, buffer);
+    } else if (extents) {
+        result = export_extents(disk, extents, file_inode.num_extents, inode_size(&disk->metadata, &file_inode), output, buffer);
+    } else {
+        result = copy_legacy_chain(disk, &file_inode, output, buffer);
+    }
+    enter_phase(previous);
+    free(extents);
+    free(buffer);
+
+    // Częściowa kopia jest gorsza niż żadna, więc zostaje usunięta
+    if (close(output) != 0 || result != 0) {
+        if (disk->bad_sums != bad_sums) {
+            fprintf(stderr, "Plik '%s' jest uszkodzony na wirtualnym dysku (niezgodna suma kontrolna).\n", output_filename);
+        } else {
+            fprintf(stderr, "Nie udało się zapisać pliku wyjściowego '%s'.\n", output_filename);
+        }
+        unlink(output_filename);
+        return -1;
+    }
+
+    printf("Plik '%s' został pomyślnie skopiowany z wirtualnego dysku.\n", output_filename);
+    return 0;
+}
+
+// Ekstent z blokiem pliku block: ostatni, który zaczyna się przed nim lub na nim
+unsigned int find_extent(const OpenFile *file, unsigned int block) {
+    unsigned int low = 0;
+    unsigned int high = file->inode.num_extents;
+    while (high - low > 1) {
+        unsigned int middle = low + (high - low) / 2;
+        if (file->starts[middle] <= block) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Kopiuje length zapisanych bajtów od pozycji position do out. Bloki wokół nich są czytane w całości
+// i sprawdzane, najwyżej jeden ciąg ekstentu o rozmiarze buffer_size(IO_BUFFER_SIZE) naraz,
+// i zostają w pamięci, dopóki kolejne wywołania nie potrzebują innych bloków
+int read_stored(Disk *disk, OpenFile *file, disk_offset position, unsigned char *out, unsigned long length) {
+    unsigned int max_count = bytes_to_blocks(disk, buffer_size(disk, IO_BUFFER_SIZE));
+    while (length > 0) {
+        unsigned int block = bytes_to_blocks(disk, position);
+        if (block >= file->starts[file->inode.num_extents]) {
+            return -1;
+        }
+        if (block < file->loaded || block - file->loaded >= file->num_loaded) {
+            unsigned long skip = position - blocks_to_bytes(disk, block);
+            unsigned int extent = find_extent(file, block);
+            unsigned int physical = file->extents[extent].start + (block - file->starts[extent]);
+            unsigned int count = blocks_for_bytes(disk, skip + length);
+            if (count > max_count) {
+                count = max_count;
+            }
+            if (count > file->starts[extent + 1] - block) {
+                count = file->starts[extent + 1] - block;
+            }
+            file->num_loaded = 0;
+            if (disk_read(disk, data_block_offset(&disk->metadata, physical), file->blocks, blocks_to_bytes(disk, count)) != 0 ||
+                verify_sums(disk, physical, file->blocks, count) != 0) {
+                return -1;
+            }
+            file->loaded = block;
+            file->num_loaded = count;
+        }
+        unsigned long skip = position - blocks_to_bytes(disk, file->loaded);
+        unsigned long piece = blocks_to_bytes(disk, file->num_loaded) - skip;
+        if (piece > length) {
+            piece = length;
+        }
+        memcpy(out, file->blocks + skip, piece);
+        out += piece;
+        position += piece;
+        length -= piece;
+    }
+    return 0;
+}
 
+// Ustala położenie każdej ramki skompresowanego pliku, czytając tylko nagłówki ramek
+int index_frames(Disk *disk, OpenFile *file) {
+    disk_offset stored = blocks_to_bytes(disk, file->starts[file->inode.num_extents]);
+    disk_offset position = 0;
+    file->num_frames = (file->size + LZ_CHUNK - 1) / LZ_CHUNK;
+    file->frames = malloc((file->num_frames + 1) * sizeof(disk_offset));
+    file->packed = malloc(sizeof(unsigned int) + LZ_BOUND(LZ_CHUNK));
+    file->raw = malloc(LZ_CHUNK);
+    if (!file->frames || !file->packed || !file->raw) {
+        return -1;
+    }
+    for (unsigned long k = 0; k < file->num_frames; k++) {
+        unsigned int header;
+        file->frames[k] = position;
+        if (stored - position < sizeof(header) ||
+            read_stored(disk, file, position, (unsigned char *)&header, sizeof(header)) != 0 ||
+            (header & ~LZ_STORED) > LZ_BOUND(LZ_CHUNK) ||
+            stored - position - sizeof(header) < (header & ~LZ_STORED)) {
+            return -1;
+        }
+        position += sizeof(header) + (header & ~LZ_STORED);
+    }
+    file->frames[file->num_frames] = position;
+    return 0;
+}
 
-unsigned int count_blocks(unsigned int disk_size_bytes) {
-    unsigned int bitmap_size_bytes;
-    unsigned int inode_bitmap_size_bytes = MAX_FILES * sizeof(bool);
-    unsigned long reserved_space;
-    unsigned int num_blocks = (disk_size_bytes - sizeof(DiskMetadata) - inode_bitmap_size_bytes - (MAX_FILES * sizeof(Inode))) / BLOCK_SIZE;
-    unsigned int prev_num_blocks = 0;
+void close_file(OpenFile *file) {
+    free(file->extents);
+    free(file->starts);
+    free(file->frames);
+    free(file->blocks);
+    free(file->packed);
+    free(file->raw);
+    memset(file, 0, sizeof(OpenFile));
+}
 
-    while (num_blocks != prev_num_blocks) {
-        prev_num_blocks = num_blocks;
+// Otwiera plik dla read_file_at. Stare obrazy trzymają bloki w łańcuchu, który nie ma indeksu
+int open_file(Disk *disk, const char *path, OpenFile *file) {
+    memset(file, 0, sizeof(OpenFile));
+    if (find_file(disk, path, &file->inode) == NO_INODE) {
+        fprintf(stderr, "Plik '%s' nie został znaleziony na wirtualnym dysku.\n", path);
+        return -1;
+    }
+    if (file->inode.file_type & TYPE_DIRECTORY) {
+        fprintf(stderr, "'%s' jest katalogiem.\n", path);
+        return -1;
+    }
+    if (is_legacy_image(&disk->metadata)) {
+        fprintf(stderr, "Odczyt fragmentu wymaga nowszego obrazu; skopiuj plik '%s' w całości.\n", path);
+        return -1;
+    }
+    file->size = inode_size(&disk->metadata, &file->inode);
+    if (is_inline(disk, &file->inode)) {
+        return 0;
+    }
 
-        // Oblicz rozmiar bitmapy bloków jako tablicy bool
-        bitmap_size_bytes = num_blocks * sizeof(bool);
+    file->extents = load_extents(disk, &file->inode);
+    file->starts = malloc((file->inode.num_extents + 1) * sizeof(unsigned int));
+    file->blocks = malloc(buffer_size(disk, IO_BUFFER_SIZE));
+    if (!file->extents || !file->starts || !file->blocks) {
+        fprintf(stderr, "Nie udało się odczytać ekstentów pliku '%s'.\n", path);
+        close_file(file);
+        return -1;
+    }
+    file->starts[0] = 0;
+    for (unsigned int i = 0; i < file->inode.num_extents; i++) {
+        file->starts[i + 1] = file->starts[i] + file->extents[i].length;
+    }
+    if (is_compressed(disk, &file->inode) && index_frames(disk, file) != 0) {
+        fprintf(stderr, "Nie udało się odczytać ramek pliku '%s'.\n", path);
+        close_file(file);
+        return -1;
+    }
+    file->cached = file->num_frames;
+    return 0;
+}
 
-        // Oblicz całkowitą zajętą przestrzeń
-        reserved_space = sizeof(DiskMetadata) + bitmap_size_bytes + inode_bitmap_size_bytes + (MAX_FILES * sizeof(Inode));
+// Czyta do length bajtów od przesunięcia offset do buffer i zwraca ich liczbę, 0 na końcu pliku
+// i -1 przy błędzie. Z pliku skompresowanego rozpakowywane są tylko ramki z żądanego zakresu
+long read_file_at(Disk *disk, OpenFile *file, disk_offset offset, unsigned char *buffer, unsigned long length) {
+    if (offset >= file->size) {
+        return 0;
+    }
+    if (length > file->size - offset) {
+        length = file->size - offset;
+    }
+    if (is_inline(disk, &file->inode)) {
+        memcpy(buffer, (unsigned char *)file->inode.extents + offset, length);
+        return (long)length;
+    }
+    if (!file->frames) {
+        return read_stored(disk, file, offset, buffer, length) == 0 ? (long)length : -1;
+    }
 
-        num_blocks = (disk_size_bytes - reserved_space) / BLOCK_SIZE;
+    unsigned long done = 0;
+    while (done < length) {
+        unsigned long frame = (offset + done) / LZ_CHUNK;
+        unsigned long skip = (offset + done) % LZ_CHUNK;
+        unsigned long raw = file->size - (disk_offset)frame * LZ_CHUNK < LZ_CHUNK ? file->size - (disk_offset)frame * LZ_CHUNK : LZ_CHUNK;
+        if (frame != file->cached) {
+            unsigned int header;
+            file->cached = file->num_frames;
+            if (read_stored(disk, file, file->frames[frame], file->packed, file->frames[frame + 1] - file->frames[frame]) != 0) {
+                return -1;
+            }
+            memcpy(&header, file->packed, sizeof(header));
+            if (header & LZ_STORED) {
+                if ((header & ~LZ_STORED) != raw) {
+                    return -1;
+                }
+                memcpy(file->raw, file->packed + sizeof(header), raw);
+            } else if (lz_decompress(file->packed + sizeof(header), header, file->raw, raw) != (long)raw) {
+                return -1;
+            }
+            file->cached = frame;
+        }
+        unsigned long piece = raw - skip < length - done ? raw - skip : length - done;
+        memcpy(buffer + done, file->raw + skip, piece);
+        done += piece;
     }
-    return num_blocks;
+    return (long)length;
 }
 
+// Zapisuje do fd length bajtów pliku od przesunięcia offset, kończąc wcześniej na końcu pliku
+int read_range(Disk *disk, const char *path, disk_offset offset, disk_offset length, int fd) {
+    OpenFile file;
+    if (open_file(disk, path, &file) != 0) {
+        return -1;
+    }
+    unsigned long size = buffer_size(disk, EXPORT_BUFFER_SIZE);
+    unsigned char *buffer = malloc(size);
+    if (!buffer) {
+        close_file(&file);
+        return -1;
+    }
 
-void initialize_disk(const char *filename, unsigned int disk_size_mb) {
-    FILE *disk = fopen(filename, "wb");
-    if (!disk) {
-        perror("Nie udało się utworzyć pliku dysku");
-        exit(EXIT_FAILURE);
+    // Wcześniejsze komunikaty muszą trafić na wyjście przed danymi
+    fflush(stdout);
+    int result = 0;
+    int previous = enter_phase(PHASE_COPY);
+    while (length > 0 && result == 0) {
+        long count = read_file_at(disk, &file, offset, buffer, length < size ? length : size);
+        if (count <= 0) {
+            result = (int)count;
+            break;
+        }
+        struct iovec vector = { buffer, (size_t)count };
+        result = write_vectors(fd, &vector, 1);
+        offset += count;
+        length -= count;
     }
+    enter_phase(previous);
+    free(buffer);
+    close_file(&file);
 
-    unsigned int disk_size_bytes = disk_size_mb * 1024 * 1024;
-    unsigned int num_blocks = count_blocks(disk_size_bytes);
+    if (result != 0) {
+        fprintf(stderr, "Nie udało się odczytać pliku '%s'.\n", path);
+    }
+    return result;
+}
 
-    unsigned int block_bitmap_size_bytes = num_blocks * sizeof(bool);
-    unsigned int inode_bitmap_size_bytes = MAX_FILES * sizeof(bool);
-    unsigned long first_data_block = sizeof(DiskMetadata) + block_bitmap_size_bytes + inode_bitmap_size_bytes + (MAX_FILES * sizeof(Inode));
 
-    // Inicjalizacja metadanych
-    DiskMetadata metadata = {
-        .disk_size = disk_size_mb,
-        .block_size = BLOCK_SIZE,
-        .num_blocks = num_blocks,
-        .first_data_block = first_data_block,
-        .num_files = 0,
-        .max_files = MAX_FILES,
-    };
+// Dodaje bloki jednego pliku w ciągach po co najwyżej buffer_size(IO_BUFFER_SIZE) bajtów
+int add_scrub_runs(Scrub *scrub, const Extent *extents, unsigned int num_extents) {
+    unsigned int max_run = bytes_to_blocks(scrub->disk, buffer_size(scrub->disk, IO_BUFFER_SIZE));
+    for (unsigned int i = 0; i < num_extents; i++) {
+        unsigned int start = extents[i].start;
+        unsigned int remaining = extents[i].length;
+        while (remaining > 0) {
+            if (scrub->num_runs == scrub->capacity) {
+                ScrubRun *grown = realloc(scrub->runs, (scrub->capacity * 2 + 64) * sizeof(ScrubRun));
+                if (!grown) {
+                    return -1;
+                }
+                scrub->runs = grown;
+                scrub->capacity = scrub->capacity * 2 + 64;
+            }
+            unsigned int length = remaining < max_run ? remaining : max_run;
+            scrub->runs[scrub->num_runs++] = (ScrubRun){ start, length, scrub->num_files };
+            start += length;
+            remaining -= length;
+        }
+    }
+    return 0;
+}
 
-    // Alokowanie pamięci dla bitmap i katalogu i-odów
-    bool *block_bitmap = calloc(num_blocks, sizeof(bool));
-    bool *inode_bitmap = calloc(MAX_FILES, sizeof(bool));
-    Inode *inode_catalog = calloc(MAX_FILES, sizeof(Inode));
+void *scrub_worker(void *argument) {
+    Scrub *scrub = argument;
+    Disk *disk = scrub->disk;
+    unsigned char *buffer = disk->map ? NULL : malloc(buffer_size(disk, IO_BUFFER_SIZE));
+    Stats stats;
+    memset(&stats, 0, sizeof(Stats));
+    for (;;) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&scrub->lock);
+#endif
+        unsigned int i = scrub->next++;
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&scrub->lock);
+#endif
+        if (i >= scrub->num_runs) {
+            break;
+        }
+        ScrubRun *run = &scrub->runs[i];
+        disk_offset offset = data_block_offset(&disk->metadata, run->start);
+        unsigned long length = blocks_to_bytes(disk, run->length);
+        unsigned char *data;
+        count_io(&stats, false, offset, length);
+        if (disk->map) {
+            data = disk_ptr(disk, offset, length);
+        } else {
+            data = buffer && pread(fileno(disk->file), buffer, length, (off_t)offset) == (ssize_t)length ? buffer : NULL;
+        }
 
-    if (!block_bitmap || !inode_bitmap || !inode_catalog) {
-        perror("Nie udało się zaalokować pamięci");
-        fclose(disk);
-        exit(EXIT_FAILURE);
+        for (unsigned int j = 0; j < run->length; j++) {
+            if (data && block_sum(disk, data + blocks_to_bytes(disk, j)) == scrub->sums[run->start + j]) {
+                continue;
+            }
+#ifdef HAVE_PTHREAD
+            pthread_mutex_lock(&scrub->lock);
+#endif
+            fprintf(stderr, "Blok %u pliku '%s' jest uszkodzony.\n", run->start + j, scrub->names + run->file * MAX_FILENAME_LEN);
+            scrub->damaged++;
+#ifdef HAVE_PTHREAD
+            pthread_mutex_unlock(&scrub->lock);
+#endif
+        }
     }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&scrub->lock);
+#endif
+    merge_stats(&stats);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&scrub->lock);
+#endif
+    free(buffer);
+    return NULL;
+}
 
-    // Zapis metadanych, bitmap i katalogu do pliku
-    fwrite(&metadata, sizeof(DiskMetadata), 1, disk);
-    fwrite(block_bitmap, sizeof(bool), num_blocks, disk);
-    fwrite(inode_bitmap, sizeof(bool), MAX_FILES, disk);
-    fwrite(inode_catalog, sizeof(Inode), MAX_FILES, disk);
+// Sprawdza wszystkie bloki wszystkich plików z tablicą sum kontrolnych. Tablica jest czytana
+// z góry, a bloki dzielone na ciągi czytane równolegle przez wątki; bloki współdzielone
+// na dysku z deduplikacją są sprawdzane raz dla każdego używającego ich pliku
+int scrub_disk(Disk *disk) {
+    if (!checksums_enabled(disk)) {
+        fprintf(stderr, "Dysk nie ma sum kontrolnych bloków.\n");
+        return -1;
+    }
+    sync_disk(disk);
 
-    // Wypełnienie pozostałego miejsca (obszar danych) zerami
-    unsigned int remaining_bytes = disk_size_bytes - first_data_block;
-    unsigned char zero_block[BLOCK_SIZE] = {0};
-    for (unsigned int i = 0; i < remaining_bytes / BLOCK_SIZE; i++) {
-        fwrite(zero_block, BLOCK_SIZE, 1, disk);
+    Scrub scrub;
+    memset(&scrub, 0, sizeof(Scrub));
+    scrub.disk = disk;
+    scrub.sums = malloc(inode_size(&disk->metadata, &disk->metadata.block_sums));
+    unsigned int per_block = disk->inodes_per_block;
+    Inode *inodes = malloc(per_block * sizeof(Inode));
+    if (!scrub.sums || !inodes || disk_read(disk, sum_offset(disk, 0), scrub.sums, inode_size(&disk->metadata, &disk->metadata.block_sums)) != 0) {
+        fprintf(stderr, "Nie udało się odczytać tablicy sum kontrolnych.\n");
+        free(scrub.sums);
+        free(inodes);
+        return -1;
     }
 
-    printf("Dysk został pomyślnie zainicjalizowany.\n");
-    printf("Metadane: rozmiar dysku = %u MB, liczba bloków = %u\n", disk_size_mb, num_blocks);
-    printf("Pierwszy blok danych zaczyna się na offset = %lu bajtów\n", first_data_block);
+    // Ciągi bloków wszystkich plików z blokami danych
+    int result = 0;
+    unsigned int blocks = (disk->metadata.num_inodes + per_block - 1) / per_block;
+    for (unsigned int block = 0; block < blocks && result == 0; block++) {
+        if (disk_read(disk, data_block_offset(&disk->metadata,
+                      map_file_block(disk->catalog_extents, disk->metadata.catalog.num_extents, block)),
+                      inodes, per_block * sizeof(Inode)) != 0) {
+            result = -1;
+            break;
+        }
+        for (unsigned int i = 0; i < per_block && block * per_block + i < disk->metadata.num_inodes; i++) {
+            if (inodes[i].file_name[0] == '\0' || inodes[i].num_extents == 0 || (inodes[i].file_type & TYPE_DIRECTORY)) {
+                continue;
+            }
+            char *names = realloc(scrub.names, (scrub.num_files + 1) * MAX_FILENAME_LEN);
+            Extent *extents = load_extents(disk, &inodes[i]);
+            if (names) {
+                scrub.names = names;
+                memcpy(names + scrub.num_files * MAX_FILENAME_LEN, inodes[i].file_name, MAX_FILENAME_LEN);
+            }
+            if (!names || !extents || add_scrub_runs(&scrub, extents, inodes[i].num_extents) != 0) {
+                fprintf(stderr, "Nie udało się odczytać ekstentów pliku '%s'.\n", inodes[i].file_name);
+                result = -1;
+            }
+            free(extents);
+            scrub.num_files++;
+        }
+    }
+    free(inodes);
 
-    // Sprzątanie
-    free(block_bitmap);
-    free(inode_bitmap);
-    free(inode_catalog);
-    fclose(disk);
+    if (result == 0) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_init(&scrub.lock, NULL);
+#endif
+        int previous = enter_phase(PHASE_COPY);
+        run_workers(scrub_worker, &scrub);
+        enter_phase(previous);
+#ifdef HAVE_PTHREAD
+        pthread_mutex_destroy(&scrub.lock);
+#endif
+        for (unsigned int i = 0; i < scrub.num_runs; i++) {
+            scrub.checked += scrub.runs[i].length;
+        }
+        printf("Sprawdzono %lu bloków %u plików: uszkodzonych %u.\n", scrub.checked, scrub.num_files, scrub.damaged);
+        result = scrub.damaged == 0 ? 0 : -1;
+    }
+    free(scrub.runs);
+    free(scrub.names);
+    free(scrub.sums);
+    return result;
 }
 
-void copy_file_to_disk(const char *disk_filename, const char *source_filename) {
-    FILE *disk = fopen(disk_filename, "r+b");
-    if (!disk) {
-        perror("Nie udało się otworzyć pliku dysku");
-        exit(EXIT_FAILURE);
+// Liczba fizycznie rozdzielonych ciągów; przylegające ekstenty tworzą jeden ciąg
+unsigned int count_fragments(const Extent *extents, unsigned int num_extents) {
+    unsigned int fragments = 0;
+    for (unsigned int i = 0; i < num_extents; i++) {
+        if (i == 0 || extents[i].start != extents[i - 1].start + extents[i - 1].length) {
+            fragments++;
+        }
     }
+    return fragments;
+}
 
-    FILE *source = fopen(source_filename, "rb");
-    if (!source) {
-        perror("Nie udało się otworzyć pliku źródłowego");
-        fclose(disk);
-        exit(EXIT_FAILURE);
-    }
+int compare_fragments(const void *a, const void *b) {
+    unsigned int first = ((const DefragFile *)a)->fragments;
+    unsigned int second = ((const DefragFile *)b)->fragments;
+    return first > second ? -1 : first < second;
+}
 
-    // Wczytanie metadanych
-    DiskMetadata metadata;
-    fread(&metadata, sizeof(DiskMetadata), 1, disk);
+int compare_starts(const void *a, const void *b) {
+    unsigned int first = ((const DefragFile *)a)->start;
+    unsigned int second = ((const DefragFile *)b)->start;
+    return first < second ? -1 : first > second;
+}
 
-    // Sprawdzenie miejsca na nowe pliki
-    if (metadata.num_files >= metadata.max_files) {
-        fprintf(stderr, "Brak miejsca na nowy plik w katalogu.\n");
-        fclose(disk);
-        fclose(source);
-        return;
+// Zwraca wszystkie pliki z blokami danych; przy show wypisuje pliki podzielone na kilka ciągów i podsumowanie
+DefragFile *collect_files(Disk *disk, unsigned int *num_files, bool show) {
+    DefragFile *files = NULL;
+    unsigned int num_fragmented = 0;
+    unsigned long fragments = 0;
+    unsigned int per_block = disk->inodes_per_block;
+    Inode *inodes = malloc(per_block * sizeof(Inode));
+    if (!inodes) {
+        return NULL;
     }
 
-    // Wczytanie bitmapy bloków i i-odów
-    bool *block_bitmap = malloc(metadata.num_blocks);
-    bool *inode_bitmap = malloc(MAX_FILES);
-    fseek(disk, sizeof(DiskMetadata), SEEK_SET);
-    fread(block_bitmap, sizeof(bool), metadata.num_blocks, disk);
-    fread(inode_bitmap, sizeof(bool), MAX_FILES, disk);
-
-    // Znalezienie wolnego inoda
-    int inode_index = -1;
-    for (unsigned int i = 0; i < MAX_FILES; i++) {
-        if (!inode_bitmap[i]) {
-            inode_index = i;
+    *num_files = 0;
+    int failed = 0;
+    unsigned int blocks = (disk->metadata.num_inodes + per_block - 1) / per_block;
+    for (unsigned int block = 0; block < blocks && !failed; block++) {
+        if (disk_read(disk, data_block_offset(&disk->metadata,
+                      map_file_block(disk->catalog_extents, disk->metadata.catalog.num_extents, block)),
+                      inodes, per_block * sizeof(Inode)) != 0) {
+            failed = 1;
             break;
         }
+        for (unsigned int i = 0; i < per_block && block * per_block + i < disk->metadata.num_inodes; i++) {
+            if (inodes[i].file_name[0] == '\0' || inodes[i].num_extents == 0 || (inodes[i].file_type & TYPE_DIRECTORY)) {
+                continue;
+            }
+            Extent *extents = load_extents(disk, &inodes[i]);
+            DefragFile *grown = realloc(files, (*num_files + 1) * sizeof(DefragFile));
+            if (grown) {
+                files = grown;
+            }
+            if (!extents || !grown) {
+                fprintf(stderr, "Nie udało się odczytać ekstentów pliku '%s'.\n", inodes[i].file_name);
+                free(extents);
+                failed = 1;
+                break;
+            }
+            DefragFile *file = &files[(*num_files)++];
+            file->number = block * per_block + i;
+            file->start = extents[0].start;
+            file->blocks = 0;
+            for (unsigned int j = 0; j < inodes[i].num_extents; j++) {
+                file->blocks += extents[j].length;
+            }
+            file->fragments = count_fragments(extents, inodes[i].num_extents);
+            fragments += file->fragments;
+            if (file->fragments > 1) {
+                num_fragmented++;
+                if (show) {
+                    printf("%-40s %10u bloków w %u fragmentach\n", inodes[i].file_name, file->blocks, file->fragments);
+                }
+            }
+            free(extents);
+        }
     }
-    if (inode_index == -1) {
-        fprintf(stderr, "Brak wolnych i-odów.\n");
-        free(block_bitmap);
-        free(inode_bitmap);
-        fclose(disk);
-        fclose(source);
-        return;
+    free(inodes);
+
+    if (failed) {
+        free(files);
+        return NULL;
+    }
+    if (show) {
+        printf("Pliki z blokami danych: %u, pofragmentowane: %u, fragmentów: %lu\n", *num_files, num_fragmented, fragments);
     }
+    return files ? files : malloc(sizeof(DefragFile));
+}
 
-    // Znalezienie pustych bloków
-    unsigned int free_blocks[metadata.num_blocks];
-    unsigned int free_block_count = 0;
-    for (unsigned int i = 0; i < metadata.num_blocks; i++) {
-        if (!block_bitmap[i]) {
-            free_blocks[free_block_count++] = i;
-        }
+void show_free_space(Disk *disk) {
+    if (disk->space.stale) {
+        build_space_index(disk);
     }
+    unsigned int largest = space_largest(&disk->space);
+    printf("Wolne miejsce: %u bloków w %u ciągach, najdłuższy ciąg %u bloków\n", disk->metadata.free_blocks,
+           disk->space.count, largest ? disk->space.nodes[largest].length : 0);
+}
 
-    // Sprawdzenie dostępnego miejsca
-    fseek(source, 0, SEEK_END);
-    unsigned int file_size = ftell(source);
-    rewind(source);
+// Wolny ciąg co najmniej blocks bloków: przy before pierwszy zaczynający się przed nim,
+// bez niego najkrótszy pasujący, żeby długie ciągi zostały w całości
+unsigned int find_target_run(Disk *disk, unsigned int blocks, unsigned int before) {
+    SpaceIndex *space = &disk->space;
+    if (space->stale && build_space_index(disk) != 0) {
+        return NO_BLOCK;
+    }
+    if (before != NO_BLOCK) {
+        unsigned int node = space_first_fit(space, space->root[BY_ADDRESS], 0, blocks);
+        return node && space->nodes[node].start < before ? space->nodes[node].start : NO_BLOCK;
+    }
+    unsigned int node = space_best_fit(space, blocks);
+    return node ? space->nodes[node].start : NO_BLOCK;
+}
 
-    unsigned int blocks_needed = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE; // Liczba potrzebnych bloków
-    if (blocks_needed > free_block_count) {
-        fprintf(stderr, "Brak miejsca na dysku na ten plik.\n");
-        free(block_bitmap);
-        free(inode_bitmap);
-        fclose(disk);
-        fclose(source);
-        return;
+// Przenosi plik do jednego ciągu wolnych bloków dużymi sekwencyjnymi kopiami. Kopia trafia do
+// bloków, na które nie wskazują zatwierdzone metadane, a nowy i-węzeł, zajęcie nowych i zwolnienie
+// starych bloków są zatwierdzane razem: po awarii zostaje stary albo nowy plik.
+// Zwraca 1, gdy nie ma odpowiedniego wolnego ciągu.
+int relocate_file(Defrag *defrag, const DefragFile *file, unsigned int before) {
+    Disk *disk = defrag->disk;
+    int previous = enter_phase(PHASE_ALLOC);
+    // Przy przesuwaniu najpierw zatwierdzane są bloki zwolnione przez poprzednie przeniesienie,
+    // więc plik może się w nie wsunąć i każdy plik jest przenoszony tylko raz
+    if (before != NO_BLOCK && disk->num_deferred > 0) {
+        sync_disk(disk);
+    }
+    Extent run = { find_target_run(disk, file->blocks, before), file->blocks };
+    if (run.start == NO_BLOCK && disk->num_deferred > 0) {
+        sync_disk(disk);
+        run.start = find_target_run(disk, file->blocks, before);
+    }
+    enter_phase(previous);
+    if (run.start == NO_BLOCK) {
+        return 1;
     }
 
-    Inode inode = {0};
-    strncpy(inode.file_name, source_filename, MAX_FILENAME_LEN - 1);
-    inode.file_size = file_size;
-    inode.first_block = free_blocks[0];
-    inode.file_type = (source_filename[0] == '.') ? 1 : 0;
-
-    // Zapis danych pliku w blokach
-    unsigned int current_block = inode.first_block;
-    for (unsigned int i = 0; i < blocks_needed; i++) {
-        unsigned int next_block = (i + 1 < blocks_needed) ? free_blocks[i + 1] : (unsigned int)-1;
-
-        // Aktualizacja bitmapy
-        block_bitmap[current_block] = true;
-
-        // Zapis danych do aktualnego bloku
-        unsigned char buffer[BLOCK_SIZE] = {0};
-        fread(buffer, 1, BLOCK_SIZE, source);
-        fseek(disk, metadata.first_data_block + current_block * BLOCK_SIZE, SEEK_SET);
-        fwrite(buffer, 1, BLOCK_SIZE, disk);
-
-        // Zapis wskaźnika na kolejny blok
-        fseek(disk, metadata.first_data_block + current_block * BLOCK_SIZE + BLOCK_SIZE - sizeof(int), SEEK_SET);
-        fwrite(&next_block, sizeof(int), 1, disk);
-
-        current_block = next_block;
-    }
-
-    // Zapis bitmapy bloków i i-odów
-    inode_bitmap[inode_index] = true;
-    fseek(disk, sizeof(DiskMetadata), SEEK_SET);
-    fwrite(block_bitmap, sizeof(bool), metadata.num_blocks, disk);
-    fwrite(inode_bitmap, sizeof(bool), MAX_FILES, disk);
-
-    // Dodanie Inode do katalogu
-    fseek(disk, sizeof(DiskMetadata) + metadata.num_blocks + MAX_FILES, SEEK_SET);
-    fseek(disk, inode_index * sizeof(Inode), SEEK_CUR);
-    fwrite(&inode, sizeof(Inode), 1, disk);
-
-    // Aktualizacja metadanych
-    metadata.num_files++;
-    fseek(disk, 0, SEEK_SET);
-    fwrite(&metadata, sizeof(DiskMetadata), 1, disk);
+    Inode inode;
+    Extent *extents;
+    if (read_inode(disk, file->number, &inode) != 0 || (extents = load_extents(disk, &inode)) == NULL) {
+        return -1;
+    }
+    mark_blocks(disk, run.start, run.length, true);
+    disk->dirty = true;
 
-    // Sprzątanie
-    free(block_bitmap);
-    free(inode_bitmap);
-    fclose(disk);
-    fclose(source);
+    int result = 0;
+    unsigned int chunk = bytes_to_blocks(disk, buffer_size(disk, IO_BUFFER_SIZE));
+    previous = enter_phase(PHASE_COPY);
+    for (unsigned int done = 0, count; done < file->blocks && result == 0; done += count) {
+        count = file->blocks - done < chunk ? file->blocks - done : chunk;
+        if (file_blocks_io(disk, extents, inode.num_extents, done, defrag->buffer, count, false) != 0 ||
+            file_blocks_io(disk, &run, 1, done, defrag->buffer, count, true) != 0) {
+            result = -1;
+        }
+    }
+    enter_phase(previous);
+    free(extents);
 
-    printf("Plik '%s' został skopiowany na wirtualny dysk.\n", source_filename);
+    Inode moved = inode;
+    if (result != 0 || store_extents(disk, &moved, &run, 1) != 0) {
+        release_extent(disk, &run);
+        return -1;
+    }
+    release_file_blocks(disk, &inode);
+    write_inode(disk, file->number, &moved);
+    defrag->relocated++;
+    defrag->moved += blocks_to_bytes(disk, file->blocks);
+    return 0;
 }
 
-void copy_file_from_disk(const char *disk_filename, const char *output_filename) {
-    // Otwórz wirtualny dysk
-    FILE *disk = fopen(disk_filename, "rb");
-    if (!disk) {
-        perror("Nie udało się otworzyć pliku dysku");
-        exit(EXIT_FAILURE);
-    }
+double seconds_since(const struct timeval *start) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
 
-    // Wczytaj metadane
-    DiskMetadata metadata;
-    fread(&metadata, sizeof(DiskMetadata), 1, disk);
-
-    // Wczytaj bitmapę i-węzłów
-    bool *inode_bitmap = malloc(MAX_FILES * sizeof(bool));
-    fseek(disk, sizeof(DiskMetadata) + (metadata.num_blocks * sizeof(bool)), SEEK_SET);
-    fread(inode_bitmap, sizeof(bool), MAX_FILES, disk);
-
-    // Znajdź plik w katalogu i-węzłów
-    Inode *inode_catalog = malloc(MAX_FILES * sizeof(Inode));
-    fseek(disk, sizeof(DiskMetadata) + (metadata.num_blocks * sizeof(bool)) + (MAX_FILES * sizeof(bool)), SEEK_SET);
-    fread(inode_catalog, sizeof(Inode), MAX_FILES, disk);
-
-    Inode *file_inode = NULL;
-    for (unsigned int i = 0; i < MAX_FILES; i++) {
-        bool ity = inode_bitmap[i];
-        char pierwsza_litera = inode_catalog[i].file_name[0];
-        if (inode_bitmap[i] && strcmp(inode_catalog[i].file_name, output_filename) == 0) {
-            file_inode = &inode_catalog[i];
-            break;
+// Przenosi pliki pofragmentowane do pojedynczych ciągów albo, przy compact, pozostałe pliki,
+// od najniżej położonych, do pierwszego wolnego ciągu przed nimi. Zwraca 1 po wyczerpaniu limitu.
+int move_files(Defrag *defrag, const DefragFile *files, unsigned int num_files, bool compact) {
+    for (unsigned int i = 0; i < num_files; i++) {
+        if (compact ? files[i].fragments > 1 : files[i].fragments < 2) {
+            continue;
+        }
+        if ((defrag->max_seconds > 0 && seconds_since(&defrag->start) >= defrag->max_seconds) ||
+            (defrag->max_bytes > 0 && defrag->moved >= defrag->max_bytes)) {
+            return 1;
+        }
+        int result = relocate_file(defrag, &files[i], compact ? files[i].start : NO_BLOCK);
+        if (result < 0) {
+            fprintf(stderr, "Nie udało się przenieść pliku o i-węźle %u.\n", files[i].number);
+            defrag->failed++;
+        } else if (result > 0 && !compact) {
+            defrag->skipped++;
+        }
+        if (defrag->disk->num_pages * 2 >= defrag->disk->page_capacity) {
+            sync_disk(defrag->disk);
         }
     }
+    return 0;
+}
 
-    if (!file_inode) {
-        fprintf(stderr, "Plik '%s' nie został znaleziony na wirtualnym dysku.\n", output_filename);
-        free(inode_bitmap);
-        free(inode_catalog);
-        fclose(disk);
-        return;
+// Defragmentacja w trzech przebiegach: pliki pofragmentowane, od najbardziej podzielonych, trafiają
+// do najlepiej pasującego wolnego ciągu; potem pliki są przesuwane w stronę początku dysku, co scala
+// wolne miejsce; na końcu ponawiane są pliki, które wcześniej się nie zmieściły. Każde przeniesienie
+// jest zatwierdzane osobno, więc po wyczerpaniu limitu czasu lub bajtów kolejne wywołanie kontynuuje pracę.
+int defrag_disk(Disk *disk, double max_seconds, disk_offset max_bytes) {
+    if (is_legacy_image(&disk->metadata)) {
+        fprintf(stderr, "Dysk jest w dawnym formacie z łańcuchem bloków i można go tylko odczytywać.\n");
+        return -1;
+    }
+    if (dedup_enabled(disk)) {
+        fprintf(stderr, "Defragmentacja dysku z deduplikacją nie jest obsługiwana.\n");
+        return -1;
     }
 
-    // Otwórz plik wyjściowy do zapisu
-    FILE *output_file = fopen(output_filename, "wb");
-    if (!output_file) {
-        perror("Nie udało się utworzyć pliku wyjściowego");
-        free(inode_bitmap);
-        free(inode_catalog);
-        fclose(disk);
-        return;
+    Defrag defrag;
+    memset(&defrag, 0, sizeof(Defrag));
+    defrag.disk = disk;
+    defrag.max_seconds = max_seconds;
+    defrag.max_bytes = max_bytes;
+    gettimeofday(&defrag.start, NULL);
+    defrag.buffer = malloc(buffer_size(disk, IO_BUFFER_SIZE));
+    if (!defrag.buffer) {
+        fprintf(stderr, "Nie udało się przydzielić pamięci.\n");
+        return -1;
     }
+    sync_disk(disk);
 
-    // Kopiuj dane pliku z dysku wirtualnego
-    unsigned int current_block = file_inode->first_block;
-    unsigned int bytes_remaining = file_inode->file_size;
+    int stopped = 0;
+    unsigned int num_files;
+    for (int pass = 0; pass < 3 && !stopped; pass++) {
+        DefragFile *files = collect_files(disk, &num_files, pass == 0);
+        if (!files) {
+            defrag.failed++;
+            break;
+        }
+        if (pass == 0) {
+            show_free_space(disk);
+        }
+        qsort(files, num_files, sizeof(DefragFile), pass == 1 ? compare_starts : compare_fragments);
+        if (pass == 2) {
+            defrag.skipped = 0;
+        }
+        stopped = move_files(&defrag, files, num_files, pass == 1);
+        sync_disk(disk);
+        free(files);
+        if (pass == 1 && defrag.skipped == 0) {
+            break;
+        }
+    }
+    free(defrag.buffer);
 
-    unsigned char buffer[BLOCK_SIZE];
-    while (current_block != (unsigned int)-1 && bytes_remaining > 0) {
-        // Odczytaj dane z bloku
-        fseek(disk, metadata.first_data_block + current_block * BLOCK_SIZE, SEEK_SET);
-        fread(buffer, 1, BLOCK_SIZE, disk);
+    if (stopped) {
+        printf("Limit wyczerpany; kolejna defragmentacja będzie kontynuować pracę.\n");
+    }
+    printf("Przeniesiono %u plików (%llu bajtów) w %.3f s; %u pofragmentowanych plików nie zmieściło się w żadnym wolnym ciągu.\n",
+           defrag.relocated, defrag.moved, seconds_since(&defrag.start), defrag.skipped);
+    free(collect_files(disk, &num_files, true));
+    show_free_space(disk);
+    return defrag.failed == 0 ? 0 : -1;
+}
 
-        // Zapisz dane do pliku wyjściowego
-        unsigned int bytes_to_write = (bytes_remaining > BLOCK_SIZE) ? BLOCK_SIZE : bytes_remaining;
-        fwrite(buffer, 1, bytes_to_write, output_file);
+// Dodaje bloki tabeli do mapy; kawałek przylegający do poprzedniego obszaru tego samego typu jest z nim łączony
+int add_map_areas(MapArea **areas, unsigned int *count, const Extent *extents, unsigned int num_extents, const char *type) {
+    MapArea *grown = realloc(*areas, (*count + num_extents) * sizeof(MapArea));
+    if (!grown) {
+        return -1;
+    }
+    *areas = grown;
+    for (unsigned int i = 0; i < num_extents; i++) {
+        MapArea *last = *count > 0 ? &grown[*count - 1] : NULL;
+        if (last && last->type == type && last->start + last->length == extents[i].start) {
+            last->length += extents[i].length;
+            continue;
+        }
+        grown[(*count)++] = (MapArea){ extents[i].start, extents[i].length, type };
+    }
+    return 0;
+}
 
-        // Odczytaj wskaźnik na następny blok
-        fseek(disk, metadata.first_data_block + current_block * BLOCK_SIZE + BLOCK_SIZE - sizeof(int), SEEK_SET);
-        fread(&current_block, sizeof(int), 1, disk);
+int compare_map_areas(const void *a, const void *b) {
+    unsigned int first = ((const MapArea *)a)->start;
+    unsigned int second = ((const MapArea *)b)->start;
+    return first < second ? -1 : first > second;
+}
 
-        bytes_remaining -= bytes_to_write;
+// Typ obszaru jest identyfikatorem wspólnym dla obu formatów; stan w JSON pozostaje po angielsku
+void print_map_area(bool json, unsigned int *printed, disk_offset address, disk_offset size, const char *type, bool used) {
+    if (size == 0) {
+        return;
     }
+    if (json) {
+        printf("%s\n    {\"address\": %llu, \"type\": \"%s\", \"size\": %llu, \"status\": \"%s\"}",
+               *printed > 0 ? "," : "", address, type, size, used ? "used" : "free");
+    } else {
+        printf("0x%010llx  %-12s %14llu  %s\n", address, type, size, used ? "zajęty" : "wolny");
+    }
+    (*printed)++;
+}
 
-    printf("Plik '%s' został pomyślnie skopiowany z wirtualnego dysku.\n", output_filename);
-
-    // Sprzątanie
-    free(inode_bitmap);
-    free(inode_catalog);
-    fclose(output_file);
-    fclose(disk);
+// Dzieli bloki danych [from, to) na ciągi zajęte i wolne, jednym przeszukaniem bitmapy na ciąg
+void print_data_runs(Disk *disk, bool json, unsigned int *printed, unsigned int from, unsigned int to) {
+    while (from < to) {
+        bool used = bitmap_test(disk->block_bitmap, from);
+        unsigned int end = bitmap_find(disk->block_bitmap, to, from, !used);
+        print_map_area(json, printed, data_block_offset(&disk->metadata, from), blocks_to_bytes(disk, end - from), "data", used);
+        from = end;
+    }
 }
 
+// Wyświetla mapę zajętości: obszary nagłówka, a potem bloki danych podzielone na tabele o stałej
+// roli (katalog, indeks nazw, dziennik, tabele deduplikacji, sumy kontrolne) i scalone ciągi zajęte i wolne
+void display_block_bitmap(Disk *disk, bool json) {
+    DiskMetadata *metadata = &disk->metadata;
+    unsigned int num_blocks = metadata->num_blocks;
+    MapArea *areas = NULL;
+    unsigned int count = 0;
+    unsigned int printed = 0;
 
-void display_block_bitmap(const char *disk_filename) {
-    // Otwieranie pliku dysku
-    FILE *disk = fopen(disk_filename, "rb");
-    if (!disk) {
-        perror("Nie udało się otworzyć pliku dysku");
-        exit(EXIT_FAILURE);
+    if (!is_legacy_image(metadata)) {
+        Extent journal = { metadata->journal_start, metadata->journal_blocks };
+        int failed = add_map_areas(&areas, &count, disk->catalog_extents, metadata->catalog.num_extents, "catalog");
+        failed |= add_map_areas(&areas, &count, disk->index_extents, metadata->name_index.num_extents, "name-index");
+        failed |= add_map_areas(&areas, &count, &journal, 1, "journal");
+        if (dedup_enabled(disk)) {
+            failed |= add_map_areas(&areas, &count, disk->block_index_extents, metadata->block_index.num_extents, "block-index");
+            failed |= add_map_areas(&areas, &count, disk->ref_extents, metadata->block_refs.num_extents, "block-refs");
+        }
+        if (checksums_enabled(disk)) {
+            failed |= add_map_areas(&areas, &count, metadata->block_sums.extents, 1, "checksums");
+        }
+        if (failed) {
+            fprintf(stderr, "Nie udało się przydzielić pamięci.\n");
+            free(areas);
+            return;
+        }
+        qsort(areas, count, sizeof(MapArea), compare_map_areas);
     }
 
-    // Wczytywanie metadanych
-    DiskMetadata metadata;
-    fread(&metadata, sizeof(DiskMetadata), 1, disk);
+    if (json) {
+        printf("{\n  \"block_size\": %u,\n  \"blocks\": %u,\n  \"used_blocks\": %u,\n  \"areas\": [",
+               disk->block_size, num_blocks, bitmap_count_set(disk->block_bitmap, num_blocks));
+    } else {
+        printf("%-12s  %-12s %14s  %s\n", "Adres", "Typ", "Rozmiar", "Stan");
+    }
 
-    // Wczytanie bitmapy zajętości bloków
-    bool *block_bitmap = malloc(metadata.num_blocks * sizeof(bool));
-    fseek(disk, sizeof(DiskMetadata), SEEK_SET);
-    fread(block_bitmap, sizeof(bool), metadata.num_blocks, disk);
+    // Obraz w starym formacie trzyma bitmapę jako tablicę bool, a katalog przed blokami danych
+    disk_offset bitmap_start = block_bitmap_offset(metadata);
+    disk_offset bitmap_end = bitmap_start + (is_legacy_image(metadata) ? num_blocks * sizeof(bool) : BITMAP_BYTES(num_blocks));
+    print_map_area(json, &printed, 0, metadata_size(metadata), "superblock", true);
+    print_map_area(json, &printed, bitmap_start, bitmap_end - bitmap_start, "bitmap", true);
+    if (is_legacy_image(metadata)) {
+        print_map_area(json, &printed, bitmap_end, metadata->first_data_block - bitmap_end, "catalog", true);
+    } else {
+        print_map_area(json, &printed, bitmap_end, metadata->first_data_block - bitmap_end, "padding", false);
+    }
 
-    // Wyświetlenie indeksów zajętych bloków
-    printf("Indeksy zajętych bloków:\n");
+    unsigned int block = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        print_data_runs(disk, json, &printed, block, areas[i].start);
+        print_map_area(json, &printed, data_block_offset(metadata, areas[i].start), blocks_to_bytes(disk, areas[i].length),
+                       areas[i].type, true);
+        block = areas[i].start + areas[i].length;
+    }
+    print_data_runs(disk, json, &printed, block, num_blocks);
+    free(areas);
 
-    for (unsigned int i = 0; i < metadata.num_blocks; i++) {
-        if (block_bitmap[i]) {
-            printf("Blok %u jest zajęty\n", i);
-        }
+    if (json) {
+        printf("\n  ]\n}\n");
+    } else {
+        printf("Zajętych bloków: %u z %u\n", bitmap_count_set(disk->block_bitmap, num_blocks), num_blocks);
     }
-    printf("Pozostałe bloki są wolne.\n");
 }
 
-void list_files_on_disk(const char *disk_filename, bool show_hidden) {
-    FILE *disk = fopen(disk_filename, "rb");
-    if (!disk) {
-        perror("Nie udało się otworzyć pliku dysku");
-        exit(EXIT_FAILURE);
+void print_file_entry(const Disk *disk, const Inode *inode, bool show_hidden) {
+    if (inode->file_name[0] == '\0') { // Sprawdzenie, czy plik istnieje
+        return;
+    }
+    if ((inode->file_type & TYPE_HIDDEN) && !show_hidden) {
+        return;
+    }
+    // Katalog ma ukośnik za nazwą; first_block katalogu to liczba wpisów
+    if (inode->file_type & TYPE_DIRECTORY) {
+        char name[MAX_FILENAME_LEN + 1];
+        sprintf(name, "%s/", inode->file_name);
+        printf("%-20s %-10llu %-10u\n", name, inode_size(&disk->metadata, inode), inode->extents[0].start);
+        return;
     }
+    // Pliki puste i przechowywane w i-węźle nie mają pierwszego bloku
+    if (inode->first_block == NO_BLOCK) {
+        printf("%-20s %-10llu %-10s\n", inode->file_name, inode_size(&disk->metadata, inode), "-");
+        return;
+    }
+    printf("%-20s %-10llu %-10u\n", 
+        inode->file_name, 
+        inode_size(&disk->metadata, inode), 
+        inode->first_block);
+}
 
-    // Wczytanie metadanych
-    DiskMetadata metadata;
-    fread(&metadata, sizeof(DiskMetadata), 1, disk);
+// Tworzy katalog path razem z brakującymi katalogami nadrzędnymi
+int make_directory(Disk *disk, const char *path) {
+    if (!has_directories(&disk->metadata)) {
+        fprintf(stderr, "Dysk w wersji formatu %u nie ma katalogów.\n", disk->metadata.version);
+        return -1;
+    }
+    char leaf[MAX_FILENAME_LEN];
+    unsigned int parent = find_parent(disk, path, leaf, true);
+    if (parent == NO_INODE || leaf[0] == '\0') {
+        fprintf(stderr, "Nieprawidłowa nazwa katalogu '%s' (człony ścieżki mają najwyżej %d znaków, a pliki mogą leżeć tylko w katalogach).\n",
+                path, MAX_FILENAME_LEN - 1);
+        return -1;
+    }
+    Inode inode;
+    if (find_entry(disk, parent, leaf, &inode) != NO_INODE) {
+        fprintf(stderr, "Plik '%s' już istnieje na dysku.\n", path);
+        return -1;
+    }
+    if (enter_directory(disk, parent, leaf, true) == NO_INODE) {
+        fprintf(stderr, "Brak miejsca na dysku na katalog '%s'.\n", path);
+        return -1;
+    }
+    printf("Katalog '%s' został utworzony na wirtualnym dysku.\n", path);
+    return 0;
+}
 
-    // Wczytanie bitmapy i katalogu i-węzłów
-    fseek(disk, sizeof(DiskMetadata) + metadata.num_blocks * sizeof(bool) + MAX_FILES * sizeof(bool), SEEK_SET);
+// Czyta naraz tablicę jednego katalogu, a potem tylko wskazane w niej i-węzły
+void list_directory(Disk *disk, unsigned int number, bool show_hidden) {
+    Directory dir;
+    if (open_directory(disk, number, &dir) != 0) {
+        fprintf(stderr, "Nie udało się odczytać katalogu.\n");
+        return;
+    }
+    unsigned int slots = table_slots(disk, dir.table);
+    IndexEntry *entries = malloc(slots * sizeof(IndexEntry));
+    if (!entries || file_data_io(disk, *dir.extents, dir.table->num_extents, (unsigned char *)entries,
+                                 slots * sizeof(IndexEntry), false) != 0) {
+        fprintf(stderr, "Nie udało się odczytać katalogu.\n");
+        free(entries);
+        close_directory(&dir);
+        return;
+    }
+    for (unsigned int i = 0; i < slots; i++) {
+        Inode inode;
+        if (entries[i].value != 0 && read_inode(disk, entries[i].value, &inode) == 0) {
+            print_file_entry(disk, &inode, show_hidden);
+        }
+    }
+    free(entries);
+    close_directory(&dir);
+}
 
-    // Wczytanie katalogu i-węzłów
-    Inode *inode_catalog = malloc(MAX_FILES * sizeof(Inode));
-    if (!inode_catalog) {
-        perror("Nie udało się zaalokować pamięci dla katalogu i-węzłów");
-        fclose(disk);
-        exit(EXIT_FAILURE);
+// Wypisuje katalog path; dysk bez katalogów wypisuje cały katalog i-węzłów
+void list_files_on_disk(Disk *disk, const char *path, bool show_hidden) {
+    unsigned int number = ROOT_DIRECTORY;
+    if (has_directories(&disk->metadata)) {
+        char leaf[MAX_FILENAME_LEN];
+        number = find_parent(disk, path, leaf, false);
+        if (number != NO_INODE && leaf[0] != '\0') {
+            Inode inode;
+            number = find_entry(disk, number, leaf, &inode);
+            if (number != NO_INODE && !(inode.file_type & TYPE_DIRECTORY)) {
+                number = NO_INODE;
+            }
+        }
+        if (number == NO_INODE) {
+            fprintf(stderr, "Katalog '%s' nie został znaleziony na wirtualnym dysku.\n", path);
+            return;
+        }
+    } else if (path[0] != '\0') {
+        fprintf(stderr, "Dysk w wersji formatu %u nie ma katalogów.\n", disk->metadata.version);
+        return;
     }
-    fread(inode_catalog, sizeof(Inode), MAX_FILES, disk);
 
     printf("%-20s %-10s %-10s\n", "Nazwa pliku", "Rozmiar", "Pierwszy blok");
     printf("---------------------------------------------\n");
 
-    for (unsigned int i = 0; i < MAX_FILES; i++) {
-        if (inode_catalog[i].file_name[0] != '\0') { // Sprawdzenie, czy plik istnieje
-            if (inode_catalog[i].file_type == 1 && !show_hidden) {
-                continue;
-            }
-            printf("%-20s %-10u %-10u\n", 
-                inode_catalog[i].file_name, 
-                inode_catalog[i].file_size, 
-                inode_catalog[i].first_block);
+    if (has_directories(&disk->metadata)) {
+        list_directory(disk, number, show_hidden);
+        return;
+    }
+
+    if (is_legacy_image(&disk->metadata)) {
+        for (unsigned int i = 0; i < MAX_FILES; i++) {
+            print_file_entry(disk, &disk->legacy_catalog[i], show_hidden);
         }
+        return;
     }
 
-    free(inode_catalog);
-    fclose(disk);
+    // Katalog i-węzłów czytany blok po bloku, tylko do ostatniego użytego i-węzła
+    unsigned int per_block = disk->inodes_per_block;
+    Inode *inodes = malloc(per_block * sizeof(Inode));
+    if (!inodes) {
+        return;
+    }
+    unsigned int blocks = (disk->metadata.num_inodes + per_block - 1) / per_block;
+    for (unsigned int block = 0; block < blocks; block++) {
+        if (disk_read(disk, data_block_offset(&disk->metadata,
+                      map_file_block(disk->catalog_extents, disk->metadata.catalog.num_extents, block)),
+                      inodes, per_block * sizeof(Inode)) != 0) {
+            break;
+        }
+        for (unsigned int i = 0; i < per_block && block * per_block + i < disk->metadata.num_inodes; i++) {
+            print_file_entry(disk, &inodes[i], show_hidden);
+        }
+    }
+    free(inodes);
 }
 
 
-int main() {
+// Program przyjmuje jedną opcję: --stats lub --stats=json wypisuje statystyki każdej czynności
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            stats_mode = STATS_TEXT;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            stats_mode = STATS_JSON;
+        } else if (strcmp(argv[i], "--alloc=first") == 0) {
+            alloc_policy = ALLOC_FIRST;
+        } else if (strcmp(argv[i], "--alloc=best") == 0) {
+            alloc_policy = ALLOC_BEST;
+        } else if (strcmp(argv[i], "--alloc=next") == 0) {
+            alloc_policy = ALLOC_NEXT;
+        } else {
+            fprintf(stderr, "Nieznana opcja: %s (--stats, --stats=json, --alloc=first|best|next).\n", argv[i]);
+            return 1;
+        }
+    }
+
     unsigned int disk_size_mb;
     int choice;
     bool show_hidden = false;
     char disk_filename[64] = "vd.bin";
-    char filename[64];
+    char filename[HOST_PATH_LEN];
+    int create_mode;
+    unsigned int block_size;
+    int dedup_choice;
 
     printf("Podaj rozmiar dysku w MB: ");
     scanf("%u", &disk_size_mb);
-    initialize_disk(disk_filename, disk_size_mb);
+    printf("Tryb tworzenia dysku (0 = rzadki, 1 = prealokowany, 2 = wypełniony zerami): ");
+    scanf("%d", &create_mode);
+    if (create_mode < CREATE_SPARSE || create_mode > CREATE_ZERO) {
+        create_mode = CREATE_SPARSE;
+    }
+    printf("Rozmiar bloku w bajtach (0 = domyślny %d): ", DEFAULT_BLOCK_SIZE);
+    scanf("%u", &block_size);
+    if (block_size == 0) {
+        block_size = DEFAULT_BLOCK_SIZE;
+    }
+    printf("Deduplikacja bloków (1 = tak, 0 = nie): ");
+    scanf("%d", &dedup_choice);
+    initialize_disk(disk_filename, disk_size_mb, create_mode, block_size, dedup_choice == 1);
+
+    // Dysk pozostaje otwarty przez całą sesję
+    Disk disk;
+    restart_stats_clock();
+    if (open_disk(disk_filename, "r+b", &disk) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    report_stats("open");
 
     while (1) {
         printf("\nWybierz czynność:\n");
@@ -405,28 +5056,51 @@ int main() {
         printf("2. Skopiuj plik z dysku\n");
         printf("3. Wyświetl bitmapę bloków\n");
         printf("4. Wylistuj pliki na dysku\n");
+        printf("5. Skopiuj katalog na dysk\n");
+        printf("6. Skopiuj plik na dysk z kompresją\n");
+        printf("7. Sprawdź sumy kontrolne bloków\n");
+        printf("8. Defragmentuj dysk\n");
+        printf("9. Utwórz katalog na dysku\n");
+        printf("10. Wylistuj wybrany katalog na dysku\n");
+        printf("11. Wypisz fragment pliku z dysku\n");
         printf("0. Zakończ program\n");
         printf("Twój wybór: ");
         scanf("%d", &choice);
 
         switch (choice) {
             case 1:
+            case 6:
                 printf("Podaj nazwę pliku do skopiowania na dysk: ");
-                scanf("%s", filename);
-                copy_file_to_disk(disk_filename, filename);
+                scanf("%511s", filename);
+                // Każdy import jest od razu zatwierdzany w dzienniku, bo sesja może zostać przerwana
+                restart_stats_clock();
+                if (import_file(&disk, filename, choice == 6) == 0) {
+                    sync_disk(&disk);
+                }
+                report_stats(choice == 6 ? "compress" : "import");
                 break;
 
             case 2:
                 printf("Podaj nazwę pliku do skopiowania z dysku: ");
-                scanf("%s", filename);
-                copy_file_from_disk(disk_filename, filename);
+                scanf("%511s", filename);
+                restart_stats_clock();
+                export_file(&disk, filename);
+                report_stats("export");
                 break;
 
             case 3:
-                display_block_bitmap(disk_filename);
+                printf("Format mapy zajętości (0 = tekst, 1 = JSON): ");
+                int json_choice;
+                scanf("%d", &json_choice);
+                restart_stats_clock();
+                display_block_bitmap(&disk, json_choice == 1);
+                report_stats("bitmap");
                 break;
 
             case 0:
+                restart_stats_clock();
+                close_disk(&disk);
+                report_stats("close");
                 printf("Zakończono program.\n");
                 exit(0);
 
@@ -435,7 +5109,63 @@ int main() {
                 unsigned int hidden_choice;
                 scanf("%u", &hidden_choice);
                 show_hidden = (hidden_choice == 1);
-                list_files_on_disk(disk_filename, show_hidden);
+                restart_stats_clock();
+                list_files_on_disk(&disk, "", show_hidden);
+                report_stats("list");
+                break;
+
+            case 5:
+                printf("Podaj katalog do skopiowania na dysk: ");
+                char directory[HOST_PATH_LEN];
+                scanf("%511s", directory);
+                restart_stats_clock();
+                bulk_import(&disk, directory);
+                report_stats("importdir");
+                break;
+
+            case 7:
+                restart_stats_clock();
+                scrub_disk(&disk);
+                report_stats("scrub");
+                break;
+
+            case 8:
+                printf("Limit czasu w sekundach (0 = bez limitu): ");
+                double max_seconds;
+                scanf("%lf", &max_seconds);
+                printf("Limit kopiowanych danych w MB (0 = bez limitu): ");
+                unsigned long max_megabytes;
+                scanf("%lu", &max_megabytes);
+                restart_stats_clock();
+                defrag_disk(&disk, max_seconds, (disk_offset)max_megabytes * 1024 * 1024);
+                report_stats("defrag");
+                break;
+
+            case 9:
+                printf("Podaj nazwę katalogu do utworzenia: ");
+                scanf("%511s", filename);
+                restart_stats_clock();
+                if (make_directory(&disk, filename) == 0) {
+                    sync_disk(&disk);
+                }
+                report_stats("mkdir");
+                break;
+
+            case 10:
+                printf("Podaj katalog do wylistowania: ");
+                scanf("%511s", filename);
+                restart_stats_clock();
+                list_files_on_disk(&disk, filename, show_hidden);
+                report_stats("list");
+                break;
+
+            case 11:
+                printf("Podaj nazwę pliku, przesunięcie i długość fragmentu: ");
+                disk_offset offset, length;
+                scanf("%511s %llu %llu", filename, &offset, &length);
+                restart_stats_clock();
+                read_range(&disk, filename, offset, length, STDOUT_FILENO);
+                report_stats("read");
                 break;
 
             default:
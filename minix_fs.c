@@ -1,16 +1,218 @@
+/* Makes off_t, and with it fseeko and pread, 64 bits on 32-bit systems. */
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+
+#if defined(_POSIX_ADVISORY_INFO) && _POSIX_ADVISORY_INFO > 0
+#define HAVE_POSIX_FALLOCATE 1
+#endif
+
+#if defined(_POSIX_MAPPED_FILES) && _POSIX_MAPPED_FILES > 0 && !defined(FS_NO_MMAP)
+#include <sys/mman.h>
+#define HAVE_MMAP 1
+#endif
+
+#if defined(_POSIX_FSYNC) && _POSIX_FSYNC > 0
+#define HAVE_FSYNC 1
+#endif
+
+#if defined(_POSIX_THREADS) && _POSIX_THREADS > 0 && !defined(FS_NO_THREADS)
+#include <pthread.h>
+#define HAVE_PTHREAD 1
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_SCAN 1
+#define HAVE_SSE42_CRC 1
+#endif
 
 typedef unsigned char bool;
 #define true 1
 #define false 0
 
-#define BLOCK_SIZE 1024
+/* Byte offsets in the image and file sizes, which pass 4 GB; long has only 32 bits on Minix. */
+typedef unsigned long long disk_offset;
+
+#define DEFAULT_BLOCK_SIZE 1024
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 32768
 #define MAX_FILES 128
 #define MAX_FILENAME_LEN 64
+#define MAX_EXTENTS 8
+#define INLINE_DATA_SIZE (MAX_EXTENTS * sizeof(Extent))
+#ifndef IO_BUFFER_SIZE
+#define IO_BUFFER_SIZE (256 * 1024)
+#endif
+#ifndef EXPORT_BUFFER_SIZE
+#define EXPORT_BUFFER_SIZE (1024 * 1024)
+#endif
+#define EXPORT_VECTORS 64
+#define CATALOG_INITIAL_BLOCKS 4
+#define NO_BLOCK ((unsigned int)-1)
+#define NO_INODE ((unsigned int)-1)
+#define BULK_MAX_THREADS 16
+#define HOST_PATH_LEN 512
+#define LZ_CHUNK (64 * 1024)
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_STORED 0x80000000U
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+#define CRC32C_POLY 0x82f63b78U
+#define SUMS_PER_PASS 256
+#define PATH_CACHE_SIZE 256
+#define ROOT_DIRECTORY 0
+
+#define CREATE_SPARSE 0
+#define CREATE_PREALLOCATE 1
+#define CREATE_ZERO 2
+
+#define COMPRESS_NONE 0
+#define COMPRESS_LZ 1
+
+#define TYPE_HIDDEN 1
+#define TYPE_DIRECTORY 2
+
+#define STATS_OFF 0
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+#define ALLOC_FIRST 0
+#define ALLOC_BEST 1
+#define ALLOC_NEXT 2
+
+#define BY_ADDRESS 0
+#define BY_LENGTH 1
+
+#define PHASE_LOAD 0
+#define PHASE_ALLOC 1
+#define PHASE_COPY 2
+#define PHASE_FLUSH 3
+#define NUM_PHASES 4
+
+#define FS_MAGIC 0x56465331
+#define FS_VERSION 11
+#define FS_OLDEST_VERSION 4
+#define INLINE_VERSION 6
+#define DEDUP_VERSION 7
+#define COMPRESS_VERSION 8
+#define CHECKSUM_VERSION 9
+#define LARGE_FILE_VERSION 10
+#define DIRECTORY_VERSION 11
+
+/* Block numbers are 32-bit; the values above MAX_BLOCKS are left for NO_BLOCK and for
+   the journal units of the area before the first data block. */
+#define MAX_BLOCKS 0xffe00000U
+
+#define JOURNAL_MAGIC 0x4a524e4c
+#define JOURNAL_MIN_BLOCKS 16
+#define JOURNAL_MAX_BLOCKS 1024
+
+typedef unsigned long bitmap_word;
+#define BITS_PER_WORD (sizeof(bitmap_word) * 8)
+#define BITMAP_BYTES(bits) ((((disk_offset)(bits) + 63) / 64) * 8)
+#define ALL_SET ((bitmap_word)~0UL)
+
+typedef struct {
+    unsigned int start;
+    unsigned int length;
+} Extent;
+
+/* A free inode has an empty name and keeps the next free inode number in first_block.
+   A file of at most INLINE_DATA_SIZE bytes has no extents and keeps its data in their place.
+   A compressed file keeps its original size in file_size; its blocks hold LZ frames.
+   From version 10 size_high holds bits 32 to 47 of the size, in what used to be padding.
+   From version 11 file_name is one component of a path and a TYPE_DIRECTORY inode keeps
+   its entries in its blocks, in a table like the name index, and their number in first_block. */
+typedef struct {
+    char file_name[MAX_FILENAME_LEN];
+    unsigned int file_size;
+    unsigned int first_block;
+    unsigned char file_type;
+    unsigned char compression;
+    unsigned short size_high;
+    unsigned int num_extents;
+    unsigned int extent_block;
+    Extent extents[MAX_EXTENTS];
+} Inode;
+
+/* Slot of the name index (value is an inode number) or of the block index (value is a
+   block number plus one); inode 0 is reserved, so value == 0 marks an empty slot. */
+typedef struct {
+    unsigned int hash;
+    unsigned int value;
+} IndexEntry;
+
+/* Content hash and number of file references of one data block on a deduplicating disk. */
+typedef struct {
+    unsigned int hash;
+    unsigned int refs;
+} BlockRef;
+
+/* Unit of bitmap write-back: one chunk of the on-disk bitmap. */
+#define BITMAP_CHUNK_BYTES 1024
+#define BITMAP_CHUNK_BITS (BITMAP_CHUNK_BYTES * 8)
 
+/* The catalog and the name index are stored in data blocks like regular files.
+   From version 11 the name index is the root directory and num_files its entry count.
+   The journal is a fixed run of data blocks allocated when the disk is created.
+   block_size is chosen at creation; version 4 images always use 1024 bytes.
+   A deduplicating disk (version 7) also has a block index from content hash to block
+   and a reference table with one BlockRef per block; older versions end before them.
+   From version 9 block_sums holds the CRC32C of every data block, in one run of blocks;
+   reserved pads the metadata of versions 7 and 8 to its old size, and padding keeps the
+   size at 800 bytes where a 64-bit field needs only 4-byte alignment. */
+typedef struct {
+    unsigned int disk_size;
+    unsigned short block_size;
+    unsigned short version;
+    unsigned int num_blocks;
+    unsigned int free_blocks;
+    disk_offset first_data_block;
+    unsigned int num_files;
+    unsigned int magic;
+    unsigned int num_inodes;
+    unsigned int free_inode;
+    Inode catalog;
+    Inode name_index;
+    unsigned int journal_start;
+    unsigned int journal_blocks;
+    Inode block_index;
+    Inode block_refs;
+    unsigned int indexed_blocks;
+    unsigned int reserved;
+    Inode block_sums;
+    unsigned int padding;
+} DiskMetadata;
+
+/* First block of the journal; the unit numbers follow it and the unit images start
+   at the first block after them. checksum covers all of it with the field zeroed. */
+typedef struct {
+    unsigned int magic;
+    unsigned int sequence;
+    unsigned int num_pages;
+    unsigned int checksum;
+} JournalHeader;
+
+/* Metadata changed since the last commit. The image is split into units: block sized
+   pieces of the area before the first data block, then one unit per data block. */
+typedef struct {
+    unsigned int unit;
+    unsigned char *data;
+} JournalPage;
+
+/* Layout used before extents: every data block ends with a pointer to the next one.
+   Its fields keep the native sizes of the machine that wrote it. */
 typedef struct {
     unsigned int disk_size;
     unsigned short block_size;
@@ -18,508 +220,5367 @@ typedef struct {
     unsigned long first_data_block;
     unsigned short num_files;
     unsigned short max_files;
-} DiskMetadata;
+} LegacyDiskMetadata;
 
 typedef struct {
     char file_name[MAX_FILENAME_LEN];
     unsigned int file_size;
     unsigned int first_block;
     unsigned char file_type;
-} Inode;
+} LegacyInode;
+
+/* A run of free blocks in the free-space index. Every node is in two treaps: one ordered
+   by address, whose nodes also keep the longest run below them, and one ordered by length
+   and then address. Links are node numbers, [BY_ADDRESS] and [BY_LENGTH]; node 0 is the
+   empty tree. */
+typedef struct {
+    unsigned int start;
+    unsigned int length;
+    unsigned int longest;
+    unsigned int priority;
+    unsigned int left[2];
+    unsigned int right[2];
+} SpaceNode;
+
+/* The free runs of the block bitmap, kept in step with it by set_blocks. When a node
+   cannot be allocated the index is marked stale and rebuilt from the bitmap before the
+   next allocation. */
+typedef struct {
+    SpaceNode *nodes;
+    unsigned int capacity;
+    unsigned int used;
+    unsigned int unused;
+    unsigned int root[2];
+    unsigned int count;
+    unsigned int seed;
+    unsigned int cursor;
+    bool stale;
+} SpaceIndex;
+
+/* A directory reached while resolving a path: name in directory parent is inode number.
+   number 0 marks an empty slot, as inode 0 is never a directory. */
+typedef struct {
+    unsigned int parent;
+    unsigned int number;
+    char name[MAX_FILENAME_LEN];
+} PathCacheEntry;
+
+/* An open image; the metadata and the block bitmap are written back by sync_disk.
+   When map is set the whole image is mapped and all access goes through memory.
+   Metadata writes collect in pages until sync_disk commits them through the journal;
+   blocks freed meanwhile are kept in deferred so that no new data overwrites them.
+   path_cache remembers the directories of recently resolved paths, by parent and name. */
+typedef struct {
+    FILE *file;
+    unsigned char *map;
+    unsigned long map_size;
+    bool writable;
+    DiskMetadata metadata;
+    bitmap_word *block_bitmap;
+    bool *bitmap_dirty;
+    SpaceIndex space;
+    bool dirty;
+    Extent *catalog_extents;
+    Extent *index_extents;
+    Extent *block_index_extents;
+    Extent *ref_extents;
+    Inode *legacy_catalog;
+    unsigned int block_size;
+    unsigned int block_shift;
+    unsigned int extents_per_block;
+    unsigned int inodes_per_block;
+    unsigned int index_entries_per_block;
+    JournalPage *pages;
+    unsigned char *page_data;
+    unsigned int num_pages;
+    unsigned int page_capacity;
+    unsigned int *page_slots;
+    unsigned int slot_mask;
+    unsigned int journal_sequence;
+    bool journal_dirty;
+    Extent *deferred;
+    unsigned int num_deferred;
+    unsigned int deferred_capacity;
+    PathCacheEntry *path_cache;
+    unsigned int bad_sums;
+} Disk;
+
+/* A directory opened for lookups and changes. table, extents and entries point at the name
+   index, its extents and num_files for the root, and at the fields of inode otherwise. */
+typedef struct {
+    unsigned int number;
+    Inode inode;
+    Extent *inode_extents;
+    Inode *table;
+    Extent **extents;
+    unsigned int *entries;
+} Directory;
+
+/* One host file of a bulk import, named by its path below the imported directory.
+   status is 0 while the file is on track, 1 when it was skipped and -1 when copying failed.
+   parent is the directory the file goes to and leaf its name there. */
+typedef struct {
+    char path[HOST_PATH_LEN];
+    char name[HOST_PATH_LEN];
+    char leaf[MAX_FILENAME_LEN];
+    unsigned int parent;
+    disk_offset file_size;
+    Extent *extents;
+    unsigned int num_extents;
+    unsigned int *sums;
+    Inode inode;
+    int status;
+} BulkFile;
+
+/* Work shared by the bulk import threads; next is the first file nobody has taken yet. */
+typedef struct {
+    Disk *disk;
+    BulkFile *files;
+    unsigned int num_files;
+    unsigned int capacity;
+    unsigned int next;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+} BulkImport;
+
+/* Data to import. A compressing source reads LZ_CHUNK bytes at a time from file and hands
+   out frames: an unsigned int with the packed length (LZ_STORED set when the chunk did not
+   shrink), then the packed bytes. raw_bytes counts what was read from file. */
+typedef struct {
+    FILE *file;
+    unsigned char *raw;
+    unsigned char *packed;
+    unsigned long packed_length;
+    unsigned long packed_offset;
+    disk_offset raw_bytes;
+} Source;
+
+/* Blocks of one file checked by a scrub thread; file indexes the names of the scrub. */
+typedef struct {
+    unsigned int start;
+    unsigned int length;
+    unsigned int file;
+} ScrubRun;
+
+/* Work shared by the scrub threads; sums is the whole checksum table. */
+typedef struct {
+    Disk *disk;
+    ScrubRun *runs;
+    unsigned int num_runs;
+    unsigned int capacity;
+    char *names;
+    unsigned int num_files;
+    unsigned int *sums;
+    unsigned int next;
+    unsigned long checked;
+    unsigned int damaged;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+} Scrub;
+
+/* Image I/O of one operation, printed by --stats. A seek is an access that does not start
+   where the previous access of the same thread ended, mapped or not. Time outside
+   allocation, data copying and flushing counts as metadata load. */
+typedef struct {
+    unsigned long seeks;
+    unsigned long reads;
+    unsigned long writes;
+    disk_offset bytes_read;
+    disk_offset bytes_written;
+    unsigned long blocks_allocated;
+    unsigned long blocks_freed;
+    disk_offset position;
+    double seconds[NUM_PHASES];
+} Stats;
+
+/* A file that defrag may move: its inode number, its first block, its size in blocks
+   and the number of physically separate runs its blocks form. */
+typedef struct {
+    unsigned int number;
+    unsigned int start;
+    unsigned int blocks;
+    unsigned int fragments;
+} DefragFile;
+
+/* Progress of one defrag run; max_seconds and max_bytes of 0 mean no limit. */
+typedef struct {
+    Disk *disk;
+    unsigned char *buffer;
+    struct timeval start;
+    double max_seconds;
+    disk_offset max_bytes;
+    disk_offset moved;
+    unsigned int relocated;
+    unsigned int skipped;
+    unsigned int failed;
+} Defrag;
+
+/* A run of data blocks with a fixed role, shown as one area of the occupancy map. */
+typedef struct {
+    unsigned int start;
+    unsigned int length;
+    const char *type;
+} MapArea;
+
+/* A file opened for reads at any offset. starts[i] is the first file block of extent i and
+   starts[num_extents] the block count, so the extent of a block is found by binary search.
+   blocks holds num_loaded stored blocks from file block loaded on. A compressed file also
+   has frames[k], the stored offset of the frame that unpacks to the bytes from
+   k * LZ_CHUNK on, and keeps the last frame it unpacked, cached, in raw. */
+typedef struct {
+    Inode inode;
+    disk_offset size;
+    Extent *extents;
+    unsigned int *starts;
+    disk_offset *frames;
+    unsigned long num_frames;
+    unsigned long cached;
+    unsigned int loaded;
+    unsigned int num_loaded;
+    unsigned char *blocks;
+    unsigned char *packed;
+    unsigned char *raw;
+} OpenFile;
 
-unsigned int count_blocks(unsigned int disk_size_bytes) {
-    unsigned int bitmap_size_bytes;
-    unsigned int inode_bitmap_size_bytes = MAX_FILES * sizeof(bool);
-    unsigned long reserved_space;
-    unsigned int num_blocks = (disk_size_bytes - sizeof(DiskMetadata) - inode_bitmap_size_bytes - (MAX_FILES * sizeof(Inode))) / BLOCK_SIZE;
-    unsigned int prev_num_blocks = 0;
+disk_offset count_blocks(disk_offset disk_size_bytes, unsigned int block_size) {
+    disk_offset bitmap_size_bytes;
+    disk_offset reserved_space;
+    disk_offset num_blocks = (disk_size_bytes - sizeof(DiskMetadata)) / block_size;
+    disk_offset prev_num_blocks = 0;
 
     while (num_blocks != prev_num_blocks) {
         prev_num_blocks = num_blocks;
-        bitmap_size_bytes = num_blocks * sizeof(bool);
-        reserved_space = sizeof(DiskMetadata) + bitmap_size_bytes + inode_bitmap_size_bytes + (MAX_FILES * sizeof(Inode));
+        bitmap_size_bytes = BITMAP_BYTES(num_blocks);
+        reserved_space = sizeof(DiskMetadata) + bitmap_size_bytes;
+
+        num_blocks = (disk_size_bytes - reserved_space) / block_size;
+    }
+    return num_blocks;
+}
+
+bool is_legacy_image(const DiskMetadata *metadata) {
+    return metadata->magic != FS_MAGIC;
+}
+
+unsigned long metadata_size(const DiskMetadata *metadata) {
+    if (is_legacy_image(metadata)) {
+        return sizeof(LegacyDiskMetadata);
+    }
+    if (metadata->version < DEDUP_VERSION) {
+        return offsetof(DiskMetadata, block_index);
+    }
+    return metadata->version < CHECKSUM_VERSION ? offsetof(DiskMetadata, block_sums) : sizeof(DiskMetadata);
+}
+
+unsigned long block_bitmap_offset(const DiskMetadata *metadata) {
+    return metadata_size(metadata);
+}
+
+disk_offset data_block_offset(const DiskMetadata *metadata, unsigned int block) {
+    return metadata->first_data_block + (disk_offset)block * metadata->block_size;
+}
+
+bool valid_block_size(unsigned int block_size) {
+    return block_size >= MIN_BLOCK_SIZE && block_size <= MAX_BLOCK_SIZE && block_size % MIN_BLOCK_SIZE == 0;
+}
+
+/* Derives the per-disk block geometry from the metadata. block_shift is left at 0 for
+   sizes that are not a power of two, which then take the division paths below. */
+void set_block_geometry(Disk *disk) {
+    unsigned int shift = 0;
+
+    disk->block_size = disk->metadata.block_size;
+    if ((disk->block_size & (disk->block_size - 1)) == 0) {
+        while ((1u << shift) < disk->block_size) {
+            shift++;
+        }
+    }
+    disk->block_shift = shift;
+    disk->extents_per_block = (disk->block_size - sizeof(unsigned int)) / sizeof(Extent);
+    disk->inodes_per_block = disk->block_size / sizeof(Inode);
+    disk->index_entries_per_block = disk->block_size / sizeof(IndexEntry);
+}
+
+/* Inline data needs version 6; older tools would take such a file for an empty one. */
+bool stores_inline(const Disk *disk, disk_offset file_size) {
+    return !is_legacy_image(&disk->metadata) && disk->metadata.version >= INLINE_VERSION &&
+           file_size > 0 && file_size <= INLINE_DATA_SIZE;
+}
+
+bool is_inline(const Disk *disk, const Inode *inode) {
+    return !is_legacy_image(&disk->metadata) && inode->num_extents == 0 && inode->file_size > 0;
+}
+
+/* Before version 8 the byte of compression was padding and may hold anything. */
+bool is_compressed(const Disk *disk, const Inode *inode) {
+    return !is_legacy_image(&disk->metadata) && disk->metadata.version >= COMPRESS_VERSION &&
+           inode->compression == COMPRESS_LZ;
+}
+
+/* Before version 10 size_high was padding too, so sizes end at 32 bits there. */
+bool has_large_files(const DiskMetadata *metadata) {
+    return !is_legacy_image(metadata) && metadata->version >= LARGE_FILE_VERSION;
+}
+
+bool has_directories(const DiskMetadata *metadata) {
+    return !is_legacy_image(metadata) && metadata->version >= DIRECTORY_VERSION;
+}
+
+disk_offset inode_size(const DiskMetadata *metadata, const Inode *inode) {
+    disk_offset size = inode->file_size;
+
+    if (has_large_files(metadata)) {
+        size |= (disk_offset)inode->size_high << 32;
+    }
+    return size;
+}
+
+void set_inode_size(const DiskMetadata *metadata, Inode *inode, disk_offset size) {
+    inode->file_size = (unsigned int)size;
+    if (has_large_files(metadata)) {
+        inode->size_high = (unsigned short)(size >> 32);
+    }
+}
+
+disk_offset max_file_size(const DiskMetadata *metadata) {
+    if (!has_large_files(metadata)) {
+        return UINT_MAX;
+    }
+    return (disk_offset)USHRT_MAX << 32 | UINT_MAX;
+}
+
+/* Whole blocks in bytes. */
+unsigned long bytes_to_blocks(const Disk *disk, disk_offset bytes) {
+    return disk->block_shift ? bytes >> disk->block_shift : bytes / disk->block_size;
+}
+
+/* Blocks needed to hold bytes. */
+unsigned long blocks_for_bytes(const Disk *disk, disk_offset bytes) {
+    return bytes_to_blocks(disk, bytes + disk->block_size - 1);
+}
+
+disk_offset blocks_to_bytes(const Disk *disk, unsigned long blocks) {
+    return disk->block_shift ? (disk_offset)blocks << disk->block_shift : (disk_offset)blocks * disk->block_size;
+}
+
+/* Size of a buffer of about size bytes that holds whole blocks. */
+unsigned long buffer_size(const Disk *disk, unsigned long size) {
+    return size < disk->block_size ? disk->block_size : size - size % disk->block_size;
+}
+
+int map_disk(Disk *disk) {
+#ifdef HAVE_MMAP
+    struct stat st;
+    void *map;
+
+    /* An image larger than the address space is read with stdio instead. */
+    if (fstat(fileno(disk->file), &st) != 0 || st.st_size == 0 || (off_t)(size_t)st.st_size != st.st_size) {
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, disk->writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fileno(disk->file), 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    disk->map = (unsigned char *)map;
+    disk->map_size = st.st_size;
+    return 0;
+#else
+    (void)disk;
+    return -1;
+#endif
+}
+
+void unmap_disk(Disk *disk) {
+#ifdef HAVE_MMAP
+    if (disk->map) {
+        munmap(disk->map, disk->map_size);
+    }
+#endif
+    disk->map = NULL;
+}
+
+/* Pointer to length bytes of the image, or NULL when it is not mapped. */
+void *disk_ptr(Disk *disk, disk_offset offset, unsigned long length) {
+    if (!disk->map || offset > disk->map_size || length > disk->map_size - offset) {
+        return NULL;
+    }
+    return disk->map + offset;
+}
+
+Stats io_stats;
+int stats_mode = STATS_OFF;
+int stats_phase = PHASE_LOAD;
+struct timeval stats_mark;
+int alloc_policy = ALLOC_FIRST;
+
+void count_io(Stats *stats, bool write, disk_offset offset, unsigned long length) {
+    if (offset != stats->position) {
+        stats->seeks++;
+    }
+    stats->position = offset + length;
+    if (write) {
+        stats->writes++;
+        stats->bytes_written += length;
+    } else {
+        stats->reads++;
+        stats->bytes_read += length;
+    }
+}
+
+/* Adds the counters of a worker thread; the caller holds the lock of the work. */
+void merge_stats(const Stats *worker) {
+    io_stats.seeks += worker->seeks;
+    io_stats.reads += worker->reads;
+    io_stats.writes += worker->writes;
+    io_stats.bytes_read += worker->bytes_read;
+    io_stats.bytes_written += worker->bytes_written;
+}
+
+/* Charges the time since the last switch to the current phase and starts phase;
+   returns the phase that was running, so that callers can restore it. */
+int enter_phase(int phase) {
+    struct timeval now;
+    int previous = stats_phase;
+
+    if (stats_mode == STATS_OFF) {
+        return previous;
+    }
+    gettimeofday(&now, NULL);
+    io_stats.seconds[stats_phase] += (now.tv_sec - stats_mark.tv_sec) + (now.tv_usec - stats_mark.tv_usec) / 1e6;
+    stats_mark = now;
+    stats_phase = phase;
+    return previous;
+}
+
+/* Prints the counters gathered since the last report to stderr and starts over. */
+void report_stats(const char *operation) {
+    int phase = stats_phase;
+
+    if (stats_mode == STATS_OFF) {
+        return;
+    }
+    enter_phase(phase);
+    if (stats_mode == STATS_JSON) {
+        fprintf(stderr, "{\"operation\": \"%s\", \"seeks\": %lu, \"reads\": %lu, \"writes\": %lu, "
+                "\"bytes_read\": %llu, \"bytes_written\": %llu, \"blocks_allocated\": %lu, \"blocks_freed\": %lu, "
+                "\"seconds\": {\"load\": %.6f, \"allocation\": %.6f, \"copy\": %.6f, \"flush\": %.6f}}\n",
+                operation, io_stats.seeks, io_stats.reads, io_stats.writes, io_stats.bytes_read, io_stats.bytes_written,
+                io_stats.blocks_allocated, io_stats.blocks_freed, io_stats.seconds[PHASE_LOAD], io_stats.seconds[PHASE_ALLOC],
+                io_stats.seconds[PHASE_COPY], io_stats.seconds[PHASE_FLUSH]);
+    } else {
+        fprintf(stderr, "Statistics of %s:\n", operation);
+        fprintf(stderr, "  seeks             %lu\n", io_stats.seeks);
+        fprintf(stderr, "  reads             %lu (%llu bytes)\n", io_stats.reads, io_stats.bytes_read);
+        fprintf(stderr, "  writes            %lu (%llu bytes)\n", io_stats.writes, io_stats.bytes_written);
+        fprintf(stderr, "  blocks allocated  %lu\n", io_stats.blocks_allocated);
+        fprintf(stderr, "  blocks freed      %lu\n", io_stats.blocks_freed);
+        fprintf(stderr, "  time              load %.6f s, allocation %.6f s, copy %.6f s, flush %.6f s\n",
+                io_stats.seconds[PHASE_LOAD], io_stats.seconds[PHASE_ALLOC], io_stats.seconds[PHASE_COPY],
+                io_stats.seconds[PHASE_FLUSH]);
+    }
+    memset(&io_stats, 0, sizeof(Stats));
+}
+
+int image_read(Disk *disk, disk_offset offset, void *buffer, unsigned long length) {
+    count_io(&io_stats, false, offset, length);
+    if (disk->map) {
+        if (!disk_ptr(disk, offset, length)) {
+            return -1;
+        }
+        memcpy(buffer, disk->map + offset, length);
+        return 0;
+    }
+    if (fseeko(disk->file, (off_t)offset, SEEK_SET) != 0) {
+        return -1;
+    }
+    return fread(buffer, 1, length, disk->file) == length ? 0 : -1;
+}
+
+int image_write(Disk *disk, disk_offset offset, const void *buffer, unsigned long length) {
+    count_io(&io_stats, true, offset, length);
+    if (disk->map) {
+        if (!disk->writable || !disk_ptr(disk, offset, length)) {
+            return -1;
+        }
+        memcpy(disk->map + offset, buffer, length);
+        return 0;
+    }
+    if (fseeko(disk->file, (off_t)offset, SEEK_SET) != 0) {
+        return -1;
+    }
+    return fwrite(buffer, 1, length, disk->file) == length ? 0 : -1;
+}
+
+/* Makes everything written so far durable. */
+void flush_disk(Disk *disk) {
+#ifdef HAVE_MMAP
+    if (disk->map) {
+        msync(disk->map, disk->map_size, MS_SYNC);
+    }
+#endif
+    fflush(disk->file);
+#ifdef HAVE_FSYNC
+    fsync(fileno(disk->file));
+#endif
+}
+
+unsigned int header_units(const Disk *disk) {
+    return blocks_for_bytes(disk, disk->metadata.first_data_block);
+}
+
+unsigned int offset_unit(const Disk *disk, disk_offset offset) {
+    if (offset < disk->metadata.first_data_block) {
+        return bytes_to_blocks(disk, offset);
+    }
+    return header_units(disk) + bytes_to_blocks(disk, offset - disk->metadata.first_data_block);
+}
+
+disk_offset unit_offset(const Disk *disk, unsigned int unit) {
+    if (unit < header_units(disk)) {
+        return blocks_to_bytes(disk, unit);
+    }
+    return data_block_offset(&disk->metadata, unit - header_units(disk));
+}
+
+unsigned long unit_length(const Disk *disk, unsigned int unit) {
+    if (unit + 1 == header_units(disk)) {
+        return disk->metadata.first_data_block - blocks_to_bytes(disk, unit);
+    }
+    return disk->block_size;
+}
+
+JournalPage *find_page(Disk *disk, unsigned int unit) {
+    unsigned int slot, index;
+
+    if (disk->num_pages == 0) {
+        return NULL;
+    }
+    for (slot = (unit * 2654435761u) & disk->slot_mask; (index = disk->page_slots[slot]) != 0;
+         slot = (slot + 1) & disk->slot_mask) {
+        if (disk->pages[index - 1].unit == unit) {
+            return &disk->pages[index - 1];
+        }
+    }
+    return NULL;
+}
+
+unsigned int journal_descriptor_blocks(const Disk *disk, unsigned int num_pages) {
+    return blocks_for_bytes(disk, sizeof(JournalHeader) + num_pages * sizeof(unsigned int));
+}
+
+unsigned int journal_checksum(const unsigned char *descriptor, unsigned long length, const JournalPage *pages, unsigned int num_pages,
+                              unsigned int block_size) {
+    unsigned int hash = 2166136261u;
+    unsigned long i;
+    unsigned int page;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ descriptor[i]) * 16777619u;
+    }
+    for (page = 0; page < num_pages; page++) {
+        for (i = 0; i < block_size; i++) {
+            hash = (hash ^ pages[page].data[i]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+/* Group commit: the file data and the previous checkpoint are flushed, the pages go
+   to the journal in one sequential write and one flush, then they are written in place.
+   The in-place writes are flushed by the next commit or by close_disk. */
+int journal_commit(Disk *disk) {
+    JournalHeader *header;
+    unsigned int *units;
+    unsigned char *descriptor;
+    unsigned int blocks, i;
+    disk_offset journal;
+    int result = 0;
+
+    if (disk->num_pages == 0) {
+        return 0;
+    }
+    blocks = journal_descriptor_blocks(disk, disk->num_pages);
+    descriptor = (unsigned char *)calloc(blocks, disk->block_size);
+    if (!descriptor) {
+        return -1;
+    }
+    header = (JournalHeader *)descriptor;
+    units = (unsigned int *)(descriptor + sizeof(JournalHeader));
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = disk->journal_sequence++;
+    header->num_pages = disk->num_pages;
+    for (i = 0; i < disk->num_pages; i++) {
+        units[i] = disk->pages[i].unit;
+    }
+    header->checksum = journal_checksum(descriptor, blocks_to_bytes(disk, blocks), disk->pages, disk->num_pages, disk->block_size);
+
+    journal = data_block_offset(&disk->metadata, disk->metadata.journal_start);
+    flush_disk(disk);
+    for (i = 0; i < disk->num_pages; i++) {
+        result |= image_write(disk, journal + blocks_to_bytes(disk, blocks + i), disk->pages[i].data, disk->block_size);
+    }
+    result |= image_write(disk, journal, descriptor, blocks_to_bytes(disk, blocks));
+    flush_disk(disk);
+
+    for (i = 0; i < disk->num_pages; i++) {
+        result |= image_write(disk, unit_offset(disk, disk->pages[i].unit), disk->pages[i].data,
+                              unit_length(disk, disk->pages[i].unit));
+    }
+    disk->num_pages = 0;
+    memset(disk->page_slots, 0, (disk->slot_mask + 1) * sizeof(unsigned int));
+    disk->journal_dirty = true;
+    free(descriptor);
+    return result;
+}
+
+/* Marks the journal empty once the last checkpoint is durable, so the next open has nothing to replay. */
+void journal_clear(Disk *disk) {
+    JournalHeader header;
+
+    if (!disk->journal_dirty) {
+        return;
+    }
+    flush_disk(disk);
+    memset(&header, 0, sizeof(JournalHeader));
+    image_write(disk, data_block_offset(&disk->metadata, disk->metadata.journal_start), &header, sizeof(JournalHeader));
+    disk->journal_dirty = false;
+}
+
+/* A single operation larger than the journal is committed in parts. */
+JournalPage *add_page(Disk *disk, unsigned int unit) {
+    JournalPage *page;
+    unsigned int slot;
+
+    if (disk->num_pages == disk->page_capacity && journal_commit(disk) != 0) {
+        return NULL;
+    }
+    page = &disk->pages[disk->num_pages++];
+    page->unit = unit;
+    for (slot = (unit * 2654435761u) & disk->slot_mask; disk->page_slots[slot] != 0; slot = (slot + 1) & disk->slot_mask) {
+    }
+    disk->page_slots[slot] = disk->num_pages;
+    return page;
+}
+
+/* Reads through the uncommitted pages; runs of units without one are read in a single call. */
+int disk_read(Disk *disk, disk_offset offset, void *buffer, unsigned long length) {
+    unsigned char *target = (unsigned char *)buffer;
+    unsigned long run = 0;
+    disk_offset start;
+    unsigned long piece;
+    unsigned int unit;
+    JournalPage *page;
+
+    if (disk->num_pages == 0) {
+        return image_read(disk, offset, buffer, length);
+    }
+    while (length > 0) {
+        unit = offset_unit(disk, offset);
+        start = unit_offset(disk, unit);
+        piece = start + unit_length(disk, unit) - offset;
+        if (piece > length) {
+            piece = length;
+        }
+        page = find_page(disk, unit);
+        if (page) {
+            if (run > 0 && image_read(disk, offset - run, target - run, run) != 0) {
+                return -1;
+            }
+            run = 0;
+            memcpy(target, page->data + (offset - start), piece);
+        } else {
+            run += piece;
+        }
+        offset += piece;
+        target += piece;
+        length -= piece;
+    }
+    return run > 0 ? image_read(disk, offset - run, target - run, run) : 0;
+}
+
+/* Metadata writes only change the uncommitted pages; journal_commit puts them on disk. */
+int disk_write(Disk *disk, disk_offset offset, const void *buffer, unsigned long length) {
+    const unsigned char *source = (const unsigned char *)buffer;
+    disk_offset start;
+    unsigned long piece;
+    unsigned int unit;
+    JournalPage *page;
+
+    if (disk->page_capacity == 0) {
+        return image_write(disk, offset, buffer, length);
+    }
+    if (!disk->writable) {
+        return -1;
+    }
+    while (length > 0) {
+        unit = offset_unit(disk, offset);
+        start = unit_offset(disk, unit);
+        piece = start + unit_length(disk, unit) - offset;
+        if (piece > length) {
+            piece = length;
+        }
+        page = find_page(disk, unit);
+        if (!page) {
+            page = add_page(disk, unit);
+            if (!page || image_read(disk, start, page->data, unit_length(disk, unit)) != 0) {
+                return -1;
+            }
+        }
+        memcpy(page->data + (offset - start), source, piece);
+        offset += piece;
+        source += piece;
+        length -= piece;
+    }
+    return 0;
+}
+
+/* Writes blocks allocated since the last commit straight to the image; no committed
+   metadata points at them yet, so they need no journaling. A mapped image is written
+   with pwrite, which stays coherent with the mapping and avoids a page fault per page. */
+int disk_write_new(Disk *disk, disk_offset offset, const void *buffer, unsigned long length) {
+    const unsigned char *source = (const unsigned char *)buffer;
+    disk_offset start;
+    unsigned long piece;
+    unsigned int unit;
+    JournalPage *page;
+
+#ifdef HAVE_MMAP
+    if (disk->map && disk->writable && disk_ptr(disk, offset, length)) {
+        count_io(&io_stats, true, offset, length);
+        if (pwrite(fileno(disk->file), buffer, length, (off_t)offset) != (ssize_t)length) {
+            return -1;
+        }
+    } else if (image_write(disk, offset, buffer, length) != 0) {
+        return -1;
+    }
+#else
+    if (image_write(disk, offset, buffer, length) != 0) {
+        return -1;
+    }
+#endif
+    while (disk->num_pages > 0 && length > 0) {
+        unit = offset_unit(disk, offset);
+        start = unit_offset(disk, unit);
+        piece = start + unit_length(disk, unit) - offset;
+        if (piece > length) {
+            piece = length;
+        }
+        page = find_page(disk, unit);
+        if (page) {
+            memcpy(page->data + (offset - start), source, piece);
+        }
+        offset += piece;
+        source += piece;
+        length -= piece;
+    }
+    return 0;
+}
+
+unsigned int crc32c_table[8][256];
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+unsigned int crc32c_sse42(unsigned int crc, const unsigned char *data, unsigned long length) {
+#ifdef __x86_64__
+    unsigned long long wide = crc;
+    unsigned long long word;
+
+    for (; length >= sizeof(word); data += sizeof(word), length -= sizeof(word)) {
+        memcpy(&word, data, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (unsigned int)wide;
+#endif
+    for (; length > 0; data++, length--) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+
+bool cpu_has_sse42(void) {
+    static int supported = -1;
+
+    if (supported < 0) {
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    }
+    return supported;
+}
+#endif
+
+/* Builds the tables of the sliced CRC32C; called before any thread computes a checksum. */
+void crc32c_init(void) {
+    unsigned int crc, i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xff] ^ (crc32c_table[j - 1][i] >> 8);
+        }
+    }
+#ifdef HAVE_SSE42_CRC
+    cpu_has_sse42();
+#endif
+}
+
+/* Slicing by 8: one table lookup per input byte, eight of them independent per step. */
+unsigned int crc32c_sliced(unsigned int crc, const unsigned char *data, unsigned long length) {
+    for (; length >= 8; data += 8, length -= 8) {
+        crc ^= (unsigned int)data[0] | ((unsigned int)data[1] << 8) | ((unsigned int)data[2] << 16) | ((unsigned int)data[3] << 24);
+        crc = crc32c_table[7][crc & 0xff] ^ crc32c_table[6][(crc >> 8) & 0xff] ^
+              crc32c_table[5][(crc >> 16) & 0xff] ^ crc32c_table[4][crc >> 24] ^
+              crc32c_table[3][data[4]] ^ crc32c_table[2][data[5]] ^ crc32c_table[1][data[6]] ^ crc32c_table[0][data[7]];
+    }
+    for (; length > 0; data++, length--) {
+        crc = crc32c_table[0][(crc ^ *data) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+unsigned int block_sum(const Disk *disk, const unsigned char *data) {
+#ifdef HAVE_SSE42_CRC
+    if (cpu_has_sse42()) {
+        return ~crc32c_sse42(~0U, data, disk->block_size);
+    }
+#endif
+    return ~crc32c_sliced(~0U, data, disk->block_size);
+}
+
+bool checksums_enabled(const Disk *disk) {
+    return !is_legacy_image(&disk->metadata) && inode_size(&disk->metadata, &disk->metadata.block_sums) > 0;
+}
+
+disk_offset sum_offset(const Disk *disk, unsigned int block) {
+    return data_block_offset(&disk->metadata, disk->metadata.block_sums.extents[0].start) + (disk_offset)block * sizeof(unsigned int);
+}
+
+/* The checksums of a file's new blocks are metadata and commit with the bitmap. */
+void write_sums(Disk *disk, unsigned int block, const unsigned int *sums, unsigned int count) {
+    disk_write(disk, sum_offset(disk, block), sums, count * sizeof(unsigned int));
+}
+
+void record_sums(Disk *disk, unsigned int block, const unsigned char *data, unsigned int count) {
+    unsigned int sums[SUMS_PER_PASS];
+    unsigned int piece, i;
+
+    if (!checksums_enabled(disk)) {
+        return;
+    }
+    for (; count > 0; block += piece, count -= piece) {
+        piece = count < SUMS_PER_PASS ? count : SUMS_PER_PASS;
+        for (i = 0; i < piece; i++) {
+            sums[i] = block_sum(disk, data + blocks_to_bytes(disk, i));
+        }
+        write_sums(disk, block, sums, piece);
+        data += blocks_to_bytes(disk, piece);
+    }
+}
+
+/* Checks count blocks read from block onwards against their stored checksums.
+   Mismatches are counted in bad_sums, so callers can tell damage from I/O errors. */
+int verify_sums(Disk *disk, unsigned int block, const unsigned char *data, unsigned int count) {
+    unsigned int sums[SUMS_PER_PASS];
+    unsigned int piece, i;
+
+    if (!checksums_enabled(disk)) {
+        return 0;
+    }
+    for (; count > 0; block += piece, count -= piece) {
+        piece = count < SUMS_PER_PASS ? count : SUMS_PER_PASS;
+        if (disk_read(disk, sum_offset(disk, block), sums, piece * sizeof(unsigned int)) != 0) {
+            return -1;
+        }
+        for (i = 0; i < piece; i++) {
+            if (block_sum(disk, data + blocks_to_bytes(disk, i)) != sums[i]) {
+                fprintf(stderr, "Checksum mismatch in block %u.\n", block + i);
+                disk->bad_sums++;
+                return -1;
+            }
+        }
+        data += blocks_to_bytes(disk, piece);
+    }
+    return 0;
+}
+
+/* Fills the blocks of an extent with the next bytes of source, of which bytes belong
+   to the file; the tail of the last block is zeroed. Fails when source ends early or
+   cannot be read. buffer holds buffer_size(disk, IO_BUFFER_SIZE) bytes. */
+int write_extent_from_file(Disk *disk, const Extent *extent, FILE *source, disk_offset bytes, unsigned char *buffer) {
+    disk_offset offset = data_block_offset(&disk->metadata, extent->start);
+    disk_offset length = blocks_to_bytes(disk, extent->length);
+    unsigned long size = buffer_size(disk, IO_BUFFER_SIZE);
+    unsigned long chunk, wanted;
+    unsigned int block = extent->start;
+    size_t bytes_read;
+
+    while (length > 0) {
+        chunk = length < size ? length : size;
+        wanted = bytes < chunk ? bytes : chunk;
+        bytes_read = fread(buffer, 1, wanted, source);
+        if (bytes_read < wanted) {
+            fprintf(stderr, "Failed to read source file.\n");
+            return -1;
+        }
+        memset(buffer + bytes_read, 0, chunk - bytes_read);
+        if (disk_write_new(disk, offset, buffer, chunk) != 0) {
+            fprintf(stderr, "Failed to write to the disk image.\n");
+            return -1;
+        }
+        bytes -= wanted;
+        record_sums(disk, block, buffer, bytes_to_blocks(disk, chunk));
+        block += bytes_to_blocks(disk, chunk);
+        offset += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+/* Writes all vectors to fd, resuming after short writes. */
+int write_vectors(int fd, struct iovec *vectors, int count) {
+    ssize_t written;
+
+    while (count > 0) {
+        written = writev(fd, vectors, count);
+        if (written < 0) {
+            return -1;
+        }
+        while (count > 0 && (size_t)written >= vectors->iov_len) {
+            written -= vectors->iov_len;
+            vectors++;
+            count--;
+        }
+        if (count > 0) {
+            vectors->iov_base = (char *)vectors->iov_base + written;
+            vectors->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/* Appends a piece of memory, merging it into the last vector when the two are contiguous. */
+void add_vector(struct iovec *vectors, int *count, void *base, unsigned long length) {
+    if (*count > 0 && (char *)vectors[*count - 1].iov_base + vectors[*count - 1].iov_len == (char *)base) {
+        vectors[*count - 1].iov_len += length;
+        return;
+    }
+    vectors[*count].iov_base = base;
+    vectors[*count].iov_len = length;
+    (*count)++;
+}
+
+/* Copies the first bytes of a file to fd. Physically adjacent extents are merged into runs,
+   which are read in whole blocks so that their checksums can be verified.
+   A mapped image hands the runs to writev straight from the map, EXPORT_VECTORS at a time;
+   otherwise each run is read with one call into buffer (buffer_size of EXPORT_BUFFER_SIZE),
+   which is written out whenever it fills up. */
+int export_extents(Disk *disk, const Extent *extents, unsigned int num_extents, disk_offset bytes, int fd, unsigned char *buffer) {
+    struct iovec vectors[EXPORT_VECTORS];
+    int count = 0;
+    unsigned long size = buffer_size(disk, EXPORT_BUFFER_SIZE);
+    unsigned long filled = 0;
+    unsigned long blocks = blocks_for_bytes(disk, bytes);
+    unsigned long excess = blocks_to_bytes(disk, blocks) - bytes;
+    disk_offset offset, length;
+    unsigned long piece;
+    unsigned int start, end, block;
+    unsigned int i = 0;
+    unsigned char *source;
+
+    while (i < num_extents && blocks > 0) {
+        start = extents[i].start;
+        end = start + extents[i].length;
+        for (i++; i < num_extents && extents[i].start == end; i++) {
+            end += extents[i].length;
+        }
+        if (end - start > blocks) {
+            end = start + blocks;
+        }
+        blocks -= end - start;
+        offset = data_block_offset(&disk->metadata, start);
+        length = blocks_to_bytes(disk, end - start);
+
+        if (disk->map) {
+            source = (unsigned char *)disk_ptr(disk, offset, length);
+            count_io(&io_stats, false, offset, length);
+            if (!source || verify_sums(disk, start, source, end - start) != 0) {
+                return -1;
+            }
+            if (count == EXPORT_VECTORS) {
+                if (write_vectors(fd, vectors, count) != 0) {
+                    return -1;
+                }
+                count = 0;
+            }
+            add_vector(vectors, &count, source, blocks == 0 ? length - excess : length);
+            continue;
+        }
+
+        for (block = start; length > 0; block += bytes_to_blocks(disk, piece)) {
+            piece = size - filled;
+            if (piece > length) {
+                piece = length;
+            }
+            if (disk_read(disk, offset, buffer + filled, piece) != 0 ||
+                verify_sums(disk, block, buffer + filled, bytes_to_blocks(disk, piece)) != 0) {
+                return -1;
+            }
+            filled += piece;
+            offset += piece;
+            length -= piece;
+            if (filled == size) {
+                add_vector(vectors, &count, buffer, blocks == 0 && length == 0 ? filled - excess : filled);
+                if (write_vectors(fd, vectors, count) != 0) {
+                    return -1;
+                }
+                count = 0;
+                filled = 0;
+            }
+        }
+    }
+    if (blocks > 0) {
+        return -1;
+    }
+
+    if (filled > 0) {
+        add_vector(vectors, &count, buffer, filled - excess);
+    }
+    return write_vectors(fd, vectors, count);
+}
+
+#if defined(__GNUC__)
+#define word_ctz(word) ((unsigned int)__builtin_ctzl(word))
+#define word_popcount(word) ((unsigned int)__builtin_popcountl(word))
+#else
+unsigned int word_ctz(bitmap_word word) {
+    unsigned int n = 0;
+
+    while (!(word & 1)) {
+        word >>= 1;
+        n++;
+    }
+    return n;
+}
+
+unsigned int word_popcount(bitmap_word word) {
+    unsigned int n = 0;
+
+    while (word) {
+        word &= word - 1;
+        n++;
+    }
+    return n;
+}
+#endif
+
+bitmap_word *alloc_bitmap(unsigned int num_bits) {
+    return (bitmap_word *)calloc(BITMAP_BYTES(num_bits) / sizeof(bitmap_word), sizeof(bitmap_word));
+}
+
+bool bitmap_test(const bitmap_word *bitmap, unsigned int bit) {
+    return (bitmap[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1;
+}
+
+void bitmap_fill(bitmap_word *bitmap, unsigned int start, unsigned int length, bool value) {
+    unsigned int word = start / BITS_PER_WORD;
+    unsigned int offset = start % BITS_PER_WORD;
+    unsigned int count;
+    bitmap_word mask;
+
+    while (length > 0) {
+        count = BITS_PER_WORD - offset;
+        if (count > length) {
+            count = length;
+        }
+        mask = (count == BITS_PER_WORD) ? ALL_SET : (((bitmap_word)1 << count) - 1) << offset;
+        if (value) {
+            bitmap[word] |= mask;
+        } else {
+            bitmap[word] &= ~mask;
+        }
+        length -= count;
+        offset = 0;
+        word++;
+    }
+}
+
+unsigned int bitmap_count_set(const bitmap_word *bitmap, unsigned int num_bits) {
+    unsigned int num_words = num_bits / BITS_PER_WORD;
+    unsigned int count = 0;
+    unsigned int i;
+
+    for (i = 0; i < num_words; i++) {
+        count += word_popcount(bitmap[i]);
+    }
+    if (num_bits % BITS_PER_WORD) {
+        count += word_popcount(bitmap[num_words] & ((((bitmap_word)1) << (num_bits % BITS_PER_WORD)) - 1));
+    }
+    return count;
+}
+
+#ifdef HAVE_AVX2_SCAN
+__attribute__((target("avx2")))
+unsigned int skip_words_avx2(const bitmap_word *bitmap, unsigned int word, unsigned int num_words, bitmap_word value) {
+    const unsigned int step = sizeof(__m256i) / sizeof(bitmap_word);
+    __m256i pattern = _mm256_set1_epi8((char)value);
+    __m256i chunk;
+
+    while (word + step <= num_words) {
+        chunk = _mm256_loadu_si256((const __m256i *)(bitmap + word));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, pattern)) != -1) {
+            break;
+        }
+        word += step;
+    }
+    return word;
+}
+
+bool cpu_has_avx2(void) {
+    static int supported = -1;
+
+    if (supported < 0) {
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return supported;
+}
+#endif
+
+unsigned int skip_words(const bitmap_word *bitmap, unsigned int word, unsigned int num_words, bitmap_word value) {
+#ifdef HAVE_AVX2_SCAN
+    if (cpu_has_avx2()) {
+        word = skip_words_avx2(bitmap, word, num_words, value);
+    }
+#endif
+    while (word < num_words && bitmap[word] == value) {
+        word++;
+    }
+    return word;
+}
+
+unsigned int bitmap_find(const bitmap_word *bitmap, unsigned int num_bits, unsigned int from, bool value) {
+    unsigned int num_words = (num_bits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    bitmap_word invert = value ? 0 : ALL_SET;
+    unsigned int word;
+    unsigned int bit;
+    bitmap_word candidates;
+
+    if (from >= num_bits) {
+        return num_bits;
+    }
+
+    word = from / BITS_PER_WORD;
+    candidates = (bitmap[word] ^ invert) & (ALL_SET << (from % BITS_PER_WORD));
+    while (!candidates) {
+        word = skip_words(bitmap, word + 1, num_words, invert);
+        if (word >= num_words) {
+            return num_bits;
+        }
+        candidates = bitmap[word] ^ invert;
+    }
+
+    bit = word * BITS_PER_WORD + word_ctz(candidates);
+    return bit < num_bits ? bit : num_bits;
+}
+
+unsigned int find_free_run(const bitmap_word *block_bitmap, unsigned int num_blocks, unsigned int from, unsigned int *length) {
+    unsigned int start = bitmap_find(block_bitmap, num_blocks, from, false);
+
+    *length = bitmap_find(block_bitmap, num_blocks, start, true) - start;
+    return start;
+}
+
+/* The bitmap is always a copy, so that its changes reach the image only through the journal. */
+bitmap_word *read_block_bitmap(Disk *disk) {
+    DiskMetadata *metadata = &disk->metadata;
+    bitmap_word *block_bitmap;
+    bool legacy_bits[BITMAP_CHUNK_BYTES];
+    unsigned int done, count, i;
+
+    block_bitmap = alloc_bitmap(metadata->num_blocks);
+    if (!block_bitmap) {
+        return NULL;
+    }
+
+    if (!is_legacy_image(metadata)) {
+        if (disk_read(disk, block_bitmap_offset(metadata), block_bitmap, BITMAP_BYTES(metadata->num_blocks)) != 0) {
+            free(block_bitmap);
+            return NULL;
+        }
+        return block_bitmap;
+    }
+
+    for (done = 0; done < metadata->num_blocks; done += count) {
+        count = metadata->num_blocks - done;
+        if (count > BITMAP_CHUNK_BYTES) {
+            count = BITMAP_CHUNK_BYTES;
+        }
+        disk_read(disk, block_bitmap_offset(metadata) + done * sizeof(bool), legacy_bits, count * sizeof(bool));
+        for (i = 0; i < count; i++) {
+            if (legacy_bits[i]) {
+                bitmap_fill(block_bitmap, done + i, 1, true);
+            }
+        }
+    }
+    return block_bitmap;
+}
+
+unsigned int bitmap_chunks(const DiskMetadata *metadata) {
+    return (BITMAP_BYTES(metadata->num_blocks) + BITMAP_CHUNK_BYTES - 1) / BITMAP_CHUNK_BYTES;
+}
+
+/* Writes back only the bitmap chunks changed since the last sync, one write per run of chunks. */
+void write_block_bitmap(Disk *disk) {
+    unsigned long bitmap_bytes = BITMAP_BYTES(disk->metadata.num_blocks);
+    unsigned int chunks = bitmap_chunks(&disk->metadata);
+    unsigned int first, last;
+    unsigned long offset, length;
+
+    for (first = 0; first < chunks; first = last) {
+        if (!disk->bitmap_dirty[first]) {
+            last = first + 1;
+            continue;
+        }
+        for (last = first; last < chunks && disk->bitmap_dirty[last]; last++) {
+            disk->bitmap_dirty[last] = false;
+        }
+        offset = (unsigned long)first * BITMAP_CHUNK_BYTES;
+        length = (unsigned long)last * BITMAP_CHUNK_BYTES < bitmap_bytes ? (unsigned long)last * BITMAP_CHUNK_BYTES - offset : bitmap_bytes - offset;
+        disk_write(disk, block_bitmap_offset(&disk->metadata) + offset, (unsigned char *)disk->block_bitmap + offset, length);
+    }
+}
+
+bool space_before(const SpaceIndex *space, int tree, unsigned int node, unsigned int start, unsigned int length) {
+    const SpaceNode *n = &space->nodes[node];
+
+    if (tree == BY_ADDRESS) {
+        return n->start < start;
+    }
+    return n->length < length || (n->length == length && n->start < start);
+}
+
+void space_update(SpaceIndex *space, unsigned int node) {
+    SpaceNode *n = &space->nodes[node];
+
+    n->longest = n->length;
+    if (space->nodes[n->left[BY_ADDRESS]].longest > n->longest) {
+        n->longest = space->nodes[n->left[BY_ADDRESS]].longest;
+    }
+    if (space->nodes[n->right[BY_ADDRESS]].longest > n->longest) {
+        n->longest = space->nodes[n->right[BY_ADDRESS]].longest;
+    }
+}
+
+unsigned int space_merge(SpaceIndex *space, int tree, unsigned int first, unsigned int second) {
+    if (!first || !second) {
+        return first ? first : second;
+    }
+    if (space->nodes[first].priority > space->nodes[second].priority) {
+        space->nodes[first].right[tree] = space_merge(space, tree, space->nodes[first].right[tree], second);
+        if (tree == BY_ADDRESS) {
+            space_update(space, first);
+        }
+        return first;
+    }
+    space->nodes[second].left[tree] = space_merge(space, tree, first, space->nodes[second].left[tree]);
+    if (tree == BY_ADDRESS) {
+        space_update(space, second);
+    }
+    return second;
+}
+
+/* Splits a treap into the nodes ordered before the key and the rest. */
+void space_split(SpaceIndex *space, int tree, unsigned int node, unsigned int start, unsigned int length,
+                 unsigned int *before, unsigned int *after) {
+    if (!node) {
+        *before = 0;
+        *after = 0;
+        return;
+    }
+    if (space_before(space, tree, node, start, length)) {
+        space_split(space, tree, space->nodes[node].right[tree], start, length, &space->nodes[node].right[tree], after);
+        *before = node;
+    } else {
+        space_split(space, tree, space->nodes[node].left[tree], start, length, before, &space->nodes[node].left[tree]);
+        *after = node;
+    }
+    if (tree == BY_ADDRESS) {
+        space_update(space, node);
+    }
+}
+
+unsigned int space_unlink(SpaceIndex *space, int tree, unsigned int node, unsigned int removed) {
+    SpaceNode *n = &space->nodes[node];
+
+    if (node == removed) {
+        return space_merge(space, tree, n->left[tree], n->right[tree]);
+    }
+    if (space_before(space, tree, node, space->nodes[removed].start, space->nodes[removed].length)) {
+        n->right[tree] = space_unlink(space, tree, n->right[tree], removed);
+    } else {
+        n->left[tree] = space_unlink(space, tree, n->left[tree], removed);
+    }
+    if (tree == BY_ADDRESS) {
+        space_update(space, node);
+    }
+    return node;
+}
+
+void space_insert(SpaceIndex *space, unsigned int start, unsigned int length) {
+    SpaceNode *grown;
+    SpaceNode *n;
+    unsigned int node, before, after;
+    int tree;
+
+    if (space->unused) {
+        node = space->unused;
+        space->unused = space->nodes[node].left[BY_ADDRESS];
+    } else {
+        if (space->used == space->capacity) {
+            grown = (SpaceNode *)realloc(space->nodes, (space->capacity * 2 + 64) * sizeof(SpaceNode));
+            if (!grown) {
+                space->stale = true;
+                return;
+            }
+            if (!space->nodes) {
+                memset(grown, 0, sizeof(SpaceNode));
+                space->used = 1;
+            }
+            space->nodes = grown;
+            space->capacity = space->capacity * 2 + 64;
+        }
+        node = space->used++;
+    }
+
+    /* xorshift32 */
+    space->seed ^= space->seed << 13;
+    space->seed ^= space->seed >> 17;
+    space->seed ^= space->seed << 5;
+    n = &space->nodes[node];
+    memset(n, 0, sizeof(SpaceNode));
+    n->start = start;
+    n->length = length;
+    n->longest = length;
+    n->priority = space->seed;
+    for (tree = BY_ADDRESS; tree <= BY_LENGTH; tree++) {
+        space_split(space, tree, space->root[tree], start, length, &before, &after);
+        space->root[tree] = space_merge(space, tree, space_merge(space, tree, before, node), after);
+    }
+    space->count++;
+}
+
+void space_remove(SpaceIndex *space, unsigned int node) {
+    space->root[BY_ADDRESS] = space_unlink(space, BY_ADDRESS, space->root[BY_ADDRESS], node);
+    space->root[BY_LENGTH] = space_unlink(space, BY_LENGTH, space->root[BY_LENGTH], node);
+    space->nodes[node].left[BY_ADDRESS] = space->unused;
+    space->unused = node;
+    space->count--;
+}
+
+/* The run with the highest start not above block, or 0. */
+unsigned int space_floor(const SpaceIndex *space, unsigned int block) {
+    unsigned int node = space->root[BY_ADDRESS];
+    unsigned int found = 0;
+
+    while (node) {
+        if (space->nodes[node].start <= block) {
+            found = node;
+            node = space->nodes[node].right[BY_ADDRESS];
+        } else {
+            node = space->nodes[node].left[BY_ADDRESS];
+        }
+    }
+    return found;
+}
+
+/* The run with the lowest start not below block, or 0. */
+unsigned int space_ceiling(const SpaceIndex *space, unsigned int block) {
+    unsigned int node = space->root[BY_ADDRESS];
+    unsigned int found = 0;
+
+    while (node) {
+        if (space->nodes[node].start >= block) {
+            found = node;
+            node = space->nodes[node].left[BY_ADDRESS];
+        } else {
+            node = space->nodes[node].right[BY_ADDRESS];
+        }
+    }
+    return found;
+}
+
+/* The lowest run starting at or after from that holds length blocks; subtrees whose
+   longest run is too short are skipped whole. */
+unsigned int space_first_fit(const SpaceIndex *space, unsigned int node, unsigned int from, unsigned int length) {
+    const SpaceNode *n;
+    unsigned int found;
+
+    while (node && space->nodes[node].longest >= length) {
+        n = &space->nodes[node];
+        if (n->start >= from) {
+            found = space_first_fit(space, n->left[BY_ADDRESS], from, length);
+            if (found) {
+                return found;
+            }
+            if (n->length >= length) {
+                return node;
+            }
+        }
+        node = n->right[BY_ADDRESS];
+    }
+    return 0;
+}
+
+/* The shortest run that holds length blocks, the lowest of equal ones. */
+unsigned int space_best_fit(const SpaceIndex *space, unsigned int length) {
+    unsigned int node = space->root[BY_LENGTH];
+    unsigned int found = 0;
+
+    while (node) {
+        if (space->nodes[node].length >= length) {
+            found = node;
+            node = space->nodes[node].left[BY_LENGTH];
+        } else {
+            node = space->nodes[node].right[BY_LENGTH];
+        }
+    }
+    return found;
+}
+
+unsigned int space_largest(const SpaceIndex *space) {
+    unsigned int node = space->root[BY_LENGTH];
+
+    while (node && space->nodes[node].right[BY_LENGTH]) {
+        node = space->nodes[node].right[BY_LENGTH];
+    }
+    return node;
+}
+
+/* Blocks that became free join the runs next to them. */
+void space_add(SpaceIndex *space, unsigned int start, unsigned int length) {
+    unsigned int end = start + length;
+    unsigned int node = space_floor(space, start);
+
+    if (node && space->nodes[node].start + space->nodes[node].length >= start) {
+        start = space->nodes[node].start;
+        if (space->nodes[node].start + space->nodes[node].length > end) {
+            end = space->nodes[node].start + space->nodes[node].length;
+        }
+        space_remove(space, node);
+    }
+    while ((node = space_ceiling(space, start)) != 0 && space->nodes[node].start <= end) {
+        if (space->nodes[node].start + space->nodes[node].length > end) {
+            end = space->nodes[node].start + space->nodes[node].length;
+        }
+        space_remove(space, node);
+    }
+    space_insert(space, start, end - start);
+}
+
+/* Blocks that became used are cut out of the runs that hold them. */
+void space_take(SpaceIndex *space, unsigned int start, unsigned int length) {
+    unsigned int end = start + length;
+    unsigned int node = space_floor(space, start);
+    unsigned int run_start, run_end;
+
+    if (!node || space->nodes[node].start + space->nodes[node].length <= start) {
+        node = space_ceiling(space, start);
+    }
+    while (node && space->nodes[node].start < end) {
+        run_start = space->nodes[node].start;
+        run_end = run_start + space->nodes[node].length;
+        space_remove(space, node);
+        if (run_start < start) {
+            space_insert(space, run_start, start - run_start);
+        }
+        if (run_end > end) {
+            space_insert(space, end, run_end - end);
+        }
+        node = space_ceiling(space, start);
+    }
+}
+
+/* Builds the index from the block bitmap, one scan over its runs. */
+int build_space_index(Disk *disk) {
+    SpaceIndex *space = &disk->space;
+    unsigned int num_blocks = disk->metadata.num_blocks;
+    unsigned int start, length;
+
+    space->used = space->nodes ? 1 : 0;
+    space->unused = 0;
+    space->root[BY_ADDRESS] = 0;
+    space->root[BY_LENGTH] = 0;
+    space->count = 0;
+    space->cursor = 0;
+    space->seed = 2463534242U;
+    space->stale = false;
+    for (start = find_free_run(disk->block_bitmap, num_blocks, 0, &length); start < num_blocks && !space->stale;
+         start = find_free_run(disk->block_bitmap, num_blocks, start + length, &length)) {
+        space_insert(space, start, length);
+    }
+    return space->stale ? -1 : 0;
+}
+
+/* All changes to the block bitmap go through here so that free_blocks and the dirty chunks stay in step. */
+void set_blocks(Disk *disk, unsigned int start, unsigned int length, bool used) {
+    unsigned int chunk;
+
+    if (length == 0) {
+        return;
+    }
+    bitmap_fill(disk->block_bitmap, start, length, used);
+    if (used) {
+        disk->metadata.free_blocks -= length;
+        space_take(&disk->space, start, length);
+    } else {
+        disk->metadata.free_blocks += length;
+        space_add(&disk->space, start, length);
+    }
+    for (chunk = start / BITMAP_CHUNK_BITS; chunk <= (start + length - 1) / BITMAP_CHUNK_BITS; chunk++) {
+        disk->bitmap_dirty[chunk] = true;
+    }
+    disk->dirty = true;
+}
+
+/* Freed blocks may still hold data of the last committed state, so they become
+   free only when the transaction that frees them commits. */
+void mark_blocks(Disk *disk, unsigned int start, unsigned int length, bool used) {
+    Extent *grown;
+
+    if (used) {
+        io_stats.blocks_allocated += length;
+    } else {
+        io_stats.blocks_freed += length;
+    }
+    if (used || length == 0) {
+        set_blocks(disk, start, length, used);
+        return;
+    }
+    if (disk->num_deferred == disk->deferred_capacity) {
+        grown = (Extent *)realloc(disk->deferred, (disk->deferred_capacity * 2 + MAX_EXTENTS) * sizeof(Extent));
+        if (!grown) {
+            set_blocks(disk, start, length, false);
+            return;
+        }
+        disk->deferred = grown;
+        disk->deferred_capacity = disk->deferred_capacity * 2 + MAX_EXTENTS;
+    }
+    disk->deferred[disk->num_deferred].start = start;
+    disk->deferred[disk->num_deferred].length = length;
+    disk->num_deferred++;
+    disk->dirty = true;
+}
+
+void apply_deferred_frees(Disk *disk) {
+    unsigned int i;
+
+    for (i = 0; i < disk->num_deferred; i++) {
+        set_blocks(disk, disk->deferred[i].start, disk->deferred[i].length, false);
+    }
+    disk->num_deferred = 0;
+}
+
+/* The run a policy picks for length blocks, or 0 when no single run holds them.
+   first: the lowest run; best: the shortest run; next: the lowest run after the
+   previous allocation, wrapping around to the start of the disk. */
+unsigned int pick_run(const SpaceIndex *space, unsigned int length) {
+    unsigned int node;
+
+    if (alloc_policy == ALLOC_BEST) {
+        return space_best_fit(space, length);
+    }
+    if (alloc_policy == ALLOC_NEXT) {
+        node = space_first_fit(space, space->root[BY_ADDRESS], space->cursor, length);
+        if (node) {
+            return node;
+        }
+    }
+    return space_first_fit(space, space->root[BY_ADDRESS], 0, length);
+}
+
+/* Takes one run chosen by alloc_policy when one holds all blocks. Otherwise the largest
+   runs are taken until the rest fits in one run, so that the file gets as few extents
+   as possible. */
+Extent *allocate_runs(Disk *disk, unsigned int blocks_needed, unsigned int *num_extents) {
+    SpaceIndex *space = &disk->space;
+    Extent *extents;
+    Extent *grown;
+    unsigned int capacity = MAX_EXTENTS;
+    unsigned int count = 0;
+    unsigned int allocated = 0;
+    unsigned int node, length, i;
+
+    if (blocks_needed > disk->metadata.free_blocks) {
+        return NULL;
+    }
+    if (space->stale && build_space_index(disk) != 0) {
+        return NULL;
+    }
+
+    extents = (Extent *)malloc(capacity * sizeof(Extent));
+    if (!extents) {
+        return NULL;
+    }
+
+    while (allocated < blocks_needed) {
+        node = pick_run(space, blocks_needed - allocated);
+        if (!node) {
+            node = space_largest(space);
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            grown = (Extent *)realloc(extents, capacity * sizeof(Extent));
+            if (!grown) {
+                node = 0;
+            } else {
+                extents = grown;
+            }
+        }
+        if (!node) {
+            /* Nothing points at these blocks yet, so they are free again at once. */
+            for (i = 0; i < count; i++) {
+                set_blocks(disk, extents[i].start, extents[i].length, false);
+            }
+            free(extents);
+            return NULL;
+        }
+        length = space->nodes[node].length;
+        if (length > blocks_needed - allocated) {
+            length = blocks_needed - allocated;
+        }
+        extents[count].start = space->nodes[node].start;
+        extents[count].length = length;
+        mark_blocks(disk, extents[count].start, length, true);
+        space->cursor = extents[count].start + length;
+        count++;
+        allocated += length;
+    }
+
+    *num_extents = count;
+    return extents;
+}
+
+/* Allocation is timed as a phase of its own by --stats. */
+Extent *allocate_extents(Disk *disk, unsigned int blocks_needed, unsigned int *num_extents) {
+    int previous = enter_phase(PHASE_ALLOC);
+    Extent *extents = allocate_runs(disk, blocks_needed, num_extents);
+
+    enter_phase(previous);
+    return extents;
+}
+
+void release_extent(Disk *disk, const Extent *extent) {
+    mark_blocks(disk, extent->start, extent->length, false);
+}
+
+unsigned int overflow_blocks(const Disk *disk, unsigned int num_extents) {
+    if (num_extents <= MAX_EXTENTS) {
+        return 0;
+    }
+    return (num_extents - MAX_EXTENTS + disk->extents_per_block - 1) / disk->extents_per_block;
+}
+
+/* Extents past MAX_EXTENTS go to overflow blocks, filled from the start; the number of
+   the next overflow block follows the last extent that fits (extents_per_block). All
+   overflow blocks are allocated at once, so they normally form a single run that is
+   written, read back and freed without following the chain block by block. */
+int store_extents(Disk *disk, Inode *inode, const Extent *extents, unsigned int num_extents) {
+    Extent *runs;
+    unsigned char *table;
+    unsigned char *block;
+    unsigned int blocks = overflow_blocks(disk, num_extents);
+    unsigned int num_runs, stored, count, next_block, done, i, j;
+
+    inode->num_extents = num_extents;
+    inode->extent_block = NO_BLOCK;
+    inode->first_block = num_extents > 0 ? extents[0].start : NO_BLOCK;
+    stored = num_extents < MAX_EXTENTS ? num_extents : MAX_EXTENTS;
+    memcpy(inode->extents, extents, stored * sizeof(Extent));
+    if (blocks == 0) {
+        return 0;
+    }
+
+    runs = allocate_extents(disk, blocks, &num_runs);
+    table = (unsigned char *)calloc(blocks, disk->block_size);
+    if (!runs || !table) {
+        for (i = 0; runs && i < num_runs; i++) {
+            release_extent(disk, &runs[i]);
+        }
+        free(runs);
+        free(table);
+        return -1;
+    }
+
+    block = table;
+    for (i = 0; i < num_runs; i++) {
+        for (j = 0; j < runs[i].length; j++) {
+            count = num_extents - stored < disk->extents_per_block ? num_extents - stored : disk->extents_per_block;
+            memcpy(block, extents + stored, count * sizeof(Extent));
+            stored += count;
+            if (j + 1 < runs[i].length) {
+                next_block = runs[i].start + j + 1;
+            } else {
+                next_block = i + 1 < num_runs ? runs[i + 1].start : NO_BLOCK;
+            }
+            memcpy(block + disk->extents_per_block * sizeof(Extent), &next_block, sizeof(unsigned int));
+            block += disk->block_size;
+        }
+    }
+
+    for (i = 0, done = 0; i < num_runs; done += runs[i].length, i++) {
+        disk_write_new(disk, data_block_offset(&disk->metadata, runs[i].start), table + blocks_to_bytes(disk, done),
+                       blocks_to_bytes(disk, runs[i].length));
+    }
+    inode->extent_block = runs[0].start;
+    free(runs);
+    free(table);
+    return 0;
+}
+
+/* Returns all extents of a file and, when chain is not NULL, the numbers of its overflow
+   blocks. The chain is read through a window that doubles while it runs into the next
+   block, so a table stored as one run costs a few reads. */
+Extent *read_extent_table(Disk *disk, const Inode *inode, unsigned int *chain) {
+    Extent *extents;
+    unsigned char *table = NULL;
+    unsigned char *block;
+    unsigned int num_blocks = disk->metadata.num_blocks;
+    unsigned int remaining = overflow_blocks(disk, inode->num_extents);
+    unsigned int max_window = bytes_to_blocks(disk, buffer_size(disk, IO_BUFFER_SIZE));
+    unsigned int window = 1;
+    unsigned int loaded, count, current_block, base, blocks;
+    unsigned int found = 0;
+
+    extents = (Extent *)malloc((inode->num_extents + 1) * sizeof(Extent));
+    if (remaining > 0) {
+        table = (unsigned char *)malloc(blocks_to_bytes(disk, remaining < max_window ? remaining : max_window));
+    }
+    if (!extents || (remaining > 0 && !table)) {
+        free(extents);
+        return NULL;
+    }
+
+    loaded = inode->num_extents < MAX_EXTENTS ? inode->num_extents : MAX_EXTENTS;
+    memcpy(extents, inode->extents, loaded * sizeof(Extent));
+
+    current_block = inode->extent_block;
+    while (loaded < inode->num_extents && current_block < num_blocks) {
+        base = current_block;
+        blocks = remaining - found < window ? remaining - found : window;
+        if (blocks > num_blocks - base) {
+            blocks = num_blocks - base;
+        }
+        if (disk_read(disk, data_block_offset(&disk->metadata, base), table, blocks_to_bytes(disk, blocks)) != 0) {
+            break;
+        }
+        while (loaded < inode->num_extents && current_block >= base && current_block - base < blocks) {
+            block = table + blocks_to_bytes(disk, current_block - base);
+            count = inode->num_extents - loaded;
+            if (count > disk->extents_per_block) {
+                count = disk->extents_per_block;
+            }
+            memcpy(extents + loaded, block, count * sizeof(Extent));
+            loaded += count;
+            if (chain) {
+                chain[found] = current_block;
+            }
+            found++;
+            memcpy(&current_block, block + disk->extents_per_block * sizeof(Extent), sizeof(unsigned int));
+        }
+        if (current_block == base + blocks) {
+            window = window * 2 < max_window ? window * 2 : max_window;
+        } else {
+            window = 1;
+        }
+    }
+    free(table);
+
+    if (loaded < inode->num_extents) {
+        free(extents);
+        return NULL;
+    }
+    return extents;
+}
+
+Extent *load_extents(Disk *disk, const Inode *inode) {
+    return read_extent_table(disk, inode, NULL);
+}
+
+/* Frees overflow blocks, one call per run of consecutive blocks. */
+void release_chain(Disk *disk, const unsigned int *chain, unsigned int count) {
+    unsigned int first, last;
+
+    for (first = 0; first < count; first = last) {
+        for (last = first + 1; last < count && chain[last] == chain[last - 1] + 1; last++) {
+        }
+        mark_blocks(disk, chain[first], last - first, false);
+    }
+}
+
+void release_extent_blocks(Disk *disk, const Inode *inode) {
+    unsigned int count = overflow_blocks(disk, inode->num_extents);
+    unsigned int *chain;
+    Extent *extents;
+
+    if (inode->extent_block == NO_BLOCK || count == 0) {
+        return;
+    }
+    chain = (unsigned int *)malloc(count * sizeof(unsigned int));
+    extents = chain ? read_extent_table(disk, inode, chain) : NULL;
+    if (extents) {
+        release_chain(disk, chain, count);
+    }
+    free(extents);
+    free(chain);
+}
+
+unsigned int map_file_block(const Extent *extents, unsigned int num_extents, unsigned int logical_block) {
+    unsigned int i;
+
+    for (i = 0; i < num_extents; i++) {
+        if (logical_block < extents[i].length) {
+            return extents[i].start + logical_block;
+        }
+        logical_block -= extents[i].length;
+    }
+    return NO_BLOCK;
+}
+
+/* Writes go only to blocks allocated since the last commit. */
+int file_data_io(Disk *disk, const Extent *extents, unsigned int num_extents, unsigned char *buffer, unsigned long bytes, bool write) {
+    disk_offset offset;
+    unsigned long length;
+    unsigned int i;
+
+    for (i = 0; i < num_extents && bytes > 0; i++) {
+        length = blocks_to_bytes(disk, extents[i].length);
+        if (length > bytes) {
+            length = bytes;
+        }
+        offset = data_block_offset(&disk->metadata, extents[i].start);
+        if ((write ? disk_write_new(disk, offset, buffer, length) : disk_read(disk, offset, buffer, length)) != 0) {
+            return -1;
+        }
+        buffer += length;
+        bytes -= length;
+    }
+    return bytes == 0 ? 0 : -1;
+}
+
+unsigned int name_hash(const char *name) {
+    unsigned int hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+disk_offset inode_offset(Disk *disk, unsigned int number) {
+    unsigned int block = map_file_block(disk->catalog_extents, disk->metadata.catalog.num_extents, number / disk->inodes_per_block);
+
+    return data_block_offset(&disk->metadata, block) + (number % disk->inodes_per_block) * sizeof(Inode);
+}
+
+int read_inode(Disk *disk, unsigned int number, Inode *inode) {
+    if (is_legacy_image(&disk->metadata)) {
+        *inode = disk->legacy_catalog[number];
+        return 0;
+    }
+    return disk_read(disk, inode_offset(disk, number), inode, sizeof(Inode));
+}
+
+int write_inode(Disk *disk, unsigned int number, const Inode *inode) {
+    return disk_write(disk, inode_offset(disk, number), inode, sizeof(Inode));
+}
+
+/* The name index and the block index are hash tables of IndexEntry stored like files, with a
+   power-of-two number of slots and linear probing; table is the inode of one of them and
+   extents its loaded extent list. */
+unsigned int table_slots(const Disk *disk, const Inode *table) {
+    return inode_size(&disk->metadata, table) / sizeof(IndexEntry);
+}
+
+disk_offset table_entry_offset(Disk *disk, const Inode *table, const Extent *extents, unsigned int slot) {
+    unsigned int block = map_file_block(extents, table->num_extents, slot / disk->index_entries_per_block);
+
+    return data_block_offset(&disk->metadata, block) + (slot % disk->index_entries_per_block) * sizeof(IndexEntry);
+}
+
+void read_table_entry(Disk *disk, const Inode *table, const Extent *extents, unsigned int slot, IndexEntry *entry) {
+    if (disk_read(disk, table_entry_offset(disk, table, extents, slot), entry, sizeof(IndexEntry)) != 0) {
+        memset(entry, 0, sizeof(IndexEntry));
+    }
+}
+
+void write_table_entry(Disk *disk, const Inode *table, const Extent *extents, unsigned int slot, const IndexEntry *entry) {
+    disk_write(disk, table_entry_offset(disk, table, extents, slot), entry, sizeof(IndexEntry));
+}
+
+int grow_table(Disk *disk, Inode *table, Extent **table_extents) {
+    Inode new_table;
+    IndexEntry *old_entries;
+    IndexEntry *new_entries;
+    Extent *extents;
+    unsigned int old_slots = table_slots(disk, table);
+    unsigned int new_slots = old_slots * 2;
+    unsigned int num_extents, current, i;
+
+    old_entries = (IndexEntry *)malloc(old_slots * sizeof(IndexEntry));
+    new_entries = (IndexEntry *)calloc(new_slots, sizeof(IndexEntry));
+    if (!old_entries || !new_entries ||
+        file_data_io(disk, *table_extents, table->num_extents, (unsigned char *)old_entries, old_slots * sizeof(IndexEntry), false) != 0) {
+        free(old_entries);
+        free(new_entries);
+        return -1;
+    }
+
+    for (i = 0; i < old_slots; i++) {
+        if (old_entries[i].value == 0) {
+            continue;
+        }
+        current = old_entries[i].hash & (new_slots - 1);
+        while (new_entries[current].value != 0) {
+            current = (current + 1) & (new_slots - 1);
+        }
+        new_entries[current] = old_entries[i];
+    }
+    free(old_entries);
+
+    extents = allocate_extents(disk, blocks_for_bytes(disk, new_slots * sizeof(IndexEntry)), &num_extents);
+    memset(&new_table, 0, sizeof(Inode));
+    set_inode_size(&disk->metadata, &new_table, (unsigned long)new_slots * sizeof(IndexEntry));
+    if (!extents || store_extents(disk, &new_table, extents, num_extents) != 0 ||
+        file_data_io(disk, extents, num_extents, (unsigned char *)new_entries, (unsigned long)new_slots * sizeof(IndexEntry), true) != 0) {
+        for (i = 0; extents && i < num_extents; i++) {
+            release_extent(disk, &extents[i]);
+        }
+        if (extents) {
+            release_extent_blocks(disk, &new_table);
+        }
+        free(extents);
+        free(new_entries);
+        return -1;
+    }
+    free(new_entries);
+
+    for (i = 0; i < table->num_extents; i++) {
+        release_extent(disk, &(*table_extents)[i]);
+    }
+    release_extent_blocks(disk, table);
+    *table = new_table;
+    free(*table_extents);
+    *table_extents = extents;
+    return 0;
+}
+
+/* count is the number of entries already in the table; it grows at three quarters full. */
+int table_insert(Disk *disk, Inode *table, Extent **extents, unsigned int count, unsigned int hash, unsigned int value) {
+    IndexEntry entry;
+    unsigned int mask, current;
+
+    if ((count + 1) * 4 > table_slots(disk, table) * 3 && grow_table(disk, table, extents) != 0) {
+        return -1;
+    }
+
+    mask = table_slots(disk, table) - 1;
+    current = hash & mask;
+    for (;;) {
+        read_table_entry(disk, table, *extents, current, &entry);
+        if (entry.value == 0) {
+            break;
+        }
+        current = (current + 1) & mask;
+    }
+    entry.hash = hash;
+    entry.value = value;
+    write_table_entry(disk, table, *extents, current, &entry);
+    return 0;
+}
+
+void table_remove(Disk *disk, const Inode *table, const Extent *extents, unsigned int slot) {
+    IndexEntry entry;
+    unsigned int mask = table_slots(disk, table) - 1;
+    unsigned int hole = slot;
+    unsigned int current = (slot + 1) & mask;
+    unsigned int home;
+
+    for (;;) {
+        read_table_entry(disk, table, extents, current, &entry);
+        if (entry.value == 0) {
+            break;
+        }
+        home = entry.hash & mask;
+        if (((current - home) & mask) >= ((current - hole) & mask)) {
+            write_table_entry(disk, table, extents, hole, &entry);
+            hole = current;
+        }
+        current = (current + 1) & mask;
+    }
+    memset(&entry, 0, sizeof(IndexEntry));
+    write_table_entry(disk, table, extents, hole, &entry);
+}
+
+bool dedup_enabled(const Disk *disk) {
+    return inode_size(&disk->metadata, &disk->metadata.block_refs) > 0;
+}
+
+/* Hashes a block word by word; equal hashes are confirmed by comparing the blocks. */
+unsigned int block_hash(const Disk *disk, const unsigned char *data) {
+    const unsigned int *words = (const unsigned int *)data;
+    unsigned int hash = 2166136261u;
+    unsigned int i;
+
+    for (i = 0; i < disk->block_size / sizeof(unsigned int); i++) {
+        hash = (hash ^ words[i]) * 16777619u;
+    }
+    return hash;
+}
+
+disk_offset block_ref_offset(Disk *disk, unsigned int block) {
+    unsigned int refs_per_block = disk->block_size / sizeof(BlockRef);
+    unsigned int table_block = map_file_block(disk->ref_extents, disk->metadata.block_refs.num_extents, block / refs_per_block);
+
+    return data_block_offset(&disk->metadata, table_block) + (block % refs_per_block) * sizeof(BlockRef);
+}
+
+void read_block_ref(Disk *disk, unsigned int block, BlockRef *ref) {
+    if (disk_read(disk, block_ref_offset(disk, block), ref, sizeof(BlockRef)) != 0) {
+        memset(ref, 0, sizeof(BlockRef));
+    }
+}
+
+void write_block_ref(Disk *disk, unsigned int block, const BlockRef *ref) {
+    disk_write(disk, block_ref_offset(disk, block), ref, sizeof(BlockRef));
+}
+
+/* Returns a stored block with the same content as data, or NO_BLOCK; scratch holds one block. */
+unsigned int find_shared_block(Disk *disk, unsigned int hash, const unsigned char *data, unsigned char *scratch) {
+    Inode *table = &disk->metadata.block_index;
+    IndexEntry entry;
+    unsigned int mask = table_slots(disk, table) - 1;
+    unsigned int current;
+
+    for (current = hash & mask; ; current = (current + 1) & mask) {
+        read_table_entry(disk, table, disk->block_index_extents, current, &entry);
+        if (entry.value == 0) {
+            return NO_BLOCK;
+        }
+        if (entry.hash == hash && disk_read(disk, data_block_offset(&disk->metadata, entry.value - 1), scratch, disk->block_size) == 0 &&
+            memcmp(scratch, data, disk->block_size) == 0) {
+            return entry.value - 1;
+        }
+    }
+}
+
+void add_block_ref(Disk *disk, unsigned int block) {
+    BlockRef ref;
+
+    read_block_ref(disk, block, &ref);
+    ref.refs++;
+    write_block_ref(disk, block, &ref);
+}
+
+/* Records a newly written block with one reference. */
+int index_block(Disk *disk, unsigned int block, unsigned int hash) {
+    BlockRef ref;
+
+    if (table_insert(disk, &disk->metadata.block_index, &disk->block_index_extents, disk->metadata.indexed_blocks, hash, block + 1) != 0) {
+        return -1;
+    }
+    disk->metadata.indexed_blocks++;
+    ref.hash = hash;
+    ref.refs = 1;
+    write_block_ref(disk, block, &ref);
+    return 0;
+}
+
+void unindex_block(Disk *disk, unsigned int block, unsigned int hash) {
+    Inode *table = &disk->metadata.block_index;
+    IndexEntry entry;
+    unsigned int mask = table_slots(disk, table) - 1;
+    unsigned int current;
+
+    for (current = hash & mask; ; current = (current + 1) & mask) {
+        read_table_entry(disk, table, disk->block_index_extents, current, &entry);
+        if (entry.value == 0) {
+            return;
+        }
+        if (entry.value == block + 1) {
+            table_remove(disk, table, disk->block_index_extents, current);
+            disk->metadata.indexed_blocks--;
+            return;
+        }
+    }
+}
+
+/* Drops one reference to every block of the extents; the hash is kept in the reference
+   table, so no data is read. A block that loses its last reference leaves the block
+   index and is freed, consecutive ones with a single call. */
+void release_shared(Disk *disk, const Extent *extents, unsigned int num_extents) {
+    BlockRef ref;
+    unsigned int run_start = 0;
+    unsigned int run_length = 0;
+    unsigned int block, i, j;
+
+    for (i = 0; i < num_extents; i++) {
+        for (j = 0; j < extents[i].length; j++) {
+            block = extents[i].start + j;
+            read_block_ref(disk, block, &ref);
+            if (ref.refs > 1) {
+                ref.refs--;
+                write_block_ref(disk, block, &ref);
+                continue;
+            }
+            if (ref.refs == 1) {
+                unindex_block(disk, block, ref.hash);
+            }
+            memset(&ref, 0, sizeof(BlockRef));
+            write_block_ref(disk, block, &ref);
+            if (run_length > 0 && run_start + run_length == block) {
+                run_length++;
+                continue;
+            }
+            if (run_length > 0) {
+                mark_blocks(disk, run_start, run_length, false);
+            }
+            run_start = block;
+            run_length = 1;
+        }
+    }
+    if (run_length > 0) {
+        mark_blocks(disk, run_start, run_length, false);
+    }
+}
+
+/* Frees the data blocks of a file; on a deduplicating disk they only lose a reference. */
+void release_data(Disk *disk, const Extent *extents, unsigned int num_extents) {
+    unsigned int i;
+
+    if (dedup_enabled(disk)) {
+        release_shared(disk, extents, num_extents);
+        return;
+    }
+    for (i = 0; i < num_extents; i++) {
+        release_extent(disk, &extents[i]);
+    }
+}
+
+/* Reads the extent table once and frees both the data and the overflow blocks;
+   the data blocks themselves are never read. */
+int release_file_blocks(Disk *disk, const Inode *inode) {
+    unsigned int count = inode->extent_block == NO_BLOCK ? 0 : overflow_blocks(disk, inode->num_extents);
+    unsigned int *chain;
+    Extent *extents;
+
+    chain = (unsigned int *)malloc((count + 1) * sizeof(unsigned int));
+    extents = chain ? read_extent_table(disk, inode, count > 0 ? chain : NULL) : NULL;
+    if (!extents) {
+        free(chain);
+        return -1;
+    }
+    release_data(disk, extents, inode->num_extents);
+    release_chain(disk, chain, count);
+    free(extents);
+    free(chain);
+    return 0;
+}
+
+int grow_catalog(Disk *disk) {
+    Inode *catalog = &disk->metadata.catalog;
+    Extent *added;
+    Extent *combined;
+    unsigned int blocks = bytes_to_blocks(disk, inode_size(&disk->metadata, catalog));
+    unsigned int num_added, total, i;
+
+    added = allocate_extents(disk, blocks, &num_added);
+    if (!added) {
+        return -1;
+    }
+    combined = (Extent *)malloc((catalog->num_extents + num_added) * sizeof(Extent));
+    if (!combined) {
+        for (i = 0; i < num_added; i++) {
+            release_extent(disk, &added[i]);
+        }
+        free(added);
+        return -1;
+    }
+
+    memcpy(combined, disk->catalog_extents, catalog->num_extents * sizeof(Extent));
+    total = catalog->num_extents;
+    for (i = 0; i < num_added; i++) {
+        if (total > 0 && combined[total - 1].start + combined[total - 1].length == added[i].start) {
+            combined[total - 1].length += added[i].length;
+        } else {
+            combined[total++] = added[i];
+        }
+    }
+    free(added);
+
+    release_extent_blocks(disk, catalog);
+    if (store_extents(disk, catalog, combined, total) != 0) {
+        free(combined);
+        return -1;
+    }
+    set_inode_size(&disk->metadata, catalog, inode_size(&disk->metadata, catalog) + blocks_to_bytes(disk, blocks));
+    free(disk->catalog_extents);
+    disk->catalog_extents = combined;
+    return 0;
+}
+
+unsigned int allocate_inode(Disk *disk) {
+    DiskMetadata *metadata = &disk->metadata;
+    Inode inode;
+    unsigned int number;
+
+    if (metadata->free_inode != NO_INODE) {
+        number = metadata->free_inode;
+        if (read_inode(disk, number, &inode) != 0) {
+            return NO_INODE;
+        }
+        metadata->free_inode = inode.first_block;
+        return number;
+    }
+
+    if (metadata->num_inodes == bytes_to_blocks(disk, inode_size(metadata, &metadata->catalog)) * disk->inodes_per_block &&
+        grow_catalog(disk) != 0) {
+        return NO_INODE;
+    }
+    return metadata->num_inodes++;
+}
+
+void release_inode(Disk *disk, unsigned int number) {
+    Inode inode;
+
+    memset(&inode, 0, sizeof(Inode));
+    inode.first_block = disk->metadata.free_inode;
+    write_inode(disk, number, &inode);
+    disk->metadata.free_inode = number;
+}
+
+/* Directories */
+
+int open_directory(Disk *disk, unsigned int number, Directory *dir) {
+    memset(dir, 0, sizeof(Directory));
+    dir->number = number;
+    if (number == ROOT_DIRECTORY) {
+        dir->table = &disk->metadata.name_index;
+        dir->extents = &disk->index_extents;
+        dir->entries = &disk->metadata.num_files;
+        return 0;
+    }
+    if (read_inode(disk, number, &dir->inode) != 0 || !(dir->inode.file_type & TYPE_DIRECTORY)) {
+        return -1;
+    }
+    dir->inode_extents = load_extents(disk, &dir->inode);
+    if (!dir->inode_extents) {
+        return -1;
+    }
+    dir->table = &dir->inode;
+    dir->extents = &dir->inode_extents;
+    dir->entries = &dir->inode.first_block;
+    return 0;
+}
+
+void close_directory(Directory *dir) {
+    free(dir->inode_extents);
+}
+
+/* Returns the inode number of name in dir and its slot in the table, or NO_INODE. */
+unsigned int directory_lookup(Disk *disk, const Directory *dir, const char *name, Inode *inode, unsigned int *slot) {
+    IndexEntry entry;
+    unsigned int hash = name_hash(name);
+    unsigned int mask = table_slots(disk, dir->table) - 1;
+    unsigned int current;
+
+    for (current = hash & mask; ; current = (current + 1) & mask) {
+        read_table_entry(disk, dir->table, *dir->extents, current, &entry);
+        if (entry.value == 0) {
+            return NO_INODE;
+        }
+        if (entry.hash == hash && read_inode(disk, entry.value, inode) == 0 && strcmp(inode->file_name, name) == 0) {
+            if (slot) {
+                *slot = current;
+            }
+            return entry.value;
+        }
+    }
+}
+
+/* grow_table rebuilds the whole table inode, so a directory gets its name, type and
+   entry count back before the inode is written. */
+int directory_insert(Disk *disk, Directory *dir, const char *name, unsigned int number) {
+    Inode saved = *dir->table;
+
+    if (table_insert(disk, dir->table, dir->extents, *dir->entries, name_hash(name), number) != 0) {
+        return -1;
+    }
+    (*dir->entries)++;
+    if (dir->number != ROOT_DIRECTORY) {
+        memcpy(dir->inode.file_name, saved.file_name, MAX_FILENAME_LEN);
+        dir->inode.file_type = saved.file_type;
+        dir->inode.first_block = saved.first_block + 1;
+        write_inode(disk, dir->number, &dir->inode);
+    }
+    return 0;
+}
+
+void directory_remove(Disk *disk, Directory *dir, unsigned int slot) {
+    table_remove(disk, dir->table, *dir->extents, slot);
+    (*dir->entries)--;
+    if (dir->number != ROOT_DIRECTORY) {
+        write_inode(disk, dir->number, &dir->inode);
+    }
+}
+
+unsigned int find_entry(Disk *disk, unsigned int parent, const char *name, Inode *inode) {
+    Directory dir;
+    unsigned int number;
+
+    if (is_legacy_image(&disk->metadata)) {
+        for (number = 0; number < MAX_FILES; number++) {
+            if (disk->legacy_catalog[number].file_name[0] != '\0' && strcmp(disk->legacy_catalog[number].file_name, name) == 0) {
+                *inode = disk->legacy_catalog[number];
+                return number;
+            }
+        }
+        return NO_INODE;
+    }
+    if (open_directory(disk, parent, &dir) != 0) {
+        return NO_INODE;
+    }
+    number = directory_lookup(disk, &dir, name, inode, NULL);
+    close_directory(&dir);
+    return number;
+}
+
+/* Enters a new name into directory parent, which is opened anew as the caller may have
+   grown its table or the catalog since it was looked up. */
+int link_entry(Disk *disk, unsigned int parent, const char *name, unsigned int number) {
+    Directory dir;
+    int result;
+
+    if (open_directory(disk, parent, &dir) != 0) {
+        return -1;
+    }
+    result = directory_insert(disk, &dir, name, number);
+    close_directory(&dir);
+    return result;
+}
+
+/* A new directory starts with one block of table. */
+unsigned int create_directory(Disk *disk, unsigned int parent, const char *name) {
+    Inode inode;
+    Extent *extents;
+    unsigned char *table;
+    unsigned int slots, num_extents, number;
+
+    for (slots = 1; slots * 2 <= disk->index_entries_per_block; slots *= 2) {
+    }
+    memset(&inode, 0, sizeof(Inode));
+    extents = allocate_extents(disk, 1, &num_extents);
+    table = (unsigned char *)calloc(1, disk->block_size);
+    if (!extents || !table || store_extents(disk, &inode, extents, num_extents) != 0 ||
+        file_data_io(disk, extents, num_extents, table, disk->block_size, true) != 0) {
+        if (extents) {
+            release_extent(disk, &extents[0]);
+        }
+        free(extents);
+        free(table);
+        return NO_INODE;
+    }
+    free(table);
+    disk->dirty = true;
+
+    number = allocate_inode(disk);
+    if (number == NO_INODE || link_entry(disk, parent, name, number) != 0) {
+        if (number != NO_INODE) {
+            release_inode(disk, number);
+        }
+        release_extent(disk, &extents[0]);
+        free(extents);
+        return NO_INODE;
+    }
+    free(extents);
+
+    strncpy(inode.file_name, name, MAX_FILENAME_LEN - 1);
+    set_inode_size(&disk->metadata, &inode, slots * sizeof(IndexEntry));
+    inode.file_type = TYPE_DIRECTORY | (name[0] == '.' ? TYPE_HIDDEN : 0);
+    inode.first_block = 0;
+    write_inode(disk, number, &inode);
+    return number;
+}
+
+unsigned int path_cache_slot(unsigned int parent, const char *name) {
+    return (name_hash(name) ^ parent * 2654435761u) & (PATH_CACHE_SIZE - 1);
+}
+
+/* Returns the directory called name in directory parent, creating it when create is set,
+   or NO_INODE when there is none or the name belongs to a file. */
+unsigned int enter_directory(Disk *disk, unsigned int parent, const char *name, bool create) {
+    PathCacheEntry *cached = disk->path_cache ? &disk->path_cache[path_cache_slot(parent, name)] : NULL;
+    Inode inode;
+    unsigned int number;
+
+    if (cached && cached->number != 0 && cached->parent == parent && strcmp(cached->name, name) == 0) {
+        return cached->number;
+    }
+    number = find_entry(disk, parent, name, &inode);
+    if (number == NO_INODE && create) {
+        number = create_directory(disk, parent, name);
+    } else if (number != NO_INODE && !(inode.file_type & TYPE_DIRECTORY)) {
+        number = NO_INODE;
+    }
+    if (cached && number != NO_INODE) {
+        cached->parent = parent;
+        cached->number = number;
+        strcpy(cached->name, name);
+    }
+    return number;
+}
+
+void forget_directory(Disk *disk, unsigned int parent, const char *name) {
+    PathCacheEntry *cached = disk->path_cache ? &disk->path_cache[path_cache_slot(parent, name)] : NULL;
+
+    if (cached && cached->parent == parent && strcmp(cached->name, name) == 0) {
+        cached->number = 0;
+    }
+}
+
+/* Tells whether no component of path is too long, "." or "..". */
+bool valid_components(const char *path) {
+    size_t length;
+
+    for (path += strspn(path, "/"); *path != '\0'; path += strspn(path, "/")) {
+        length = strcspn(path, "/");
+        if (length >= MAX_FILENAME_LEN || strncmp(path, ".", length) == 0 || strncmp(path, "..", length) == 0) {
+            return false;
+        }
+        path += length;
+    }
+    return true;
+}
+
+/* Copies the last component of path to leaf and returns the directory that holds it,
+   creating missing directories when create is set. Repeated slashes are skipped and an
+   empty leaf stands for the root. Without directories the whole path is the name. Returns
+   NO_INODE when a component is too long, is "." or "..", or is not a directory; the
+   components are all checked before any directory is made. */
+unsigned int find_parent(Disk *disk, const char *path, char *leaf, bool create) {
+    unsigned int parent = ROOT_DIRECTORY;
+    size_t length;
+
+    leaf[0] = '\0';
+    if (!has_directories(&disk->metadata)) {
+        length = strlen(path);
+        if (length >= MAX_FILENAME_LEN) {
+            return NO_INODE;
+        }
+        memcpy(leaf, path, length + 1);
+        return ROOT_DIRECTORY;
+    }
+    if (!valid_components(path)) {
+        return NO_INODE;
+    }
+
+    for (;;) {
+        path += strspn(path, "/");
+        length = strcspn(path, "/");
+        if (length == 0) {
+            return parent;
+        }
+        if (leaf[0] != '\0') {
+            parent = enter_directory(disk, parent, leaf, create);
+            if (parent == NO_INODE) {
+                return NO_INODE;
+            }
+        }
+        memcpy(leaf, path, length);
+        leaf[length] = '\0';
+        path += length;
+    }
+}
+
+unsigned int find_file(Disk *disk, const char *path, Inode *inode) {
+    char leaf[MAX_FILENAME_LEN];
+    unsigned int parent = find_parent(disk, path, leaf, false);
+
+    if (parent == NO_INODE || leaf[0] == '\0') {
+        return NO_INODE;
+    }
+    return find_entry(disk, parent, leaf, inode);
+}
+
+int read_metadata(Disk *disk, DiskMetadata *metadata) {
+    LegacyDiskMetadata legacy;
+
+    memset(metadata, 0, sizeof(DiskMetadata));
+    if (disk_read(disk, 0, metadata, sizeof(DiskMetadata)) != 0) {
+        fprintf(stderr, "Failed to read disk metadata.\n");
+        return -1;
+    }
+
+    if (metadata->magic == FS_MAGIC) {
+        if (metadata->version < FS_OLDEST_VERSION || metadata->version > FS_VERSION) {
+            fprintf(stderr, "Unsupported disk format version %u.\n", metadata->version);
+            return -1;
+        }
+        memset((unsigned char *)metadata + metadata_size(metadata), 0, sizeof(DiskMetadata) - metadata_size(metadata));
+    } else {
+        if (disk_read(disk, 0, &legacy, sizeof(LegacyDiskMetadata)) != 0) {
+            fprintf(stderr, "Failed to read disk metadata.\n");
+            return -1;
+        }
+        memset(metadata, 0, sizeof(DiskMetadata));
+        metadata->disk_size = legacy.disk_size;
+        metadata->block_size = legacy.block_size;
+        metadata->num_blocks = legacy.num_blocks;
+        metadata->first_data_block = legacy.first_data_block;
+        metadata->num_files = legacy.num_files;
+        metadata->num_inodes = MAX_FILES;
+        metadata->free_inode = NO_INODE;
+    }
+
+    if (!valid_block_size(metadata->block_size)) {
+        fprintf(stderr, "Unsupported block size %u.\n", metadata->block_size);
+        return -1;
+    }
+    return 0;
+}
+
+int load_legacy_catalog(Disk *disk) {
+    LegacyInode legacy;
+    bool inode_bitmap[MAX_FILES];
+    unsigned long offset;
+    unsigned int i;
+
+    disk->legacy_catalog = (Inode *)calloc(MAX_FILES, sizeof(Inode));
+    if (!disk->legacy_catalog) {
+        return -1;
+    }
+
+    offset = sizeof(LegacyDiskMetadata) + disk->metadata.num_blocks * sizeof(bool);
+    if (disk_read(disk, offset, inode_bitmap, MAX_FILES * sizeof(bool)) != 0) {
+        return -1;
+    }
+    offset += MAX_FILES * sizeof(bool);
+    for (i = 0; i < MAX_FILES; i++, offset += sizeof(LegacyInode)) {
+        if (disk_read(disk, offset, &legacy, sizeof(LegacyInode)) != 0) {
+            return -1;
+        }
+        if (!inode_bitmap[i]) {
+            continue;
+        }
+        memcpy(disk->legacy_catalog[i].file_name, legacy.file_name, MAX_FILENAME_LEN);
+        disk->legacy_catalog[i].file_size = legacy.file_size;
+        disk->legacy_catalog[i].first_block = legacy.first_block;
+        disk->legacy_catalog[i].file_type = legacy.file_type;
+        disk->legacy_catalog[i].extent_block = NO_BLOCK;
+    }
+    return 0;
+}
+
+/* Sizes the page set so that one commit always fits into the journal. */
+int alloc_journal_pages(Disk *disk) {
+    unsigned int capacity = disk->metadata.journal_blocks;
+    unsigned int slots = 1;
+
+    unsigned int i;
+
+    while (capacity > 0 && journal_descriptor_blocks(disk, capacity) + capacity > disk->metadata.journal_blocks) {
+        capacity--;
+    }
+    while (slots < capacity * 2) {
+        slots *= 2;
+    }
+    disk->pages = (JournalPage *)malloc(capacity * sizeof(JournalPage));
+    disk->page_data = (unsigned char *)malloc(blocks_to_bytes(disk, capacity));
+    disk->page_slots = (unsigned int *)calloc(slots, sizeof(unsigned int));
+    if (capacity == 0 || !disk->pages || !disk->page_data || !disk->page_slots) {
+        return -1;
+    }
+    for (i = 0; i < capacity; i++) {
+        disk->pages[i].data = disk->page_data + blocks_to_bytes(disk, i);
+    }
+    disk->slot_mask = slots - 1;
+    disk->page_capacity = capacity;
+    return 0;
+}
+
+/* Replays the last commit if it is complete; an interrupted commit fails the checksum
+   and is dropped. A read-only open keeps the replayed units as pages instead. */
+int journal_recover(Disk *disk) {
+    JournalHeader header;
+    unsigned char *descriptor;
+    unsigned int *units;
+    unsigned int blocks, checksum, i;
+    disk_offset journal = data_block_offset(&disk->metadata, disk->metadata.journal_start);
+    JournalPage *page;
+
+    if (image_read(disk, journal, &header, sizeof(JournalHeader)) != 0) {
+        return -1;
+    }
+    if (header.magic != JOURNAL_MAGIC || header.num_pages == 0 || header.num_pages > disk->page_capacity) {
+        return 0;
+    }
+    disk->journal_sequence = header.sequence + 1;
+
+    blocks = journal_descriptor_blocks(disk, header.num_pages);
+    descriptor = (unsigned char *)malloc(blocks_to_bytes(disk, blocks));
+    if (!descriptor || image_read(disk, journal, descriptor, blocks_to_bytes(disk, blocks)) != 0) {
+        free(descriptor);
+        return -1;
+    }
+    units = (unsigned int *)(descriptor + sizeof(JournalHeader));
+    for (i = 0; i < header.num_pages; i++) {
+        page = add_page(disk, units[i]);
+        if (image_read(disk, journal + blocks_to_bytes(disk, blocks + i), page->data, disk->block_size) != 0) {
+            break;
+        }
+    }
+    checksum = header.checksum;
+    ((JournalHeader *)descriptor)->checksum = 0;
+    if (i < header.num_pages ||
+        journal_checksum(descriptor, blocks_to_bytes(disk, blocks), disk->pages, disk->num_pages, disk->block_size) != checksum) {
+        disk->num_pages = 0;
+        memset(disk->page_slots, 0, (disk->slot_mask + 1) * sizeof(unsigned int));
+        free(descriptor);
+        return 0;
+    }
+    free(descriptor);
+
+    if (disk->writable) {
+        for (i = 0; i < disk->num_pages; i++) {
+            image_write(disk, unit_offset(disk, disk->pages[i].unit), disk->pages[i].data,
+                        unit_length(disk, disk->pages[i].unit));
+        }
+        disk->num_pages = 0;
+        memset(disk->page_slots, 0, (disk->slot_mask + 1) * sizeof(unsigned int));
+        disk->journal_dirty = true;
+        journal_clear(disk);
+    }
+    return 0;
+}
+
+void free_disk(Disk *disk) {
+    free(disk->block_bitmap);
+    free(disk->bitmap_dirty);
+    free(disk->space.nodes);
+    unmap_disk(disk);
+    fclose(disk->file);
+    free(disk->catalog_extents);
+    free(disk->index_extents);
+    free(disk->block_index_extents);
+    free(disk->ref_extents);
+    free(disk->legacy_catalog);
+    free(disk->pages);
+    free(disk->page_data);
+    free(disk->page_slots);
+    free(disk->deferred);
+    free(disk->path_cache);
+}
+
+/* Maps the image when possible and falls back to stdio access otherwise.
+   The metadata is read again after recovery, which may have replaced it. */
+int open_disk(const char *filename, const char *mode, Disk *disk) {
+    memset(disk, 0, sizeof(Disk));
+    disk->file = fopen(filename, mode);
+    if (!disk->file) {
+        perror("Failed to open disk file");
+        return -1;
+    }
+    disk->writable = strchr(mode, '+') != NULL;
+    map_disk(disk);
+
+    if (read_metadata(disk, &disk->metadata) == 0) {
+        set_block_geometry(disk);
+        if (is_legacy_image(&disk->metadata)) {
+            disk->block_bitmap = read_block_bitmap(disk);
+            if (disk->block_bitmap && load_legacy_catalog(disk) == 0) {
+                return 0;
+            }
+        } else if (alloc_journal_pages(disk) == 0 && journal_recover(disk) == 0 &&
+                   read_metadata(disk, &disk->metadata) == 0) {
+            disk->block_bitmap = read_block_bitmap(disk);
+            disk->bitmap_dirty = (bool *)calloc(bitmap_chunks(&disk->metadata), sizeof(bool));
+            if (disk->block_bitmap) {
+                build_space_index(disk);
+            }
+            disk->catalog_extents = load_extents(disk, &disk->metadata.catalog);
+            disk->index_extents = load_extents(disk, &disk->metadata.name_index);
+            if (dedup_enabled(disk)) {
+                disk->block_index_extents = load_extents(disk, &disk->metadata.block_index);
+                disk->ref_extents = load_extents(disk, &disk->metadata.block_refs);
+            }
+            if (checksums_enabled(disk)) {
+                crc32c_init();
+            }
+            if (has_directories(&disk->metadata)) {
+                disk->path_cache = (PathCacheEntry *)calloc(PATH_CACHE_SIZE, sizeof(PathCacheEntry));
+            }
+            if (disk->catalog_extents && disk->index_extents && disk->block_bitmap && disk->bitmap_dirty &&
+                (!dedup_enabled(disk) || (disk->block_index_extents && disk->ref_extents))) {
+                return 0;
+            }
+        }
+        fprintf(stderr, "Failed to read the file catalog.\n");
+    }
+
+    free_disk(disk);
+    return -1;
+}
+
+/* Ends the running transaction; everything changed since the last sync is committed at once. */
+void sync_disk(Disk *disk) {
+    int previous;
+
+    if (!disk->dirty) {
+        return;
+    }
+    previous = enter_phase(PHASE_FLUSH);
+    apply_deferred_frees(disk);
+    write_block_bitmap(disk);
+    disk_write(disk, 0, &disk->metadata, metadata_size(&disk->metadata));
+    journal_commit(disk);
+    disk->dirty = false;
+    enter_phase(previous);
+}
+
+void close_disk(Disk *disk) {
+    int previous;
+
+    sync_disk(disk);
+    previous = enter_phase(PHASE_FLUSH);
+    journal_clear(disk);
+    free_disk(disk);
+    enter_phase(previous);
+}
+
+int reserve_disk_space(FILE *disk, disk_offset disk_size_bytes, disk_offset first_data_block, int create_mode) {
+    unsigned char *zero_buffer;
+    disk_offset remaining;
+    unsigned long chunk;
+
+    fflush(disk);
+    if (create_mode == CREATE_PREALLOCATE) {
+#ifdef HAVE_POSIX_FALLOCATE
+        return posix_fallocate(fileno(disk), 0, (off_t)disk_size_bytes) == 0 ? 0 : -1;
+#else
+        fprintf(stderr, "Preallocation is not supported here, writing zeros instead.\n");
+        create_mode = CREATE_ZERO;
+#endif
+    }
+    if (create_mode == CREATE_SPARSE) {
+        return ftruncate(fileno(disk), (off_t)disk_size_bytes);
+    }
+
+    zero_buffer = (unsigned char *)calloc(1, IO_BUFFER_SIZE);
+    if (!zero_buffer) {
+        return -1;
+    }
+    if (fseeko(disk, (off_t)first_data_block, SEEK_SET) != 0) {
+        free(zero_buffer);
+        return -1;
+    }
+    remaining = disk_size_bytes - first_data_block;
+    while (remaining > 0) {
+        chunk = remaining < IO_BUFFER_SIZE ? remaining : IO_BUFFER_SIZE;
+        if (fwrite(zero_buffer, 1, chunk, disk) != chunk) {
+            free(zero_buffer);
+            return -1;
+        }
+        remaining -= chunk;
+    }
+    free(zero_buffer);
+    return 0;
+}
+void initialize_disk(const char *filename, unsigned int disk_size_mb, int create_mode, unsigned int block_size, bool dedup) {
+    FILE *disk;
+    disk_offset disk_size_bytes;
+    disk_offset num_blocks;
+    unsigned long block_bitmap_size_bytes;
+    disk_offset first_data_block;
+    unsigned int journal_blocks;
+    unsigned int index_slots;
+    unsigned int reserved_blocks;
+    unsigned int ref_blocks = 0;
+    unsigned int sum_blocks;
+    DiskMetadata metadata;
+    bitmap_word *block_bitmap;
+    unsigned char *zero_blocks;
+
+    if (!valid_block_size(block_size)) {
+        fprintf(stderr, "Unsupported block size %u (a multiple of %d up to %d).\n", block_size, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    disk = fopen(filename, "wb");
+    if (!disk) {
+        perror("Failed to create disk file");
+        exit(EXIT_FAILURE);
+    }
+
+    disk_size_bytes = (disk_offset)disk_size_mb * 1024 * 1024;
+    num_blocks = count_blocks(disk_size_bytes, block_size);
+    if (num_blocks > MAX_BLOCKS || disk_size_bytes / 1024 / 1024 != disk_size_mb) {
+        fprintf(stderr, "Disk of %u MB needs more than %u blocks of %u bytes; choose larger blocks.\n",
+                disk_size_mb, MAX_BLOCKS, block_size);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    block_bitmap_size_bytes = BITMAP_BYTES(num_blocks);
+    first_data_block = sizeof(DiskMetadata) + block_bitmap_size_bytes;
+
+    journal_blocks = num_blocks / 16;
+    if (journal_blocks < JOURNAL_MIN_BLOCKS) {
+        journal_blocks = JOURNAL_MIN_BLOCKS;
+    } else if (journal_blocks > JOURNAL_MAX_BLOCKS) {
+        journal_blocks = JOURNAL_MAX_BLOCKS;
+    }
+    reserved_blocks = CATALOG_INITIAL_BLOCKS + 1 + journal_blocks;
+    if (dedup) {
+        ref_blocks = (unsigned int)((num_blocks * sizeof(BlockRef) + block_size - 1) / block_size);
+        reserved_blocks += 1 + ref_blocks;
+    }
+    sum_blocks = (unsigned int)((num_blocks * sizeof(unsigned int) + block_size - 1) / block_size);
+    reserved_blocks += sum_blocks;
+    if (num_blocks < reserved_blocks) {
+        fprintf(stderr, "Disk of %u MB is too small.\n", disk_size_mb);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&metadata, 0, sizeof(DiskMetadata));
+    metadata.disk_size = disk_size_mb;
+    metadata.block_size = block_size;
+    metadata.version = FS_VERSION;
+    metadata.num_blocks = num_blocks;
+    metadata.free_blocks = num_blocks - reserved_blocks;
+    metadata.first_data_block = first_data_block;
+    metadata.num_files = 0;
+    metadata.magic = FS_MAGIC;
+    metadata.num_inodes = 1;
+    metadata.free_inode = NO_INODE;
+
+    metadata.catalog.file_size = CATALOG_INITIAL_BLOCKS * block_size;
+    metadata.catalog.first_block = 0;
+    metadata.catalog.num_extents = 1;
+    metadata.catalog.extent_block = NO_BLOCK;
+    metadata.catalog.extents[0].start = 0;
+    metadata.catalog.extents[0].length = CATALOG_INITIAL_BLOCKS;
+
+    /* The name index is a hash table with a power-of-two number of slots. */
+    for (index_slots = 1; index_slots * 2 <= block_size / sizeof(IndexEntry); index_slots *= 2) {
+    }
+    metadata.name_index.file_size = index_slots * sizeof(IndexEntry);
+    metadata.name_index.first_block = CATALOG_INITIAL_BLOCKS;
+    metadata.name_index.num_extents = 1;
+    metadata.name_index.extent_block = NO_BLOCK;
+    metadata.name_index.extents[0].start = CATALOG_INITIAL_BLOCKS;
+    metadata.name_index.extents[0].length = 1;
+
+    metadata.journal_start = CATALOG_INITIAL_BLOCKS + 1;
+    metadata.journal_blocks = journal_blocks;
+
+    /* The block index and the reference table follow the journal; like the rest of
+       the reserved space they start out zeroed, that is empty. */
+    if (dedup) {
+        metadata.block_index = metadata.name_index;
+        metadata.block_index.first_block = metadata.journal_start + journal_blocks;
+        metadata.block_index.extents[0].start = metadata.block_index.first_block;
+        set_inode_size(&metadata, &metadata.block_refs, num_blocks * sizeof(BlockRef));
+        metadata.block_refs.first_block = metadata.block_index.first_block + 1;
+        metadata.block_refs.num_extents = 1;
+        metadata.block_refs.extent_block = NO_BLOCK;
+        metadata.block_refs.extents[0].start = metadata.block_refs.first_block;
+        metadata.block_refs.extents[0].length = ref_blocks;
+    }
+
+    /* The checksum table takes the last reserved blocks. */
+    set_inode_size(&metadata, &metadata.block_sums, num_blocks * sizeof(unsigned int));
+    metadata.block_sums.first_block = reserved_blocks - sum_blocks;
+    metadata.block_sums.num_extents = 1;
+    metadata.block_sums.extent_block = NO_BLOCK;
+    metadata.block_sums.extents[0].start = metadata.block_sums.first_block;
+    metadata.block_sums.extents[0].length = sum_blocks;
+
+    block_bitmap = alloc_bitmap(num_blocks);
+    zero_blocks = (unsigned char *)calloc(CATALOG_INITIAL_BLOCKS + 2, block_size);
+
+    if (!block_bitmap || !zero_blocks) {
+        perror("Failed to allocate memory");
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+    bitmap_fill(block_bitmap, 0, reserved_blocks, true);
+
+    fwrite(&metadata, sizeof(DiskMetadata), 1, disk);
+    fwrite(block_bitmap, 1, block_bitmap_size_bytes, disk);
+
+    if (reserve_disk_space(disk, disk_size_bytes, first_data_block, create_mode) != 0) {
+        perror("Failed to reserve disk space");
+        free(block_bitmap);
+        free(zero_blocks);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+
+    fseeko(disk, (off_t)first_data_block, SEEK_SET);
+    fwrite(zero_blocks, block_size, CATALOG_INITIAL_BLOCKS + 2, disk);
+
+    printf("Disk initialized successfully.\n");
+    printf("Metadata: disk size = %u MB, block size = %u bytes, number of blocks = %llu\n", disk_size_mb, block_size, num_blocks);
+    printf("First data block starts at offset = %llu bytes\n", first_data_block);
+    if (dedup) {
+        printf("Block deduplication enabled (%u blocks of reference table).\n", ref_blocks);
+    }
+
+    free(block_bitmap);
+    free(zero_blocks);
+    fclose(disk);
+}
+
+/* Small files are read straight into the inode and take no data blocks. */
+Extent *import_inline(FILE *source, Inode *inode, disk_offset file_size) {
+    if (fread(inode->extents, 1, file_size, source) != file_size) {
+        fprintf(stderr, "Failed to read source file.\n");
+        return NULL;
+    }
+    return (Extent *)malloc(sizeof(Extent));
+}
+
+/* Moves a small streamed file from its block into the inode; on a read error it keeps the block. */
+int move_inline(Disk *disk, Inode *inode, Extent *extents, unsigned int *num_extents, disk_offset file_size) {
+    if (disk_read(disk, data_block_offset(&disk->metadata, extents[0].start), inode->extents, file_size) != 0) {
+        return -1;
+    }
+    release_data(disk, extents, *num_extents);
+    *num_extents = 0;
+    return 0;
+}
+
+/* Allocates the whole file at once when its size is known up front. */
+Extent *import_sized(Disk *disk, FILE *source, disk_offset file_size, unsigned char *buffer, unsigned int *num_extents) {
+    Extent *extents;
+    disk_offset extent_bytes;
+    unsigned int blocks_needed, i;
+
+    if (file_size > max_file_size(&disk->metadata) || file_size > blocks_to_bytes(disk, disk->metadata.num_blocks)) {
+        fprintf(stderr, "Not enough space on disk for this file.\n");
+        return NULL;
+    }
+    blocks_needed = blocks_for_bytes(disk, file_size);
+    if (blocks_needed > disk->metadata.free_blocks && disk->num_deferred > 0) {
+        sync_disk(disk);
+    }
+    extents = allocate_extents(disk, blocks_needed, num_extents);
+    if (!extents) {
+        fprintf(stderr, "Not enough space on disk for this file.\n");
+        return NULL;
+    }
+    for (i = 0; i < *num_extents; i++) {
+        if (write_extent_from_file(disk, &extents[i], source, file_size, buffer) != 0) {
+            release_data(disk, extents, *num_extents);
+            free(extents);
+            return NULL;
+        }
+        extent_bytes = blocks_to_bytes(disk, extents[i].length);
+        file_size -= file_size < extent_bytes ? file_size : extent_bytes;
+    }
+    return extents;
+}
+
+/* Adds blocks to a file that is still growing: the last extent is extended in place
+   while the blocks after it are free, the rest goes to newly allocated runs. When
+   space runs out, blocks freed by the running transaction are made usable by a commit;
+   a crash before the import ends can then leak the blocks taken so far, nothing more. */
+int append_blocks(Disk *disk, Extent **extents, unsigned int *num_extents, unsigned int *capacity, unsigned int blocks) {
+    Extent *last;
+    Extent *added;
+    Extent *grown;
+    unsigned int end, length, num_added, i;
+    int previous;
+
+    if (*num_extents > 0) {
+        previous = enter_phase(PHASE_ALLOC);
+        last = &(*extents)[*num_extents - 1];
+        end = last->start + last->length;
+        length = bitmap_find(disk->block_bitmap, disk->metadata.num_blocks, end, true) - end;
+        if (length > blocks) {
+            length = blocks;
+        }
+        mark_blocks(disk, end, length, true);
+        last->length += length;
+        blocks -= length;
+        enter_phase(previous);
+    }
+    if (blocks == 0) {
+        return 0;
+    }
+
+    added = allocate_extents(disk, blocks, &num_added);
+    if (!added && disk->num_deferred > 0) {
+        sync_disk(disk);
+        added = allocate_extents(disk, blocks, &num_added);
+    }
+    if (!added) {
+        return -1;
+    }
+    if (*num_extents + num_added > *capacity) {
+        grown = (Extent *)realloc(*extents, (*capacity * 2 + num_added + MAX_EXTENTS) * sizeof(Extent));
+        if (!grown) {
+            for (i = 0; i < num_added; i++) {
+                release_extent(disk, &added[i]);
+            }
+            free(added);
+            return -1;
+        }
+        *extents = grown;
+        *capacity = *capacity * 2 + num_added + MAX_EXTENTS;
+    }
+    memcpy(*extents + *num_extents, added, num_added * sizeof(Extent));
+    *num_extents += num_added;
+    free(added);
+    return 0;
+}
+
+/* Reads or writes count blocks of buffer, starting at logical block first of the file. */
+int file_blocks_io(Disk *disk, const Extent *extents, unsigned int num_extents, unsigned int first, unsigned char *buffer, unsigned int count, bool write) {
+    disk_offset offset;
+    unsigned int length, i;
+
+    for (i = 0; i < num_extents && count > 0; i++) {
+        if (first >= extents[i].length) {
+            first -= extents[i].length;
+            continue;
+        }
+        length = extents[i].length - first < count ? extents[i].length - first : count;
+        offset = data_block_offset(&disk->metadata, extents[i].start + first);
+        if (write) {
+            if (disk_write_new(disk, offset, buffer, blocks_to_bytes(disk, length)) != 0) {
+                return -1;
+            }
+            record_sums(disk, extents[i].start + first, buffer, length);
+        } else if (disk_read(disk, offset, buffer, blocks_to_bytes(disk, length)) != 0 ||
+                   verify_sums(disk, extents[i].start + first, buffer, length) != 0) {
+            return -1;
+        }
+        buffer += blocks_to_bytes(disk, length);
+        count -= length;
+        first = 0;
+    }
+    return count == 0 ? 0 : -1;
+}
+
+unsigned int lz_read32(const unsigned char *data) {
+    unsigned int value;
+
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+/* Stores a literal or match length that does not fit the four bits of its token. */
+unsigned char *lz_put_length(unsigned char *out, unsigned long length) {
+    for (; length >= 255; length -= 255) {
+        *out++ = 255;
+    }
+    *out++ = (unsigned char)length;
+    return out;
+}
+
+/* Compresses length bytes of in into out (at least LZ_BOUND(length) bytes) and returns the
+   packed length. The format is the LZ4 block format: a token with the literal count and
+   the match length less LZ_MIN_MATCH, the literals, a 16 bit offset of the match.
+   Matches are found through a table of the last position of every hashed 4 byte string;
+   the search skips ahead faster the longer it goes without a match. */
+unsigned long lz_compress(const unsigned char *in, unsigned long length, unsigned char *out) {
+    unsigned int table[1 << LZ_HASH_BITS];
+    unsigned char *start = out;
+    unsigned char *token;
+    unsigned long pos = 0;
+    unsigned long anchor = 0;
+    unsigned long limit, ref, match, literals;
+    unsigned int hash;
+
+    memset(table, 0, sizeof(table));
+    limit = length > 12 ? length - 12 : 0;
+    while (pos < limit) {
+        hash = (lz_read32(in + pos) * 2654435761U) >> (32 - LZ_HASH_BITS);
+        ref = table[hash];
+        table[hash] = (unsigned int)pos;
+        if (ref >= pos || pos - ref > 65535 || lz_read32(in + ref) != lz_read32(in + pos)) {
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+
+        match = LZ_MIN_MATCH;
+        while (pos + match < length - 5 && in[ref + match] == in[pos + match]) {
+            match++;
+        }
+        literals = pos - anchor;
+        token = out++;
+        *token = (unsigned char)((literals < 15 ? literals : 15) << 4);
+        if (literals >= 15) {
+            out = lz_put_length(out, literals - 15);
+        }
+        memcpy(out, in + anchor, literals);
+        out += literals;
+        *out++ = (unsigned char)((pos - ref) & 0xff);
+        *out++ = (unsigned char)((pos - ref) >> 8);
+        *token |= (unsigned char)(match - LZ_MIN_MATCH < 15 ? match - LZ_MIN_MATCH : 15);
+        if (match - LZ_MIN_MATCH >= 15) {
+            out = lz_put_length(out, match - LZ_MIN_MATCH - 15);
+        }
+        pos += match;
+        anchor = pos;
+    }
+
+    literals = length - anchor;
+    *out++ = (unsigned char)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) {
+        out = lz_put_length(out, literals - 15);
+    }
+    memcpy(out, in + anchor, literals);
+    return (unsigned long)(out - start) + literals;
+}
+
+/* Unpacks one frame into out; returns the unpacked length or -1 when the frame is damaged. */
+long lz_decompress(const unsigned char *in, unsigned long length, unsigned char *out, unsigned long capacity) {
+    unsigned long pos = 0;
+    unsigned long done = 0;
+    unsigned long literals, match, offset, i;
+    unsigned char token, byte;
+
+    while (pos < length) {
+        token = in[pos++];
+        literals = token >> 4;
+        if (literals == 15) {
+            do {
+                if (pos >= length) {
+                    return -1;
+                }
+                byte = in[pos++];
+                literals += byte;
+            } while (byte == 255);
+        }
+        if (literals > length - pos || literals > capacity - done) {
+            return -1;
+        }
+        memcpy(out + done, in + pos, literals);
+        pos += literals;
+        done += literals;
+        if (pos == length) {
+            break;
+        }
+
+        if (length - pos < 2) {
+            return -1;
+        }
+        offset = in[pos] | ((unsigned long)in[pos + 1] << 8);
+        pos += 2;
+        match = token & 15;
+        if (match == 15) {
+            do {
+                if (pos >= length) {
+                    return -1;
+                }
+                byte = in[pos++];
+                match += byte;
+            } while (byte == 255);
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > done || match > capacity - done) {
+            return -1;
+        }
+        if (offset >= match) {
+            memcpy(out + done, out + done - offset, match);
+        } else {
+            for (i = 0; i < match; i++) {
+                out[done + i] = out[done + i - offset];
+            }
+        }
+        done += match;
+    }
+    return (long)done;
+}
+
+/* Fills buffer like fread; a compressing source packs the next chunk whenever the last frame is used up. */
+size_t read_source(Source *source, unsigned char *buffer, size_t length) {
+    size_t filled = 0;
+    size_t raw, piece;
+    unsigned long packed;
+    unsigned int header;
+
+    if (!source->raw) {
+        return fread(buffer, 1, length, source->file);
+    }
+    while (filled < length) {
+        if (source->packed_offset == source->packed_length) {
+            raw = fread(source->raw, 1, LZ_CHUNK, source->file);
+            if (raw == 0) {
+                break;
+            }
+            source->raw_bytes += raw;
+            packed = lz_compress(source->raw, raw, source->packed + sizeof(header));
+            if (packed < raw) {
+                header = (unsigned int)packed;
+            } else {
+                memcpy(source->packed + sizeof(header), source->raw, raw);
+                header = (unsigned int)raw | LZ_STORED;
+                packed = raw;
+            }
+            memcpy(source->packed, &header, sizeof(header));
+            source->packed_length = sizeof(header) + packed;
+            source->packed_offset = 0;
+        }
+        piece = source->packed_length - source->packed_offset;
+        if (piece > length - filled) {
+            piece = length - filled;
+        }
+        memcpy(buffer + filled, source->packed + source->packed_offset, piece);
+        source->packed_offset += piece;
+        filled += piece;
+    }
+    return filled;
+}
+
+/* Reads a source of unknown length, such as a pipe, in IO_BUFFER_SIZE pieces and
+   allocates blocks as the data arrives. */
+Extent *import_stream(Disk *disk, Source *source, unsigned char *buffer, unsigned int *num_extents, disk_offset *file_size) {
+    Extent *extents = NULL;
+    unsigned int capacity = 0;
+    unsigned int written = 0;
+    unsigned int blocks, i;
+    size_t bytes_read;
+
+    *num_extents = 0;
+    *file_size = 0;
+    while ((bytes_read = read_source(source, buffer, buffer_size(disk, IO_BUFFER_SIZE))) > 0) {
+        blocks = blocks_for_bytes(disk, bytes_read);
+        memset(buffer + bytes_read, 0, blocks_to_bytes(disk, blocks) - bytes_read);
+        if (*file_size + bytes_read > max_file_size(&disk->metadata) || append_blocks(disk, &extents, num_extents, &capacity, blocks) != 0 ||
+            file_blocks_io(disk, extents, *num_extents, written, buffer, blocks, true) != 0) {
+            fprintf(stderr, "Not enough space on disk for this file.\n");
+            break;
+        }
+        written += blocks;
+        *file_size += bytes_read;
+    }
+
+    if (bytes_read > 0 || ferror(source->file)) {
+        if (bytes_read == 0) {
+            fprintf(stderr, "Failed to read source file.\n");
+        }
+        for (i = 0; i < *num_extents; i++) {
+            release_extent(disk, &extents[i]);
+        }
+        free(extents);
+        return NULL;
+    }
+    return extents ? extents : (Extent *)malloc(sizeof(Extent));
+}
+
+/* Adds one block at the end of a file's extent list, extending the last extent when it is adjacent. */
+int add_file_block(Extent **extents, unsigned int *num_extents, unsigned int *capacity, unsigned int block) {
+    Extent *grown;
+
+    if (*num_extents > 0 && (*extents)[*num_extents - 1].start + (*extents)[*num_extents - 1].length == block) {
+        (*extents)[*num_extents - 1].length++;
+        return 0;
+    }
+    if (*num_extents == *capacity) {
+        grown = (Extent *)realloc(*extents, (*capacity * 2 + MAX_EXTENTS) * sizeof(Extent));
+        if (!grown) {
+            return -1;
+        }
+        *extents = grown;
+        *capacity = *capacity * 2 + MAX_EXTENTS;
+    }
+    (*extents)[*num_extents].start = block;
+    (*extents)[*num_extents].length = 1;
+    (*num_extents)++;
+    return 0;
+}
+
+/* Imports a file on a deduplicating disk. Every block is hashed; a block whose content is
+   already stored gets another reference, the others are written to new blocks and indexed. */
+Extent *import_shared(Disk *disk, Source *source, unsigned char *buffer, unsigned int *num_extents, disk_offset *file_size) {
+    Extent *extents = NULL;
+    Extent *last;
+    unsigned char *scratch;
+    unsigned char *data;
+    unsigned int capacity = 0;
+    unsigned int blocks, block, hash, i;
+    size_t bytes_read = 0;
+    bool failed = false;
+
+    *num_extents = 0;
+    *file_size = 0;
+    scratch = (unsigned char *)malloc(disk->block_size);
+    if (!scratch) {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        return NULL;
+    }
+    while (!failed && (bytes_read = read_source(source, buffer, buffer_size(disk, IO_BUFFER_SIZE))) > 0) {
+        blocks = blocks_for_bytes(disk, bytes_read);
+        memset(buffer + bytes_read, 0, blocks_to_bytes(disk, blocks) - bytes_read);
+        failed = *file_size + bytes_read > max_file_size(&disk->metadata);
+        for (i = 0; i < blocks && !failed; i++) {
+            data = buffer + blocks_to_bytes(disk, i);
+            hash = block_hash(disk, data);
+            block = find_shared_block(disk, hash, data, scratch);
+            if (block != NO_BLOCK) {
+                failed = add_file_block(&extents, num_extents, &capacity, block) != 0;
+                if (!failed) {
+                    add_block_ref(disk, block);
+                }
+            } else if (append_blocks(disk, &extents, num_extents, &capacity, 1) != 0) {
+                failed = true;
+            } else {
+                last = &extents[*num_extents - 1];
+                block = last->start + last->length - 1;
+                failed = disk_write_new(disk, data_block_offset(&disk->metadata, block), data, disk->block_size) != 0 ||
+                         index_block(disk, block, hash) != 0;
+                record_sums(disk, block, data, 1);
+            }
+        }
+        *file_size += bytes_read;
+    }
+    free(scratch);
+
+    if (failed || ferror(source->file)) {
+        fprintf(stderr, failed ? "Not enough space on disk for this file.\n" : "Failed to read source file.\n");
+        release_shared(disk, extents, *num_extents);
+        free(extents);
+        return NULL;
+    }
+    return extents ? extents : (Extent *)malloc(sizeof(Extent));
+}
+
+/* Imports source_filename as file_name. "-" reads standard input. Sources that cannot
+   seek (pipes, FIFOs, terminals) are streamed; others are allocated in one piece.
+   A compressed file is always streamed, as its packed size is only known at the end. */
+int import_file_from(Disk *disk, const char *file_name, const char *source_filename, bool compress) {
+    FILE *file;
+    Source source;
+    unsigned int inode_number;
+    unsigned int num_extents = 0;
+    disk_offset file_size;
+    off_t length;
+    unsigned char *buffer;
+    Extent *extents;
+    Inode inode;
+    struct stat info;
+    char leaf[MAX_FILENAME_LEN];
+    unsigned int parent;
+    bool from_stdin = strcmp(source_filename, "-") == 0;
+    int previous;
+
+    if (is_legacy_image(&disk->metadata)) {
+        fprintf(stderr, "Disk uses the legacy chained format and is read-only.\n");
+        return -1;
+    }
+
+    /* Nothing is made on disk until the name is known to be good and the source is open;
+       missing directories are only made once the data is stored. */
+    parent = find_parent(disk, file_name, leaf, false);
+    if (leaf[0] == '\0' || (has_directories(&disk->metadata) ?
+                             !valid_components(file_name) || file_name[strlen(file_name) - 1] == '/' :
+                             parent == NO_INODE)) {
+        fprintf(stderr, "Invalid file name '%s' (names are at most %d characters and only directories hold files).\n",
+                file_name, MAX_FILENAME_LEN - 1);
+        return -1;
+    }
+
+    if (parent != NO_INODE && find_entry(disk, parent, leaf, &inode) != NO_INODE) {
+        fprintf(stderr, "File '%s' already exists on disk.\n", file_name);
+        return -1;
+    }
+
+    if (compress && disk->metadata.version < COMPRESS_VERSION) {
+        fprintf(stderr, "Disk format version %u does not support compression.\n", disk->metadata.version);
+        return -1;
+    }
+
+    file = from_stdin ? stdin : fopen(source_filename, "rb");
+    if (!file) {
+        perror("Failed to open source file");
+        return -1;
+    }
+    /* A directory or a device would give a meaningless length to the size probe below. */
+    if (!from_stdin && fstat(fileno(file), &info) == 0 && !S_ISREG(info.st_mode) && !S_ISFIFO(info.st_mode)) {
+        fprintf(stderr, "'%s' is not a regular file.\n", source_filename);
+        fclose(file);
+        return -1;
+    }
+
+    memset(&source, 0, sizeof(Source));
+    source.file = file;
+    buffer = (unsigned char *)malloc(buffer_size(disk, IO_BUFFER_SIZE));
+    if (compress) {
+        source.raw = (unsigned char *)malloc(LZ_CHUNK);
+        source.packed = (unsigned char *)malloc(sizeof(unsigned int) + LZ_BOUND(LZ_CHUNK));
+    }
+    if (!buffer || (compress && (!source.raw || !source.packed))) {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        free(buffer);
+        free(source.raw);
+        free(source.packed);
+        if (!from_stdin) {
+            fclose(file);
+        }
+        return -1;
+    }
+
+    disk->dirty = true;
+    memset(&inode, 0, sizeof(Inode));
+    previous = enter_phase(PHASE_COPY);
+    if (fseeko(file, 0, SEEK_END) == 0 && (length = ftello(file)) >= 0) {
+        rewind(file);
+        file_size = length;
+        if (stores_inline(disk, file_size)) {
+            extents = import_inline(file, &inode, file_size);
+            compress = false;
+        } else if (dedup_enabled(disk)) {
+            extents = import_shared(disk, &source, buffer, &num_extents, &file_size);
+        } else if (compress) {
+            extents = import_stream(disk, &source, buffer, &num_extents, &file_size);
+        } else {
+            extents = import_sized(disk, file, file_size, buffer, &num_extents);
+        }
+    } else {
+        clearerr(file);
+        if (dedup_enabled(disk)) {
+            extents = import_shared(disk, &source, buffer, &num_extents, &file_size);
+        } else {
+            extents = import_stream(disk, &source, buffer, &num_extents, &file_size);
+        }
+        if (extents && !compress && stores_inline(disk, file_size)) {
+            move_inline(disk, &inode, extents, &num_extents, file_size);
+        }
+    }
+    enter_phase(previous);
+    free(buffer);
+    free(source.raw);
+    free(source.packed);
+    if (!from_stdin) {
+        fclose(file);
+    }
+    if (compress) {
+        inode.compression = COMPRESS_LZ;
+        file_size = source.raw_bytes;
+    }
+
+    if (!extents || file_size > max_file_size(&disk->metadata) || store_extents(disk, &inode, extents, num_extents) != 0) {
+        if (extents) {
+            fprintf(stderr, "Not enough space on disk for this file.\n");
+            release_data(disk, extents, num_extents);
+            release_extent_blocks(disk, &inode);
+        }
+        free(extents);
+        return -1;
+    }
+    free(extents);
+
+    if (parent == NO_INODE) {
+        parent = find_parent(disk, file_name, leaf, true);
+    }
+    if (parent == NO_INODE) {
+        fprintf(stderr, "Failed to make the directories of '%s' (only directories hold files).\n", file_name);
+        release_file_blocks(disk, &inode);
+        return -1;
+    }
+
+    inode_number = allocate_inode(disk);
+    if (inode_number == NO_INODE || link_entry(disk, parent, leaf, inode_number) != 0) {
+        if (inode_number == NO_INODE) {
+            fprintf(stderr, "No free inode.\n");
+        } else {
+            fprintf(stderr, "Not enough space on disk for the file name index.\n");
+            release_inode(disk, inode_number);
+        }
+        release_file_blocks(disk, &inode);
+        return -1;
+    }
+
+    strcpy(inode.file_name, leaf);
+    set_inode_size(&disk->metadata, &inode, file_size);
+    inode.file_type = (leaf[0] == '.') ? TYPE_HIDDEN : 0;
+    write_inode(disk, inode_number, &inode);
+
+    printf("File '%s' copied to virtual disk.\n", file_name);
+    return 0;
+}
+
+int import_file(Disk *disk, const char *source_filename) {
+    return import_file_from(disk, source_filename, source_filename, false);
+}
+
+/* Adds every regular file below root/relative; symbolic links are not followed. */
+int collect_host_files(BulkImport *bulk, const char *root, const char *relative) {
+    char path[HOST_PATH_LEN];
+    char name[HOST_PATH_LEN];
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    BulkFile *grown;
+    BulkFile *file;
+    int failed = 0;
+
+    snprintf(path, sizeof(path), relative[0] ? "%s/%s" : "%s", root, relative);
+    dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        return 1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if ((unsigned int)snprintf(name, sizeof(name), relative[0] ? "%s/%s" : "%s%s", relative, entry->d_name) >= sizeof(name) ||
+            (unsigned int)snprintf(path, sizeof(path), "%s/%s", root, name) >= sizeof(path) || lstat(path, &st) != 0) {
+            fprintf(stderr, "Skipping '%s/%s'.\n", root, name);
+            failed++;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            failed += collect_host_files(bulk, root, name);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (!has_directories(&bulk->disk->metadata) && strlen(name) >= MAX_FILENAME_LEN) {
+            fprintf(stderr, "File name '%s' is too long (maximum length is %d characters).\n", name, MAX_FILENAME_LEN - 1);
+            failed++;
+            continue;
+        }
+
+        if (bulk->num_files == bulk->capacity) {
+            grown = (BulkFile *)realloc(bulk->files, (bulk->capacity * 2 + 64) * sizeof(BulkFile));
+            if (!grown) {
+                fprintf(stderr, "Failed to allocate memory.\n");
+                failed++;
+                break;
+            }
+            bulk->files = grown;
+            bulk->capacity = bulk->capacity * 2 + 64;
+        }
+        file = &bulk->files[bulk->num_files++];
+        memset(file, 0, sizeof(BulkFile));
+        strcpy(file->path, path);
+        strcpy(file->name, name);
+        file->file_size = st.st_size;
+    }
+    closedir(dir);
+    return failed;
+}
+
+/* Splits the next blocks of a central allocation off for one file. */
+unsigned int carve_extents(const Extent *pool, unsigned int *index, unsigned int *taken, unsigned int blocks, Extent *extents) {
+    unsigned int count = 0;
+    unsigned int length;
+
+    while (blocks > 0) {
+        length = pool[*index].length - *taken;
+        if (length > blocks) {
+            length = blocks;
+        }
+        extents[count].start = pool[*index].start + *taken;
+        extents[count].length = length;
+        count++;
+        blocks -= length;
+        *taken += length;
+        if (*taken == pool[*index].length) {
+            (*index)++;
+            *taken = 0;
+        }
+    }
+    return count;
+}
+
+/* Copies a host file into its blocks with positional I/O, so that threads need no shared file position.
+   Inline files are read into their inode. */
+int write_bulk_file(Disk *disk, BulkFile *file, unsigned char *buffer, Stats *stats) {
+    disk_offset position = 0;
+    unsigned long size = buffer_size(disk, IO_BUFFER_SIZE);
+    disk_offset offset, length;
+    unsigned long chunk;
+    ssize_t bytes_read;
+    unsigned int done = 0;
+    unsigned int i, j;
+    int source;
+    int result = 0;
+
+    source = open(file->path, O_RDONLY);
+    if (source < 0) {
+        perror(file->path);
+        return -1;
+    }
+    if (stores_inline(disk, file->file_size) &&
+        pread(source, file->inode.extents, file->file_size, 0) != (ssize_t)file->file_size) {
+        perror(file->path);
+        result = -1;
+    }
+    if (checksums_enabled(disk) && file->num_extents > 0) {
+        file->sums = (unsigned int *)malloc(blocks_for_bytes(disk, file->file_size) * sizeof(unsigned int));
+        if (!file->sums) {
+            result = -1;
+        }
+    }
+    for (i = 0; i < file->num_extents && result == 0; i++) {
+        offset = data_block_offset(&disk->metadata, file->extents[i].start);
+        length = blocks_to_bytes(disk, file->extents[i].length);
+        while (length > 0) {
+            chunk = length < size ? length : size;
+            bytes_read = pread(source, buffer, chunk, (off_t)position);
+            if (bytes_read < 0) {
+                perror(file->path);
+                result = -1;
+                break;
+            }
+            memset(buffer + bytes_read, 0, chunk - bytes_read);
+            count_io(stats, true, offset, chunk);
+            if (pwrite(fileno(disk->file), buffer, chunk, (off_t)offset) != (ssize_t)chunk) {
+                perror(file->path);
+                result = -1;
+                break;
+            }
+            for (j = 0; file->sums && j < bytes_to_blocks(disk, chunk); j++) {
+                file->sums[done++] = block_sum(disk, buffer + blocks_to_bytes(disk, j));
+            }
+            position += chunk;
+            offset += chunk;
+            length -= chunk;
+        }
+    }
+    close(source);
+    return result;
+}
+
+void *bulk_worker(void *argument) {
+    BulkImport *bulk = (BulkImport *)argument;
+    unsigned char *buffer = (unsigned char *)malloc(IO_BUFFER_SIZE);
+    unsigned int i;
+    Stats stats;
+
+    memset(&stats, 0, sizeof(Stats));
+    for (;;) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&bulk->lock);
+#endif
+        i = bulk->next++;
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&bulk->lock);
+#endif
+        if (i >= bulk->num_files) {
+            break;
+        }
+        if (bulk->files[i].status == 0) {
+            bulk->files[i].status = buffer ? write_bulk_file(bulk->disk, &bulk->files[i], buffer, &stats) : -1;
+        }
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&bulk->lock);
+#endif
+    merge_stats(&stats);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&bulk->lock);
+#endif
+    free(buffer);
+    return NULL;
+}
+
+/* Runs one worker per online CPU; without threads the calling thread does all the work. */
+void run_workers(void *(*worker)(void *), void *work) {
+#ifdef HAVE_PTHREAD
+    pthread_t threads[BULK_MAX_THREADS];
+    unsigned int count = BULK_MAX_THREADS;
+    unsigned int started, i;
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus > 0 && cpus < BULK_MAX_THREADS) {
+        count = cpus;
+    }
+#endif
+    for (started = 0; started < count && pthread_create(&threads[started], NULL, worker, work) == 0; started++) {
+    }
+    if (started == 0) {
+        worker(work);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+#else
+    worker(work);
+#endif
+}
+
+/* Imports every regular file below a host directory, named by its relative path.
+   Space for all files is allocated at once, the data is written by worker threads
+   straight into the new blocks, and the metadata is added in one pass and committed
+   together (in groups, when it does not fit into the journal at once). */
+int bulk_import(Disk *disk, const char *directory) {
+    BulkImport bulk;
+    BulkFile *file;
+    Extent *pool = NULL;
+    Extent *carved = NULL;
+    Inode inode;
+    unsigned long total = 0;
+    unsigned int num_pool = 0;
+    unsigned int pool_index = 0;
+    unsigned int pool_taken = 0;
+    unsigned int carved_used = 0;
+    unsigned int blocks, number, imported, i, j;
+    int failed;
+    int previous;
+
+    if (is_legacy_image(&disk->metadata)) {
+        fprintf(stderr, "Disk uses the legacy chained format and is read-only.\n");
+        return -1;
+    }
+
+    memset(&bulk, 0, sizeof(BulkImport));
+    bulk.disk = disk;
+    failed = collect_host_files(&bulk, directory, "");
+
+    /* Deduplication looks every block up in order, so such a disk takes the files one by one. */
+    if (dedup_enabled(disk)) {
+        imported = 0;
+        for (i = 0; i < bulk.num_files; i++) {
+            if (import_file_from(disk, bulk.files[i].name, bulk.files[i].path, false) == 0) {
+                imported++;
+            } else {
+                failed++;
+            }
+            if (disk->num_pages * 2 >= disk->page_capacity) {
+                sync_disk(disk);
+            }
+        }
+        sync_disk(disk);
+        free(bulk.files);
+        printf("%u of %u files from '%s' copied to virtual disk.\n", imported, bulk.num_files, directory);
+        return failed;
+    }
+
+    /* Names are checked here; missing directories are only made once a file's data is stored. */
+    for (i = 0; i < bulk.num_files; i++) {
+        file = &bulk.files[i];
+        file->parent = find_parent(disk, file->name, file->leaf, false);
+        if (file->leaf[0] == '\0' || (has_directories(&disk->metadata) ? !valid_components(file->name) : file->parent == NO_INODE)) {
+            fprintf(stderr, "Invalid file name '%s' (names are at most %d characters and only directories hold files).\n",
+                    file->name, MAX_FILENAME_LEN - 1);
+            file->status = 1;
+            failed++;
+            continue;
+        }
+        if (file->parent != NO_INODE && find_entry(disk, file->parent, file->leaf, &inode) != NO_INODE) {
+            fprintf(stderr, "File '%s' already exists on disk.\n", file->name);
+            file->status = 1;
+            failed++;
+            continue;
+        }
+        if (file->file_size > max_file_size(&disk->metadata) || file->file_size > blocks_to_bytes(disk, disk->metadata.num_blocks)) {
+            fprintf(stderr, "Not enough space on disk for '%s'.\n", file->name);
+            file->status = 1;
+            failed++;
+            continue;
+        }
+        if (!stores_inline(disk, file->file_size)) {
+            total += blocks_for_bytes(disk, file->file_size);
+        }
+    }
+
+    disk->dirty = true;
+    if (total > disk->metadata.free_blocks && disk->num_deferred > 0) {
+        sync_disk(disk);
+    }
+    if (total <= disk->metadata.free_blocks) {
+        pool = allocate_extents(disk, total, &num_pool);
+    }
+    if (pool) {
+        carved = (Extent *)malloc((num_pool + bulk.num_files) * sizeof(Extent));
+        if (!carved) {
+            for (i = 0; i < num_pool; i++) {
+                release_extent(disk, &pool[i]);
+            }
+            free(pool);
+            pool = NULL;
+        }
+    }
+
+    /* Without one allocation for everything, files are placed one by one while space lasts. */
+    for (i = 0; i < bulk.num_files; i++) {
+        file = &bulk.files[i];
+        if (file->status != 0) {
+            continue;
+        }
+        if (stores_inline(disk, file->file_size)) {
+            file->inode.first_block = NO_BLOCK;
+            file->inode.extent_block = NO_BLOCK;
+            continue;
+        }
+        blocks = blocks_for_bytes(disk, file->file_size);
+        if (pool) {
+            file->extents = carved + carved_used;
+            file->num_extents = carve_extents(pool, &pool_index, &pool_taken, blocks, file->extents);
+            carved_used += file->num_extents;
+        } else {
+            file->extents = allocate_extents(disk, blocks, &file->num_extents);
+        }
+        if (!file->extents || store_extents(disk, &file->inode, file->extents, file->num_extents) != 0) {
+            fprintf(stderr, "Not enough space on disk for '%s'.\n", file->name);
+            if (file->extents) {
+                for (number = 0; number < file->num_extents; number++) {
+                    release_extent(disk, &file->extents[number]);
+                }
+                release_extent_blocks(disk, &file->inode);
+            }
+            file->status = 1;
+            failed++;
+        }
+    }
+    free(pool);
+
+    fflush(disk->file);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&bulk.lock, NULL);
+#endif
+    previous = enter_phase(PHASE_COPY);
+    run_workers(bulk_worker, &bulk);
+    enter_phase(previous);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&bulk.lock);
+#endif
+    fflush(disk->file);
+
+    imported = 0;
+    for (i = 0; i < bulk.num_files; i++) {
+        file = &bulk.files[i];
+        if (file->status == 1) {
+            continue;
+        }
+        if (file->status != 0) {
+            release_file_blocks(disk, &file->inode);
+            failed++;
+            continue;
+        }
+        if (file->parent == NO_INODE) {
+            file->parent = find_parent(disk, file->name, file->leaf, true);
+        }
+        if (file->parent == NO_INODE) {
+            fprintf(stderr, "Failed to make the directories of '%s' (only directories hold files).\n", file->name);
+            release_file_blocks(disk, &file->inode);
+            failed++;
+            continue;
+        }
+        number = allocate_inode(disk);
+        if (number == NO_INODE || link_entry(disk, file->parent, file->leaf, number) != 0) {
+            fprintf(stderr, "No room in the catalog for '%s'.\n", file->name);
+            if (number != NO_INODE) {
+                release_inode(disk, number);
+            }
+            release_file_blocks(disk, &file->inode);
+            failed++;
+            continue;
+        }
+        strcpy(file->inode.file_name, file->leaf);
+        set_inode_size(&disk->metadata, &file->inode, file->file_size);
+        file->inode.file_type = (file->leaf[0] == '.') ? TYPE_HIDDEN : 0;
+        write_inode(disk, number, &file->inode);
+        for (blocks = 0, j = 0; file->sums && j < file->num_extents; j++) {
+            write_sums(disk, file->extents[j].start, file->sums + blocks, file->extents[j].length);
+            blocks += file->extents[j].length;
+        }
+        imported++;
+        if (disk->num_pages * 2 >= disk->page_capacity) {
+            sync_disk(disk);
+        }
+    }
+    sync_disk(disk);
+
+    for (i = 0; i < bulk.num_files; i++) {
+        free(bulk.files[i].sums);
+        if (!carved) {
+            free(bulk.files[i].extents);
+        }
+    }
+    free(carved);
+    free(bulk.files);
+
+    printf("%u of %u files from '%s' copied to virtual disk.\n", imported, bulk.num_files, directory);
+    return failed;
+}
+
+/* The chain is read through a window that doubles while the next block follows the window,
+   so sequentially written files are read in large pieces and scattered ones block by block. */
+int copy_legacy_chain(Disk *disk, const Inode *inode, int output, unsigned char *buffer) {
+    struct iovec vectors[EXPORT_VECTORS];
+    int count;
+    unsigned int num_blocks = disk->metadata.num_blocks;
+    unsigned int current_block;
+    unsigned int bytes_remaining;
+    unsigned int bytes_to_write;
+    unsigned int base, blocks;
+    unsigned int window = 1;
+    unsigned int max_window = bytes_to_blocks(disk, buffer_size(disk, EXPORT_BUFFER_SIZE));
+    unsigned char *block;
+
+    current_block = inode->first_block;
+    bytes_remaining = inode->file_size;
+
+    while (current_block < num_blocks && bytes_remaining > 0) {
+        base = current_block;
+        blocks = num_blocks - base < window ? num_blocks - base : window;
+        if (disk_read(disk, data_block_offset(&disk->metadata, base), buffer, blocks_to_bytes(disk, blocks)) != 0) {
+            return -1;
+        }
+
+        count = 0;
+        while (current_block >= base && current_block - base < blocks && bytes_remaining > 0 && count < EXPORT_VECTORS) {
+            block = buffer + blocks_to_bytes(disk, current_block - base);
+            bytes_to_write = (bytes_remaining < disk->block_size) ? bytes_remaining : disk->block_size;
+            add_vector(vectors, &count, block, bytes_to_write);
+            bytes_remaining -= bytes_to_write;
+            memcpy(&current_block, block + disk->block_size - sizeof(int), sizeof(int));
+        }
+        if (write_vectors(output, vectors, count) != 0) {
+            return -1;
+        }
+
+        if (current_block == base + blocks) {
+            window = window * 2 < max_window ? window * 2 : max_window;
+        } else {
+            window = 1;
+        }
+    }
+    return 0;
+}
+
+/* Unpacks a compressed file frame by frame. Whole blocks are read into packed until the next
+   frame is complete there; the unpacked chunks collect in buffer, which is written when full. */
+int export_packed(Disk *disk, const Extent *extents, unsigned int num_extents, disk_offset bytes, int fd, unsigned char *buffer) {
+    struct iovec vector;
+    unsigned long size = buffer_size(disk, EXPORT_BUFFER_SIZE);
+    unsigned long capacity = buffer_size(disk, 2 * (sizeof(unsigned int) + LZ_CHUNK));
+    unsigned long filled = 0;
+    unsigned long have = 0;
+    unsigned long used = 0;
+    unsigned long length, raw;
+    unsigned int total = 0;
+    unsigned int next = 0;
+    unsigned int header, count, i;
+    unsigned char *packed;
+    int result = 0;
+
+    packed = (unsigned char *)malloc(capacity);
+    if (!packed) {
+        return -1;
+    }
+    for (i = 0; i < num_extents; i++) {
+        total += extents[i].length;
+    }
+
+    while (bytes > 0 && result == 0) {
+        if (have - used >= sizeof(header)) {
+            memcpy(&header, packed + used, sizeof(header));
+            length = header & ~LZ_STORED;
+        }
+        if (have - used < sizeof(header) || have - used - sizeof(header) < length) {
+            memmove(packed, packed + used, have - used);
+            have -= used;
+            used = 0;
+            count = bytes_to_blocks(disk, capacity - have);
+            if (count > total - next) {
+                count = total - next;
+            }
+            if (count == 0 || file_blocks_io(disk, extents, num_extents, next, packed + have, count, false) != 0) {
+                result = -1;
+            }
+            next += count;
+            have += blocks_to_bytes(disk, count);
+            continue;
+        }
+
+        raw = bytes < LZ_CHUNK ? bytes : LZ_CHUNK;
+        if (size - filled < raw) {
+            vector.iov_base = buffer;
+            vector.iov_len = filled;
+            result = write_vectors(fd, &vector, 1);
+            filled = 0;
+        }
+        if (header & LZ_STORED) {
+            if (length != raw) {
+                result = -1;
+            } else {
+                memcpy(buffer + filled, packed + used + sizeof(header), raw);
+            }
+        } else if (lz_decompress(packed + used + sizeof(header), length, buffer + filled, raw) != (long)raw) {
+            result = -1;
+        }
+        used += sizeof(header) + length;
+        filled += raw;
+        bytes -= raw;
+    }
+    free(packed);
+
+    if (result == 0 && filled > 0) {
+        vector.iov_base = buffer;
+        vector.iov_len = filled;
+        result = write_vectors(fd, &vector, 1);
+    }
+    return result;
+}
+
+/* Makes the missing host directories above path, as mkdir -p does; open then reports
+   any that could not be made. */
+void make_host_parents(const char *path) {
+    char prefix[HOST_PATH_LEN];
+    struct stat info;
+    size_t length;
+
+    for (length = 1; length < HOST_PATH_LEN && path[length] != '\0'; length++) {
+        if (path[length] == '/' && path[length - 1] != '/') {
+            memcpy(prefix, path, length);
+            prefix[length] = '\0';
+            if (stat(prefix, &info) != 0) {
+                mkdir(prefix, 0777);
+            }
+        }
+    }
+}
+
+/* Copies a file out of the disk to the same path on the host, making its directories. */
+int export_file(Disk *disk, const char *output_filename) {
+    struct iovec vector;
+    int output;
+    int result;
+    Inode file_inode;
+    Extent *extents = NULL;
+    unsigned char *buffer;
+    unsigned int bad_sums = disk->bad_sums;
+    int previous;
+
+    if (find_file(disk, output_filename, &file_inode) == NO_INODE) {
+        printf("File '%s' not found on disk.\n", output_filename);
+        return -1;
+    }
+    if (file_inode.file_type & TYPE_DIRECTORY) {
+        fprintf(stderr, "'%s' is a directory.\n", output_filename);
+        return -1;
+    }
+
+    make_host_parents(output_filename);
+    output = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (output < 0) {
+        perror("Failed to create output file");
+        return -1;
+    }
+
+    if (is_inline(disk, &file_inode)) {
+        vector.iov_base = file_inode.extents;
+        vector.iov_len = file_inode.file_size;
+        result = write_vectors(output, &vector, 1);
+        if (close(output) != 0 || result != 0) {
+            fprintf(stderr, "Failed to write output file '%s'.\n", output_filename);
+            unlink(output_filename);
+            return -1;
+        }
+        printf("File '%s' copied from virtual disk.\n", output_filename);
+        return 0;
+    }
+
+    buffer = (unsigned char *)malloc(buffer_size(disk, EXPORT_BUFFER_SIZE));
+    if (!is_legacy_image(&disk->metadata)) {
+        extents = load_extents(disk, &file_inode);
+    }
+    if (!buffer || (!extents && !is_legacy_image(&disk->metadata))) {
+        fprintf(stderr, "Failed to read extents of file '%s'.\n", output_filename);
+        free(buffer);
+        close(output);
+        unlink(output_filename);
+        return -1;
+    }
+
+    previous = enter_phase(PHASE_COPY);
+    if (extents && is_compressed(disk, &file_inode)) {
+        result = export_packed(disk, extents, file_inode.num_extents, inode_size(&disk->metadata, &file_inode), output, buffer);
+    } else if (extents) {
+        result = export_extents(disk, extents, file_inode.num_extents, inode_size(&disk->metadata, &file_inode), output, buffer);
+    } else {
+        result = copy_legacy_chain(disk, &file_inode, output, buffer);
+    }
+    enter_phase(previous);
+    free(extents);
+    free(buffer);
+
+    /* A partial copy is worse than none, so it is removed. */
+    if (close(output) != 0 || result != 0) {
+        if (disk->bad_sums != bad_sums) {
+            fprintf(stderr, "File '%s' is damaged on the virtual disk (checksum mismatch).\n", output_filename);
+        } else {
+            fprintf(stderr, "Failed to write output file '%s'.\n", output_filename);
+        }
+        unlink(output_filename);
+        return -1;
+    }
+
+    printf("File '%s' copied from virtual disk.\n", output_filename);
+    return 0;
+}
+
+/* The extent holding file block block: the last one that starts at or before it. */
+unsigned int find_extent(const OpenFile *file, unsigned int block) {
+    unsigned int low = 0;
+    unsigned int high = file->inode.num_extents;
+    unsigned int middle;
+
+    while (high - low > 1) {
+        middle = low + (high - low) / 2;
+        if (file->starts[middle] <= block) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/* Copies length stored bytes from position on into out. The blocks around them are read
+   whole and checked, at most one extent run of buffer_size(IO_BUFFER_SIZE) bytes per call,
+   and kept for the next call while it needs no other blocks. */
+int read_stored(Disk *disk, OpenFile *file, disk_offset position, unsigned char *out, unsigned long length) {
+    unsigned int max_count = bytes_to_blocks(disk, buffer_size(disk, IO_BUFFER_SIZE));
+    unsigned int block, extent, physical, count;
+    unsigned long skip, piece;
+
+    while (length > 0) {
+        block = bytes_to_blocks(disk, position);
+        if (block >= file->starts[file->inode.num_extents]) {
+            return -1;
+        }
+        if (block < file->loaded || block - file->loaded >= file->num_loaded) {
+            skip = position - blocks_to_bytes(disk, block);
+            extent = find_extent(file, block);
+            physical = file->extents[extent].start + (block - file->starts[extent]);
+            count = blocks_for_bytes(disk, skip + length) < max_count ? blocks_for_bytes(disk, skip + length) : max_count;
+            if (count > file->starts[extent + 1] - block) {
+                count = file->starts[extent + 1] - block;
+            }
+            file->num_loaded = 0;
+            if (disk_read(disk, data_block_offset(&disk->metadata, physical), file->blocks, blocks_to_bytes(disk, count)) != 0 ||
+                verify_sums(disk, physical, file->blocks, count) != 0) {
+                return -1;
+            }
+            file->loaded = block;
+            file->num_loaded = count;
+        }
+        skip = position - blocks_to_bytes(disk, file->loaded);
+        piece = blocks_to_bytes(disk, file->num_loaded) - skip < length ? blocks_to_bytes(disk, file->num_loaded) - skip : length;
+        memcpy(out, file->blocks + skip, piece);
+        out += piece;
+        position += piece;
+        length -= piece;
+    }
+    return 0;
+}
+
+/* Finds where every frame of a compressed file is stored, reading only the frame headers. */
+int index_frames(Disk *disk, OpenFile *file) {
+    disk_offset stored = blocks_to_bytes(disk, file->starts[file->inode.num_extents]);
+    disk_offset position = 0;
+    unsigned long k;
+    unsigned int header;
+
+    file->num_frames = (file->size + LZ_CHUNK - 1) / LZ_CHUNK;
+    file->frames = (disk_offset *)malloc((file->num_frames + 1) * sizeof(disk_offset));
+    file->packed = (unsigned char *)malloc(sizeof(unsigned int) + LZ_BOUND(LZ_CHUNK));
+    file->raw = (unsigned char *)malloc(LZ_CHUNK);
+    if (!file->frames || !file->packed || !file->raw) {
+        return -1;
+    }
+    for (k = 0; k < file->num_frames; k++) {
+        file->frames[k] = position;
+        if (stored - position < sizeof(header) ||
+            read_stored(disk, file, position, (unsigned char *)&header, sizeof(header)) != 0 ||
+            (header & ~LZ_STORED) > LZ_BOUND(LZ_CHUNK) ||
+            stored - position - sizeof(header) < (header & ~LZ_STORED)) {
+            return -1;
+        }
+        position += sizeof(header) + (header & ~LZ_STORED);
+    }
+    file->frames[k] = position;
+    return 0;
+}
+
+void close_file(OpenFile *file) {
+    free(file->extents);
+    free(file->starts);
+    free(file->frames);
+    free(file->blocks);
+    free(file->packed);
+    free(file->raw);
+    memset(file, 0, sizeof(OpenFile));
+}
+
+/* Opens a file for read_file_at. Legacy images keep blocks in a chain, which has no index. */
+int open_file(Disk *disk, const char *path, OpenFile *file) {
+    unsigned int i;
+
+    memset(file, 0, sizeof(OpenFile));
+    if (find_file(disk, path, &file->inode) == NO_INODE) {
+        fprintf(stderr, "File '%s' not found on disk.\n", path);
+        return -1;
+    }
+    if (file->inode.file_type & TYPE_DIRECTORY) {
+        fprintf(stderr, "'%s' is a directory.\n", path);
+        return -1;
+    }
+    if (is_legacy_image(&disk->metadata)) {
+        fprintf(stderr, "Ranged reads need a newer image; export '%s' instead.\n", path);
+        return -1;
+    }
+    file->size = inode_size(&disk->metadata, &file->inode);
+    if (is_inline(disk, &file->inode)) {
+        return 0;
+    }
+
+    file->extents = load_extents(disk, &file->inode);
+    file->starts = (unsigned int *)malloc((file->inode.num_extents + 1) * sizeof(unsigned int));
+    file->blocks = (unsigned char *)malloc(buffer_size(disk, IO_BUFFER_SIZE));
+    if (!file->extents || !file->starts || !file->blocks) {
+        fprintf(stderr, "Failed to read extents of file '%s'.\n", path);
+        close_file(file);
+        return -1;
+    }
+    file->starts[0] = 0;
+    for (i = 0; i < file->inode.num_extents; i++) {
+        file->starts[i + 1] = file->starts[i] + file->extents[i].length;
+    }
+    if (is_compressed(disk, &file->inode) && index_frames(disk, file) != 0) {
+        fprintf(stderr, "Failed to read frames of file '%s'.\n", path);
+        close_file(file);
+        return -1;
+    }
+    file->cached = file->num_frames;
+    return 0;
+}
+
+/* Reads up to length bytes from offset on into buffer and returns how many were read,
+   0 at the end of the file and -1 on errors. A compressed file unpacks only the frames
+   that overlap the range. */
+long read_file_at(Disk *disk, OpenFile *file, disk_offset offset, unsigned char *buffer, unsigned long length) {
+    unsigned long done = 0;
+    unsigned long frame, skip, raw, piece;
+    unsigned int header;
+
+    if (offset >= file->size) {
+        return 0;
+    }
+    if (length > file->size - offset) {
+        length = file->size - offset;
+    }
+    if (is_inline(disk, &file->inode)) {
+        memcpy(buffer, (unsigned char *)file->inode.extents + offset, length);
+        return (long)length;
+    }
+    if (!file->frames) {
+        return read_stored(disk, file, offset, buffer, length) == 0 ? (long)length : -1;
+    }
+
+    while (done < length) {
+        frame = (offset + done) / LZ_CHUNK;
+        skip = (offset + done) % LZ_CHUNK;
+        raw = file->size - (disk_offset)frame * LZ_CHUNK < LZ_CHUNK ? file->size - (disk_offset)frame * LZ_CHUNK : LZ_CHUNK;
+        if (frame != file->cached) {
+            file->cached = file->num_frames;
+            if (read_stored(disk, file, file->frames[frame], file->packed, file->frames[frame + 1] - file->frames[frame]) != 0) {
+                return -1;
+            }
+            memcpy(&header, file->packed, sizeof(header));
+            if (header & LZ_STORED) {
+                if ((header & ~LZ_STORED) != raw) {
+                    return -1;
+                }
+                memcpy(file->raw, file->packed + sizeof(header), raw);
+            } else if (lz_decompress(file->packed + sizeof(header), header, file->raw, raw) != (long)raw) {
+                return -1;
+            }
+            file->cached = frame;
+        }
+        piece = raw - skip < length - done ? raw - skip : length - done;
+        memcpy(buffer + done, file->raw + skip, piece);
+        done += piece;
+    }
+    return (long)length;
+}
+
+/* Writes length bytes of a file from offset on to fd, stopping early at the end of the file. */
+int read_range(Disk *disk, const char *path, disk_offset offset, disk_offset length, int fd) {
+    struct iovec vector;
+    OpenFile file;
+    unsigned long size = buffer_size(disk, EXPORT_BUFFER_SIZE);
+    unsigned char *buffer;
+    long count;
+    int result = 0;
+    int previous;
+
+    if (open_file(disk, path, &file) != 0) {
+        return -1;
+    }
+    buffer = (unsigned char *)malloc(size);
+    if (!buffer) {
+        close_file(&file);
+        return -1;
+    }
+
+    /* Output printed earlier by a batch must come first. */
+    fflush(stdout);
+    previous = enter_phase(PHASE_COPY);
+    while (length > 0 && result == 0) {
+        count = read_file_at(disk, &file, offset, buffer, length < size ? length : size);
+        if (count <= 0) {
+            result = (int)count;
+            break;
+        }
+        vector.iov_base = buffer;
+        vector.iov_len = count;
+        result = write_vectors(fd, &vector, 1);
+        offset += count;
+        length -= count;
+    }
+    enter_phase(previous);
+    free(buffer);
+    close_file(&file);
+
+    if (result != 0) {
+        fprintf(stderr, "Failed to read file '%s'.\n", path);
+    }
+    return result;
+}
+
+/* A directory is removed only when empty; its table blocks are freed like overflow blocks. */
+int delete_file(Disk *disk, const char *file_name) {
+    Directory dir;
+    Inode inode;
+    Extent *extents;
+    char leaf[MAX_FILENAME_LEN];
+    unsigned int parent, inode_number, slot, i;
+
+    if (is_legacy_image(&disk->metadata)) {
+        fprintf(stderr, "Disk uses the legacy chained format and is read-only.\n");
+        return -1;
+    }
+
+    parent = find_parent(disk, file_name, leaf, false);
+    inode_number = NO_INODE;
+    if (parent != NO_INODE && leaf[0] != '\0' && open_directory(disk, parent, &dir) == 0) {
+        inode_number = directory_lookup(disk, &dir, leaf, &inode, &slot);
+        if (inode_number == NO_INODE) {
+            close_directory(&dir);
+        }
+    }
+    if (inode_number == NO_INODE) {
+        fprintf(stderr, "Plik '%s' nie istnieje na dysku.\n", file_name);
+        return -1;
+    }
+    if ((inode.file_type & TYPE_DIRECTORY) && inode.first_block > 0) {
+        fprintf(stderr, "Directory '%s' is not empty.\n", file_name);
+        close_directory(&dir);
+        return -1;
+    }
+
+    disk->dirty = true;
+    if (inode.file_type & TYPE_DIRECTORY) {
+        extents = load_extents(disk, &inode);
+        for (i = 0; extents && i < inode.num_extents; i++) {
+            release_extent(disk, &extents[i]);
+        }
+        free(extents);
+        release_extent_blocks(disk, &inode);
+        forget_directory(disk, parent, leaf);
+    } else {
+        release_file_blocks(disk, &inode);
+    }
+    directory_remove(disk, &dir, slot);
+    close_directory(&dir);
+    release_inode(disk, inode_number);
+
+    printf("File '%s' was removed from virtual disk.\n", file_name);
+    return 0;
+}
+
+int make_directory(Disk *disk, const char *path) {
+    Inode inode;
+    char leaf[MAX_FILENAME_LEN];
+    unsigned int parent;
+
+    if (!has_directories(&disk->metadata)) {
+        fprintf(stderr, "Disk format version %u has no directories.\n", disk->metadata.version);
+        return -1;
+    }
+    parent = find_parent(disk, path, leaf, true);
+    if (parent == NO_INODE || leaf[0] == '\0') {
+        fprintf(stderr, "Invalid directory name '%s' (names are at most %d characters and only directories hold files).\n", path, MAX_FILENAME_LEN - 1);
+        return -1;
+    }
+    if (find_entry(disk, parent, leaf, &inode) != NO_INODE) {
+        fprintf(stderr, "File '%s' already exists on disk.\n", path);
+        return -1;
+    }
+    if (enter_directory(disk, parent, leaf, true) == NO_INODE) {
+        fprintf(stderr, "Not enough space on disk for directory '%s'.\n", path);
+        return -1;
+    }
+    printf("Directory '%s' created on virtual disk.\n", path);
+    return 0;
+}
+
+/* Adds the blocks of one file in runs of at most buffer_size(IO_BUFFER_SIZE) bytes. */
+int add_scrub_runs(Scrub *scrub, const Extent *extents, unsigned int num_extents) {
+    ScrubRun *grown;
+    unsigned int max_run = bytes_to_blocks(scrub->disk, buffer_size(scrub->disk, IO_BUFFER_SIZE));
+    unsigned int start, remaining, i;
+
+    for (i = 0; i < num_extents; i++) {
+        for (start = extents[i].start, remaining = extents[i].length; remaining > 0; ) {
+            if (scrub->num_runs == scrub->capacity) {
+                grown = (ScrubRun *)realloc(scrub->runs, (scrub->capacity * 2 + 64) * sizeof(ScrubRun));
+                if (!grown) {
+                    return -1;
+                }
+                scrub->runs = grown;
+                scrub->capacity = scrub->capacity * 2 + 64;
+            }
+            scrub->runs[scrub->num_runs].start = start;
+            scrub->runs[scrub->num_runs].length = remaining < max_run ? remaining : max_run;
+            scrub->runs[scrub->num_runs].file = scrub->num_files;
+            start += scrub->runs[scrub->num_runs].length;
+            remaining -= scrub->runs[scrub->num_runs].length;
+            scrub->num_runs++;
+        }
+    }
+    return 0;
+}
+
+void *scrub_worker(void *argument) {
+    Scrub *scrub = (Scrub *)argument;
+    Disk *disk = scrub->disk;
+    ScrubRun *run;
+    unsigned char *buffer = NULL;
+    unsigned char *data;
+    disk_offset offset;
+    unsigned long length;
+    unsigned int i, j;
+    Stats stats;
+
+    memset(&stats, 0, sizeof(Stats));
+    if (!disk->map) {
+        buffer = (unsigned char *)malloc(buffer_size(disk, IO_BUFFER_SIZE));
+    }
+    for (;;) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&scrub->lock);
+#endif
+        i = scrub->next++;
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&scrub->lock);
+#endif
+        if (i >= scrub->num_runs) {
+            break;
+        }
+        run = &scrub->runs[i];
+        offset = data_block_offset(&disk->metadata, run->start);
+        length = blocks_to_bytes(disk, run->length);
+        count_io(&stats, false, offset, length);
+        if (disk->map) {
+            data = (unsigned char *)disk_ptr(disk, offset, length);
+        } else {
+            data = buffer && pread(fileno(disk->file), buffer, length, (off_t)offset) == (ssize_t)length ? buffer : NULL;
+        }
+
+        for (j = 0; j < run->length; j++) {
+            if (data && block_sum(disk, data + blocks_to_bytes(disk, j)) == scrub->sums[run->start + j]) {
+                continue;
+            }
+#ifdef HAVE_PTHREAD
+            pthread_mutex_lock(&scrub->lock);
+#endif
+            fprintf(stderr, "Block %u of file '%s' is damaged.\n", run->start + j, scrub->names + run->file * MAX_FILENAME_LEN);
+            scrub->damaged++;
+#ifdef HAVE_PTHREAD
+            pthread_mutex_unlock(&scrub->lock);
+#endif
+        }
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&scrub->lock);
+#endif
+    merge_stats(&stats);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&scrub->lock);
+#endif
+    free(buffer);
+    return NULL;
+}
+
+/* Checks every block of every file against the checksum table. The table is read
+   up front and the blocks are split into runs that worker threads read in parallel;
+   shared blocks of a deduplicating disk are checked once for each file using them. */
+int scrub_disk(Disk *disk) {
+    Scrub scrub;
+    Inode *inodes;
+    Extent *extents;
+    char *names;
+    unsigned int blocks, block, i;
+    int result = 0;
+    int previous;
+
+    if (!checksums_enabled(disk)) {
+        fprintf(stderr, "Disk has no block checksums.\n");
+        return -1;
+    }
+    sync_disk(disk);
+
+    memset(&scrub, 0, sizeof(Scrub));
+    scrub.disk = disk;
+    scrub.sums = (unsigned int *)malloc(inode_size(&disk->metadata, &disk->metadata.block_sums));
+    inodes = (Inode *)malloc(disk->inodes_per_block * sizeof(Inode));
+    if (!scrub.sums || !inodes || disk_read(disk, sum_offset(disk, 0), scrub.sums, inode_size(&disk->metadata, &disk->metadata.block_sums)) != 0) {
+        fprintf(stderr, "Failed to read the checksum table.\n");
+        free(scrub.sums);
+        free(inodes);
+        return -1;
+    }
+
+    blocks = (disk->metadata.num_inodes + disk->inodes_per_block - 1) / disk->inodes_per_block;
+    for (block = 0; block < blocks && result == 0; block++) {
+        if (disk_read(disk, data_block_offset(&disk->metadata,
+                      map_file_block(disk->catalog_extents, disk->metadata.catalog.num_extents, block)),
+                      inodes, disk->inodes_per_block * sizeof(Inode)) != 0) {
+            result = -1;
+            break;
+        }
+        for (i = 0; i < disk->inodes_per_block && block * disk->inodes_per_block + i < disk->metadata.num_inodes; i++) {
+            if (inodes[i].file_name[0] == '\0' || inodes[i].num_extents == 0 || (inodes[i].file_type & TYPE_DIRECTORY)) {
+                continue;
+            }
+            names = (char *)realloc(scrub.names, (scrub.num_files + 1) * MAX_FILENAME_LEN);
+            extents = load_extents(disk, &inodes[i]);
+            if (names) {
+                scrub.names = names;
+                memcpy(names + scrub.num_files * MAX_FILENAME_LEN, inodes[i].file_name, MAX_FILENAME_LEN);
+            }
+            if (!names || !extents || add_scrub_runs(&scrub, extents, inodes[i].num_extents) != 0) {
+                fprintf(stderr, "Failed to read extents of file '%s'.\n", inodes[i].file_name);
+                result = -1;
+            }
+            free(extents);
+            scrub.num_files++;
+        }
+    }
+    free(inodes);
+
+    if (result == 0) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_init(&scrub.lock, NULL);
+#endif
+        previous = enter_phase(PHASE_COPY);
+        run_workers(scrub_worker, &scrub);
+        enter_phase(previous);
+#ifdef HAVE_PTHREAD
+        pthread_mutex_destroy(&scrub.lock);
+#endif
+        for (i = 0; i < scrub.num_runs; i++) {
+            scrub.checked += scrub.runs[i].length;
+        }
+        printf("Scrub checked %lu blocks of %u files: %u damaged.\n", scrub.checked, scrub.num_files, scrub.damaged);
+        result = scrub.damaged == 0 ? 0 : -1;
+    }
+    free(scrub.runs);
+    free(scrub.names);
+    free(scrub.sums);
+    return result;
+}
+
+/* Number of physically separate runs; adjoining extents form one run. */
+unsigned int count_fragments(const Extent *extents, unsigned int num_extents) {
+    unsigned int fragments = 0;
+    unsigned int i;
+
+    for (i = 0; i < num_extents; i++) {
+        if (i == 0 || extents[i].start != extents[i - 1].start + extents[i - 1].length) {
+            fragments++;
+        }
+    }
+    return fragments;
+}
+
+int compare_fragments(const void *a, const void *b) {
+    unsigned int first = ((const DefragFile *)a)->fragments;
+    unsigned int second = ((const DefragFile *)b)->fragments;
+
+    return first > second ? -1 : first < second;
+}
+
+int compare_starts(const void *a, const void *b) {
+    unsigned int first = ((const DefragFile *)a)->start;
+    unsigned int second = ((const DefragFile *)b)->start;
+
+    return first < second ? -1 : first > second;
+}
+
+/* Walks the catalog and returns every file that has data blocks. With show, each file
+   made of more than one run and the totals are printed. */
+DefragFile *collect_files(Disk *disk, unsigned int *num_files, bool show) {
+    DefragFile *files = NULL;
+    DefragFile *grown;
+    DefragFile *file;
+    Inode *inodes;
+    Extent *extents;
+    unsigned int num_fragmented = 0;
+    unsigned long fragments = 0;
+    unsigned int blocks, block, i, j;
+    int failed = 0;
+
+    *num_files = 0;
+    inodes = (Inode *)malloc(disk->inodes_per_block * sizeof(Inode));
+    if (!inodes) {
+        return NULL;
+    }
+    blocks = (disk->metadata.num_inodes + disk->inodes_per_block - 1) / disk->inodes_per_block;
+    for (block = 0; block < blocks && !failed; block++) {
+        if (disk_read(disk, data_block_offset(&disk->metadata,
+                      map_file_block(disk->catalog_extents, disk->metadata.catalog.num_extents, block)),
+                      inodes, disk->inodes_per_block * sizeof(Inode)) != 0) {
+            failed = 1;
+            break;
+        }
+        for (i = 0; i < disk->inodes_per_block && block * disk->inodes_per_block + i < disk->metadata.num_inodes; i++) {
+            if (inodes[i].file_name[0] == '\0' || inodes[i].num_extents == 0 || (inodes[i].file_type & TYPE_DIRECTORY)) {
+                continue;
+            }
+            extents = load_extents(disk, &inodes[i]);
+            grown = (DefragFile *)realloc(files, (*num_files + 1) * sizeof(DefragFile));
+            if (!extents || !grown) {
+                fprintf(stderr, "Failed to read extents of file '%s'.\n", inodes[i].file_name);
+                free(extents);
+                if (grown) {
+                    files = grown;
+                }
+                failed = 1;
+                break;
+            }
+            files = grown;
+            file = &files[(*num_files)++];
+            file->number = block * disk->inodes_per_block + i;
+            file->start = extents[0].start;
+            file->blocks = 0;
+            for (j = 0; j < inodes[i].num_extents; j++) {
+                file->blocks += extents[j].length;
+            }
+            file->fragments = count_fragments(extents, inodes[i].num_extents);
+            fragments += file->fragments;
+            if (file->fragments > 1) {
+                num_fragmented++;
+                if (show) {
+                    printf("%-40s %10u blocks in %u fragments\n", inodes[i].file_name, file->blocks, file->fragments);
+                }
+            }
+            free(extents);
+        }
+    }
+    free(inodes);
 
-        num_blocks = (disk_size_bytes - reserved_space) / BLOCK_SIZE;
+    if (failed) {
+        free(files);
+        return NULL;
     }
-    return num_blocks;
+    if (show) {
+        printf("Files with data blocks: %u, fragmented: %u, fragments: %lu\n", *num_files, num_fragmented, fragments);
+    }
+    return files ? files : (DefragFile *)malloc(sizeof(DefragFile));
 }
 
-void initialize_disk(const char *filename, unsigned int disk_size_mb) {
-    FILE *disk;
-    unsigned int disk_size_bytes;
-    unsigned int num_blocks;
-    unsigned int block_bitmap_size_bytes;
-    unsigned int inode_bitmap_size_bytes;
-    unsigned long first_data_block;
-    DiskMetadata metadata;
-    bool *block_bitmap;
-    bool *inode_bitmap;
-    Inode *inode_catalog;
-    unsigned int remaining_bytes;
-    unsigned char zero_block[BLOCK_SIZE];
-    unsigned int i;
+void show_free_space(Disk *disk) {
+    unsigned int largest;
 
-    disk = fopen(filename, "wb");
-    if (!disk) {
-        perror("Failed to create disk file");
-        exit(EXIT_FAILURE);
+    if (disk->space.stale) {
+        build_space_index(disk);
     }
+    largest = space_largest(&disk->space);
+    printf("Free space: %u blocks in %u runs, largest run %u blocks\n", disk->metadata.free_blocks,
+           disk->space.count, largest ? disk->space.nodes[largest].length : 0);
+}
 
-    disk_size_bytes = disk_size_mb * 1024 * 1024;
-    num_blocks = count_blocks(disk_size_bytes);
-
-    block_bitmap_size_bytes = num_blocks * sizeof(bool);
-    inode_bitmap_size_bytes = MAX_FILES * sizeof(bool);
-    first_data_block = sizeof(DiskMetadata) + block_bitmap_size_bytes + inode_bitmap_size_bytes + (MAX_FILES * sizeof(Inode));
+/* A free run of at least blocks blocks. With before set, the first one that starts
+   below it; otherwise the smallest one, so that large runs stay whole. */
+unsigned int find_target_run(Disk *disk, unsigned int blocks, unsigned int before) {
+    SpaceIndex *space = &disk->space;
+    unsigned int node;
 
-    metadata.disk_size = disk_size_mb;
-    metadata.block_size = BLOCK_SIZE;
-    metadata.num_blocks = num_blocks;
-    metadata.first_data_block = first_data_block;
-    metadata.num_files = 0;
-    metadata.max_files = MAX_FILES;
+    if (space->stale && build_space_index(disk) != 0) {
+        return NO_BLOCK;
+    }
+    if (before != NO_BLOCK) {
+        node = space_first_fit(space, space->root[BY_ADDRESS], 0, blocks);
+        return node && space->nodes[node].start < before ? space->nodes[node].start : NO_BLOCK;
+    }
+    node = space_best_fit(space, blocks);
+    return node ? space->nodes[node].start : NO_BLOCK;
+}
 
-    block_bitmap = (bool *)calloc(num_blocks, sizeof(bool));
-    inode_bitmap = (bool *)calloc(MAX_FILES, sizeof(bool));
-    inode_catalog = (Inode *)calloc(MAX_FILES, sizeof(Inode));
+/* Moves a file into one run of free blocks with large sequential copies. The copy goes
+   to blocks no committed metadata points at, and the new inode, the allocation and the
+   release of the old blocks commit together, so a crash leaves either the old or the
+   new file. Returns 1 when no suitable free run exists. */
+int relocate_file(Defrag *defrag, const DefragFile *file, unsigned int before) {
+    Disk *disk = defrag->disk;
+    unsigned int chunk = bytes_to_blocks(disk, buffer_size(disk, IO_BUFFER_SIZE));
+    unsigned int done, count, i;
+    Inode inode, moved;
+    Extent *extents;
+    Extent run;
+    int previous;
+    int result = 0;
 
-    if (!block_bitmap || !inode_bitmap || !inode_catalog) {
-        perror("Failed to allocate memory");
-        fclose(disk);
-        exit(EXIT_FAILURE);
+    previous = enter_phase(PHASE_ALLOC);
+    /* Compaction commits the blocks freed by the previous move first, so each file can
+       slide into them and needs to move only once. */
+    if (before != NO_BLOCK && disk->num_deferred > 0) {
+        sync_disk(disk);
+    }
+    run.start = find_target_run(disk, file->blocks, before);
+    if (run.start == NO_BLOCK && disk->num_deferred > 0) {
+        sync_disk(disk);
+        run.start = find_target_run(disk, file->blocks, before);
+    }
+    enter_phase(previous);
+    if (run.start == NO_BLOCK) {
+        return 1;
+    }
+    if (read_inode(disk, file->number, &inode) != 0 || (extents = load_extents(disk, &inode)) == NULL) {
+        return -1;
     }
+    run.length = file->blocks;
+    mark_blocks(disk, run.start, run.length, true);
+    disk->dirty = true;
 
-    fwrite(&metadata, sizeof(DiskMetadata), 1, disk);
-    fwrite(block_bitmap, sizeof(bool), num_blocks, disk);
-    fwrite(inode_bitmap, sizeof(bool), MAX_FILES, disk);
-    fwrite(inode_catalog, sizeof(Inode), MAX_FILES, disk);
+    previous = enter_phase(PHASE_COPY);
+    for (done = 0; done < file->blocks && result == 0; done += count) {
+        count = file->blocks - done < chunk ? file->blocks - done : chunk;
+        if (file_blocks_io(disk, extents, inode.num_extents, done, defrag->buffer, count, false) != 0 ||
+            file_blocks_io(disk, &run, 1, done, defrag->buffer, count, true) != 0) {
+            result = -1;
+        }
+    }
+    enter_phase(previous);
 
-    remaining_bytes = disk_size_bytes - first_data_block;
-    memset(zero_block, 0, BLOCK_SIZE);
-    for (i = 0; i < remaining_bytes / BLOCK_SIZE; i++) {
-        fwrite(zero_block, BLOCK_SIZE, 1, disk);
+    moved = inode;
+    if (result != 0 || store_extents(disk, &moved, &run, 1) != 0) {
+        release_extent(disk, &run);
+        free(extents);
+        return -1;
+    }
+    release_extent_blocks(disk, &inode);
+    for (i = 0; i < inode.num_extents; i++) {
+        release_extent(disk, &extents[i]);
     }
+    write_inode(disk, file->number, &moved);
+    free(extents);
+    defrag->relocated++;
+    defrag->moved += blocks_to_bytes(disk, file->blocks);
+    return 0;
+}
 
-    printf("Disk initialized successfully.\n");
-    printf("Metadata: disk size = %u MB, number of blocks = %u\n", disk_size_mb, num_blocks);
-    printf("First data block starts at offset = %lu bytes\n", first_data_block);
+double seconds_since(const struct timeval *start) {
+    struct timeval now;
 
-    free(block_bitmap);
-    free(inode_bitmap);
-    free(inode_catalog);
-    fclose(disk);
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
 }
 
-void copy_file_to_disk(const char *disk_filename, const char *source_filename) {
-    FILE *disk;
-    FILE *source;
-    DiskMetadata metadata;
-    bool *block_bitmap;
-    bool *inode_bitmap;
-    int inode_index;
-    unsigned int free_block_count;
-    unsigned int file_size;
-    unsigned int blocks_needed;
-    unsigned int current_block;
+/* Moves the fragmented files into single runs or, when compact is set, slides the other
+   files, lowest first, down into the first free run below them. Returns 1 once the budget
+   is used up. */
+int move_files(Defrag *defrag, const DefragFile *files, unsigned int num_files, bool compact) {
     unsigned int i;
-    unsigned int next_block;
-    unsigned char buffer[BLOCK_SIZE];
-    unsigned int *free_blocks = NULL;
-    Inode inode;
-
-    if (strlen(source_filename) >= MAX_FILENAME_LEN) {
-        fprintf(stderr, "File name '%s' is too long (maximum length is %d characters).\n", 
-                source_filename, MAX_FILENAME_LEN - 1);
-        return;
-    }
-
-    disk = fopen(disk_filename, "r+b");
-    if (!disk) {
-        perror("Failed to open disk file");
-        return;
-    }
+    int result;
 
-    source = fopen(source_filename, "rb");
-    if (!source) {
-        perror("Failed to open source file");
-        fclose(disk);
-        return;
+    for (i = 0; i < num_files; i++) {
+        if (compact ? files[i].fragments > 1 : files[i].fragments < 2) {
+            continue;
+        }
+        if ((defrag->max_seconds > 0 && seconds_since(&defrag->start) >= defrag->max_seconds) ||
+            (defrag->max_bytes > 0 && defrag->moved >= defrag->max_bytes)) {
+            return 1;
+        }
+        result = relocate_file(defrag, &files[i], compact ? files[i].start : NO_BLOCK);
+        if (result < 0) {
+            fprintf(stderr, "Failed to move the file with inode %u.\n", files[i].number);
+            defrag->failed++;
+        } else if (result > 0 && !compact) {
+            defrag->skipped++;
+        }
+        if (defrag->disk->num_pages * 2 >= defrag->disk->page_capacity) {
+            sync_disk(defrag->disk);
+        }
     }
+    return 0;
+}
 
-    fread(&metadata, sizeof(DiskMetadata), 1, disk);
+/* Defragments in three passes: fragmented files, most fragmented first, move to the
+   best fitting free run; then files are compacted towards the start of the disk, which
+   merges free space; then the fragmented files that did not fit are tried again. The
+   run stops once max_seconds have passed or max_bytes have been copied, and a later run
+   continues from the state it left, as every move is committed on its own. */
+int defrag_disk(Disk *disk, double max_seconds, disk_offset max_bytes) {
+    Defrag defrag;
+    DefragFile *files;
+    unsigned int num_files;
+    int pass;
+    int stopped = 0;
 
-    if (metadata.num_files >= metadata.max_files) {
-        fprintf(stderr, "No space for a new file in the directory.\n");
-        fclose(disk);
-        fclose(source);
-        return;
+    if (is_legacy_image(&disk->metadata)) {
+        fprintf(stderr, "Disk uses the legacy chained format and is read-only.\n");
+        return -1;
     }
-
-    block_bitmap = (bool *)malloc(metadata.num_blocks * sizeof(bool));
-    inode_bitmap = (bool *)malloc(MAX_FILES * sizeof(bool));
-    if (!block_bitmap || !inode_bitmap) {
-        fprintf(stderr, "Failed to allocate memory for bitmaps.\n");
-        fclose(disk);
-        fclose(source);
-        free(block_bitmap);
-        free(inode_bitmap);
-        return;
+    if (dedup_enabled(disk)) {
+        fprintf(stderr, "Defragmentation is not supported on deduplicating disks.\n");
+        return -1;
     }
 
-    free_blocks = malloc(metadata.num_blocks * sizeof(unsigned int));
-    if (!free_blocks) {
-        fprintf(stderr, "Failed to allocate memory for free blocks array.\n");
-        free(block_bitmap);
-        free(inode_bitmap);
-        fclose(disk);
-        fclose(source);
-        return;
+    memset(&defrag, 0, sizeof(Defrag));
+    defrag.disk = disk;
+    defrag.max_seconds = max_seconds;
+    defrag.max_bytes = max_bytes;
+    gettimeofday(&defrag.start, NULL);
+    defrag.buffer = (unsigned char *)malloc(buffer_size(disk, IO_BUFFER_SIZE));
+    if (!defrag.buffer) {
+        fprintf(stderr, "Failed to allocate memory.\n");
+        return -1;
     }
+    sync_disk(disk);
 
-    fseek(disk, sizeof(DiskMetadata), SEEK_SET);
-    fread(block_bitmap, sizeof(bool), metadata.num_blocks, disk);
-    fread(inode_bitmap, sizeof(bool), MAX_FILES, disk);
-
-    inode_index = -1;
-    for (i = 0; i < MAX_FILES; i++) {
-        if (!inode_bitmap[i]) {
-            inode_index = i;
+    for (pass = 0; pass < 3 && !stopped; pass++) {
+        files = collect_files(disk, &num_files, pass == 0);
+        if (!files) {
+            defrag.failed++;
+            break;
+        }
+        if (pass == 0) {
+            show_free_space(disk);
+        }
+        qsort(files, num_files, sizeof(DefragFile), pass == 1 ? compare_starts : compare_fragments);
+        if (pass == 2) {
+            defrag.skipped = 0;
+        }
+        stopped = move_files(&defrag, files, num_files, pass == 1);
+        sync_disk(disk);
+        free(files);
+        if (pass == 1 && defrag.skipped == 0) {
             break;
         }
     }
-    if (inode_index == -1) {
-        fprintf(stderr, "No free inode.\n");
-        free(block_bitmap);
-        free(inode_bitmap);
-        fclose(disk);
-        fclose(source);
-        return;
+    free(defrag.buffer);
+
+    if (stopped) {
+        printf("Budget used up; run defrag again to continue.\n");
     }
+    printf("Moved %u files (%llu bytes) in %.3f s; %u fragmented files did not fit in any free run.\n",
+           defrag.relocated, defrag.moved, seconds_since(&defrag.start), defrag.skipped);
+    free(collect_files(disk, &num_files, true));
+    show_free_space(disk);
+    return defrag.failed == 0 ? 0 : -1;
+}
 
-    free_block_count = 0;
-    for (i = 0; i < metadata.num_blocks; i++) {
-        if (!block_bitmap[i]) {
-            free_blocks[free_block_count++] = i;
+/* Adds the blocks of a table to the map; pieces adjoining the previous one of the same type are merged. */
+int add_map_areas(MapArea **areas, unsigned int *count, const Extent *extents, unsigned int num_extents, const char *type) {
+    MapArea *grown;
+    MapArea *last;
+    unsigned int i;
+
+    grown = (MapArea *)realloc(*areas, (*count + num_extents) * sizeof(MapArea));
+    if (!grown) {
+        return -1;
+    }
+    *areas = grown;
+    for (i = 0; i < num_extents; i++) {
+        last = *count > 0 ? &grown[*count - 1] : NULL;
+        if (last && last->type == type && last->start + last->length == extents[i].start) {
+            last->length += extents[i].length;
+            continue;
         }
+        grown[*count].start = extents[i].start;
+        grown[*count].length = extents[i].length;
+        grown[*count].type = type;
+        (*count)++;
     }
+    return 0;
+}
 
-    fseek(source, 0, SEEK_END);
-    file_size = ftell(source);
-    rewind(source);
+int compare_map_areas(const void *a, const void *b) {
+    unsigned int first = ((const MapArea *)a)->start;
+    unsigned int second = ((const MapArea *)b)->start;
 
-    blocks_needed = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    if (blocks_needed > free_block_count) {
-        fprintf(stderr, "Not enough space on disk for this file.\n");
-        free(block_bitmap);
-        free(inode_bitmap);
-        fclose(disk);
-        fclose(source);
+    return first < second ? -1 : first > second;
+}
+
+void print_map_area(bool json, unsigned int *printed, disk_offset address, disk_offset size, const char *type, const char *status) {
+    if (size == 0) {
         return;
     }
+    if (json) {
+        printf("%s\n    {\"address\": %llu, \"type\": \"%s\", \"size\": %llu, \"status\": \"%s\"}",
+               *printed > 0 ? "," : "", address, type, size, status);
+    } else {
+        printf("0x%010llx  %-12s %14llu  %s\n", address, type, size, status);
+    }
+    (*printed)++;
+}
 
-    memset(&inode, 0, sizeof(Inode));
-    strncpy(inode.file_name, source_filename, MAX_FILENAME_LEN - 1);
-    inode.file_size = file_size;
-    inode.first_block = free_blocks[0];
-    inode.file_type = (source_filename[0] == '.') ? 1 : 0;
-
-    current_block = inode.first_block;
-    for (i = 0; i < blocks_needed; i++) {
-        next_block = (i + 1 < blocks_needed) ? free_blocks[i + 1] : (unsigned int)-1;
+/* Splits data blocks [from, to) into used and free runs, one bitmap scan per run. */
+void print_data_runs(Disk *disk, bool json, unsigned int *printed, unsigned int from, unsigned int to) {
+    unsigned int end;
+    bool used;
 
-        block_bitmap[current_block] = true;
+    while (from < to) {
+        used = bitmap_test(disk->block_bitmap, from);
+        end = bitmap_find(disk->block_bitmap, to, from, !used);
+        print_map_area(json, printed, data_block_offset(&disk->metadata, from), blocks_to_bytes(disk, end - from),
+                       "data", used ? "used" : "free");
+        from = end;
+    }
+}
 
-        memset(buffer, 0, BLOCK_SIZE);
-        fread(buffer, 1, BLOCK_SIZE, source);
-        fseek(disk, metadata.first_data_block + current_block * BLOCK_SIZE, SEEK_SET);
-        fwrite(buffer, 1, BLOCK_SIZE, disk);
+/* Prints the occupancy map: the header areas, then the data blocks as tables with a fixed
+   role (catalog, name index, journal, dedup tables, checksums) and merged used and free runs. */
+void show_block_bitmap(Disk *disk, bool json) {
+    DiskMetadata *metadata = &disk->metadata;
+    unsigned int num_blocks = metadata->num_blocks;
+    disk_offset bitmap_end;
+    MapArea *areas = NULL;
+    unsigned int count = 0;
+    unsigned int printed = 0;
+    unsigned int block = 0;
+    unsigned int i;
+    Extent journal;
+    int failed = 0;
 
-        fseek(disk, metadata.first_data_block + current_block * BLOCK_SIZE + BLOCK_SIZE - sizeof(int), SEEK_SET);
-        fwrite(&next_block, sizeof(int), 1, disk);
+    if (!is_legacy_image(metadata)) {
+        journal.start = metadata->journal_start;
+        journal.length = metadata->journal_blocks;
+        failed |= add_map_areas(&areas, &count, disk->catalog_extents, metadata->catalog.num_extents, "catalog");
+        failed |= add_map_areas(&areas, &count, disk->index_extents, metadata->name_index.num_extents, "name-index");
+        failed |= add_map_areas(&areas, &count, &journal, 1, "journal");
+        if (dedup_enabled(disk)) {
+            failed |= add_map_areas(&areas, &count, disk->block_index_extents, metadata->block_index.num_extents, "block-index");
+            failed |= add_map_areas(&areas, &count, disk->ref_extents, metadata->block_refs.num_extents, "block-refs");
+        }
+        if (checksums_enabled(disk)) {
+            failed |= add_map_areas(&areas, &count, metadata->block_sums.extents, 1, "checksums");
+        }
+        if (failed) {
+            fprintf(stderr, "Failed to allocate memory.\n");
+            free(areas);
+            return;
+        }
+        qsort(areas, count, sizeof(MapArea), compare_map_areas);
+    }
 
-        current_block = next_block;
+    if (json) {
+        printf("{\n  \"block_size\": %u,\n  \"blocks\": %u,\n  \"used_blocks\": %u,\n  \"areas\": [",
+               disk->block_size, num_blocks, bitmap_count_set(disk->block_bitmap, num_blocks));
+    } else {
+        printf("%-12s  %-12s %14s  %s\n", "Address", "Type", "Size", "Status");
     }
 
-    inode_bitmap[inode_index] = true;
-    fseek(disk, sizeof(DiskMetadata), SEEK_SET);
-    fwrite(block_bitmap, sizeof(bool), metadata.num_blocks, disk);
-    fwrite(inode_bitmap, sizeof(bool), MAX_FILES, disk);
+    print_map_area(json, &printed, 0, metadata_size(metadata), "superblock", "used");
+    if (is_legacy_image(metadata)) {
+        bitmap_end = block_bitmap_offset(metadata) + num_blocks * sizeof(bool);
+        print_map_area(json, &printed, block_bitmap_offset(metadata), bitmap_end - block_bitmap_offset(metadata), "bitmap", "used");
+        print_map_area(json, &printed, bitmap_end, metadata->first_data_block - bitmap_end, "catalog", "used");
+    } else {
+        bitmap_end = block_bitmap_offset(metadata) + BITMAP_BYTES(num_blocks);
+        print_map_area(json, &printed, block_bitmap_offset(metadata), bitmap_end - block_bitmap_offset(metadata), "bitmap", "used");
+        print_map_area(json, &printed, bitmap_end, metadata->first_data_block - bitmap_end, "padding", "free");
+    }
 
-    fseek(disk, sizeof(DiskMetadata) + metadata.num_blocks + MAX_FILES, SEEK_SET);
-    fseek(disk, inode_index * sizeof(Inode), SEEK_CUR);
-    fwrite(&inode, sizeof(Inode), 1, disk);
+    for (i = 0; i < count; i++) {
+        print_data_runs(disk, json, &printed, block, areas[i].start);
+        print_map_area(json, &printed, data_block_offset(metadata, areas[i].start), blocks_to_bytes(disk, areas[i].length),
+                       areas[i].type, "used");
+        block = areas[i].start + areas[i].length;
+    }
+    print_data_runs(disk, json, &printed, block, num_blocks);
+    free(areas);
 
-    metadata.num_files++;
-    fseek(disk, 0, SEEK_SET);
-    fwrite(&metadata, sizeof(DiskMetadata), 1, disk);
+    if (json) {
+        printf("\n  ]\n}\n");
+    } else {
+        printf("%u of %u blocks occupied\n", bitmap_count_set(disk->block_bitmap, num_blocks), num_blocks);
+    }
+}
 
-    free(free_blocks);
-    free(block_bitmap);
-    free(inode_bitmap);
-    fclose(disk);
-    fclose(source);
+void print_file_entry(const Disk *disk, const Inode *inode, bool show_hidden) {
+    char name[MAX_FILENAME_LEN + 1];
 
-    printf("File '%s' copied to virtual disk.\n", source_filename);
+    if (inode->file_name[0] == '\0' || ((inode->file_type & TYPE_HIDDEN) && !show_hidden)) {
+        return;
+    }
+    if (inode->file_type & TYPE_DIRECTORY) {
+        sprintf(name, "%s/", inode->file_name);
+        printf("%-40s %-10llu %-10u\n", name, inode_size(&disk->metadata, inode), inode->extents[0].start);
+        return;
+    }
+    if (inode->first_block == NO_BLOCK) {
+        printf("%-40s %-10llu %-10s\n", inode->file_name, inode_size(&disk->metadata, inode), "-");
+        return;
+    }
+    printf("%-40s %-10llu %-10u\n",
+        inode->file_name, 
+        inode_size(&disk->metadata, inode), 
+        inode->first_block);
 }
 
-void copy_file_from_disk(const char *disk_filename, const char *output_filename) {
-    FILE *disk;
-    FILE *output;
-    DiskMetadata metadata;
-    bool *inode_bitmap;
-    Inode *inode_catalog;
-    Inode *file_inode = NULL;
-    unsigned int current_block;
-    unsigned int bytes_remaining;
-    unsigned char buffer[BLOCK_SIZE];
-    unsigned int bytes_to_write;
-    int i;
+/* Reads the table of one directory at once and then only the inodes it names. */
+void show_directory(Disk *disk, unsigned int number, bool show_hidden) {
+    Directory dir;
+    IndexEntry *entries;
+    Inode inode;
+    unsigned int slots, i;
 
-    disk = fopen(disk_filename, "rb");
-    if (!disk) {
-        perror("Failed to open disk file");
+    if (open_directory(disk, number, &dir) != 0) {
+        fprintf(stderr, "Failed to read the directory.\n");
+        return;
+    }
+    slots = table_slots(disk, dir.table);
+    entries = (IndexEntry *)malloc(slots * sizeof(IndexEntry));
+    if (!entries || file_data_io(disk, *dir.extents, dir.table->num_extents, (unsigned char *)entries,
+                                 slots * sizeof(IndexEntry), false) != 0) {
+        fprintf(stderr, "Failed to read the directory.\n");
+        free(entries);
+        close_directory(&dir);
         return;
     }
+    for (i = 0; i < slots; i++) {
+        if (entries[i].value != 0 && read_inode(disk, entries[i].value, &inode) == 0) {
+            print_file_entry(disk, &inode, show_hidden);
+        }
+    }
+    free(entries);
+    close_directory(&dir);
+}
 
-    fseek(disk, 0, SEEK_SET);
-    fread(&metadata, sizeof(DiskMetadata), 1, disk);
+/* Lists the directory path; disks without directories list the whole catalog. */
+void show_files(Disk *disk, const char *path, bool show_hidden) {
+    Inode *inodes;
+    Inode inode;
+    char leaf[MAX_FILENAME_LEN];
+    unsigned int blocks, block, i;
+    unsigned int number = ROOT_DIRECTORY;
 
-    inode_bitmap = (bool *)malloc(MAX_FILES * sizeof(bool));
-    inode_catalog = (Inode *)malloc(MAX_FILES * sizeof(Inode));
-    if (!inode_bitmap || !inode_catalog) {
-        perror("Failed to allocate memory");
-        fclose(disk);
-        free(inode_bitmap);
-        free(inode_catalog);
+    if (has_directories(&disk->metadata)) {
+        number = find_parent(disk, path, leaf, false);
+        if (number != NO_INODE && leaf[0] != '\0') {
+            number = find_entry(disk, number, leaf, &inode);
+            if (number != NO_INODE && !(inode.file_type & TYPE_DIRECTORY)) {
+                number = NO_INODE;
+            }
+        }
+        if (number == NO_INODE) {
+            fprintf(stderr, "Directory '%s' not found on disk.\n", path);
+            return;
+        }
+    } else if (path[0] != '\0') {
+        fprintf(stderr, "Disk format version %u has no directories.\n", disk->metadata.version);
         return;
     }
 
-    fseek(disk, sizeof(DiskMetadata) + metadata.num_blocks, SEEK_SET);
-    fread(inode_bitmap, sizeof(bool), MAX_FILES, disk);
-    fread(inode_catalog, sizeof(Inode), MAX_FILES, disk);
+    printf("%-40s %-10s %-10s\n", "Nazwa pliku", "Rozmiar", "Pierwszy blok");
+    printf("---------------------------------------------\n");
 
-    for (i = 0; i < MAX_FILES; i++) {
-        if (inode_bitmap[i] && strcmp(inode_catalog[i].file_name, output_filename) == 0) {
-            file_inode = &inode_catalog[i];
-            break;
-        }
+    if (has_directories(&disk->metadata)) {
+        show_directory(disk, number, show_hidden);
+        return;
     }
 
-    if (!file_inode) {
-        printf("File '%s' not found on disk.\n", output_filename);
-        free(inode_bitmap);
-        free(inode_catalog);
-        fclose(disk);
+    if (is_legacy_image(&disk->metadata)) {
+        for (i = 0; i < MAX_FILES; i++) {
+            print_file_entry(disk, &disk->legacy_catalog[i], show_hidden);
+        }
         return;
     }
 
-    output = fopen(output_filename, "wb");
-    if (!output) {
-        perror("Failed to create output file");
-        free(inode_bitmap);
-        free(inode_catalog);
-        fclose(disk);
+    inodes = (Inode *)malloc(disk->inodes_per_block * sizeof(Inode));
+    if (!inodes) {
         return;
     }
+    blocks = (disk->metadata.num_inodes + disk->inodes_per_block - 1) / disk->inodes_per_block;
+    for (block = 0; block < blocks; block++) {
+        if (disk_read(disk, data_block_offset(&disk->metadata,
+                      map_file_block(disk->catalog_extents, disk->metadata.catalog.num_extents, block)),
+                      inodes, disk->inodes_per_block * sizeof(Inode)) != 0) {
+            break;
+        }
+        for (i = 0; i < disk->inodes_per_block && block * disk->inodes_per_block + i < disk->metadata.num_inodes; i++) {
+            print_file_entry(disk, &inodes[i], show_hidden);
+        }
+    }
+    free(inodes);
+}
 
-    current_block = file_inode->first_block;
-    bytes_remaining = file_inode->file_size;
+int copy_file_to_disk(const char *disk_filename, const char *file_name, const char *source_filename, bool compress) {
+    Disk disk;
+    int result;
 
-    while (current_block != (unsigned int)-1) {
-        fseek(disk, metadata.first_data_block + current_block * BLOCK_SIZE, SEEK_SET);
-        fread(buffer, 1, BLOCK_SIZE, disk);
+    if (open_disk(disk_filename, "r+b", &disk) != 0) {
+        return -1;
+    }
+    result = import_file_from(&disk, file_name, source_filename, compress);
+    close_disk(&disk);
+    return result;
+}
 
-        bytes_to_write = (bytes_remaining < BLOCK_SIZE) ? bytes_remaining : BLOCK_SIZE;
-        fwrite(buffer, 1, bytes_to_write, output);
+int copy_directory_to_disk(const char *disk_filename, const char *directory) {
+    Disk disk;
+    int failed;
 
-        bytes_remaining -= bytes_to_write;
-        fseek(disk, metadata.first_data_block + current_block * BLOCK_SIZE + BLOCK_SIZE - sizeof(int), SEEK_SET);
-        fread(&current_block, sizeof(int), 1, disk);
+    if (open_disk(disk_filename, "r+b", &disk) != 0) {
+        return -1;
     }
+    failed = bulk_import(&disk, directory);
+    close_disk(&disk);
+    return failed;
+}
 
-    fclose(output);
-    free(inode_bitmap);
-    free(inode_catalog);
-    fclose(disk);
+int copy_file_from_disk(const char *disk_filename, const char *output_filename) {
+    Disk disk;
+    int result;
 
-    printf("File '%s' copied from virtual disk.\n", output_filename);
+    if (open_disk(disk_filename, "rb", &disk) != 0) {
+        return -1;
+    }
+    result = export_file(&disk, output_filename);
+    close_disk(&disk);
+    return result;
 }
 
 void delete_file_from_disk(const char *disk_filename, const char *file_name) {
-    FILE *disk;
-    DiskMetadata metadata;
-    bool *block_bitmap;
-    bool *inode_bitmap;
-    Inode *inode_catalog;
-    size_t offset_to_block_bitmap, offset_to_inode_bitmap, offset_to_inode_catalog;
-    unsigned int current_block, next_block;
-    int inode_index = -1;
-    unsigned int i;
+    Disk disk;
 
-    disk = fopen(disk_filename, "r+b");
-    if (!disk) {
-        perror("Nie udalo sie");
+    if (open_disk(disk_filename, "r+b", &disk) != 0) {
         exit(EXIT_FAILURE);
     }
+    delete_file(&disk, file_name);
+    close_disk(&disk);
+}
 
-    fread(&metadata, sizeof(DiskMetadata), 1, disk);
-
-
-    offset_to_block_bitmap = sizeof(DiskMetadata);
-    offset_to_inode_bitmap = offset_to_block_bitmap + metadata.num_blocks * sizeof(bool);
-    offset_to_inode_catalog = offset_to_inode_bitmap + MAX_FILES * sizeof(bool);
+int defrag_image(const char *disk_filename, double max_seconds, unsigned long max_megabytes) {
+    Disk disk;
+    int result;
 
-    
-    block_bitmap = (bool *)malloc(metadata.num_blocks * sizeof(bool));
-    inode_bitmap = (bool *)malloc(MAX_FILES * sizeof(bool));
-    inode_catalog = (Inode *)malloc(MAX_FILES * sizeof(Inode));
-    if (!block_bitmap || !inode_bitmap || !inode_catalog) {
-        perror("Nie udalo sie");
-        fclose(disk);
-        exit(EXIT_FAILURE);
+    if (open_disk(disk_filename, "r+b", &disk) != 0) {
+        return -1;
     }
+    result = defrag_disk(&disk, max_seconds, (disk_offset)max_megabytes * 1024 * 1024);
+    close_disk(&disk);
+    return result;
+}
 
-    fseek(disk, offset_to_block_bitmap, SEEK_SET);
-    fread(block_bitmap, sizeof(bool), metadata.num_blocks, disk);
-    fread(inode_bitmap, sizeof(bool), MAX_FILES, disk);
-    fread(inode_catalog, sizeof(Inode), MAX_FILES, disk);
+int scrub_image(const char *disk_filename) {
+    Disk disk;
+    int result;
 
-    for (i = 0; i < MAX_FILES; i++) {
-        if (inode_bitmap[i] && strcmp(inode_catalog[i].file_name, file_name) == 0) {
-            inode_index = i;
-            break;
-        }
+    if (open_disk(disk_filename, "r+b", &disk) != 0) {
+        return -1;
     }
+    result = scrub_disk(&disk);
+    close_disk(&disk);
+    return result;
+}
 
-    if (inode_index == -1) {
-        fprintf(stderr, "Plik '%s' nie istnieje na dysku.\n", file_name);
-        free(block_bitmap);
-        free(inode_bitmap);
-        free(inode_catalog);
-        fclose(disk);
-        return;
-    }
+void display_block_bitmap(const char *disk_filename, bool json) {
+    Disk disk;
 
-    current_block = inode_catalog[inode_index].first_block;
-    while (current_block != (unsigned int)-1) {
-        fseek(disk, metadata.first_data_block + current_block * BLOCK_SIZE + BLOCK_SIZE - sizeof(int), SEEK_SET);
-        fread(&next_block, sizeof(int), 1, disk);
-        block_bitmap[current_block] = false;
-        current_block = next_block;
+    if (open_disk(disk_filename, "rb", &disk) != 0) {
+        exit(EXIT_FAILURE);
     }
-
-    inode_bitmap[inode_index] = false;
-    memset(&inode_catalog[inode_index], 0, sizeof(Inode));
-
-    metadata.num_files--;
-
-    fseek(disk, 0, SEEK_SET);
-    fwrite(&metadata, sizeof(DiskMetadata), 1, disk);
-    fseek(disk, offset_to_block_bitmap, SEEK_SET);
-    fwrite(block_bitmap, sizeof(bool), metadata.num_blocks, disk);
-    fwrite(inode_bitmap, sizeof(bool), MAX_FILES, disk);
-    fwrite(inode_catalog, sizeof(Inode), MAX_FILES, disk);
-
-    free(block_bitmap);
-    free(inode_bitmap);
-    free(inode_catalog);
-    fclose(disk);
-
-    printf("File '%s' was removed from virtual disk.\n", file_name);
+    show_block_bitmap(&disk, json);
+    close_disk(&disk);
 }
 
+void list_files_on_disk(const char *disk_filename, const char *path, bool show_hidden) {
+    Disk disk;
 
-void display_block_bitmap(const char *disk_filename) {
-    FILE *disk;
-    DiskMetadata metadata;
-    bool *block_bitmap;
-    unsigned int i;
-
-    disk = fopen(disk_filename, "rb");
-    if (!disk) {
-        perror("Nie udało sie");
+    if (open_disk(disk_filename, "rb", &disk) != 0) {
         exit(EXIT_FAILURE);
     }
+    show_files(&disk, path, show_hidden);
+    close_disk(&disk);
+}
 
-    fread(&metadata, sizeof(DiskMetadata), 1, disk);
+int read_from_disk(const char *disk_filename, const char *path, disk_offset offset, disk_offset length) {
+    Disk disk;
+    int result;
 
-    block_bitmap = (bool *)malloc(metadata.num_blocks * sizeof(bool));
-    if (!block_bitmap) {
-        perror("Nie udało sie");
-        fclose(disk);
-        exit(EXIT_FAILURE);
+    if (open_disk(disk_filename, "rb", &disk) != 0) {
+        return -1;
     }
+    result = read_range(&disk, path, offset, length, STDOUT_FILENO);
+    close_disk(&disk);
+    return result;
+}
 
-    fseek(disk, sizeof(DiskMetadata), SEEK_SET);
-    fread(block_bitmap, sizeof(bool), metadata.num_blocks, disk);
+int make_directory_on_disk(const char *disk_filename, const char *path) {
+    Disk disk;
+    int result;
 
-    printf("Indexes of occupied blocks:\n");
-    for (i = 0; i < metadata.num_blocks; i++) {
-        if (block_bitmap[i]) {
-            printf("Block %u is occupied\n", i);
-        }
+    if (open_disk(disk_filename, "r+b", &disk) != 0) {
+        return -1;
     }
-
-    free(block_bitmap);
-    fclose(disk);
-    printf("Others blocks are free\n");
+    result = make_directory(&disk, path);
+    close_disk(&disk);
+    return result;
 }
 
+/* Runs one command per line against a single open disk:
+   import <name> [source|-], export|delete <name>, importdir <directory>, bitmap [json],
+   list [directory], mkdir <directory>, read <name> <offset> <length>, sync, scrub,
+   defrag [seconds] [megabytes].
+   Lines starting with '#' are skipped.
+   Commands share one journal commit until sync or until the journal is half full.
+   With --stats every command reports its own counters. */
+int run_batch(const char *disk_filename, FILE *script, bool show_hidden) {
+    Disk disk;
+    char line[512];
+    char command[16];
+    char argument[256];
+    char source[256];
+    char length[32];
+    int fields;
+    int failed = 0;
+    unsigned int line_number = 0;
+    bool compress;
 
-void list_files_on_disk(const char *disk_filename, bool show_hidden) {
-    FILE *disk;
-    DiskMetadata metadata;
-    Inode *inode_catalog;
-    unsigned int i;
-
-    disk = fopen(disk_filename, "rb");
-    if (!disk) {
-        perror("Nie udalo sie");
-        exit(EXIT_FAILURE);
+    if (open_disk(disk_filename, "r+b", &disk) != 0) {
+        return -1;
     }
 
-    fread(&metadata, sizeof(DiskMetadata), 1, disk);
-
-    fseek(disk, sizeof(DiskMetadata) + metadata.num_blocks * sizeof(bool) + MAX_FILES * sizeof(bool), SEEK_SET);
+    while (fgets(line, sizeof(line), script)) {
+        line_number++;
+        fields = sscanf(line, "%15s %255s %255s %31s", command, argument, source, length);
+        if (fields < 1 || command[0] == '#') {
+            continue;
+        }
 
-    inode_catalog = (Inode *)malloc(MAX_FILES * sizeof(Inode));
-    if (!inode_catalog) {
-        perror("Nie udalo sie");
-        fclose(disk);
-        exit(EXIT_FAILURE);
+        compress = strcmp(command, "compress") == 0;
+        if ((compress || strcmp(command, "import") == 0) && fields >= 3 && script == stdin && strcmp(source, "-") == 0) {
+            fprintf(stderr, "Line %u: standard input already holds the script.\n", line_number);
+            failed++;
+        } else if ((compress || strcmp(command, "import") == 0) && fields >= 2) {
+            failed += import_file_from(&disk, argument, fields >= 3 ? source : argument, compress) != 0;
+        } else if (strcmp(command, "export") == 0 && fields == 2) {
+            failed += export_file(&disk, argument) != 0;
+        } else if (strcmp(command, "delete") == 0 && fields == 2) {
+            failed += delete_file(&disk, argument) != 0;
+        } else if (strcmp(command, "importdir") == 0 && fields == 2) {
+            failed += bulk_import(&disk, argument) != 0;
+        } else if (strcmp(command, "bitmap") == 0) {
+            show_block_bitmap(&disk, fields == 2 && strcmp(argument, "json") == 0);
+        } else if (strcmp(command, "list") == 0) {
+            show_files(&disk, fields >= 2 ? argument : "", show_hidden);
+        } else if (strcmp(command, "mkdir") == 0 && fields == 2) {
+            failed += make_directory(&disk, argument) != 0;
+        } else if (strcmp(command, "read") == 0 && fields == 4) {
+            failed += read_range(&disk, argument, strtoull(source, NULL, 10), strtoull(length, NULL, 10), STDOUT_FILENO) != 0;
+        } else if (strcmp(command, "sync") == 0) {
+            sync_disk(&disk);
+        } else if (strcmp(command, "scrub") == 0) {
+            failed += scrub_disk(&disk) != 0;
+        } else if (strcmp(command, "defrag") == 0) {
+            failed += defrag_disk(&disk, fields >= 2 ? atof(argument) : 0,
+                                  fields >= 3 ? (disk_offset)strtoul(source, NULL, 10) * 1024 * 1024 : 0) != 0;
+        } else {
+            fprintf(stderr, "Line %u: unknown command '%s'.\n", line_number, command);
+            failed++;
+        }
+        if (disk.num_pages * 2 >= disk.page_capacity) {
+            sync_disk(&disk);
+        }
+        report_stats(command);
     }
 
-    fread(inode_catalog, sizeof(Inode), MAX_FILES, disk);
+    close_disk(&disk);
+    return failed;
+}
 
-    printf("%-40s %-10s %-10s\n", "Nazwa pliku", "Rozmiar", "Pierwszy blok");
-    printf("---------------------------------------------\n");
 
+/* Operation names of the command line choices, used by --stats. */
+const char *operation_names[] = {
+    "exit", "import", "export", "bitmap", "list", "delete", "create", "batch", "importdir", "compress", "scrub", "defrag",
+    "mkdir", "read"
+};
 
-    for (i = 0; i < MAX_FILES; i++) {
-        if (inode_catalog[i].file_name[0] != '\0') {
-            if (inode_catalog[i].file_type == 1 && !show_hidden) {
-                continue;
+/* Allocation policies of --alloc, indexed by ALLOC_FIRST, ALLOC_BEST and ALLOC_NEXT. */
+const char *policy_names[] = { "first", "best", "next" };
+
+/* Removes --stats, --stats=json and --alloc=<policy> from the arguments and applies them.
+   Returns the number of arguments left, or -1 for an unknown policy. */
+int parse_options(int argc, char *argv[]) {
+    int kept = 1;
+    int i, policy;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            stats_mode = STATS_TEXT;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            stats_mode = STATS_JSON;
+        } else if (strncmp(argv[i], "--alloc=", 8) == 0) {
+            for (policy = ALLOC_NEXT; policy >= 0 && strcmp(argv[i] + 8, policy_names[policy]) != 0; policy--) {
             }
-            printf("%-40s %-10u %-10u\n",
-                inode_catalog[i].file_name, 
-                inode_catalog[i].file_size, 
-                inode_catalog[i].first_block);
+            if (policy < 0) {
+                printf("Nieznana polityka przydzialu: %s (first, best, next).\n", argv[i] + 8);
+                return -1;
+            }
+            alloc_policy = policy;
+        } else {
+            argv[kept++] = argv[i];
         }
     }
-
-    free(inode_catalog);
-    fclose(disk);
+    argv[kept] = NULL;
+    if (stats_mode != STATS_OFF) {
+        gettimeofday(&stats_mark, NULL);
+    }
+    return kept;
 }
 
-
-
 int main(int argc, char *argv[]) {
     unsigned int disk_size_mb;
     bool show_hidden;
     char disk_filename[64] = "vd.bin";
-    char filename[64];
+    char filename[HOST_PATH_LEN];
     int choice;
+    int create_mode;
+    unsigned int block_size;
+    FILE *script;
+    int status = 0;
 
+    argc = parse_options(argc, argv);
+    if (argc < 0) {
+        return 1;
+    }
     if (argc < 5) {
         printf("Za malo argumentów.\n");
         return 1;
@@ -530,7 +5591,21 @@ int main(int argc, char *argv[]) {
     disk_filename[MAX_FILENAME_LEN- 1] = '\0';
 
     if (atoi(argv[1]) == 1) {
-        initialize_disk(disk_filename, disk_size_mb);
+        create_mode = CREATE_SPARSE;
+        if (argc > 6 && strcmp(argv[6], "prealloc") == 0) {
+            create_mode = CREATE_PREALLOCATE;
+        } else if (argc > 6 && strcmp(argv[6], "zero") == 0) {
+            create_mode = CREATE_ZERO;
+        } else if (argc > 6 && strcmp(argv[6], "sparse") != 0) {
+            printf("Nieznany tryb tworzenia dysku: %s (sparse, prealloc, zero).\n", argv[6]);
+            return 1;
+        }
+        block_size = argc > 7 ? (unsigned int)atoi(argv[7]) : DEFAULT_BLOCK_SIZE;
+        if (argc > 8 && strcmp(argv[8], "dedup") != 0) {
+            printf("Nieznana opcja dysku: %s (dedup).\n", argv[8]);
+            return 1;
+        }
+        initialize_disk(disk_filename, disk_size_mb, create_mode, block_size, argc > 8);
         return 0;
     }
 
@@ -539,13 +5614,14 @@ int main(int argc, char *argv[]) {
 
     switch (choice) {
         case 1:
+        case 9:
             if (argc < 7) {
                 printf("Podaj nazwe pliku do skopiowania na dysk.\n");
                 return 1;
             }
-            strncpy(filename, argv[6], MAX_FILENAME_LEN - 1);
-            filename[MAX_FILENAME_LEN - 1] = '\0';
-            copy_file_to_disk(disk_filename, filename);
+            strncpy(filename, argv[6], HOST_PATH_LEN - 1);
+            filename[HOST_PATH_LEN - 1] = '\0';
+            status = copy_file_to_disk(disk_filename, filename, argc > 7 ? argv[7] : filename, choice == 9) == 0 ? 0 : 1;
             break;
 
         case 2:
@@ -553,17 +5629,17 @@ int main(int argc, char *argv[]) {
                 printf("Podaj nazwe pliku do skopiowania z dysku.\n");
                 return 1;
             }
-            strncpy(filename, argv[6], MAX_FILENAME_LEN - 1);
-            filename[MAX_FILENAME_LEN - 1] = '\0';
-            copy_file_from_disk(disk_filename, filename);
+            strncpy(filename, argv[6], HOST_PATH_LEN - 1);
+            filename[HOST_PATH_LEN - 1] = '\0';
+            status = copy_file_from_disk(disk_filename, filename) == 0 ? 0 : 1;
             break;
 
         case 3:
-            display_block_bitmap(disk_filename);
+            display_block_bitmap(disk_filename, argc > 6 && strcmp(argv[6], "json") == 0);
             break;
 
         case 4:
-            list_files_on_disk(disk_filename, show_hidden);
+            list_files_on_disk(disk_filename, argc > 6 ? argv[6] : "", show_hidden);
             break;
 
         case 5:
@@ -571,20 +5647,69 @@ int main(int argc, char *argv[]) {
                 printf("Podaj nazwe pliku do usuniecia z dysku.\n");
                 return 1;
             }
-            strncpy(filename, argv[6], MAX_FILENAME_LEN - 1);
-            filename[MAX_FILENAME_LEN - 1] = '\0';
+            strncpy(filename, argv[6], HOST_PATH_LEN - 1);
+            filename[HOST_PATH_LEN - 1] = '\0';
             delete_file_from_disk(disk_filename, filename);
             break;
 
         case 6:
             return 0;
 
+        case 7:
+            if (argc < 7 || strcmp(argv[6], "-") == 0) {
+                status = run_batch(disk_filename, stdin, show_hidden) == 0 ? 0 : 1;
+                break;
+            }
+            script = fopen(argv[6], "r");
+            if (!script) {
+                perror("Failed to open batch script");
+                return 1;
+            }
+            status = run_batch(disk_filename, script, show_hidden) == 0 ? 0 : 1;
+            fclose(script);
+            break;
+
+        case 8:
+            if (argc < 7) {
+                printf("Podaj katalog do skopiowania na dysk.\n");
+                return 1;
+            }
+            status = copy_directory_to_disk(disk_filename, argv[6]) == 0 ? 0 : 1;
+            break;
+
+        case 10:
+            status = scrub_image(disk_filename) == 0 ? 0 : 1;
+            break;
+
+        case 11:
+            status = defrag_image(disk_filename, argc > 6 ? atof(argv[6]) : 0,
+                                  argc > 7 ? strtoul(argv[7], NULL, 10) : 0) == 0 ? 0 : 1;
+            break;
+
+        case 12:
+            if (argc < 7) {
+                printf("Podaj nazwe katalogu do utworzenia na dysku.\n");
+                return 1;
+            }
+            status = make_directory_on_disk(disk_filename, argv[6]) == 0 ? 0 : 1;
+            break;
+
+        case 13:
+            if (argc < 9) {
+                printf("Podaj nazwe pliku, przesuniecie i dlugosc do odczytu.\n");
+                return 1;
+            }
+            status = read_from_disk(disk_filename, argv[6], strtoull(argv[7], NULL, 10), strtoull(argv[8], NULL, 10)) == 0 ? 0 : 1;
+            break;
+
         default:
             printf("Nieprawidlowy wybór.\n");
             return 1;
     }
 
-    return 0;
+    /* A batch has reported its commands already; what is left is closing the disk. */
+    report_stats(choice == 7 ? "close" : operation_names[choice]);
+    return status;
 }
 
 